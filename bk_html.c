@@ -25,6 +25,7 @@
 #include <limits.h>
 #include "halibut.h"
 #include "winchm.h"
+#include "deflate.h"
 
 #define is_heading_type(type) ( (type) == para_Title || \
 				(type) == para_Chapter || \
@@ -52,10 +53,13 @@ typedef struct {
     int leaf_smallest_contents;
     bool navlinks;
     bool rellinks;
+    bool precompress;
+    bool search_index;
     char *contents_filename;
     char *index_filename;
     char *template_filename;
     char *single_filename;
+    char *search_filename, *search_index_filename, *search_script_filename;
     char *chm_filename, *hhp_filename, *hhc_filename, *hhk_filename;
     char **template_fragments;
     int ntfragments;
@@ -66,6 +70,7 @@ typedef struct {
     wchar_t *author, *description;
     wchar_t *index_text, *contents_text, *preamble_text, *title_separator;
     wchar_t *nav_prev_text, *nav_next_text, *nav_up_text, *nav_separator;
+    wchar_t *search_text, *search_none_text;
     wchar_t *index_main_sep, *index_multi_sep;
     wchar_t *pre_versionid, *post_versionid;
     int restrict_charset, output_charset;
@@ -75,6 +80,12 @@ typedef struct {
     } htmlver;
     wchar_t *lquote, *rquote;
     int leaf_level;
+    /*
+     * Working data for each paragraph and word of the document,
+     * indexed by paragraph::index and word::index.
+     */
+    struct htmlsect **psects;
+    struct htmlindexref **windexrefs;
 } htmlconfig;
 
 #define contents_depth(conf, level) \
@@ -108,38 +119,63 @@ struct htmlsect {
     htmlsect *next, *parent;
     htmlfile *file;
     paragraph *title, *text;
-    enum { NORMAL, TOP, INDEX } type;
+    enum { NORMAL, TOP, INDEX, SEARCH } type;
     int contents_depth;
     char **fragments;
+    /*
+     * The section list is in document order, so each section's
+     * descendants follow it contiguously. `subtree_end' points at
+     * the first section after them (NULL at the end of the list).
+     * Since every section in a file descends from that file's
+     * `first' section, this lets a pass over one file visit only
+     * its own part of the list.
+     */
+    htmlsect *subtree_end;
+};
+
+/*
+ * A table of the names in use: either the file names, or the
+ * fragment names in every file. Each name remembers the last number
+ * tried after it to make a clashing name unique (see
+ * html_sanitise_fragment() and html_sanitise_filename()), so that
+ * the next clash can carry on from there.
+ */
+typedef struct htmlname htmlname;
+struct htmlname {
+    htmlname *next;		       /* in the same hash bucket */
+    htmlfile *file;		       /* containing file, for a fragment */
+    char *name;			       /* owned by whoever uses the name */
+    int suffix;
 };
 
+typedef struct {
+    htmlname **buckets;
+    int nbuckets, nnames;
+} htmlnames;
+
 typedef struct {
     htmlfile *head, *tail;
-    htmlfile *single, *index;
-    tree234 *frags;
-    tree234 *files;
+    htmlfile *single, *index, *search;
+    htmlnames *frags;
+    htmlnames *files;
 } htmlfilelist;
 
 typedef struct {
     htmlsect *head, *tail;
 } htmlsectlist;
 
-typedef struct {
-    htmlfile *file;
+typedef struct htmlindexref htmlindexref;
+struct htmlindexref {
+    htmlsect *section;
     char *fragment;
-} htmlfragment;
+    bool generated, referenced;
+};
 
 typedef struct {
     int nrefs, refsize;
-    word **refs;
+    htmlindexref **refs;
 } htmlindex;
 
-typedef struct {
-    htmlsect *section;
-    char *fragment;
-    bool generated, referenced;
-} htmlindexref;
-
 typedef struct {
     /*
      * This level deals with charset conversion, starting and
@@ -244,6 +280,101 @@ void ho_setup_rdstringc(htmloutput *ho, rdstringc *rs)
     ho->write = ho_write_rdstringc;
 }
 
+/*
+ * With html-precompress, each HTML file is gathered in memory
+ * instead of being written straight out, and then written along
+ * with a gzipped copy beside it for the benefit of web servers that
+ * can serve those directly.
+ *
+ * A file whose contents haven't changed since the last run isn't
+ * rewritten, and neither is its gzipped copy if that still matches,
+ * so a rebuild of a large manual only touches what actually
+ * changed.
+ */
+static char *gz_filename(const char *filename)
+{
+    char *ret = snewn(strlen(filename) + 4, char);
+    sprintf(ret, "%s.gz", filename);
+    return ret;
+}
+
+/*
+ * Read the whole of a file into memory, returning NULL if it
+ * can't be read.
+ */
+static char *read_whole_file(const char *filename, const char *mode,
+			     size_t *lenp)
+{
+    FILE *fp = fopen(filename, mode);
+    char *data = NULL;
+    size_t len = 0, size = 0, got;
+
+    if (!fp)
+	return NULL;
+    do {
+	if (size - len < 4096) {
+	    size = size * 3 / 2 + 4096;
+	    data = sresize(data, size, char);
+	}
+	got = fread(data + len, 1, size - len, fp);
+	len += got;
+    } while (got > 0);
+    if (ferror(fp)) {
+	sfree(data);
+	data = NULL;
+    }
+    fclose(fp);
+    *lenp = len;
+    return data;
+}
+
+static bool file_unchanged(const char *filename, rdstringc const *rs)
+{
+    size_t len;
+    char *data = read_whole_file(filename, "r", &len);
+    bool ret = data && len == (size_t)rs->pos && !memcmp(data, rs->text, len);
+    sfree(data);
+    return ret;
+}
+
+static bool gz_unchanged(const char *filename, rdstringc const *rs)
+{
+    size_t len;
+    char *data = read_whole_file(filename, "rb", &len);
+    deflate_decompress_ctx *dc;
+    void *out = NULL;
+    int outlen = 0;
+    bool ret = false;
+
+    if (!data || len > INT_MAX) {
+	sfree(data);
+	return false;
+    }
+    dc = deflate_decompress_new(DEFLATE_TYPE_GZIP);
+    if (deflate_decompress_data(dc, data, len, &out, &outlen) == 0)
+	ret = ((size_t)outlen == (size_t)rs->pos &&
+	       !memcmp(out, rs->text, outlen));
+    deflate_decompress_free(dc);
+    sfree(out);
+    sfree(data);
+    return ret;
+}
+
+static void precompress_write(const char *filename, rdstringc const *rs,
+			      errorstate *es)
+{
+    char *gzname = gz_filename(filename);
+    bool unchanged = file_unchanged(filename, rs);
+
+    if (!unchanged && !write_whole_file(filename, rs->text, rs->pos, false))
+	err_cantopenw(es, filename);
+    if ((!unchanged || !gz_unchanged(gzname, rs)) &&
+	!write_whole_file(gzname, rs->text, rs->pos, true))
+	err_cantopenw(es, gzname);
+
+    sfree(gzname);
+}
+
 void ho_string(htmloutput *ho, const char *string)
 {
     ho->write(ho->write_ctx, string, strlen(string));
@@ -268,24 +399,101 @@ void ho_finish(htmloutput *ho)
 #define HO_HACK_QUOTENOTHING 2
 #define HO_HACK_OMITQUOTES 4
 
-static int html_fragment_compare(const void *av, const void *bv, void *cmpctx)
+static htmlnames *html_names_new(void)
 {
-    const htmlfragment *a = (const htmlfragment *)av;
-    const htmlfragment *b = (const htmlfragment *)bv;
-    int cmp;
+    htmlnames *names = snew(htmlnames);
+    int i;
+
+    names->nbuckets = 256;
+    names->nnames = 0;
+    names->buckets = snewn(names->nbuckets, htmlname *);
+    for (i = 0; i < names->nbuckets; i++)
+	names->buckets[i] = NULL;
+    return names;
+}
 
-    if ((cmp = strcmp(a->file->filename, b->file->filename)) != 0)
-	return cmp;
-    else
-	return strcmp(a->fragment, b->fragment);
+/*
+ * The names themselves belong to the htmlfile or htmlsect (or
+ * whatever) which uses them, so they aren't freed here.
+ */
+static void html_names_free(htmlnames *names)
+{
+    int i;
+
+    for (i = 0; i < names->nbuckets; i++) {
+	htmlname *n, *next;
+	for (n = names->buckets[i]; n; n = next) {
+	    next = n->next;
+	    sfree(n);
+	}
+    }
+    sfree(names->buckets);
+    sfree(names);
+}
+
+static unsigned html_name_hash(htmlfile *file, const char *name)
+{
+    const char *p;
+    unsigned h = 0;
+
+    if (file) {
+	for (p = file->filename; *p; p++)
+	    h = 31 * h + (unsigned char)*p;
+	h = 31 * h + '#';
+    }
+    for (p = name; *p; p++)
+	h = 31 * h + (unsigned char)*p;
+    return h;
+}
+
+static htmlname *html_name_find(htmlnames *names, htmlfile *file,
+				const char *name)
+{
+    htmlname *n;
+
+    n = names->buckets[html_name_hash(file, name) & (names->nbuckets-1)];
+    for (; n; n = n->next)
+	if (n->file == file && !strcmp(n->name, name))
+	    return n;
+    return NULL;
 }
 
-static int html_filename_compare(const void *av, const void *bv, void *cmpctx)
+static void html_name_add(htmlnames *names, htmlfile *file, char *name)
 {
-    const char *a = (const char *)av;
-    const char *b = (const char *)bv;
+    htmlname *n = snew(htmlname);
+    unsigned h;
+
+    if (names->nnames >= names->nbuckets) {
+	/*
+	 * Double the table, splitting each bucket in two.
+	 */
+	htmlname **buckets = snewn(2 * names->nbuckets, htmlname *);
+	int i;
+
+	for (i = 0; i < 2 * names->nbuckets; i++)
+	    buckets[i] = NULL;
+	for (i = 0; i < names->nbuckets; i++) {
+	    htmlname *m, *next;
+	    for (m = names->buckets[i]; m; m = next) {
+		next = m->next;
+		h = html_name_hash(m->file, m->name) &
+		    (2 * names->nbuckets - 1);
+		m->next = buckets[h];
+		buckets[h] = m;
+	    }
+	}
+	sfree(names->buckets);
+	names->buckets = buckets;
+	names->nbuckets *= 2;
+    }
 
-    return strcmp(a, b);
+    n->file = file;
+    n->name = name;
+    n->suffix = 1;
+    h = html_name_hash(file, name) & (names->nbuckets-1);
+    n->next = names->buckets[h];
+    names->buckets[h] = n;
+    names->nnames++;
 }
 
 static void html_file_section(htmlconfig *cfg, htmlfilelist *files,
@@ -336,6 +544,10 @@ static void html_contents_entry(htmloutput *ho, int depth, htmlsect *s,
 static void html_section_title(htmloutput *ho, htmlsect *s,
 			       htmlfile *thisfile, keywordlist *keywords,
 			       htmlconfig *cfg, bool real);
+static word *html_section_number(htmlsect *s, htmlconfig *cfg,
+				 wchar_t **suffix);
+static void html_search_form(htmloutput *ho, htmlfile *thisfile,
+			     htmlconfig *cfg);
 
 static htmlconfig html_configure(paragraph *source, bool chm_mode,
                                  errorstate *es)
@@ -363,9 +575,14 @@ static htmlconfig html_configure(paragraph *source, bool chm_mode,
     ret.leaf_smallest_contents = 4;
     ret.navlinks = chm_mode ? false : true;
     ret.rellinks = true;
+    ret.precompress = false;
+    ret.search_index = false;
     ret.single_filename = dupstr("Manual.html");
     ret.contents_filename = dupstr("Contents.html");
     ret.index_filename = dupstr("IndexPage.html");
+    ret.search_filename = dupstr("Search.html");
+    ret.search_index_filename = dupstr("SearchIndex.js");
+    ret.search_script_filename = dupstr("Search.js");
     ret.template_filename = dupstr("%n.html");
     if (chm_mode) {
         ret.chm_filename = dupstr("output.chm");
@@ -395,6 +612,8 @@ static htmlconfig html_configure(paragraph *source, bool chm_mode,
     ret.nav_next_text = L"Next";
     ret.nav_up_text = L"Up";
     ret.nav_separator = L" | ";
+    ret.search_text = L"Search";
+    ret.search_none_text = L"No matches.";
     ret.index_main_sep = L": ";
     ret.index_multi_sep = L", ";
     ret.pre_versionid = L"[";
@@ -515,6 +734,24 @@ static htmlconfig html_configure(paragraph *source, bool chm_mode,
 		ret.navlinks = !utob(uadv(k));
 	    } else if (!ustricmp(k, L"rellinks")) {
 		ret.rellinks = utob(uadv(k));
+	    } else if (!generic && !chm_mode &&
+                       !ustricmp(k, L"precompress")) {
+		ret.precompress = utob(uadv(k));
+	    } else if (!generic && !chm_mode &&
+                       !ustricmp(k, L"search-index")) {
+		ret.search_index = utob(uadv(k));
+	    } else if (!generic && !chm_mode &&
+                       !ustricmp(k, L"search-filename")) {
+		sfree(ret.search_filename);
+		ret.search_filename = dupstr(adv(p->origkeyword));
+	    } else if (!generic && !chm_mode &&
+                       !ustricmp(k, L"search-index-filename")) {
+		sfree(ret.search_index_filename);
+		ret.search_index_filename = dupstr(adv(p->origkeyword));
+	    } else if (!generic && !chm_mode &&
+                       !ustricmp(k, L"search-script-filename")) {
+		sfree(ret.search_script_filename);
+		ret.search_script_filename = dupstr(adv(p->origkeyword));
 	    } else if (!ustricmp(k, L"chapter-suffix")) {
 		ret.achapter.number_suffix = uadv(k);
 	    } else if (!ustricmp(k, L"leaf-level")) {
@@ -643,6 +880,10 @@ static htmlconfig html_configure(paragraph *source, bool chm_mode,
 		ret.nav_up_text = uadv(k);
 	    } else if (!ustricmp(k, L"nav-separator")) {
 		ret.nav_separator = uadv(k);
+	    } else if (!ustricmp(k, L"search-text")) {
+		ret.search_text = uadv(k);
+	    } else if (!ustricmp(k, L"search-none-text")) {
+		ret.search_none_text = uadv(k);
 	    } else if (!ustricmp(k, L"index-main-separator")) {
 		ret.index_main_sep = uadv(k);
 	    } else if (!ustricmp(k, L"index-multiple-separator")) {
@@ -761,13 +1002,1581 @@ paragraph *chm_config_filename(char *filename)
     return cmdline_cfg_simple("chm-filename", filename, NULL);
 }
 
+/*
+ * Once the files and sections are all laid out, each HTML file can
+ * be written without reference to any other, so the files are
+ * handed out to the worker threads. A file bound for a CHM is
+ * gathered in its job's buffer, and the main thread adds them all
+ * to the archive in file order afterwards.
+ */
+struct html_filejob {
+    htmlfile *f;
+    rdstringc rs;		       /* output, if gathered in memory */
+    errorstate es;
+};
+
+struct html_filejobs {
+    htmlconfig *conf;
+    htmlfilelist *files;
+    htmlsectlist *sects;
+    keywordlist *keywords;
+    indexdata *idx;
+    struct chm *chm;
+    bool has_index;
+    paragraph **versionids;	       /* shared by every file's footer */
+    int nversionids;
+    struct html_filejob *jobs;
+};
+
+static void html_file_job(void *vctx, int i)
+{
+    struct html_filejobs *ctx = (struct html_filejobs *)vctx;
+    struct html_filejob *job = &ctx->jobs[i];
+    htmlconfig *conf = ctx->conf;
+    htmlfilelist *files = ctx->files;
+    htmlsectlist *sects = ctx->sects;
+    keywordlist *keywords = ctx->keywords;
+    htmlfile *f = job->f;
+    htmlfile *prevf = i > 0 ? ctx->jobs[i-1].f : NULL;
+    htmlsect *s;
+    paragraph *p;
+    htmloutput ho;
+    bool displaying, precompress = false;
+    int vi;
+    enum LISTTYPE { NOLIST, UL, OL, DL };
+    enum ITEMTYPE { NOITEM, LI, DT, DD };
+    struct stackelement {
+	struct stackelement *next;
+	enum LISTTYPE listtype;
+	enum ITEMTYPE itemtype;
+    } *stackhead;
+
+#define listname(lt) ( (lt)==UL ? "ul" : (lt)==OL ? "ol" : "dl" )
+#define itemname(lt) ( (lt)==LI ? "li" : (lt)==DT ? "dt" : "dd" )
+
+    err_defer(&job->es);
+    ho.es = &job->es;
+    if (ctx->chm)
+        ho_setup_rdstringc(&ho, &job->rs);
+    else if (!strcmp(f->filename, "-"))
+        ho_setup_stdio(&ho, stdout);
+    else if (conf->precompress) {
+        ho_setup_rdstringc(&ho, &job->rs);
+        precompress = true;
+    } else
+        ho_setup_file(&ho, f->filename);
+
+    ho.charset = conf->output_charset;
+    ho.restrict_charset = conf->restrict_charset;
+    ho.cstate = charset_init_state;
+    ho.ver = conf->htmlver;
+    ho.state = HO_NEUTRAL;
+    ho.contents_level = 0;
+    ho.hackflags = 0;	       /* none of these thankyouverymuch */
+    ho.hacklimit = -1;
+
+    /* <!DOCTYPE>. */
+    switch (conf->htmlver) {
+      case HTML_3_2:
+        ho_string(&ho, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD "
+                  "HTML 3.2 Final//EN\">\n");
+	break;
+      case HTML_4:
+        ho_string(&ho, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML"
+                  " 4.01//EN\"\n\"http://www.w3.org/TR/html4/"
+                  "strict.dtd\">\n");
+	break;
+      case ISO_HTML:
+        ho_string(&ho, "<!DOCTYPE HTML PUBLIC \"ISO/IEC "
+                  "15445:2000//DTD HTML//EN\">\n");
+	break;
+      case XHTML_1_0_TRANSITIONAL:
+        ho_string(&ho, "<?xml version=\"1.0\" encoding=\"");
+        ho_string(&ho, charset_to_mimeenc(conf->output_charset));
+        ho_string(&ho, "\"?>\n"
+                  "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML"
+                  " 1.0 Transitional//EN\"\n\"http://www.w3.org/TR/"
+                  "xhtml1/DTD/xhtml1-transitional.dtd\">\n");
+	break;
+      case XHTML_1_0_STRICT:
+        ho_string(&ho, "<?xml version=\"1.0\" encoding=\"");
+        ho_string(&ho, charset_to_mimeenc(conf->output_charset));
+        ho_string(&ho, "\"?>\n"
+                  "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML"
+                  " 1.0 Strict//EN\"\n\"http://www.w3.org/TR/xhtml1/"
+                  "DTD/xhtml1-strict.dtd\">\n");
+	break;
+    }
+
+    element_open(&ho, "html");
+    if (is_xhtml(conf->htmlver)) {
+	element_attr(&ho, "xmlns", "http://www.w3.org/1999/xhtml");
+    }
+    html_nl(&ho);
+
+    element_open(&ho, "head");
+    html_nl(&ho);
+
+    element_empty(&ho, "meta");
+    element_attr(&ho, "http-equiv", "content-type");
+    {
+	char buf[200];
+	sprintf(buf, "text/html; charset=%.150s",
+		charset_to_mimeenc(conf->output_charset));
+	element_attr(&ho, "content", buf);
+    }
+    html_nl(&ho);
+
+    {
+        rdstringc rs = { 0, 0, NULL };
+        rdaddsc(&rs, "Halibut, ");
+        rdaddsc(&rs, version);
+        if (rs.text) {
+            element_empty(&ho, "meta");
+            element_attr(&ho, "name", "generator");
+            element_attr(&ho, "content", rs.text);
+            html_nl(&ho);
+            sfree(rs.text);
+        }
+    }
+
+    if (conf->author) {
+	element_empty(&ho, "meta");
+	element_attr(&ho, "name", "author");
+	element_attr_w(&ho, "content", conf->author);
+	html_nl(&ho);
+    }
+
+    if (conf->description) {
+	element_empty(&ho, "meta");
+	element_attr(&ho, "name", "description");
+	element_attr_w(&ho, "content", conf->description);
+	html_nl(&ho);
+    }
+
+    element_open(&ho, "title");
+    if (f->first && f->first->title) {
+	html_words(&ho, f->first->title->words, NOTHING,
+		   f, keywords, conf);
+
+	assert(f->last);
+	if (f->last != f->first && f->last->title) {
+	    html_text(&ho, conf->title_separator);
+	    html_words(&ho, f->last->title->words, NOTHING,
+		       f, keywords, conf);
+	}
+    }
+    element_close(&ho, "title");
+    html_nl(&ho);
+
+    if (conf->rellinks) {
+
+	if (prevf) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "previous");
+	    element_attr(&ho, "href", prevf->filename);
+	    html_nl(&ho);
+	}
+
+	if (f != files->head) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "ToC");
+	    element_attr(&ho, "href", files->head->filename);
+	    html_nl(&ho);
+	}
+
+	if (conf->leaf_level > 0) {
+	    htmlsect *p = f->first->parent;
+	    assert(p == f->last->parent);
+	    if (p) {
+		element_empty(&ho, "link");
+		element_attr(&ho, "rel", "up");
+		element_attr(&ho, "href", p->file->filename);
+		html_nl(&ho);
+	    }
+	}
+
+	if (ctx->has_index && files->index && f != files->index) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "index");
+	    element_attr(&ho, "href", files->index->filename);
+	    html_nl(&ho);
+	}
+
+	if (files->search && f != files->search) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "search");
+	    element_attr(&ho, "href", files->search->filename);
+	    html_nl(&ho);
+	}
+
+	if (f->next) {
+	    element_empty(&ho, "link");
+	    element_attr(&ho, "rel", "next");
+	    element_attr(&ho, "href", f->next->filename);
+	    html_nl(&ho);
+	}
+
+    }
+
+    if (conf->head_end)
+	html_raw(&ho, conf->head_end);
+
+    /*
+     * Add any <head> data defined in specific sections
+     * that go in this file. (This is mostly to allow <meta
+     * name="AppleTitle"> tags for Mac online help.)
+     */
+    for (s = f->first; s != f->first->subtree_end; s = s->next) {
+	if (s->file == f && s->text) {
+	    for (p = s->text;
+		 p && (p == s->text || p->type == para_Title ||
+		       !is_heading_type(p->type));
+		 p = p->next) {
+		if (p->type == para_Config) {
+		    if (!ustricmp(p->keyword, L"html-local-head")) {
+			html_raw(&ho, adv(p->origkeyword));
+		    }
+		}
+	    }
+	}
+    }
+
+    element_close(&ho, "head");
+    html_nl(&ho);
+
+    if (conf->body_tag)
+	html_raw(&ho, conf->body_tag);
+    else
+	element_open(&ho, "body");
+    html_nl(&ho);
+
+    if (conf->body_start)
+	html_raw(&ho, conf->body_start);
+
+    /*
+     * Write out a nav bar. Special case: we don't do this
+     * if there is only one file.
+     */
+    if (conf->navlinks && files->head != files->tail) {
+	element_open(&ho, "p");
+	if (conf->nav_attr)
+	    html_raw_as_attr(&ho, conf->nav_attr);
+
+	if (prevf) {
+	    element_open(&ho, "a");
+	    element_attr(&ho, "href", prevf->filename);
+	}
+	html_text(&ho, conf->nav_prev_text);
+	if (prevf)
+	    element_close(&ho, "a");
+
+	html_text(&ho, conf->nav_separator);
+
+	if (f != files->head) {
+	    element_open(&ho, "a");
+	    element_attr(&ho, "href", files->head->filename);
+	}
+	html_text(&ho, conf->contents_text);
+	if (f != files->head)
+	    element_close(&ho, "a");
+
+	/* We don't bother with "Up" links for leaf-level 1,
+	 * as they would be identical to the "Contents" links. */
+	if (conf->leaf_level >= 2) {
+	    htmlsect *p = f->first->parent;
+	    assert(p == f->last->parent);
+	    html_text(&ho, conf->nav_separator);
+	    if (p) {
+		element_open(&ho, "a");
+		element_attr(&ho, "href", p->file->filename);
+	    }
+	    html_text(&ho, conf->nav_up_text);
+	    if (p) {
+		element_close(&ho, "a");
+	    }
+	}
+
+	if (ctx->has_index && files->index) {
+	    html_text(&ho, conf->nav_separator);
+	    if (f != files->index) {
+		element_open(&ho, "a");
+		element_attr(&ho, "href", files->index->filename);
+	    }
+	    html_text(&ho, conf->index_text);
+	    if (f != files->index)
+		element_close(&ho, "a");
+	}
+
+	if (files->search) {
+	    html_text(&ho, conf->nav_separator);
+	    if (f != files->search) {
+		element_open(&ho, "a");
+		element_attr(&ho, "href", files->search->filename);
+	    }
+	    html_text(&ho, conf->search_text);
+	    if (f != files->search)
+		element_close(&ho, "a");
+	}
+
+	html_text(&ho, conf->nav_separator);
+
+	if (f->next) {
+	    element_open(&ho, "a");
+	    element_attr(&ho, "href", f->next->filename);
+	}
+	html_text(&ho, conf->nav_next_text);
+	if (f->next)
+	    element_close(&ho, "a");
+
+	element_close(&ho, "p");
+	html_nl(&ho);
+    }
+
+    /*
+     * Special case: for single-file mode, we output the top
+     * section title before the TOC.
+     */
+    if (files->head == files->tail && sects->head->type == TOP) {
+	element_open(&ho, "h1");
+
+	/*
+	 * Provide anchor(s) for cross-links to target.
+	 */
+	{
+	    int i;
+	    for (i=0; i < conf->ntfragments; i++)
+		if (sects->head->fragments[i])
+		    html_fragment(&ho, sects->head->fragments[i]);
+	}
+
+	html_section_title(&ho, sects->head, f, keywords, conf, true);
+
+	element_close(&ho, "h1");
+    }
+
+    /*
+     * Write out a prefix TOC for the file (if a leaf file).
+     * 
+     * We start by going through the section list and
+     * collecting the sections which need to be added to
+     * the contents. On the way, we also test to see if
+     * this file is a leaf file (defined as one which
+     * contains all descendants of any section it
+     * contains), because this will play a part in our
+     * decision on whether or not to _output_ the TOC.
+     *
+     * Only sections in the subtree of this file's first
+     * section can have an ancestor in the file, so that
+     * is the only part of the list we need to look at.
+     */
+    {
+	int ntoc = 0, tocsize = 0, tocstartidx = 0;
+	htmlsect **toc = NULL;
+	bool leaf = true;
+
+	for (s = f->first; s != f->first->subtree_end; s = s->next) {
+	    htmlsect *a, *ac;
+	    int depth, adepth;
+
+	    /*
+	     * Search up from this section until we find
+	     * the highest-level one which belongs in this
+	     * file.
+	     */
+	    depth = adepth = 0;
+	    a = NULL;
+	    for (ac = s; ac; ac = ac->parent) {
+		if (ac->file == f) {
+		    a = ac;
+		    adepth = depth;
+		}
+		depth++;
+	    }
+
+	    if (s->file != f && a != NULL)
+		leaf = false;
+
+	    if (a) {
+		if (adepth <= a->contents_depth) {
+		    if (ntoc >= tocsize) {
+			tocsize += 64;
+			toc = sresize(toc, tocsize, htmlsect *);
+		    }
+		    toc[ntoc++] = s;
+		}
+	    }
+	}
+
+	/*
+	 * Special case: for single-file mode, we don't output
+	 * the first section TOC entry if it's the top since we
+	 * have already output a section title for it above the
+	 * TOC, and since we don't output the top TOC entry, we
+	 * reduce the level of the remaining TOC entries by one
+	 * so that they are output correctly one level up from
+	 * where they would have been.
+	 */
+	tocstartidx = (files->head == files->tail && ntoc > 0 &&
+		       toc[0]->type == TOP) ? 1 : 0;
+	if (leaf && conf->leaf_contains_contents &&
+	    ntoc >= conf->leaf_smallest_contents &&
+	    tocstartidx < ntoc) {
+	    int i;
+
+	    for (i = tocstartidx; i < ntoc; i++) {
+		htmlsect *s = toc[i];
+		int hlevel = (s->type == TOP ? -1 :
+			      s->type == INDEX || s->type == SEARCH ? 0 :
+			      heading_depth(s->title))
+		    - tocstartidx - f->min_heading_depth + 1;
+
+		assert(hlevel >= 1);
+		html_contents_entry(&ho, hlevel, s,
+				    f, keywords, conf);
+	    }
+	    html_contents_entry(&ho, 0, NULL, f, keywords, conf);
+	}
+    }
+
+    /*
+     * Now go through the document and output some real
+     * text.
+     */
+    displaying = false;
+    for (s = f->first; s != f->first->subtree_end; s = s->next) {
+	if (s->file == f) {
+	    /*
+	     * This section belongs in this file.
+	     * Display it.
+	     */
+	    displaying = true;
+	} else {
+	    /*
+	     * Doesn't belong in this file, but it may be
+	     * a descendant of a section which does, in
+	     * which case we should consider it for the
+	     * main TOC of this file (for non-leaf files).
+	     */
+	    htmlsect *a, *ac;
+	    int depth, adepth;
+
+	    displaying = false;
+
+	    /*
+	     * Search up from this section until we find
+	     * the highest-level one which belongs in this
+	     * file.
+	     */
+	    depth = adepth = 0;
+	    a = NULL;
+	    for (ac = s; ac; ac = ac->parent) {
+		if (ac->file == f) {
+		    a = ac;
+		    adepth = depth;
+		}
+		depth++;
+	    }
+
+	    if (a != NULL) {
+		/*
+		 * This section does not belong in this
+		 * file, but an ancestor of it does. Write
+		 * out a contents table entry, if the depth
+		 * doesn't exceed the maximum contents
+		 * depth for the ancestor section.
+		 */
+		if (adepth <= a->contents_depth) {
+		    html_contents_entry(&ho, adepth, s,
+					f, keywords, conf);
+		}
+	    }
+	}
+
+	if (displaying) {
+	    int hlevel;
+	    char htag[3];
+
+	    html_contents_entry(&ho, 0, NULL, f, keywords, conf);
+
+	    /*
+	     * Display the section heading.
+	     *
+	     * Special case: for single-file mode, we don't
+	     * output the top section title since we have
+	     * already output it before the TOC.
+	     */
+	    if (files->head != files->tail || s->type != TOP) {
+		hlevel = (s->type == TOP ? -1 :
+			  s->type == INDEX || s->type == SEARCH ? 0 :
+			  heading_depth(s->title))
+		    - f->min_heading_depth + 1;
+		assert(hlevel >= 1);
+		/* HTML headings only go up to <h6> */
+		if (hlevel > 6)
+		    hlevel = 6;
+		htag[0] = 'h';
+		htag[1] = '0' + hlevel;
+		htag[2] = '\0';
+		element_open(&ho, htag);
+
+		/*
+		 * Provide anchor(s) for cross-links to target.
+		 * 
+		 * (Also we'll have to do this separately in
+		 * other paragraph types - NumberedList and
+		 * BiblioCited.)
+		 */
+		{
+		    int i;
+		    for (i=0; i < conf->ntfragments; i++)
+			if (s->fragments[i])
+			    html_fragment(&ho, s->fragments[i]);
+		}
+
+		html_section_title(&ho, s, f, keywords, conf, true);
+
+		element_close(&ho, htag);
+	    }
+
+	    /*
+	     * Now display the section text.
+	     */
+	    if (s->text) {
+		stackhead = snew(struct stackelement);
+		stackhead->next = NULL;
+		stackhead->listtype = NOLIST;
+		stackhead->itemtype = NOITEM;
+
+		for (p = s->text;; p = p->next) {
+		    enum LISTTYPE listtype;
+		    struct stackelement *se;
+
+		    /*
+		     * Preliminary switch to figure out what
+		     * sort of list we expect to be inside at
+		     * this stage.
+		     *
+		     * Since p may still be NULL at this point,
+		     * I invent a harmless paragraph type for
+		     * it if it is.
+		     */
+		    switch (p ? p->type : para_Normal) {
+		      case para_Rule:
+		      case para_Normal:
+		      case para_Copyright:
+		      case para_BiblioCited:
+		      case para_Code:
+		      case para_QuotePush:
+		      case para_QuotePop:
+		      case para_Chapter:
+		      case para_Appendix:
+		      case para_UnnumberedChapter:
+		      case para_Heading:
+		      case para_Subsect:
+		      case para_LcontPop:
+			listtype = NOLIST;
+			break;
+
+		      case para_Bullet:
+			listtype = UL;
+			break;
+
+		      case para_NumberedList:
+			listtype = OL;
+			break;
+
+		      case para_DescribedThing:
+		      case para_Description:
+			listtype = DL;
+			break;
+
+		      case para_LcontPush:
+			se = snew(struct stackelement);
+			se->next = stackhead;
+			se->listtype = NOLIST;
+			se->itemtype = NOITEM;
+			stackhead = se;
+			continue;
+
+		      default:     /* some totally non-printing para */
+			continue;
+		    }
+
+		    html_nl(&ho);
+
+		    /*
+		     * Terminate the most recent list item, if
+		     * any. (We left this until after
+		     * processing LcontPush, since in that case
+		     * the list item won't want to be
+		     * terminated until after the corresponding
+		     * LcontPop.)
+		     */
+		    if (stackhead->itemtype != NOITEM) {
+			element_close(&ho, itemname(stackhead->itemtype));
+			html_nl(&ho);
+		    }
+		    stackhead->itemtype = NOITEM;
+
+		    /*
+		     * Terminate the current list, if it's not
+		     * the one we want to be in.
+		     */
+		    if (listtype != stackhead->listtype &&
+			stackhead->listtype != NOLIST) {
+			element_close(&ho, listname(stackhead->listtype));
+			html_nl(&ho);
+		    }
+
+		    /*
+		     * Leave the loop if our time has come.
+		     */
+		    if (!p || (is_heading_type(p->type) &&
+			       p->type != para_Title))
+			break;     /* end of section text */
+
+		    /*
+		     * Start a fresh list if necessary.
+		     */
+		    if (listtype != stackhead->listtype &&
+			listtype != NOLIST)
+			element_open(&ho, listname(listtype));
+
+		    stackhead->listtype = listtype;
+
+		    switch (p->type) {
+		      case para_Rule:
+			element_empty(&ho, "hr");
+			break;
+		      case para_Code:
+			html_codepara(&ho, p->words);
+			break;
+		      case para_Normal:
+		      case para_Copyright:
+			element_open(&ho, "p");
+			html_nl(&ho);
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			html_nl(&ho);
+			element_close(&ho, "p");
+			break;
+		      case para_BiblioCited:
+			element_open(&ho, "p");
+			if (conf->psects[p->index]) {
+			    htmlsect *s = conf->psects[p->index];
+			    int i;
+			    for (i=0; i < conf->ntfragments; i++)
+				if (s->fragments[i])
+				    html_fragment(&ho, s->fragments[i]);
+			}
+			html_nl(&ho);
+			html_words(&ho, p->kwtext, ALL,
+				   f, keywords, conf);
+			html_text(&ho, L" ");
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			html_nl(&ho);
+			element_close(&ho, "p");
+			break;
+		      case para_Bullet:
+		      case para_NumberedList:
+			element_open(&ho, "li");
+			if (conf->psects[p->index]) {
+			    htmlsect *s = conf->psects[p->index];
+			    int i;
+			    for (i=0; i < conf->ntfragments; i++)
+				if (s->fragments[i])
+				    html_fragment(&ho, s->fragments[i]);
+			}
+			html_nl(&ho);
+			stackhead->itemtype = LI;
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			break;
+		      case para_DescribedThing:
+			element_open(&ho, "dt");
+			html_nl(&ho);
+			stackhead->itemtype = DT;
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			break;
+		      case para_Description:
+			element_open(&ho, "dd");
+			html_nl(&ho);
+			stackhead->itemtype = DD;
+			html_words(&ho, p->words, ALL,
+				   f, keywords, conf);
+			break;
+
+		      case para_QuotePush:
+			element_open(&ho, "blockquote");
+			break;
+		      case para_QuotePop:
+			element_close(&ho, "blockquote");
+			break;
+
+		      case para_LcontPop:
+			se = stackhead;
+			stackhead = stackhead->next;
+			assert(stackhead);
+			sfree(se);
+			break;
+		    }
+		}
+
+		assert(stackhead && !stackhead->next);
+		sfree(stackhead);
+	    }
+	    
+	    if (s->type == INDEX) {
+		indexentry *entry;
+		int i;
+
+		/*
+		 * This section is the index. I'll just
+		 * render it as a single paragraph, with a
+		 * colon between the index term and the
+		 * references, and <br> in between each
+		 * entry.
+		 */
+		element_open(&ho, "p");
+
+		for (i = 0; (entry =
+			     index234(ctx->idx->entries, i)) != NULL; i++) {
+		    htmlindex *hi = (htmlindex *)entry->backend_data;
+		    int j;
+
+		    if (i > 0)
+			element_empty(&ho, "br");
+		    html_nl(&ho);
+
+		    html_words(&ho, entry->text, MARKUP|LINKS,
+			       f, keywords, conf);
+
+		    html_text(&ho, conf->index_main_sep);
+
+		    for (j = 0; j < hi->nrefs; j++) {
+			htmlindexref *hr = hi->refs[j];
+			paragraph *p = hr->section->title;
+
+			if (j > 0)
+			    html_text(&ho, conf->index_multi_sep);
+
+			html_href(&ho, f, hr->section->file,
+				  hr->fragment);
+			hr->referenced = true;
+			if (p && p->kwtext)
+			    html_words(&ho, p->kwtext, MARKUP|LINKS,
+				       f, keywords, conf);
+			else if (p && p->words)
+			    html_words(&ho, p->words, MARKUP|LINKS,
+				       f, keywords, conf);
+			else {
+			    /*
+			     * If there is no title at all,
+			     * this must be because our
+			     * target section is the
+			     * preamble section and there
+			     * is no title. So we use the
+			     * preamble_text.
+			     */
+			    html_text(&ho, conf->preamble_text);
+			}
+			element_close(&ho, "a");
+		    }
+		}
+		element_close(&ho, "p");
+	    }
+
+	    if (s->type == SEARCH)
+		html_search_form(&ho, f, conf);
+	}
+    }
+
+    html_contents_entry(&ho, 0, NULL, f, keywords, conf);
+    html_nl(&ho);
+
+    {
+	/*
+	 * Footer.
+	 */
+	bool done_version_ids = false;
+
+	if (conf->address_section)
+	    element_empty(&ho, "hr");
+
+	if (conf->body_end)
+	    html_raw(&ho, conf->body_end);
+
+	if (conf->address_section) {
+	    bool started = false;
+	    if (conf->htmlver == ISO_HTML) {
+		/*
+		 * The ISO-HTML validator complains if
+		 * there isn't a <div> tag surrounding the
+		 * <address> tag. I'm uncertain of why this
+		 * should be - there appears to be no
+		 * mention of this in the ISO-HTML spec,
+		 * suggesting that it doesn't represent a
+		 * change from HTML 4, but nonetheless the
+		 * HTML 4 validator doesn't seem to mind.
+		 */
+		element_open(&ho, "div");
+	    }
+	    element_open(&ho, "address");
+	    if (conf->addr_start) {
+		html_raw(&ho, conf->addr_start);
+		html_nl(&ho);
+		started = true;
+	    }
+	    if (conf->visible_version_id) {
+		for (vi = 0; vi < ctx->nversionids; vi++) {
+		    if (started)
+			element_empty(&ho, "br");
+		    html_nl(&ho);
+		    html_text(&ho, conf->pre_versionid);
+		    html_words(&ho, ctx->versionids[vi]->words, NOTHING,
+			       f, keywords, conf);
+		    html_text(&ho, conf->post_versionid);
+		    started = true;
+		}
+		done_version_ids = true;
+	    }
+	    if (conf->addr_end) {
+		if (started)
+		    element_empty(&ho, "br");
+		html_raw(&ho, conf->addr_end);
+	    }
+	    element_close(&ho, "address");
+	    if (conf->htmlver == ISO_HTML)
+		element_close(&ho, "div");
+	}
+
+	if (!done_version_ids) {
+	    /*
+	     * If the user didn't want the version IDs
+	     * visible, I think we still have a duty to put
+	     * them in an HTML comment.
+	     */
+	    if (ctx->nversionids > 0) {
+		html_raw(&ho, "<!-- version IDs:\n");
+		for (vi = 0; vi < ctx->nversionids; vi++) {
+		    html_words(&ho, ctx->versionids[vi]->words, NOTHING,
+			       f, keywords, conf);
+		    html_nl(&ho);
+		}
+		html_raw(&ho, "-->\n");
+	    }
+	}
+    }
+
+    element_close(&ho, "body");
+    html_nl(&ho);
+    element_close(&ho, "html");
+    html_nl(&ho);
+    cleanup(&ho);
+
+    if (precompress) {
+	precompress_write(f->filename, &job->rs, &job->es);
+	sfree(job->rs.text);
+	job->rs = empty_rdstringc;
+    }
+}
+
+/*
+ * Client-side search. If html-search-index is on, we add a search
+ * page to the output, and write out an index of every section's
+ * words and a script to look queries up in it.
+ *
+ * The index is a JavaScript file, rather than (say) JSON, so that
+ * the search page can load it with a <script> tag even when the
+ * manual is read from local files. It sets halibut_search_index to
+ * an object containing:
+ *
+ *  - `files': the HTML file names.
+ *  - `docs': three entries for each section: the index of its file
+ *    in `files', its fragment name (or "" to link to the top of the
+ *    file), and its title as plain text.
+ *  - `terms': the term dictionary. Terms are in sorted order, and
+ *    each is written as the length of the prefix it shares with the
+ *    term before it, the length of the rest of it, the rest of it,
+ *    and the length of its posting list.
+ *  - `postings': the posting lists, one after another. Each posting
+ *    is the difference between its section number and the previous
+ *    posting's, followed by the number of times the term occurs in
+ *    the section (counting each occurrence in the title as
+ *    SEARCH_TITLEWEIGHT). A search ranks sections by these counts.
+ *
+ * All numbers are written in base64 VLQ: five bits per base64
+ * digit, least significant first, with 32 added to every digit but
+ * the last. The terms only ever contain characters from the Basic
+ * Multilingual Plane, so comparing them a byte at a time in UTF-8
+ * sorts them the same way JavaScript's string comparison will, and
+ * all lengths are in UTF-16 code units, which is what a JavaScript
+ * string counts.
+ *
+ * Each section's text is broken into words and sorted into a run
+ * in parallel, and then the runs are merged into the posting lists.
+ */
+#define SEARCH_MAXWORD 64	       /* skip longer words than this */
+#define SEARCH_TITLEWEIGHT 5
+
+static const char search_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * The script which looks queries up in the index. Its idea of a
+ * word, and of case folding, must match search_wordchar() and
+ * search_fold() below.
+ */
+static const char search_script[] =
+"/*\n"
+" * Search the index in halibut_search_index, and list the matching\n"
+" * sections on the search page. Generated by Halibut.\n"
+" */\n"
+"(function () {\n"
+"    var index = halibut_search_index;\n"
+"    var digits = \"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz\" +\n"
+"        \"0123456789+/\";\n"
+"    var value = [], terms = [], offsets = [0], pos, i;\n"
+"\n"
+"    for (i = 0; i < 64; i++)\n"
+"        value[digits.charCodeAt(i)] = i;\n"
+"\n"
+"    function vlq(s) {\n"
+"        var n = 0, scale = 1, d;\n"
+"        do {\n"
+"            d = value[s.charCodeAt(pos++)];\n"
+"            n += (d & 31) * scale;\n"
+"            scale *= 32;\n"
+"        } while (d & 32);\n"
+"        return n;\n"
+"    }\n"
+"\n"
+"    /* Unpack the term dictionary. */\n"
+"    (function () {\n"
+"        var dict = index.terms, term = \"\", prefix, len;\n"
+"        pos = 0;\n"
+"        while (pos < dict.length) {\n"
+"            prefix = vlq(dict);\n"
+"            len = vlq(dict);\n"
+"            term = term.substring(0, prefix) + dict.substr(pos, len);\n"
+"            pos += len;\n"
+"            terms.push(term);\n"
+"            offsets.push(offsets[offsets.length - 1] + vlq(dict));\n"
+"        }\n"
+"    })();\n"
+"\n"
+"    function wordchar(c) {\n"
+"        return (c >= 0x30 && c <= 0x39) || (c >= 0x41 && c <= 0x5A) ||\n"
+"            (c >= 0x61 && c <= 0x7A) ||\n"
+"            (c >= 0xC0 && c != 0xD7 && c != 0xF7 &&\n"
+"             !(c >= 0x2000 && c < 0x2070) && !(c >= 0x3000 && c < 0x3040) &&\n"
+"             !(c >= 0xD800 && c < 0xE000) && c != 0xFEFF);\n"
+"    }\n"
+"\n"
+"    function fold(c) {\n"
+"        if ((c >= 0x41 && c <= 0x5A) ||\n"
+"            (c >= 0xC0 && c <= 0xDE && c != 0xD7) ||\n"
+"            (c >= 0x391 && c <= 0x3A9 && c != 0x3A2) ||\n"
+"            (c >= 0x410 && c <= 0x42F))\n"
+"            return c + 0x20;\n"
+"        if (c >= 0x400 && c <= 0x40F)\n"
+"            return c + 0x50;\n"
+"        return c;\n"
+"    }\n"
+"\n"
+"    function words(query) {\n"
+"        var ret = [], word = \"\", c, i;\n"
+"        for (i = 0; i <= query.length; i++) {\n"
+"            c = i < query.length ? query.charCodeAt(i) : 0;\n"
+"            if (wordchar(c)) {\n"
+"                word += String.fromCharCode(fold(c));\n"
+"            } else if (word) {\n"
+"                ret.push(word);\n"
+"                word = \"\";\n"
+"            }\n"
+"        }\n"
+"        return ret;\n"
+"    }\n"
+"\n"
+"    /* Find the first term not less than a word. */\n"
+"    function lookup(word) {\n"
+"        var lo = 0, hi = terms.length, mid;\n"
+"        while (lo < hi) {\n"
+"            mid = (lo + hi) >> 1;\n"
+"            if (terms[mid] < word)\n"
+"                lo = mid + 1;\n"
+"            else\n"
+"                hi = mid;\n"
+"        }\n"
+"        return lo;\n"
+"    }\n"
+"\n"
+"    /* Add the counts in one term's posting list to a set of hits. */\n"
+"    function postings(t, hits) {\n"
+"        var s = index.postings, doc = 0;\n"
+"        pos = offsets[t];\n"
+"        while (pos < offsets[t + 1]) {\n"
+"            doc += vlq(s);\n"
+"            hits[doc] = (hits[doc] || 0) + vlq(s);\n"
+"        }\n"
+"    }\n"
+"\n"
+"    /*\n"
+"     * Return the sections containing every word of the query, best\n"
+"     * first. The last word also matches any term it is a prefix of.\n"
+"     */\n"
+"    function search(query) {\n"
+"        var ws = words(query), result = null, docs = [];\n"
+"        var hits, both, t, i, d;\n"
+"        for (i = 0; i < ws.length; i++) {\n"
+"            hits = {};\n"
+"            t = lookup(ws[i]);\n"
+"            if (i == ws.length - 1) {\n"
+"                for (; t < terms.length &&\n"
+"                     terms[t].substring(0, ws[i].length) == ws[i]; t++)\n"
+"                    postings(t, hits);\n"
+"            } else if (t < terms.length && terms[t] == ws[i]) {\n"
+"                postings(t, hits);\n"
+"            }\n"
+"            if (result) {\n"
+"                both = {};\n"
+"                for (d in result)\n"
+"                    if (hits.hasOwnProperty(d))\n"
+"                        both[d] = result[d] + hits[d];\n"
+"                result = both;\n"
+"            } else {\n"
+"                result = hits;\n"
+"            }\n"
+"        }\n"
+"        for (d in result)\n"
+"            docs.push(+d);\n"
+"        docs.sort(function (a, b) { return result[b] - result[a] || a - b; });\n"
+"        return docs;\n"
+"    }\n"
+"\n"
+"    function show(query) {\n"
+"        var results = document.getElementById(\"halibut-search-results\");\n"
+"        var none = document.getElementById(\"halibut-search-none\");\n"
+"        var docs = search(query), list, item, link, frag, i;\n"
+"        while (results.firstChild)\n"
+"            results.removeChild(results.firstChild);\n"
+"        none.style.display =\n"
+"            words(query).length && !docs.length ? \"\" : \"none\";\n"
+"        if (!docs.length)\n"
+"            return;\n"
+"        list = document.createElement(\"ol\");\n"
+"        for (i = 0; i < docs.length; i++) {\n"
+"            frag = index.docs[3 * docs[i] + 1];\n"
+"            link = document.createElement(\"a\");\n"
+"            link.href = index.files[index.docs[3 * docs[i]]] +\n"
+"                (frag ? \"#\" + frag : \"\");\n"
+"            link.appendChild(document.createTextNode(\n"
+"                index.docs[3 * docs[i] + 2]));\n"
+"            item = document.createElement(\"li\");\n"
+"            item.appendChild(link);\n"
+"            list.appendChild(item);\n"
+"        }\n"
+"        results.appendChild(list);\n"
+"    }\n"
+"\n"
+"    (function () {\n"
+"        var input = document.getElementById(\"halibut-search-query\");\n"
+"        var m = /[?&]q=([^&]*)/.exec(window.location.search);\n"
+"        if (m) {\n"
+"            try {\n"
+"                input.value = decodeURIComponent(m[1].replace(/\\+/g, \" \"));\n"
+"            } catch (e) {\n"
+"            }\n"
+"        }\n"
+"        input.oninput = function () { show(input.value); };\n"
+"        if (input.value)\n"
+"            show(input.value);\n"
+"    })();\n"
+"})();\n";
+
+struct search_posting {
+    const char *term;
+    int count;
+};
+
+struct search_doc {
+    htmlsect *s;
+    char *title;		       /* plain text, in UTF-8 */
+    char *terms;		       /* folded, NUL-terminated, in UTF-8 */
+    struct search_posting *postings;
+    int npostings, next;
+};
+
+struct search_jobs {
+    htmlconfig *conf;
+    keywordlist *keywords;
+    struct search_doc *docs;
+};
+
+static int search_posting_cmp(const void *av, const void *bv)
+{
+    const struct search_posting *a = (const struct search_posting *)av;
+    const struct search_posting *b = (const struct search_posting *)bv;
+    return strcmp(a->term, b->term);
+}
+
+static bool search_wordchar(unsigned c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+	(c >= 'a' && c <= 'z') ||
+	(c >= 0xC0 && c < 0x10000 && c != 0xD7 && c != 0xF7 &&
+	 !(c >= 0x2000 && c < 0x2070) && !(c >= 0x3000 && c < 0x3040) &&
+	 !(c >= 0xD800 && c < 0xE000) && c != 0xFEFF);
+}
+
+/*
+ * Fold Latin-1, Greek and Cyrillic capitals to lower case. Every
+ * character keeps the length of its UTF-8 encoding.
+ */
+static unsigned search_fold(unsigned c)
+{
+    if ((c >= 'A' && c <= 'Z') ||
+	(c >= 0xC0 && c <= 0xDE && c != 0xD7) ||
+	(c >= 0x391 && c <= 0x3A9 && c != 0x3A2) ||
+	(c >= 0x410 && c <= 0x42F))
+	return c + 0x20;
+    if (c >= 0x400 && c <= 0x40F)
+	return c + 0x50;
+    return c;
+}
+
+/* Decode one character of some UTF-8 we encoded ourselves. */
+static unsigned search_utf8(const char **pp)
+{
+    const unsigned char *p = (const unsigned char *)*pp;
+    unsigned c = *p++;
+    int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+
+    if (n)
+	c &= 0x3F >> n;
+    while (n-- > 0 && (*p & 0xC0) == 0x80)
+	c = (c << 6) | (*p++ & 0x3F);
+    *pp = (const char *)p;
+    return c;
+}
+
+static void search_vlq(rdstringc *rs, unsigned val)
+{
+    do {
+	int digit = val & 31;
+	val >>= 5;
+	if (val)
+	    digit |= 32;
+	rdaddc(rs, search_digits[digit]);
+    } while (val);
+}
+
+/*
+ * Add len bytes of UTF-8 to a JavaScript string literal, escaping
+ * anything outside printable ASCII.
+ */
+static void search_js_text(rdstringc *rs, const char *p, int len)
+{
+    const char *end = p + len;
+    char buf[20];
+
+    while (p < end) {
+	unsigned c = search_utf8(&p);
+
+	if (c >= 0x10000) {
+	    c -= 0x10000;
+	    sprintf(buf, "\\u%04X\\u%04X",
+		    0xD800 + (c >> 10), 0xDC00 + (c & 0x3FF));
+	    rdaddsc(rs, buf);
+	} else if (c < 0x20 || c >= 0x7F) {
+	    sprintf(buf, "\\u%04X", c);
+	    rdaddsc(rs, buf);
+	} else if (c == '"' || c == '\\') {
+	    rdaddc(rs, '\\');
+	    rdaddc(rs, c);
+	} else {
+	    rdaddc(rs, c);
+	}
+    }
+}
+
+/*
+ * Render one section's title and text as plain UTF-8, break it into
+ * words, and sort them into a run.
+ */
+static void search_doc_job(void *vctx, int i)
+{
+    struct search_jobs *ctx = (struct search_jobs *)vctx;
+    struct search_doc *doc = &ctx->docs[i];
+    htmlconfig *conf = ctx->conf;
+    htmlsect *s = doc->s;
+    htmloutput ho;
+    rdstringc rs = { 0, 0, NULL };
+    paragraph *p;
+    word *w;
+    const char *q, *end;
+    char *out, *wordstart;
+    int titlelen, size = 0, k, n;
+    bool done = false, intitle = false;
+
+    ho.charset = ho.restrict_charset = CS_UTF8;
+    ho.cstate = charset_init_state;
+    ho.es = NULL;
+    ho.ver = conf->htmlver;
+    ho.state = HO_NEUTRAL;
+    ho.contents_level = 0;
+    ho.hackflags = HO_HACK_QUOTENOTHING;
+    ho.hacklimit = -1;
+    ho_setup_rdstringc(&ho, &rs);
+
+    if (s->title) {
+	wchar_t *suffix;
+	word *number = html_section_number(s, conf, &suffix);
+
+	if (number) {
+	    html_words(&ho, number, NOTHING, NULL, ctx->keywords, conf);
+	    html_text(&ho, suffix);
+	}
+	html_words(&ho, s->title->words, NOTHING, NULL, ctx->keywords, conf);
+    } else {
+	html_text(&ho, conf->preamble_text);
+    }
+    doc->title = dupstr(rs.text ? rs.text : "");
+    titlelen = rs.pos;
+    html_nl(&ho);
+
+    for (p = s->text;
+	 p && (p->type == para_Title || !is_heading_type(p->type));
+	 p = p->next) {
+	switch (p->type) {
+	  case para_Normal:
+	  case para_Copyright:
+	  case para_BiblioCited:
+	  case para_Bullet:
+	  case para_NumberedList:
+	  case para_DescribedThing:
+	  case para_Description:
+	    html_words(&ho, p->words, NOTHING, NULL, ctx->keywords, conf);
+	    html_nl(&ho);
+	    break;
+	  case para_Code:
+	    for (w = p->words; w; w = w->next)
+		if (w->type == word_WeakCode) {
+		    html_text(&ho, w->text);
+		    html_nl(&ho);
+		}
+	    break;
+	}
+    }
+    cleanup(&ho);
+
+    /*
+     * Now break it into words. Folding doesn't change the length of
+     * a character, and each word's terminating NUL replaces a
+     * separator (except perhaps at the very end), so the folded
+     * words take no more room than the text did.
+     */
+    doc->terms = out = snewn(rs.pos + 1, char);
+    doc->postings = NULL;
+    doc->npostings = doc->next = 0;
+
+    q = rs.text;
+    end = q + rs.pos;
+    wordstart = out;
+    while (!done) {
+	unsigned c;
+
+	if (q == end) {
+	    c = 0;
+	    done = true;
+	} else {
+	    if (out == wordstart)
+		intitle = q - rs.text < titlelen;
+	    c = search_utf8(&q);
+	}
+
+	if (search_wordchar(c)) {
+	    c = search_fold(c);
+	    if (c < 0x80) {
+		*out++ = c;
+	    } else if (c < 0x800) {
+		*out++ = 0xC0 | (c >> 6);
+		*out++ = 0x80 | (c & 0x3F);
+	    } else {
+		*out++ = 0xE0 | (c >> 12);
+		*out++ = 0x80 | ((c >> 6) & 0x3F);
+		*out++ = 0x80 | (c & 0x3F);
+	    }
+	} else if (out > wordstart) {
+	    *out++ = '\0';
+	    if (out - wordstart - 1 <= SEARCH_MAXWORD) {
+		if (doc->npostings >= size) {
+		    size = doc->npostings * 3 / 2 + 64;
+		    doc->postings = sresize(doc->postings, size,
+					    struct search_posting);
+		}
+		doc->postings[doc->npostings].term = wordstart;
+		doc->postings[doc->npostings].count =
+		    intitle ? SEARCH_TITLEWEIGHT : 1;
+		doc->npostings++;
+	    }
+	    wordstart = out;
+	}
+    }
+    sfree(rs.text);
+
+    /* Sort the run, and add up the counts of repeated words. */
+    qsort(doc->postings, doc->npostings, sizeof(*doc->postings),
+	  search_posting_cmp);
+    for (k = n = 0; k < doc->npostings; k++) {
+	if (n > 0 && !strcmp(doc->postings[n-1].term,
+			     doc->postings[k].term))
+	    doc->postings[n-1].count += doc->postings[k].count;
+	else
+	    doc->postings[n++] = doc->postings[k];
+    }
+    doc->npostings = n;
+}
+
+/*
+ * Order the merge heap: by the next term in each run, then by
+ * section.
+ */
+static bool search_heap_less(struct search_doc *docs, int a, int b)
+{
+    int cmp = strcmp(docs[a].postings[docs[a].next].term,
+		     docs[b].postings[docs[b].next].term);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void search_heap_down(struct search_doc *docs, int *heap, int n, int i)
+{
+    while (1) {
+	int c = 2*i+1;
+	if (c >= n)
+	    break;
+	if (c+1 < n && search_heap_less(docs, heap[c+1], heap[c]))
+	    c++;
+	if (!search_heap_less(docs, heap[c], heap[i]))
+	    break;
+	{ int tmp = heap[c]; heap[c] = heap[i]; heap[i] = tmp; }
+	i = c;
+    }
+}
+
+/*
+ * Finish a term's entry in the dictionary, now that its posting
+ * list is complete, and append the list to the rest.
+ */
+static void search_add_term(rdstringc *dict, rdstringc *postings,
+			    rdstringc *list, const char *term,
+			    const char *prevterm)
+{
+    int shared = 0, prefixlen = 0, suffixlen = 0;
+    const char *p;
+
+    if (prevterm)
+	while (term[shared] && term[shared] == prevterm[shared])
+	    shared++;
+    while (shared > 0 && (term[shared] & 0xC0) == 0x80)
+	shared--;		       /* back up to a character boundary */
+
+    for (p = term; *p; p++)
+	if ((*p & 0xC0) != 0x80) {
+	    if (p < term + shared)
+		prefixlen++;
+	    else
+		suffixlen++;
+	}
+
+    search_vlq(dict, prefixlen);
+    search_vlq(dict, suffixlen);
+    search_js_text(dict, term + shared, strlen(term + shared));
+    search_vlq(dict, list->pos);
+    rdaddsn(postings, list->text, list->pos);
+    list->pos = 0;
+}
+
+static void html_search_write(htmlconfig *conf, const char *filename,
+			      rdstringc const *rs, errorstate *es)
+{
+    if (conf->precompress)
+	precompress_write(filename, rs, es);
+    else if (!write_whole_file(filename, rs->text, rs->pos, false))
+	err_cantopenw(es, filename);
+}
+
+/*
+ * Build the search index for the document, and write it out along
+ * with the search script.
+ */
+static void html_search_index(htmlconfig *conf, htmlfilelist *files,
+			      htmlsectlist *sects, keywordlist *keywords,
+			      errorstate *es)
+{
+    struct search_jobs ctx;
+    struct search_doc *docs;
+    rdstringc out = { 0, 0, NULL }, dict = { 0, 0, NULL };
+    rdstringc postings = { 0, 0, NULL }, list = { 0, 0, NULL };
+    const char *term = NULL, *prevterm = NULL;
+    htmlfile *f;
+    htmlsect *s;
+    int *heap;
+    int ndocs, n, i, prevdoc = 0;
+
+    ndocs = 0;
+    for (s = sects->head; s; s = s->next)
+	if (s->type == NORMAL || s->type == TOP)
+	    ndocs++;
+    docs = snewn(ndocs, struct search_doc);
+    ndocs = 0;
+    for (s = sects->head; s; s = s->next)
+	if (s->type == NORMAL || s->type == TOP)
+	    docs[ndocs++].s = s;
+
+    ctx.conf = conf;
+    ctx.keywords = keywords;
+    ctx.docs = docs;
+    run_jobs(ndocs, search_doc_job, &ctx);
+
+    /*
+     * Merge the runs, writing out each term's posting list as soon
+     * as we've seen all of it.
+     */
+    heap = snewn(ndocs, int);
+    for (i = n = 0; i < ndocs; i++)
+	if (docs[i].npostings)
+	    heap[n++] = i;
+    for (i = n/2; i-- > 0 ;)
+	search_heap_down(docs, heap, n, i);
+
+    while (n > 0) {
+	int d = heap[0];
+	struct search_posting *sp = &docs[d].postings[docs[d].next];
+
+	if (!term || strcmp(term, sp->term)) {
+	    if (term)
+		search_add_term(&dict, &postings, &list, term, prevterm);
+	    prevterm = term;
+	    term = sp->term;
+	    prevdoc = 0;
+	}
+	search_vlq(&list, d - prevdoc);
+	search_vlq(&list, sp->count);
+	prevdoc = d;
+
+	if (++docs[d].next == docs[d].npostings)
+	    heap[0] = heap[--n];
+	search_heap_down(docs, heap, n, 0);
+    }
+    if (term)
+	search_add_term(&dict, &postings, &list, term, prevterm);
+    sfree(heap);
+    sfree(list.text);
+
+    rdaddsc(&out, "var halibut_search_index = {\n\"files\": [");
+    for (f = files->head, i = 0; f; f = f->next, i++) {
+	f->temp = i;
+	rdaddsc(&out, i ? ",\n\"" : "\n\"");
+	search_js_text(&out, f->filename, strlen(f->filename));
+	rdaddc(&out, '"');
+    }
+    rdaddsc(&out, "\n],\n\"docs\": [");
+    for (i = 0; i < ndocs; i++) {
+	char buf[40];
+	s = docs[i].s;
+	sprintf(buf, "%s\n%d,\"", i ? "," : "", s->file->temp);
+	rdaddsc(&out, buf);
+	if (s->fragments[0])
+	    search_js_text(&out, s->fragments[0], strlen(s->fragments[0]));
+	rdaddsc(&out, "\",\"");
+	search_js_text(&out, docs[i].title, strlen(docs[i].title));
+	rdaddc(&out, '"');
+    }
+    rdaddsc(&out, "\n],\n\"terms\": \"");
+    if (dict.text)
+	rdaddsn(&out, dict.text, dict.pos);
+    rdaddsc(&out, "\",\n\"postings\": \"");
+    if (postings.text)
+	rdaddsn(&out, postings.text, postings.pos);
+    rdaddsc(&out, "\"\n};\n");
+    sfree(dict.text);
+    sfree(postings.text);
+
+    for (i = 0; i < ndocs; i++) {
+	sfree(docs[i].title);
+	sfree(docs[i].terms);
+	sfree(docs[i].postings);
+    }
+    sfree(docs);
+
+    html_search_write(conf, conf->search_index_filename, &out, es);
+    sfree(out.text);
+
+    out.text = dupstr(search_script);
+    out.pos = strlen(search_script);
+    out.size = out.pos + 1;
+    html_search_write(conf, conf->search_script_filename, &out, es);
+    sfree(out.text);
+}
+
+/*
+ * The body of the search page: a form to type the query into, and
+ * the scripts which look it up and list the results below it.
+ */
+static void html_search_form(htmloutput *ho, htmlfile *thisfile,
+			     htmlconfig *cfg)
+{
+    element_open(ho, "form");
+    element_attr(ho, "action", thisfile->filename);
+    element_attr(ho, "method", "get");
+    element_open(ho, "p");
+    element_empty(ho, "input");
+    element_attr(ho, "type", "text");
+    element_attr(ho, "name", "q");
+    element_attr(ho, "id", "halibut-search-query");
+    html_nl(ho);
+    element_empty(ho, "input");
+    element_attr(ho, "type", "submit");
+    element_attr_w(ho, "value", cfg->search_text);
+    element_close(ho, "p");
+    element_close(ho, "form");
+    html_nl(ho);
+
+    element_open(ho, "p");
+    element_attr(ho, "id", "halibut-search-none");
+    element_attr(ho, "style", "display: none");
+    html_text(ho, cfg->search_none_text);
+    element_close(ho, "p");
+    html_nl(ho);
+
+    element_open(ho, "div");
+    element_attr(ho, "id", "halibut-search-results");
+    element_close(ho, "div");
+    html_nl(ho);
+
+    element_open(ho, "script");
+    element_attr(ho, "type", "text/javascript");
+    element_attr(ho, "src", cfg->search_index_filename);
+    element_close(ho, "script");
+    html_nl(ho);
+    element_open(ho, "script");
+    element_attr(ho, "type", "text/javascript");
+    element_attr(ho, "src", cfg->search_script_filename);
+    element_close(ho, "script");
+    html_nl(ho);
+}
+
 static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
                                 indexdata *idx, errorstate *es, bool chm_mode)
 {
     paragraph *p;
     htmlsect *topsect;
     htmlconfig conf;
-    htmlfilelist files = { NULL, NULL, NULL, NULL, NULL, NULL };
+    htmlfilelist files = { NULL, NULL, NULL, NULL, NULL, NULL, NULL };
     htmlsectlist sects = { NULL, NULL }, nonsects = { NULL, NULL };
     struct chm *chm = NULL;
     bool has_index, hhk_needed = false;
@@ -775,22 +2584,31 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
     conf = html_configure(sourceform, chm_mode, es);
 
     /*
-     * We're going to make heavy use of paragraphs' private data
-     * fields in the forthcoming code. Clear them first, so we can
-     * reliably tell whether we have auxiliary data for a
-     * particular paragraph.
+     * We're going to keep a lot of auxiliary data about individual
+     * paragraphs and words in the forthcoming code. Set up the
+     * tables for it, empty, so we can reliably tell whether we
+     * have any for a particular one.
      */
-    for (p = sourceform; p; p = p->next)
-	p->private_data = NULL;
+    {
+	int i, nparas, nwords;
+
+	doc_size(sourceform, &nparas, &nwords);
+	conf.psects = snewn(nparas, htmlsect *);
+	for (i = 0; i < nparas; i++)
+	    conf.psects[i] = NULL;
+	conf.windexrefs = snewn(nwords, htmlindexref *);
+	for (i = 0; i < nwords; i++)
+	    conf.windexrefs[i] = NULL;
+    }
 
-    files.frags = newtree234(html_fragment_compare, NULL);
-    files.files = newtree234(html_filename_compare, NULL);
+    files.frags = html_names_new();
+    files.files = html_names_new();
 
     /*
      * Start by figuring out into which file each piece of the
      * document should be put. We'll do this by inventing an
-     * `htmlsect' structure and stashing it in the private_data
-     * field of each section paragraph; we also need one additional
+     * `htmlsect' structure and recording it in conf.psects for
+     * each section paragraph; we also need one additional
      * htmlsect for the document index, which won't show up in the
      * source form but needs to be consistently mentioned in
      * contents links.
@@ -824,11 +2642,11 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 		sect->contents_depth = contents_depth(conf, d+1) - (d+1);
 
 		if (p->parent) {
-		    sect->parent = (htmlsect *)p->parent->private_data;
+		    sect->parent = conf.psects[p->parent->index];
 		    assert(sect->parent != NULL);
 		} else
 		    sect->parent = topsect;
-		p->private_data = sect;
+		conf.psects[p->index] = sect;
 
 		html_file_section(&conf, &files, sect, d);
 
@@ -862,6 +2680,24 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 							sect->fragments[0]);
 	    files.index = sect->file;
 	}
+
+	/*
+	 * And the search page, if we're writing a search index. It
+	 * goes in the contents next to the index, like a peer of
+	 * the chapters.
+	 */
+	if (conf.search_index) {
+	    sect = html_new_sect(&sects, NULL, &conf);
+	    sect->text = NULL;
+	    sect->type = SEARCH;
+	    sect->parent = topsect;
+            sect->contents_depth = 0;
+	    html_file_section(&conf, &files, sect, 0);   /* peer of chapters */
+	    sect->fragments[0] = utoa_dup(conf.search_text, CS_ASCII);
+	    sect->fragments[0] = html_sanitise_fragment(&files, sect->file,
+							sect->fragments[0]);
+	    files.search = sect->file;
+	}
     }
 
     /*
@@ -896,7 +2732,7 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 			   sects.head->type == TOP);
 		    parent = sects.head;
 		} else
-		    parent = (htmlsect *)q->private_data;
+		    parent = conf.psects[q->index];
 
 		/*
 		 * Now we can construct an htmlsect for this
@@ -909,7 +2745,7 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 		sect = html_new_sect(&nonsects, p, &conf);
 		sect->file = parent->file;
 		sect->parent = parent;
-		p->private_data = sect;
+		conf.psects[p->index] = sect;
 
 		/*
 		 * Fragment IDs for these paragraphs will simply be
@@ -924,6 +2760,25 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 	}
     }
 
+    /*
+     * Find the end of each section's subtree in the section list.
+     * Each new section closes every open section between its
+     * predecessor and its own parent.
+     */
+    {
+	htmlsect *s, *a, *prev = NULL;
+
+	for (s = sects.head; s; s = s->next) {
+	    for (a = prev; a != s->parent; a = a->parent) {
+		assert(a);	       /* parent must be still open */
+		a->subtree_end = s;
+	    }
+	    prev = s;
+	}
+	for (a = prev; a; a = a->parent)
+	    a->subtree_end = NULL;
+    }
+
     /*
      * Reset the fragment numbers in each file. I've just used them
      * to generate `p' fragment IDs for non-section paragraphs
@@ -976,7 +2831,7 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 	lastsect = sects.head;	       /* this is always the top section */
 	for (p = sourceform; p; p = p->next) {
 	    if (is_heading_type(p->type) && p->type != para_Title)
-		lastsect = (htmlsect *)p->private_data;
+		lastsect = conf.psects[p->index];
 
 	    for (w = p->words; w; w = w->next)
 		if (w->type == word_IndexRef) {
@@ -995,7 +2850,7 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 			    html_sanitise_fragment(&files, hr->section->file,
 						   hr->fragment);
 		    }
-		    w->private_data = hr;
+		    conf.windexrefs[w->index] = hr;
 
 		    tag = index_findtag(idx, w->text);
 		    if (!tag)
@@ -1007,10 +2862,11 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 
 			if (hi->nrefs >= hi->refsize) {
 			    hi->refsize += 32;
-			    hi->refs = sresize(hi->refs, hi->refsize, word *);
+			    hi->refs = sresize(hi->refs, hi->refsize,
+					       htmlindexref *);
 			}
 
-			hi->refs[hi->nrefs++] = w;
+			hi->refs[hi->nrefs++] = hr;
 		    }
 		}
 	}
@@ -1020,8 +2876,9 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
         chm = chm_new();
 
     /*
-     * Now we're ready to write out the actual HTML files.
-     * 
+     * Now we're ready to write out the actual HTML files, which
+     * html_file_job() does for each file in parallel.
+     *
      * For each file:
      * 
      *  - we open that file and write its header
@@ -1034,829 +2891,69 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
      *  - finally, we output the file trailer and close the file.
      */
     {
-	htmlfile *f, *prevf;
-	htmlsect *s;
-	paragraph *p;
-
-	prevf = NULL;
-
-	for (f = files.head; f; f = f->next) {
-	    htmloutput ho;
-	    bool displaying;
-	    enum LISTTYPE { NOLIST, UL, OL, DL };
-	    enum ITEMTYPE { NOITEM, LI, DT, DD };
-	    struct stackelement {
-		struct stackelement *next;
-		enum LISTTYPE listtype;
-		enum ITEMTYPE itemtype;
-	    } *stackhead;
-
-#define listname(lt) ( (lt)==UL ? "ul" : (lt)==OL ? "ol" : "dl" )
-#define itemname(lt) ( (lt)==LI ? "li" : (lt)==DT ? "dt" : "dd" )
-
-            if (chm)
-                ho_setup_chm(&ho, chm, f->filename);
-	    else if (!strcmp(f->filename, "-"))
-                ho_setup_stdio(&ho, stdout);
-            else
-                ho_setup_file(&ho, f->filename);
-
-	    ho.charset = conf.output_charset;
-	    ho.restrict_charset = conf.restrict_charset;
-	    ho.cstate = charset_init_state;
-            ho.es = es;
-	    ho.ver = conf.htmlver;
-	    ho.state = HO_NEUTRAL;
-	    ho.contents_level = 0;
-	    ho.hackflags = 0;	       /* none of these thankyouverymuch */
-	    ho.hacklimit = -1;
-
-	    /* <!DOCTYPE>. */
-	    switch (conf.htmlver) {
-	      case HTML_3_2:
-                ho_string(&ho, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD "
-                          "HTML 3.2 Final//EN\">\n");
-		break;
-	      case HTML_4:
-                ho_string(&ho, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML"
-                          " 4.01//EN\"\n\"http://www.w3.org/TR/html4/"
-                          "strict.dtd\">\n");
-		break;
-	      case ISO_HTML:
-                ho_string(&ho, "<!DOCTYPE HTML PUBLIC \"ISO/IEC "
-                          "15445:2000//DTD HTML//EN\">\n");
-		break;
-	      case XHTML_1_0_TRANSITIONAL:
-                ho_string(&ho, "<?xml version=\"1.0\" encoding=\"");
-                ho_string(&ho, charset_to_mimeenc(conf.output_charset));
-                ho_string(&ho, "\"?>\n"
-                          "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML"
-                          " 1.0 Transitional//EN\"\n\"http://www.w3.org/TR/"
-                          "xhtml1/DTD/xhtml1-transitional.dtd\">\n");
-		break;
-	      case XHTML_1_0_STRICT:
-                ho_string(&ho, "<?xml version=\"1.0\" encoding=\"");
-                ho_string(&ho, charset_to_mimeenc(conf.output_charset));
-                ho_string(&ho, "\"?>\n"
-                          "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML"
-                          " 1.0 Strict//EN\"\n\"http://www.w3.org/TR/xhtml1/"
-                          "DTD/xhtml1-strict.dtd\">\n");
-		break;
-	    }
-
-	    element_open(&ho, "html");
-	    if (is_xhtml(conf.htmlver)) {
-		element_attr(&ho, "xmlns", "http://www.w3.org/1999/xhtml");
-	    }
-	    html_nl(&ho);
-
-	    element_open(&ho, "head");
-	    html_nl(&ho);
-
-	    element_empty(&ho, "meta");
-	    element_attr(&ho, "http-equiv", "content-type");
-	    {
-		char buf[200];
-		sprintf(buf, "text/html; charset=%.150s",
-			charset_to_mimeenc(conf.output_charset));
-		element_attr(&ho, "content", buf);
-	    }
-	    html_nl(&ho);
-
-            {
-                rdstringc rs = { 0, 0, NULL };
-                rdaddsc(&rs, "Halibut, ");
-                rdaddsc(&rs, version);
-                if (rs.text) {
-                    element_empty(&ho, "meta");
-                    element_attr(&ho, "name", "generator");
-                    element_attr(&ho, "content", rs.text);
-                    html_nl(&ho);
-                    sfree(rs.text);
-                }
-	    }
-
-	    if (conf.author) {
-		element_empty(&ho, "meta");
-		element_attr(&ho, "name", "author");
-		element_attr_w(&ho, "content", conf.author);
-		html_nl(&ho);
-	    }
-
-	    if (conf.description) {
-		element_empty(&ho, "meta");
-		element_attr(&ho, "name", "description");
-		element_attr_w(&ho, "content", conf.description);
-		html_nl(&ho);
-	    }
-
-	    element_open(&ho, "title");
-	    if (f->first && f->first->title) {
-		html_words(&ho, f->first->title->words, NOTHING,
-			   f, keywords, &conf);
-
-		assert(f->last);
-		if (f->last != f->first && f->last->title) {
-		    html_text(&ho, conf.title_separator);
-		    html_words(&ho, f->last->title->words, NOTHING,
-			       f, keywords, &conf);
-		}
-	    }
-	    element_close(&ho, "title");
-	    html_nl(&ho);
-
-	    if (conf.rellinks) {
-
-		if (prevf) {
-		    element_empty(&ho, "link");
-		    element_attr(&ho, "rel", "previous");
-		    element_attr(&ho, "href", prevf->filename);
-		    html_nl(&ho);
-		}
-
-		if (f != files.head) {
-		    element_empty(&ho, "link");
-		    element_attr(&ho, "rel", "ToC");
-		    element_attr(&ho, "href", files.head->filename);
-		    html_nl(&ho);
-		}
-
-		if (conf.leaf_level > 0) {
-		    htmlsect *p = f->first->parent;
-		    assert(p == f->last->parent);
-		    if (p) {
-			element_empty(&ho, "link");
-			element_attr(&ho, "rel", "up");
-			element_attr(&ho, "href", p->file->filename);
-			html_nl(&ho);
-		    }
-		}
-
-		if (has_index && files.index && f != files.index) {
-		    element_empty(&ho, "link");
-		    element_attr(&ho, "rel", "index");
-		    element_attr(&ho, "href", files.index->filename);
-		    html_nl(&ho);
-		}
-
-		if (f->next) {
-		    element_empty(&ho, "link");
-		    element_attr(&ho, "rel", "next");
-		    element_attr(&ho, "href", f->next->filename);
-		    html_nl(&ho);
-		}
-
-	    }
-
-	    if (conf.head_end)
-		html_raw(&ho, conf.head_end);
-
-	    /*
-	     * Add any <head> data defined in specific sections
-	     * that go in this file. (This is mostly to allow <meta
-	     * name="AppleTitle"> tags for Mac online help.)
-	     */
-	    for (s = sects.head; s; s = s->next) {
-		if (s->file == f && s->text) {
-		    for (p = s->text;
-			 p && (p == s->text || p->type == para_Title ||
-			       !is_heading_type(p->type));
-			 p = p->next) {
-			if (p->type == para_Config) {
-			    if (!ustricmp(p->keyword, L"html-local-head")) {
-				html_raw(&ho, adv(p->origkeyword));
-			    }
-			}
-		    }
-		}
-	    }
-
-	    element_close(&ho, "head");
-	    html_nl(&ho);
-
-	    if (conf.body_tag)
-		html_raw(&ho, conf.body_tag);
-	    else
-		element_open(&ho, "body");
-	    html_nl(&ho);
-
-	    if (conf.body_start)
-		html_raw(&ho, conf.body_start);
-
-	    /*
-	     * Write out a nav bar. Special case: we don't do this
-	     * if there is only one file.
-	     */
-	    if (conf.navlinks && files.head != files.tail) {
-		element_open(&ho, "p");
-		if (conf.nav_attr)
-		    html_raw_as_attr(&ho, conf.nav_attr);
-
-		if (prevf) {
-		    element_open(&ho, "a");
-		    element_attr(&ho, "href", prevf->filename);
-		}
-		html_text(&ho, conf.nav_prev_text);
-		if (prevf)
-		    element_close(&ho, "a");
-
-		html_text(&ho, conf.nav_separator);
-
-		if (f != files.head) {
-		    element_open(&ho, "a");
-		    element_attr(&ho, "href", files.head->filename);
-		}
-		html_text(&ho, conf.contents_text);
-		if (f != files.head)
-		    element_close(&ho, "a");
-
-		/* We don't bother with "Up" links for leaf-level 1,
-		 * as they would be identical to the "Contents" links. */
-		if (conf.leaf_level >= 2) {
-		    htmlsect *p = f->first->parent;
-		    assert(p == f->last->parent);
-		    html_text(&ho, conf.nav_separator);
-		    if (p) {
-			element_open(&ho, "a");
-			element_attr(&ho, "href", p->file->filename);
-		    }
-		    html_text(&ho, conf.nav_up_text);
-		    if (p) {
-			element_close(&ho, "a");
-		    }
-		}
-
-		if (has_index && files.index) {
-		    html_text(&ho, conf.nav_separator);
-		    if (f != files.index) {
-			element_open(&ho, "a");
-			element_attr(&ho, "href", files.index->filename);
-		    }
-		    html_text(&ho, conf.index_text);
-		    if (f != files.index)
-			element_close(&ho, "a");
-		}
-
-		html_text(&ho, conf.nav_separator);
-
-		if (f->next) {
-		    element_open(&ho, "a");
-		    element_attr(&ho, "href", f->next->filename);
-		}
-		html_text(&ho, conf.nav_next_text);
-		if (f->next)
-		    element_close(&ho, "a");
-
-		element_close(&ho, "p");
-		html_nl(&ho);
-	    }
-	    prevf = f;
-
-	    /*
-	     * Special case: for single-file mode, we output the top
-	     * section title before the TOC.
-	     */
-	    if (files.head == files.tail && sects.head->type == TOP) {
-		element_open(&ho, "h1");
-
-		/*
-		 * Provide anchor(s) for cross-links to target.
-		 */
-		{
-		    int i;
-		    for (i=0; i < conf.ntfragments; i++)
-			if (sects.head->fragments[i])
-			    html_fragment(&ho, sects.head->fragments[i]);
-		}
-
-		html_section_title(&ho, sects.head, f, keywords, &conf, true);
-
-		element_close(&ho, "h1");
-	    }
-
-	    /*
-	     * Write out a prefix TOC for the file (if a leaf file).
-	     * 
-	     * We start by going through the section list and
-	     * collecting the sections which need to be added to
-	     * the contents. On the way, we also test to see if
-	     * this file is a leaf file (defined as one which
-	     * contains all descendants of any section it
-	     * contains), because this will play a part in our
-	     * decision on whether or not to _output_ the TOC.
-	     */
-	    {
-		int ntoc = 0, tocsize = 0, tocstartidx = 0;
-		htmlsect **toc = NULL;
-		bool leaf = true;
-
-		for (s = sects.head; s; s = s->next) {
-		    htmlsect *a, *ac;
-		    int depth, adepth;
-
-		    /*
-		     * Search up from this section until we find
-		     * the highest-level one which belongs in this
-		     * file.
-		     */
-		    depth = adepth = 0;
-		    a = NULL;
-		    for (ac = s; ac; ac = ac->parent) {
-			if (ac->file == f) {
-			    a = ac;
-			    adepth = depth;
-			}
-			depth++;
-		    }
-
-		    if (s->file != f && a != NULL)
-			leaf = false;
-
-		    if (a) {
-			if (adepth <= a->contents_depth) {
-			    if (ntoc >= tocsize) {
-				tocsize += 64;
-				toc = sresize(toc, tocsize, htmlsect *);
-			    }
-			    toc[ntoc++] = s;
-			}
-		    }
-		}
-
-		/*
-		 * Special case: for single-file mode, we don't output
-		 * the first section TOC entry if it's the top since we
-		 * have already output a section title for it above the
-		 * TOC, and since we don't output the top TOC entry, we
-		 * reduce the level of the remaining TOC entries by one
-		 * so that they are output correctly one level up from
-		 * where they would have been.
-		 */
-		tocstartidx = (files.head == files.tail && ntoc > 0 &&
-			       toc[0]->type == TOP) ? 1 : 0;
-		if (leaf && conf.leaf_contains_contents &&
-		    ntoc >= conf.leaf_smallest_contents &&
-		    tocstartidx < ntoc) {
-		    int i;
+	struct html_filejobs ctx;
+	htmlfile *f;
+	int nfiles, versionidsize = 0, i;
 
-		    for (i = tocstartidx; i < ntoc; i++) {
-			htmlsect *s = toc[i];
-			int hlevel = (s->type == TOP ? -1 :
-				      s->type == INDEX ? 0 :
-				      heading_depth(s->title))
-			    - tocstartidx - f->min_heading_depth + 1;
+	ctx.conf = &conf;
+	ctx.files = &files;
+	ctx.sects = &sects;
+	ctx.keywords = keywords;
+	ctx.idx = idx;
+	ctx.chm = chm;
+	ctx.has_index = has_index;
 
-			assert(hlevel >= 1);
-			html_contents_entry(&ho, hlevel, s,
-					    f, keywords, &conf);
-		    }
-		    html_contents_entry(&ho, 0, NULL, f, keywords, &conf);
+	/*
+	 * Every file's footer lists the same version IDs, so collect
+	 * them once rather than rescanning the document per file.
+	 */
+	ctx.versionids = NULL;
+	ctx.nversionids = 0;
+	for (p = sourceform; p; p = p->next)
+	    if (p->type == para_VersionID) {
+		if (ctx.nversionids >= versionidsize) {
+		    versionidsize += 16;
+		    ctx.versionids = sresize(ctx.versionids, versionidsize,
+					     paragraph *);
 		}
+		ctx.versionids[ctx.nversionids++] = p;
 	    }
 
-	    /*
-	     * Now go through the document and output some real
-	     * text.
-	     */
-	    displaying = false;
-	    for (s = sects.head; s; s = s->next) {
-		if (s->file == f) {
-		    /*
-		     * This section belongs in this file.
-		     * Display it.
-		     */
-		    displaying = true;
-		} else {
-		    /*
-		     * Doesn't belong in this file, but it may be
-		     * a descendant of a section which does, in
-		     * which case we should consider it for the
-		     * main TOC of this file (for non-leaf files).
-		     */
-		    htmlsect *a, *ac;
-		    int depth, adepth;
-
-		    displaying = false;
-
-		    /*
-		     * Search up from this section until we find
-		     * the highest-level one which belongs in this
-		     * file.
-		     */
-		    depth = adepth = 0;
-		    a = NULL;
-		    for (ac = s; ac; ac = ac->parent) {
-			if (ac->file == f) {
-			    a = ac;
-			    adepth = depth;
-			}
-			depth++;
-		    }
-
-		    if (a != NULL) {
-			/*
-			 * This section does not belong in this
-			 * file, but an ancestor of it does. Write
-			 * out a contents table entry, if the depth
-			 * doesn't exceed the maximum contents
-			 * depth for the ancestor section.
-			 */
-			if (adepth <= a->contents_depth) {
-			    html_contents_entry(&ho, adepth, s,
-						f, keywords, &conf);
-			}
-		    }
-		}
-
-		if (displaying) {
-		    int hlevel;
-		    char htag[3];
-
-		    html_contents_entry(&ho, 0, NULL, f, keywords, &conf);
-
-		    /*
-		     * Display the section heading.
-		     *
-		     * Special case: for single-file mode, we don't
-		     * output the top section title since we have
-		     * already output it before the TOC.
-		     */
-		    if (files.head != files.tail || s->type != TOP) {
-			hlevel = (s->type == TOP ? -1 :
-				  s->type == INDEX ? 0 :
-				  heading_depth(s->title))
-			    - f->min_heading_depth + 1;
-			assert(hlevel >= 1);
-			/* HTML headings only go up to <h6> */
-			if (hlevel > 6)
-			    hlevel = 6;
-			htag[0] = 'h';
-			htag[1] = '0' + hlevel;
-			htag[2] = '\0';
-			element_open(&ho, htag);
-
-			/*
-			 * Provide anchor(s) for cross-links to target.
-			 * 
-			 * (Also we'll have to do this separately in
-			 * other paragraph types - NumberedList and
-			 * BiblioCited.)
-			 */
-			{
-			    int i;
-			    for (i=0; i < conf.ntfragments; i++)
-				if (s->fragments[i])
-				    html_fragment(&ho, s->fragments[i]);
-			}
-
-			html_section_title(&ho, s, f, keywords, &conf, true);
-
-			element_close(&ho, htag);
-		    }
-
-		    /*
-		     * Now display the section text.
-		     */
-		    if (s->text) {
-			stackhead = snew(struct stackelement);
-			stackhead->next = NULL;
-			stackhead->listtype = NOLIST;
-			stackhead->itemtype = NOITEM;
-
-			for (p = s->text;; p = p->next) {
-			    enum LISTTYPE listtype;
-			    struct stackelement *se;
-
-			    /*
-			     * Preliminary switch to figure out what
-			     * sort of list we expect to be inside at
-			     * this stage.
-			     *
-			     * Since p may still be NULL at this point,
-			     * I invent a harmless paragraph type for
-			     * it if it is.
-			     */
-			    switch (p ? p->type : para_Normal) {
-			      case para_Rule:
-			      case para_Normal:
-			      case para_Copyright:
-			      case para_BiblioCited:
-			      case para_Code:
-			      case para_QuotePush:
-			      case para_QuotePop:
-			      case para_Chapter:
-			      case para_Appendix:
-			      case para_UnnumberedChapter:
-			      case para_Heading:
-			      case para_Subsect:
-			      case para_LcontPop:
-				listtype = NOLIST;
-				break;
-
-			      case para_Bullet:
-				listtype = UL;
-				break;
-
-			      case para_NumberedList:
-				listtype = OL;
-				break;
-
-			      case para_DescribedThing:
-			      case para_Description:
-				listtype = DL;
-				break;
-
-			      case para_LcontPush:
-				se = snew(struct stackelement);
-				se->next = stackhead;
-				se->listtype = NOLIST;
-				se->itemtype = NOITEM;
-				stackhead = se;
-				continue;
-
-			      default:     /* some totally non-printing para */
-				continue;
-			    }
-
-			    html_nl(&ho);
-
-			    /*
-			     * Terminate the most recent list item, if
-			     * any. (We left this until after
-			     * processing LcontPush, since in that case
-			     * the list item won't want to be
-			     * terminated until after the corresponding
-			     * LcontPop.)
-			     */
-			    if (stackhead->itemtype != NOITEM) {
-				element_close(&ho, itemname(stackhead->itemtype));
-				html_nl(&ho);
-			    }
-			    stackhead->itemtype = NOITEM;
-
-			    /*
-			     * Terminate the current list, if it's not
-			     * the one we want to be in.
-			     */
-			    if (listtype != stackhead->listtype &&
-				stackhead->listtype != NOLIST) {
-				element_close(&ho, listname(stackhead->listtype));
-				html_nl(&ho);
-			    }
-
-			    /*
-			     * Leave the loop if our time has come.
-			     */
-			    if (!p || (is_heading_type(p->type) &&
-				       p->type != para_Title))
-				break;     /* end of section text */
-
-			    /*
-			     * Start a fresh list if necessary.
-			     */
-			    if (listtype != stackhead->listtype &&
-				listtype != NOLIST)
-				element_open(&ho, listname(listtype));
-
-			    stackhead->listtype = listtype;
-
-			    switch (p->type) {
-			      case para_Rule:
-				element_empty(&ho, "hr");
-				break;
-			      case para_Code:
-				html_codepara(&ho, p->words);
-				break;
-			      case para_Normal:
-			      case para_Copyright:
-				element_open(&ho, "p");
-				html_nl(&ho);
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				html_nl(&ho);
-				element_close(&ho, "p");
-				break;
-			      case para_BiblioCited:
-				element_open(&ho, "p");
-				if (p->private_data) {
-				    htmlsect *s = (htmlsect *)p->private_data;
-				    int i;
-				    for (i=0; i < conf.ntfragments; i++)
-					if (s->fragments[i])
-					    html_fragment(&ho, s->fragments[i]);
-				}
-				html_nl(&ho);
-				html_words(&ho, p->kwtext, ALL,
-					   f, keywords, &conf);
-				html_text(&ho, L" ");
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				html_nl(&ho);
-				element_close(&ho, "p");
-				break;
-			      case para_Bullet:
-			      case para_NumberedList:
-				element_open(&ho, "li");
-				if (p->private_data) {
-				    htmlsect *s = (htmlsect *)p->private_data;
-				    int i;
-				    for (i=0; i < conf.ntfragments; i++)
-					if (s->fragments[i])
-					    html_fragment(&ho, s->fragments[i]);
-				}
-				html_nl(&ho);
-				stackhead->itemtype = LI;
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				break;
-			      case para_DescribedThing:
-				element_open(&ho, "dt");
-				html_nl(&ho);
-				stackhead->itemtype = DT;
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				break;
-			      case para_Description:
-				element_open(&ho, "dd");
-				html_nl(&ho);
-				stackhead->itemtype = DD;
-				html_words(&ho, p->words, ALL,
-					   f, keywords, &conf);
-				break;
-
-			      case para_QuotePush:
-				element_open(&ho, "blockquote");
-				break;
-			      case para_QuotePop:
-				element_close(&ho, "blockquote");
-				break;
-
-			      case para_LcontPop:
-				se = stackhead;
-				stackhead = stackhead->next;
-				assert(stackhead);
-				sfree(se);
-				break;
-			    }
-			}
-
-			assert(stackhead && !stackhead->next);
-			sfree(stackhead);
-		    }
-		    
-		    if (s->type == INDEX) {
-			indexentry *entry;
-			int i;
-
-			/*
-			 * This section is the index. I'll just
-			 * render it as a single paragraph, with a
-			 * colon between the index term and the
-			 * references, and <br> in between each
-			 * entry.
-			 */
-			element_open(&ho, "p");
-
-			for (i = 0; (entry =
-				     index234(idx->entries, i)) != NULL; i++) {
-			    htmlindex *hi = (htmlindex *)entry->backend_data;
-			    int j;
-
-			    if (i > 0)
-				element_empty(&ho, "br");
-			    html_nl(&ho);
-
-			    html_words(&ho, entry->text, MARKUP|LINKS,
-				       f, keywords, &conf);
-
-			    html_text(&ho, conf.index_main_sep);
-
-			    for (j = 0; j < hi->nrefs; j++) {
-				htmlindexref *hr =
-				    (htmlindexref *)hi->refs[j]->private_data;
-				paragraph *p = hr->section->title;
-
-				if (j > 0)
-				    html_text(&ho, conf.index_multi_sep);
-
-				html_href(&ho, f, hr->section->file,
-					  hr->fragment);
-				hr->referenced = true;
-				if (p && p->kwtext)
-				    html_words(&ho, p->kwtext, MARKUP|LINKS,
-					       f, keywords, &conf);
-				else if (p && p->words)
-				    html_words(&ho, p->words, MARKUP|LINKS,
-					       f, keywords, &conf);
-				else {
-				    /*
-				     * If there is no title at all,
-				     * this must be because our
-				     * target section is the
-				     * preamble section and there
-				     * is no title. So we use the
-				     * preamble_text.
-				     */
-				    html_text(&ho, conf.preamble_text);
-				}
-				element_close(&ho, "a");
-			    }
-			}
-			element_close(&ho, "p");
-		    }
-		}
-	    }
+	nfiles = 0;
+	for (f = files.head; f; f = f->next)
+	    nfiles++;
+	ctx.jobs = snewn(nfiles, struct html_filejob);
+	for (f = files.head, i = 0; f; f = f->next, i++) {
+	    ctx.jobs[i].f = f;
+	    ctx.jobs[i].rs = empty_rdstringc;
+	}
 
-	    html_contents_entry(&ho, 0, NULL, f, keywords, &conf);
-	    html_nl(&ho);
+	run_jobs(nfiles, html_file_job, &ctx);
 
-	    {
-		/*
-		 * Footer.
-		 */
-		bool done_version_ids = false;
-
-		if (conf.address_section)
-		    element_empty(&ho, "hr");
-
-		if (conf.body_end)
-		    html_raw(&ho, conf.body_end);
-
-		if (conf.address_section) {
-		    bool started = false;
-		    if (conf.htmlver == ISO_HTML) {
-			/*
-			 * The ISO-HTML validator complains if
-			 * there isn't a <div> tag surrounding the
-			 * <address> tag. I'm uncertain of why this
-			 * should be - there appears to be no
-			 * mention of this in the ISO-HTML spec,
-			 * suggesting that it doesn't represent a
-			 * change from HTML 4, but nonetheless the
-			 * HTML 4 validator doesn't seem to mind.
-			 */
-			element_open(&ho, "div");
-		    }
-		    element_open(&ho, "address");
-		    if (conf.addr_start) {
-			html_raw(&ho, conf.addr_start);
-			html_nl(&ho);
-			started = true;
-		    }
-		    if (conf.visible_version_id) {
-			for (p = sourceform; p; p = p->next)
-			    if (p->type == para_VersionID) {
-				if (started)
-				    element_empty(&ho, "br");
-				html_nl(&ho);
-				html_text(&ho, conf.pre_versionid);
-				html_words(&ho, p->words, NOTHING,
-					   f, keywords, &conf);
-				html_text(&ho, conf.post_versionid);
-				started = true;
-			    }
-			done_version_ids = true;
-		    }
-		    if (conf.addr_end) {
-			if (started)
-			    element_empty(&ho, "br");
-			html_raw(&ho, conf.addr_end);
-		    }
-		    element_close(&ho, "address");
-		    if (conf.htmlver == ISO_HTML)
-			element_close(&ho, "div");
-		}
+	/*
+	 * Report each file's errors, and add it to the CHM if we're
+	 * building one, in file order.
+	 */
+	for (i = 0; i < nfiles; i++) {
+	    struct html_filejob *job = &ctx.jobs[i];
 
-		if (!done_version_ids) {
-		    /*
-		     * If the user didn't want the version IDs
-		     * visible, I think we still have a duty to put
-		     * them in an HTML comment.
-		     */
-		    bool started = false;
-		    for (p = sourceform; p; p = p->next)
-			if (p->type == para_VersionID) {
-			    if (!started) {
-				html_raw(&ho, "<!-- version IDs:\n");
-				started = true;
-			    }
-			    html_words(&ho, p->words, NOTHING,
-				       f, keywords, &conf);
-			    html_nl(&ho);
-			}
-		    if (started)
-			html_raw(&ho, "-->\n");
-		}
-	    }
+	    err_release(&job->es, -1);
+	    if (job->es.fatal)
+		es->fatal = true;
+	    err_undefer(&job->es);
 
-	    element_close(&ho, "body");
-	    html_nl(&ho);
-	    element_close(&ho, "html");
-	    html_nl(&ho);
-	    cleanup(&ho);
+	    if (chm)
+		chm_add_file(chm, job->f->filename, job->rs.text, job->rs.pos);
+	    sfree(job->rs.text);
 	}
+
+	sfree(ctx.jobs);
+	sfree(ctx.versionids);
     }
 
+    if (conf.search_index)
+	html_search_index(&conf, &files, &sects, keywords, es);
+
     /*
      * Before we start outputting the HTML Help files, check
      * whether there's even going to _be_ an index file: we omit it
@@ -1965,6 +3062,8 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
                                NULL, keywords, &conf);
                 else if (f->first->type == INDEX)
                     html_text(&ho, conf.index_text);
+                else if (f->first->type == SEARCH)
+                    html_text(&ho, conf.search_text);
                 rdaddc(&rs, '\0');
                 
                 while (s && s->file == f)
@@ -2169,26 +3268,20 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 
 	    /*
 	     * Determine if this file is a leaf file, by
-	     * trawling the section list to see if there's any
-	     * section with an ancestor in this file but which
-	     * is not itself in this file.
+	     * trawling the subtree of its first section to see
+	     * if any of it is not itself in this file.
 	     *
 	     * Special case: for contents purposes, the TOP
 	     * file is not considered to be the parent of the
 	     * chapter files, so it's always a leaf.
-	     * 
+	     *
 	     * A file with no sections in it is also a leaf.
 	     */
 	    if (f->first && f->first->type != TOP) {
-		for (s = f->first; s; s = s->next) {
-		    htmlsect *a;
-
-		    if (leaf && s->file != f) {
-			for (a = s; a; a = a->parent)
-			    if (a->file == f) {
-				leaf = false;
-				break;
-			    }
+		for (s = f->first; s != f->first->subtree_end; s = s->next) {
+		    if (s->file != f) {
+			leaf = false;
+			break;
 		    }
 		}
 	    }
@@ -2212,6 +3305,8 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 			   NULL, keywords, &conf);
 	    else if (f->first->type == INDEX)
 		html_text(&ho, conf.index_text);
+	    else if (f->first->type == SEARCH)
+		html_text(&ho, conf.search_text);
             ho_string(&ho, "\"><PARAM NAME=\"Local\" VALUE=\"");
             ho_string(&ho, f->filename);
             ho_string(&ho, "\"><PARAM NAME=\"ImageNumber\" VALUE=\"");
@@ -2283,8 +3378,7 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 		ho_string(&ho, "\">\n");
 
 		for (j = 0; j < hi->nrefs; j++) {
-		    htmlindexref *hr =
-			(htmlindexref *)hi->refs[j]->private_data;
+		    htmlindexref *hr = hi->refs[j];
 
 		    /*
 		     * Use the temp field to ensure we don't
@@ -2307,8 +3401,7 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 		 * fields ready for the _next_ index term.
 		 */
 		for (j = 0; j < hi->nrefs; j++) {
-		    htmlindexref *hr =
-			(htmlindexref *)hi->refs[j]->private_data;
+		    htmlindexref *hr = hi->refs[j];
 		    hr->section->file->temp = 0;
 		}
 	    }
@@ -2322,16 +3415,13 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
         /*
          * Finalise and write out the CHM file.
          */
-        const char *data;
-        int len;
         FILE *fp;
 
         fp = fopen(conf.chm_filename, "wb");
         if (!fp) {
             err_cantopenw(es, conf.chm_filename);
         } else {
-            data = chm_build(chm, &len);
-            fwrite(data, 1, len, fp);
+            rope_write(chm_build(chm), fp);
             fclose(fp);
         }
 
@@ -2349,7 +3439,7 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 	word *w;
 	for (w = p->words; w; w = w->next)
 	    if (w->type == word_IndexRef) {
-		htmlindexref *hr = (htmlindexref *)w->private_data;
+		htmlindexref *hr = conf.windexrefs[w->index];
 
 		assert(hr->referenced == hr->generated);
 	    }
@@ -2358,23 +3448,8 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
     /*
      * Free all the working data.
      */
-    {
-	htmlfragment *frag;
-	while ( (frag = (htmlfragment *)delpos234(files.frags, 0)) != NULL ) {
-	    /*
-	     * frag->fragment is dynamically allocated, but will be
-	     * freed when we process the htmlsect structure which
-	     * it is attached to.
-	     */
-	    sfree(frag);
-	}
-	freetree234(files.frags);
-    }
-    /*
-     * The strings in files.files are all owned by their containing
-     * htmlfile structures, so there's no need to free them here.
-     */
-    freetree234(files.files);
+    html_names_free(files.frags);
+    html_names_free(files.files);
     {
 	htmlsect *sect, *tmp;
 	sect = sects.head;
@@ -2422,16 +3497,21 @@ static void html_backend_common(paragraph *sourceform, keywordlist *keywords,
 	for (p = sourceform; p; p = p->next)
 	    for (w = p->words; w; w = w->next)
 		if (w->type == word_IndexRef) {
-		    htmlindexref *hr = (htmlindexref *)w->private_data;
+		    htmlindexref *hr = conf.windexrefs[w->index];
 		    assert(hr != NULL);
 		    sfree(hr->fragment);
 		    sfree(hr);
 		}
     }
+    sfree(conf.psects);
+    sfree(conf.windexrefs);
     sfree(conf.asect);
     sfree(conf.single_filename);
     sfree(conf.contents_filename);
     sfree(conf.index_filename);
+    sfree(conf.search_filename);
+    sfree(conf.search_index_filename);
+    sfree(conf.search_script_filename);
     sfree(conf.template_filename);
     while (conf.ntfragments--)
 	sfree(conf.template_fragments[conf.ntfragments]);
@@ -2510,6 +3590,8 @@ static void html_file_section(htmlconfig *cfg, htmlfilelist *files,
 		file = html_new_file(files, cfg->contents_filename);
 	    } else if (sect->type == INDEX) {
 		file = html_new_file(files, cfg->index_filename);
+	    } else if (sect->type == SEARCH) {
+		file = html_new_file(files, cfg->search_filename);
 	    } else {
 		char *title;
 
@@ -2549,7 +3631,6 @@ static htmlfile *html_new_file(htmlfilelist *list, char *filename)
     list->tail = ret;
 
     ret->filename = html_sanitise_filename(list, dupstr(filename));
-    add234(list->files, ret->filename);
     ret->last_fragment_number = 0;
     ret->min_heading_depth = INT_MAX;
     ret->first = ret->last = NULL;
@@ -2573,6 +3654,7 @@ static htmlsect *html_new_sect(htmlsectlist *list, paragraph *title,
     ret->file = NULL;
     ret->parent = NULL;
     ret->type = NORMAL;
+    ret->subtree_end = NULL;
 
     ret->fragments = snewn(cfg->ntfragments, char *);
     {
@@ -2625,7 +3707,7 @@ static void html_words(htmloutput *ho, word *words, int flags,
              * NULL as an after-effect of that */
 	    if (kwl) {
                 p = kwl->para;
-                s = (htmlsect *)p->private_data;
+                s = cfg->psects[p->index];
 
                 assert(s);
 
@@ -2646,7 +3728,7 @@ static void html_words(htmloutput *ho, word *words, int flags,
 	break;
       case word_IndexRef:
 	if (flags & INDEXENTS) {
-	    htmlindexref *hr = (htmlindexref *)w->private_data;
+	    htmlindexref *hr = cfg->windexrefs[w->index];
 	    html_fragment(ho, hr->fragment);
 	    hr->generated = true;
 	}
@@ -3105,23 +4187,26 @@ static char *html_sanitise_fragment(htmlfilelist *files, htmlfile *file,
      * Now we check for clashes with other fragment names, and
      * adjust this one if necessary by appending a hyphen followed
      * by a number.
+     *
+     * Names are never removed from the table, so if this name has
+     * clashed before, every suffix up to the last one tried then
+     * is still taken, and we can start after it.
      */
     {
-	htmlfragment *frag = snew(htmlfragment);
-	int len = 0;		       /* >0 indicates we have resized */
-	int suffix = 1;
-
-	frag->file = file;
-	frag->fragment = text;
+	htmlname *orig = html_name_find(files->frags, file, text);
 
-	while (add234(files->frags, frag) != frag) {
-	    if (!len) {
-		len = strlen(text);
-		frag->fragment = text = sresize(text, len+20, char);
-	    }
+	if (orig) {
+	    int len = strlen(text);
+	    int suffix = orig->suffix;
 
-	    sprintf(text + len, "-%d", ++suffix);
+	    text = sresize(text, len+20, char);
+	    do {
+		sprintf(text + len, "-%d", ++suffix);
+	    } while (html_name_find(files->frags, file, text));
+	    orig->suffix = suffix;
 	}
+
+	html_name_add(files->frags, file, text);
     }
 
     return text;
@@ -3159,32 +4244,36 @@ static char *html_sanitise_filename(htmlfilelist *files, char *text)
     /*
      * Now we check for clashes with other filenames, and adjust
      * this one if necessary by appending a hyphen followed by a
-     * number just before the file extension (if any).
+     * number just before the file extension (if any). As with
+     * fragments, we carry on from the last number tried the
+     * previous time this name clashed.
      */
     {
-	int len, extpos;
-	int suffix = 1;
+	htmlname *orig = html_name_find(files->files, NULL, text);
 
-	p = NULL;
+	if (orig) {
+	    int len, extpos;
+	    int suffix = orig->suffix;
 
-	while (find234(files->files, text)) {
-	    if (!p) {
-		len = strlen(text);
-		p = text;
-		text = snewn(len+20, char);
+	    len = strlen(text);
+	    p = text;
+	    text = snewn(len+20, char);
 
-		for (extpos = len; extpos > 0 && p[extpos-1] != '.'; extpos--);
-		if (extpos > 0)
-		    extpos--;
-		else
-		    extpos = len;
-	    }
+	    for (extpos = len; extpos > 0 && p[extpos-1] != '.'; extpos--);
+	    if (extpos > 0)
+		extpos--;
+	    else
+		extpos = len;
 
-	    sprintf(text, "%.*s-%d%s", extpos, p, ++suffix, p+extpos);
-	}
+	    do {
+		sprintf(text, "%.*s-%d%s", extpos, p, ++suffix, p+extpos);
+	    } while (html_name_find(files->files, NULL, text));
+	    orig->suffix = suffix;
 
-	if (p)
 	    sfree(p);
+	}
+
+	html_name_add(files->files, NULL, text);
     }
 
     return text;
@@ -3225,35 +4314,47 @@ static void html_contents_entry(htmloutput *ho, int depth, htmlsect *s,
     /* <li> will be closed by a later invocation */
 }
 
+/*
+ * Return the number to show in front of a section's title, if
+ * any, and the text to separate it from the title.
+ */
+static word *html_section_number(htmlsect *s, htmlconfig *cfg,
+				 wchar_t **suffix)
+{
+    sectlevel *sl;
+    int depth = heading_depth(s->title);
+
+    if (depth < 0)
+	sl = NULL;
+    else if (depth == 0)
+	sl = &cfg->achapter;
+    else if (depth <= cfg->nasect)
+	sl = &cfg->asect[depth-1];
+    else
+	sl = &cfg->asect[cfg->nasect-1];
+
+    if (!sl || !sl->number_at_all)
+	return NULL;
+
+    *suffix = sl->number_suffix;
+    if (sl->just_numbers)
+	return s->title->kwtext2;
+    else
+	return s->title->kwtext;
+}
+
 static void html_section_title(htmloutput *ho, htmlsect *s, htmlfile *thisfile,
 			       keywordlist *keywords, htmlconfig *cfg,
 			       bool real)
 {
     if (s->title) {
-	sectlevel *sl;
-	word *number;
-	int depth = heading_depth(s->title);
-
-	if (depth < 0)
-	    sl = NULL;
-	else if (depth == 0)
-	    sl = &cfg->achapter;
-	else if (depth <= cfg->nasect)
-	    sl = &cfg->asect[depth-1];
-	else
-	    sl = &cfg->asect[cfg->nasect-1];
-
-	if (!sl || !sl->number_at_all)
-	    number = NULL;
-	else if (sl->just_numbers)
-	    number = s->title->kwtext2;
-	else
-	    number = s->title->kwtext;
+	wchar_t *suffix;
+	word *number = html_section_number(s, cfg, &suffix);
 
 	if (number) {
 	    html_words(ho, number, MARKUP,
 		       thisfile, keywords, cfg);
-	    html_text(ho, sl->number_suffix);
+	    html_text(ho, suffix);
 	}
 
 	html_words(ho, s->title->words, real ? ALL : MARKUP,
@@ -3271,5 +4372,7 @@ static void html_section_title(htmloutput *ho, htmlsect *s, htmlfile *thisfile,
 	    html_text(ho, cfg->preamble_text);
 	else if (s->type == INDEX)
 	    html_text(ho, cfg->index_text);
+	else if (s->type == SEARCH)
+	    html_text(ho, cfg->search_text);
     }
 }
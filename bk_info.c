@@ -62,6 +62,7 @@ typedef struct {
 typedef struct {
     char *filename;
     int maxfilesize;
+    bool compress;
     int charset;
     int listindentbefore, listindentafter;
     int indent_code, width, index_width;
@@ -74,6 +75,12 @@ typedef struct {
     wchar_t *sectsuffix;
     wchar_t *rule;
     wchar_t *index_text;
+    /*
+     * The document's keywords, and the node (if any) made for each
+     * paragraph, indexed by paragraph::index.
+     */
+    keywordlist *keywords;
+    struct node_tag **pnodes;
 } infoconfig;
 
 typedef struct {
@@ -92,7 +99,8 @@ struct node_tag {
     int pos, filenum;
     bool started_menu;
     char *name;
-    info_data text;
+    paragraph *para;		       /* heading, or NULL for Top/index */
+    info_data text, menu;
 };
 
 typedef struct {
@@ -110,22 +118,47 @@ static int info_rdaddsc(info_data *, char const *);
 static void info_heading(info_data *, word *, word *, alignstruct, int,
 			 infoconfig *);
 static void info_rule(info_data *, int, int, infoconfig *);
-static void info_para(info_data *, word *, wchar_t *, word *, keywordlist *,
-		      int, int, int, infoconfig *);
+static void info_para(info_data *, word *, wchar_t *, word *, int, int, int,
+		      infoconfig *);
 static void info_codepara(info_data *, word *, int, int);
 static void info_versionid(info_data *, word *, infoconfig *);
 static void info_menu_item(info_data *, node *, paragraph *, infoconfig *);
-static word *info_transform_wordlist(word *, keywordlist *);
+static word *info_transform_wordlist(word *, infoconfig *);
+static node *info_xref_node(word *, infoconfig *);
 static int info_check_index(word *, node *, indexdata *);
 
 static int info_rdaddwc(info_data *, word *, word *, bool, infoconfig *);
 
+static void info_node_job(void *, int);
+static void info_node_body(info_data *, paragraph *, infoconfig *);
+static void info_file_job(void *, int);
+static bool info_write_file(rope *, int, infoconfig *, errorstate *);
+
 static node *info_node_new(char *name, int charset);
 static char *info_node_name_for_para(paragraph *p, infoconfig *,
                                      errorstate *);
 static char *info_node_name_for_text(wchar_t *text, infoconfig *,
                                      errorstate *);
 
+/*
+ * Work shared out between worker threads: formatting the text of
+ * each node, and then writing each output file.
+ */
+struct info_nodejobs {
+    infoconfig *conf;
+    paragraph *sourceform;
+    node *topnode;
+    node **nodes;
+};
+
+struct info_filejobs {
+    infoconfig *conf;
+    node *topnode;
+    info_data *intro;
+    node **firstnode;		       /* first node in each subfile */
+    errorstate *es;		       /* one per file */
+};
+
 static infoconfig info_configure(paragraph *source, errorstate *es) {
     infoconfig ret;
     paragraph *p;
@@ -136,6 +169,7 @@ static infoconfig info_configure(paragraph *source, errorstate *es) {
      */
     ret.filename = dupstr("output.info");
     ret.maxfilesize = 64 << 10;
+    ret.compress = false;
     ret.charset = CS_ASCII;
     ret.width = 70;
     ret.listindentbefore = 1;
@@ -193,6 +227,8 @@ static infoconfig info_configure(paragraph *source, errorstate *es) {
                     &p->fpos, uadv(p->keyword), es);
 	    } else if (!ustricmp(p->keyword, L"info-max-file-size")) {
 		ret.maxfilesize = utoi(uadv(p->keyword));
+	    } else if (!ustricmp(p->keyword, L"info-compress")) {
+		ret.compress = utob(uadv(p->keyword));
 	    } else if (!ustricmp(p->keyword, L"info-width")) {
 		ret.width = utoi(uadv(p->keyword));
 	    } else if (!ustricmp(p->keyword, L"info-indent-code")) {
@@ -313,21 +349,23 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
 		  indexdata *idx, void *unused, errorstate *es) {
     paragraph *p;
     infoconfig conf;
-    word *prefix, *body, *wp;
-    word spaceword;
-    wchar_t *prefixextra;
-    int nesting, nestindent;
-    int indentb, indenta;
-    int filepos;
+    int filepos, nnodes, nfiles;
     bool has_index = false;
     info_data intro_text = EMPTY_INFO_DATA;
     node *topnode, *currnode;
-    word bullet;
-    FILE *fp;
 
     IGNORE(unused);
 
     conf = info_configure(sourceform, es);
+    conf.keywords = keywords;
+    {
+	int i, nparas;
+
+	doc_size(sourceform, &nparas, NULL);
+	conf.pnodes = snewn(nparas, node *);
+	for (i = 0; i < nparas; i++)
+	    conf.pnodes[i] = NULL;
+    }
 
     /*
      * Go through and create a node for each section.
@@ -351,10 +389,11 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
 	    newnode = info_node_new(nodename, conf.charset);
 	    sfree(nodename);
 
-	    p->private_data = newnode;
+	    conf.pnodes[p->index] = newnode;
+	    newnode->para = p;
 
 	    if (p->parent)
-		upnode = (node *)p->parent->private_data;
+		upnode = conf.pnodes[p->parent->index];
 	    else
 		upnode = topnode;
 	    assert(upnode);
@@ -368,7 +407,6 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
 	}
 	break;
       default:
-        p->private_data = NULL;
         break;
     }
 
@@ -438,8 +476,8 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
 	    info_rdaddsc(&intro_text, ")");
 	    if (*kw) {
 		keyword *kwl = kw_lookup(keywords, kw);
-		if (kwl && kwl->para->private_data) {
-		    node *n = (node *)kwl->para->private_data;
+		if (kwl && conf.pnodes[kwl->para->index]) {
+		    node *n = conf.pnodes[kwl->para->index];
 		    info_rdaddsc(&intro_text, n->name);
 		}
 	    }
@@ -450,8 +488,8 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
 
     for (p = sourceform; p; p = p->next)
 	if (p->type == para_Copyright)
-	    info_para(&intro_text, NULL, NULL, p->words, keywords,
-		      0, 0, conf.width, &conf);
+	    info_para(&intro_text, NULL, NULL, p->words, 0, 0, conf.width,
+		      &conf);
 
     for (p = sourceform; p; p = p->next)
 	if (p->type == para_VersionID)
@@ -460,80 +498,30 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
     if (intro_text.output.text[intro_text.output.pos-1] != '\n')
 	info_rdaddc(&intro_text, '\n');
 
-    /* Do the title */
-    for (p = sourceform; p; p = p->next)
-	if (p->type == para_Title)
-	    info_heading(&topnode->text, NULL, p->words,
-			 conf.atitle, conf.width, &conf);
-
-    nestindent = conf.listindentbefore + conf.listindentafter;
-    nesting = 0;
-
+    /*
+     * Go through the document in order, building each node's menu
+     * of its children and finding out which nodes each index term
+     * is referred to from. The text of the nodes themselves is
+     * formatted separately below.
+     */
     currnode = topnode;
-
-    /* Do the main document */
     for (p = sourceform; p; p = p->next) switch (p->type) {
-
-      case para_QuotePush:
-	nesting += 2;
-	break;
-      case para_QuotePop:
-	nesting -= 2;
-	assert(nesting >= 0);
-	break;
-
-      case para_LcontPush:
-	nesting += nestindent;
-	break;
-      case para_LcontPop:
-	nesting -= nestindent;
-	assert(nesting >= 0);
-	break;
-
-	/*
-	 * Things we ignore because we've already processed them or
-	 * aren't going to touch them in this pass.
-	 */
-      case para_IM:
-      case para_BR:
-      case para_Biblio:		       /* only touch BiblioCited */
-      case para_VersionID:
-      case para_NoCite:
-      case para_Title:
-	break;
-
-	/*
-	 * Chapter titles.
-	 */
       case para_Chapter:
       case para_Appendix:
       case para_UnnumberedChapter:
       case para_Heading:
       case para_Subsect:
-	currnode = p->private_data;
+	currnode = conf.pnodes[p->index];
 	assert(currnode);
 	assert(currnode->up);
 
 	if (!currnode->up->started_menu) {
-	    info_rdaddsc(&currnode->up->text, "* Menu:\n\n");
+	    info_rdaddsc(&currnode->up->menu, "* Menu:\n\n");
 	    currnode->up->started_menu = true;
 	}
-	info_menu_item(&currnode->up->text, currnode, p, &conf);
+	info_menu_item(&currnode->up->menu, currnode, p, &conf);
 
 	has_index |= info_check_index(p->words, currnode, idx);
-	if (p->type == para_Chapter || p->type == para_Appendix ||
-	    p->type == para_UnnumberedChapter)
-	    info_heading(&currnode->text, p->kwtext, p->words,
-			 conf.achapter, conf.width, &conf);
-	else
-	    info_heading(&currnode->text, p->kwtext, p->words,
-			 conf.asect[p->aux>=conf.nasect?conf.nasect-1:p->aux],
-			 conf.width, &conf);
-	nesting = 0;
-	break;
-
-      case para_Rule:
-	info_rule(&currnode->text, nesting, conf.width - nesting, &conf);
 	break;
 
       case para_Normal:
@@ -544,55 +532,9 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
       case para_Bullet:
       case para_NumberedList:
 	has_index |= info_check_index(p->words, currnode, idx);
-	if (p->type == para_Bullet) {
-	    bullet.next = NULL;
-	    bullet.alt = NULL;
-	    bullet.type = word_Normal;
-	    bullet.text = conf.bullet;
-	    prefix = &bullet;
-	    prefixextra = NULL;
-	    indentb = conf.listindentbefore;
-	    indenta = conf.listindentafter;
-	} else if (p->type == para_NumberedList) {
-	    prefix = p->kwtext;
-	    prefixextra = conf.listsuffix;
-	    indentb = conf.listindentbefore;
-	    indenta = conf.listindentafter;
-	} else if (p->type == para_Description) {
-	    prefix = NULL;
-	    prefixextra = NULL;
-	    indentb = conf.listindentbefore;
-	    indenta = conf.listindentafter;
-	} else {
-	    prefix = NULL;
-	    prefixextra = NULL;
-	    indentb = indenta = 0;
-	}
-	if (p->type == para_BiblioCited) {
-	    body = dup_word_list(p->kwtext);
-	    for (wp = body; wp->next; wp = wp->next);
-	    wp->next = &spaceword;
-	    spaceword.next = p->words;
-	    spaceword.alt = NULL;
-	    spaceword.type = word_WhiteSpace;
-	    spaceword.text = NULL;
-	} else {
-	    wp = NULL;
-	    body = p->words;
-	}
-	info_para(&currnode->text, prefix, prefixextra, body, keywords,
-		  nesting + indentb, indenta,
-		  conf.width - nesting - indentb - indenta, &conf);
-	if (wp) {
-	    wp->next = NULL;
-	    free_word_list(body);
-	}
 	break;
 
-      case para_Code:
-	info_codepara(&currnode->text, p->words,
-		      nesting + conf.indent_code,
-		      conf.width - nesting - 2 * conf.indent_code);
+      default:
 	break;
     }
 
@@ -623,7 +565,7 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
 	}
 	info_rdaddsc(&newnode->text, "\n\n");
 
-	info_menu_item(&topnode->text, newnode, NULL, &conf);
+	info_menu_item(&topnode->menu, newnode, NULL, &conf);
 
 	for (i = 0; (entry = index234(idx->entries, i)) != NULL; i++) {
 	    info_idx *ii = (info_idx *)entry->backend_data;
@@ -647,38 +589,31 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
     }
 
     /*
-     * Finalise the text of each node, by adding the ^_ delimiter
-     * and the node line at the top.
+     * Now every node's name, neighbours and menu are known, and
+     * cross-references can be resolved through conf.pnodes, so the
+     * nodes' text can be formatted independently of each other.
      */
-    for (currnode = topnode; currnode; currnode = currnode->listnext) {
-	char *origtext = currnode->text.output.text;
-	currnode->text = empty_info_data;
-	currnode->text.charset = conf.charset;
-	info_rdaddsc(&currnode->text, "\037\nFile: ");
-	info_rdaddsc(&currnode->text, conf.filename);
-	info_rdaddsc(&currnode->text, ",  Node: ");
-	info_rdaddsc(&currnode->text, currnode->name);
-	if (currnode->prev) {
-	    info_rdaddsc(&currnode->text, ",  Prev: ");
-	    info_rdaddsc(&currnode->text, currnode->prev->name);
-	}
-	info_rdaddsc(&currnode->text, ",  Up: ");
-	info_rdaddsc(&currnode->text, (currnode->up ?
-				       currnode->up->name : "(dir)"));
-	if (currnode->next) {
-	    info_rdaddsc(&currnode->text, ",  Next: ");
-	    info_rdaddsc(&currnode->text, currnode->next->name);
-	}
-	info_rdaddsc(&currnode->text, "\n\n");
-	info_rdaddsc(&currnode->text, origtext);
-	/*
-	 * Just make _absolutely_ sure we end with a newline.
-	 */
-	if (currnode->text.output.text[currnode->text.output.pos-1] != '\n')
-	    info_rdaddc(&currnode->text, '\n');
+    {
+	struct info_nodejobs ctx;
+	int i;
+
+	ctx.conf = &conf;
+	ctx.sourceform = sourceform;
+	ctx.topnode = topnode;
+	nnodes = 0;
+	for (currnode = topnode; currnode; currnode = currnode->listnext)
+	    nnodes++;
+	ctx.nodes = snewn(nnodes, node *);
+	for (currnode = topnode, i = 0; currnode;
+	     currnode = currnode->listnext, i++)
+	    ctx.nodes[i] = currnode;
+
+	run_jobs(nnodes, info_node_job, &ctx);
+
+	sfree(ctx.nodes);
+    }
 
-	sfree(origtext);
-    }    
+    sfree(conf.pnodes);
 
     /*
      * Compute the offsets for the tag table.
@@ -692,82 +627,322 @@ void info_backend(paragraph *sourceform, keywordlist *keywords,
     /*
      * Split into sub-files.
      */
+    nfiles = 0;
     if (conf.maxfilesize > 0) {
-	int currfilesize = intro_text.output.pos, currfilenum = 1;
+	int currfilesize = intro_text.output.pos;
+	nfiles = 1;
 	for (currnode = topnode; currnode; currnode = currnode->listnext) {
 	    if (currfilesize > intro_text.output.pos &&
 		currfilesize + currnode->text.output.pos > conf.maxfilesize) {
-		currfilenum++;
+		nfiles++;
 		currfilesize = intro_text.output.pos;
 	    }
-	    currnode->filenum = currfilenum;
+	    currnode->filenum = nfiles;
 	    currfilesize += currnode->text.output.pos;
 	}
     }
 
     /*
-     * Write the primary output file.
+     * Write the primary output file and the subfiles, each from
+     * its own job.
      */
-    fp = fopen(conf.filename, "w");
-    if (!fp) {
-	err_cantopenw(es, conf.filename);
-	return;
-    }
-    fputs(intro_text.output.text, fp);
-    if (conf.maxfilesize == 0) {
+    {
+	struct info_filejobs ctx;
+	bool failed = false;
+	int i;
+
+	ctx.conf = &conf;
+	ctx.topnode = topnode;
+	ctx.intro = &intro_text;
+	ctx.firstnode = snewn(nfiles + 1, node *);
+	ctx.es = snewn(nfiles + 1, errorstate);
+	ctx.firstnode[0] = topnode;
 	for (currnode = topnode; currnode; currnode = currnode->listnext)
-	    fputs(currnode->text.output.text, fp);
+	    if (currnode->filenum &&
+		(currnode == topnode ||
+		 currnode->filenum != currnode->prev->filenum))
+		ctx.firstnode[currnode->filenum] = currnode;
+
+	run_jobs(nfiles + 1, info_file_job, &ctx);
+
+	/*
+	 * Report errors in file order, and only the first failure,
+	 * since the rest will almost certainly fail the same way.
+	 */
+	for (i = 0; i <= nfiles; i++) {
+	    if (!failed)
+		err_release(&ctx.es[i], -1);
+	    if (ctx.es[i].fatal)
+		es->fatal = failed = true;
+	    err_undefer(&ctx.es[i]);
+	}
+
+	sfree(ctx.firstnode);
+	sfree(ctx.es);
+    }
+}
+
+/*
+ * Format the complete text of one node: the ^_ delimiter and node
+ * line, then the node's heading and body, then its menu.
+ */
+static void info_node_job(void *vctx, int i)
+{
+    struct info_nodejobs *ctx = (struct info_nodejobs *)vctx;
+    infoconfig *conf = ctx->conf;
+    node *n = ctx->nodes[i];
+    info_data text = EMPTY_INFO_DATA;
+    paragraph *p;
+
+    text.charset = conf->charset;
+    info_rdaddsc(&text, "\037\nFile: ");
+    info_rdaddsc(&text, conf->filename);
+    info_rdaddsc(&text, ",  Node: ");
+    info_rdaddsc(&text, n->name);
+    if (n->prev) {
+	info_rdaddsc(&text, ",  Prev: ");
+	info_rdaddsc(&text, n->prev->name);
+    }
+    info_rdaddsc(&text, ",  Up: ");
+    info_rdaddsc(&text, (n->up ? n->up->name : "(dir)"));
+    if (n->next) {
+	info_rdaddsc(&text, ",  Next: ");
+	info_rdaddsc(&text, n->next->name);
+    }
+    info_rdaddsc(&text, "\n\n");
+
+    if (n == ctx->topnode) {
+	/* Do the title */
+	for (p = ctx->sourceform; p; p = p->next)
+	    if (p->type == para_Title)
+		info_heading(&text, NULL, p->words,
+			     conf->atitle, conf->width, conf);
+	info_node_body(&text, ctx->sourceform, conf);
+    } else if ((p = n->para) != NULL) {
+	if (p->type == para_Chapter || p->type == para_Appendix ||
+	    p->type == para_UnnumberedChapter)
+	    info_heading(&text, p->kwtext, p->words,
+			 conf->achapter, conf->width, conf);
+	else
+	    info_heading(&text, p->kwtext, p->words,
+			 conf->asect[p->aux>=conf->nasect?conf->nasect-1:p->aux],
+			 conf->width, conf);
+	info_node_body(&text, p->next, conf);
     } else {
-	int filenum = 0;
-	fprintf(fp, "\037\nIndirect:\n");
-	for (currnode = topnode; currnode; currnode = currnode->listnext)
-	    if (filenum != currnode->filenum) {
-		filenum = currnode->filenum;
-		fprintf(fp, "%s-%d: %d\n", conf.filename, filenum,
-			currnode->pos);
-	    }
+	/* The index node, whose text was built up front. */
+	info_rdaddsc(&text, n->text.output.text);
+	sfree(n->text.output.text);
+    }
+
+    if (n->started_menu) {
+	info_rdaddsc(&text, n->menu.output.text);
+	sfree(n->menu.output.text);
     }
-    fprintf(fp, "\037\nTag Table:\n");
-    if (conf.maxfilesize > 0)
-	fprintf(fp, "(Indirect)\n");
-    for (currnode = topnode; currnode; currnode = currnode->listnext)
-	fprintf(fp, "Node: %s\177%d\n", currnode->name, currnode->pos);
-    fprintf(fp, "\037\nEnd Tag Table\n");
-    fclose(fp);
 
     /*
-     * Write the subfiles.
+     * Just make _absolutely_ sure we end with a newline.
      */
-    if (conf.maxfilesize > 0) {
-	int filenum = 0;
-	fp = NULL;
+    if (text.output.text[text.output.pos-1] != '\n')
+	info_rdaddc(&text, '\n');
 
-	for (currnode = topnode; currnode; currnode = currnode->listnext) {
-	    if (filenum != currnode->filenum) {
-		char *fname;
+    n->text = text;
+}
 
-		filenum = currnode->filenum;
+/*
+ * Format the paragraphs of a node's body, from `p' up to the next
+ * section heading.
+ */
+static void info_node_body(info_data *text, paragraph *p, infoconfig *conf)
+{
+    word *prefix, *body, *wp;
+    word spaceword, bullet;
+    wchar_t *prefixextra;
+    int nesting, nestindent;
+    int indentb, indenta;
 
-		if (fp)
-		    fclose(fp);
-		fname = snewn(strlen(conf.filename) + 40, char);
-		sprintf(fname, "%s-%d", conf.filename, filenum);
-		fp = fopen(fname, "w");
-		if (!fp) {
-		    err_cantopenw(es, fname);
-		    return;
-		}
-		sfree(fname);
-		fputs(intro_text.output.text, fp);
-	    }
-	    fputs(currnode->text.output.text, fp);
+    nestindent = conf->listindentbefore + conf->listindentafter;
+    nesting = 0;
+
+    for (; p; p = p->next) switch (p->type) {
+
+      case para_QuotePush:
+	nesting += 2;
+	break;
+      case para_QuotePop:
+	nesting -= 2;
+	assert(nesting >= 0);
+	break;
+
+      case para_LcontPush:
+	nesting += nestindent;
+	break;
+      case para_LcontPop:
+	nesting -= nestindent;
+	assert(nesting >= 0);
+	break;
+
+	/*
+	 * The next section heading starts a new node.
+	 */
+      case para_Chapter:
+      case para_Appendix:
+      case para_UnnumberedChapter:
+      case para_Heading:
+      case para_Subsect:
+	return;
+
+      case para_Rule:
+	info_rule(text, nesting, conf->width - nesting, conf);
+	break;
+
+      case para_Normal:
+      case para_Copyright:
+      case para_DescribedThing:
+      case para_Description:
+      case para_BiblioCited:
+      case para_Bullet:
+      case para_NumberedList:
+	if (p->type == para_Bullet) {
+	    bullet.next = NULL;
+	    bullet.alt = NULL;
+	    bullet.type = word_Normal;
+	    bullet.text = conf->bullet;
+	    prefix = &bullet;
+	    prefixextra = NULL;
+	    indentb = conf->listindentbefore;
+	    indenta = conf->listindentafter;
+	} else if (p->type == para_NumberedList) {
+	    prefix = p->kwtext;
+	    prefixextra = conf->listsuffix;
+	    indentb = conf->listindentbefore;
+	    indenta = conf->listindentafter;
+	} else if (p->type == para_Description) {
+	    prefix = NULL;
+	    prefixextra = NULL;
+	    indentb = conf->listindentbefore;
+	    indenta = conf->listindentafter;
+	} else {
+	    prefix = NULL;
+	    prefixextra = NULL;
+	    indentb = indenta = 0;
+	}
+	if (p->type == para_BiblioCited) {
+	    body = dup_word_list(p->kwtext);
+	    for (wp = body; wp->next; wp = wp->next);
+	    wp->next = &spaceword;
+	    spaceword.next = p->words;
+	    spaceword.alt = NULL;
+	    spaceword.type = word_WhiteSpace;
+	    spaceword.text = NULL;
+	} else {
+	    wp = NULL;
+	    body = p->words;
+	}
+	info_para(text, prefix, prefixextra, body, nesting + indentb, indenta,
+		  conf->width - nesting - indentb - indenta, conf);
+	if (wp) {
+	    wp->next = NULL;
+	    free_word_list(body);
 	}
+	break;
 
-	if (fp)
-	    fclose(fp);
+      case para_Code:
+	info_codepara(text, p->words,
+		      nesting + conf->indent_code,
+		      conf->width - nesting - 2 * conf->indent_code);
+	break;
+
+      default:
+	break;
     }
 }
 
+/*
+ * Write output file number `i': the primary file (which holds the
+ * whole document, or if it's split, the indirect table) with its tag
+ * table, or one of the subfiles.
+ */
+static void info_file_job(void *vctx, int i)
+{
+    struct info_filejobs *ctx = (struct info_filejobs *)vctx;
+    infoconfig *conf = ctx->conf;
+    errorstate *es = &ctx->es[i];
+    rope out = empty_rope;
+    node *currnode;
+    char buf[80];
+
+    err_defer(es);
+
+    /*
+     * The text of the nodes is written straight out of their own
+     * buffers.
+     */
+    rope_addref(&out, ctx->intro->output.text, ctx->intro->output.pos);
+
+    if (i > 0) {
+	for (currnode = ctx->firstnode[i];
+	     currnode && currnode->filenum == i;
+	     currnode = currnode->listnext)
+	    rope_addref(&out, currnode->text.output.text,
+			currnode->text.output.pos);
+	info_write_file(&out, i, conf, es);
+	return;
+    }
+
+    if (conf->maxfilesize == 0) {
+	for (currnode = ctx->topnode; currnode; currnode = currnode->listnext)
+	    rope_addref(&out, currnode->text.output.text,
+			currnode->text.output.pos);
+    } else {
+	int filenum = 0;
+	rope_addsc(&out, "\037\nIndirect:\n");
+	for (currnode = ctx->topnode; currnode; currnode = currnode->listnext)
+	    if (filenum != currnode->filenum) {
+		filenum = currnode->filenum;
+		rope_addsc(&out, conf->filename);
+		sprintf(buf, "-%d: %d\n", filenum, currnode->pos);
+		rope_addsc(&out, buf);
+	    }
+    }
+    rope_addsc(&out, "\037\nTag Table:\n");
+    if (conf->maxfilesize > 0)
+	rope_addsc(&out, "(Indirect)\n");
+    for (currnode = ctx->topnode; currnode; currnode = currnode->listnext) {
+	rope_addsc(&out, "Node: ");
+	rope_addsc(&out, currnode->name);
+	sprintf(buf, "\177%d\n", currnode->pos);
+	rope_addsc(&out, buf);
+    }
+    rope_addsc(&out, "\037\nEnd Tag Table\n");
+    info_write_file(&out, 0, conf, es);
+}
+
+/*
+ * Write out the main file (filenum 0) or one of the numbered
+ * subfiles, whose text has been gathered in `out', and empty `out'
+ * ready for the next one.
+ */
+static bool info_write_file(rope *out, int filenum, infoconfig *conf,
+			    errorstate *es)
+{
+    char *fname = snewn(strlen(conf->filename) + 40, char);
+    bool ret;
+
+    strcpy(fname, conf->filename);
+    if (filenum)
+	sprintf(fname + strlen(fname), "-%d", filenum);
+    if (conf->compress)
+	strcat(fname, ".gz");
+
+    ret = write_rope_file(fname, out, conf->compress);
+    if (!ret)
+	err_cantopenw(es, fname);
+
+    sfree(fname);
+    rope_free(out);
+    return ret;
+}
+
 static int info_check_index(word *w, node *n, indexdata *idx)
 {
     int ret = 0;
@@ -810,16 +985,15 @@ static int info_check_index(word *w, node *n, indexdata *idx)
     return ret;
 }
 
-static word *info_transform_wordlist(word *words, keywordlist *keywords)
+static word *info_transform_wordlist(word *words, infoconfig *cfg)
 {
     word *ret = dup_word_list(words);
     word *w;
     keyword *kwl;
 
     for (w = ret; w; w = w->next) {
-	w->private_data = NULL;
 	if (w->type == word_UpperXref || w->type == word_LowerXref) {
-	    kwl = kw_lookup(keywords, w->text);
+	    kwl = kw_lookup(cfg->keywords, w->text);
 	    if (kwl) {
 		if (kwl->para->type == para_NumberedList ||
 		    kwl->para->type == para_BiblioCited) {
@@ -849,16 +1023,13 @@ static word *info_transform_wordlist(word *words, keywordlist *keywords)
 		    /*
 		     * Now w is the UpperXref / LowerXref we
 		     * started with, and w4 is the next word after
-		     * the corresponding XrefEnd (if any). The
-		     * simplest thing is just to stick a pointer to
-		     * the target node structure in the private
-		     * data field of the xref word, and let
-		     * info_rdaddwc and friends read the node name
-		     * out from there.
+		     * the corresponding XrefEnd (if any). We leave
+		     * just the xref word itself, and let
+		     * info_rdaddwc and friends look up the target
+		     * node's name from its keyword.
 		     */
 		    w->next = w4;
-		    w->private_data = kwl->para->private_data;
-		    assert(w->private_data);
+		    assert(info_xref_node(w, cfg));
 		}
 	    }
 	}
@@ -867,9 +1038,21 @@ static word *info_transform_wordlist(word *words, keywordlist *keywords)
     return ret;
 }
 
+/*
+ * Find the node an xref word points at, or NULL if it doesn't point
+ * at a node (e.g. it's an xref to a numbered list item).
+ */
+static node *info_xref_node(word *w, infoconfig *cfg)
+{
+    keyword *kwl = kw_lookup(cfg->keywords, w->text);
+
+    return kwl ? cfg->pnodes[kwl->para->index] : NULL;
+}
+
 static int info_rdaddwc(info_data *id, word *words, word *end, bool xrefs,
 			infoconfig *cfg) {
     int ret = 0;
+    node *xn;
 
     for (; words && words != end; words = words->next) switch (words->type) {
       case word_HyperLink:
@@ -934,13 +1117,13 @@ static int info_rdaddwc(info_data *id, word *words, word *end, bool xrefs,
 
       case word_UpperXref:
       case word_LowerXref:
-	if (xrefs && words->private_data) {
+	if (xrefs && (xn = info_xref_node(words, cfg)) != NULL) {
 	    /*
 	     * This bit is structural and so must be done in char
 	     * rather than wchar_t.
 	     */
 	    ret += info_rdaddsc(id, "*Note ");
-	    ret += info_rdaddsc(id, ((node *)words->private_data)->name);
+	    ret += info_rdaddsc(id, xn->name);
 	    ret += info_rdaddsc(id, "::");
 	}
 	break;
@@ -963,6 +1146,7 @@ static int info_width_internal_list(word *words, bool xrefs, infoconfig *cfg) {
 static int info_width_internal(word *words, bool xrefs, infoconfig *cfg) {
     int wid;
     int attr;
+    node *xn;
 
     switch (words->type) {
       case word_HyperLink:
@@ -973,10 +1157,9 @@ static int info_width_internal(word *words, bool xrefs, infoconfig *cfg) {
 
       case word_UpperXref:
       case word_LowerXref:
-	if (xrefs && words->private_data) {
+	if (xrefs && (xn = info_xref_node(words, cfg)) != NULL) {
 	    /* "*Note " plus "::" comes to 8 characters */
-	    return 8 + strwid(((node *)words->private_data)->name,
-			      cfg->charset);
+	    return 8 + strwid(xn->name, cfg->charset);
 	} else
 	    return 0;
     }
@@ -1091,15 +1274,15 @@ static void info_rule(info_data *text, int indent, int width, infoconfig *cfg)
 }
 
 static void info_para(info_data *text, word *prefix, wchar_t *prefixextra,
-		      word *input, keywordlist *keywords, int indent,
-		      int extraindent, int width, infoconfig *cfg) {
+		      word *input, int indent, int extraindent, int width,
+		      infoconfig *cfg) {
     wrappedline *wrapping, *p;
     word *words;
     int e;
     int i;
     int firstlinewidth = width;
 
-    words = info_transform_wordlist(input, keywords);
+    words = info_transform_wordlist(input, cfg);
 
     if (prefix) {
 	for (i = 0; i < indent; i++)
@@ -1163,8 +1346,9 @@ static node *info_node_new(char *name, int charset)
     node *n;
 
     n = snew(node);
-    n->text = empty_info_data;
-    n->text.charset = charset;
+    n->text = n->menu = empty_info_data;
+    n->text.charset = n->menu.charset = charset;
+    n->para = NULL;
     n->up = n->next = n->prev = n->lastchild = n->listnext = NULL;
     n->name = dupstr(name);
     n->started_menu = false;
@@ -12,13 +12,14 @@ typedef struct {
     bool headnumbers;
     int mindepth;
     char *filename;
+    bool compress;
     int charset;
     wchar_t *bullet, *rule, *lquote, *rquote;
 } manconfig;
 
-static void man_text(FILE *, word *,
+static void man_text(rdstringc *, word *,
 		     bool newline, int quote_props, manconfig *conf);
-static void man_codepara(FILE *, word *, int charset);
+static void man_codepara(rdstringc *, word *, int charset);
 static bool man_convert(wchar_t const *s, int maxlen,
                         char **result, int quote_props,
                         int charset, charset_state *state);
@@ -125,6 +126,7 @@ static manconfig man_configure(paragraph *source, errorstate *es) {
     ret.headnumbers = false;
     ret.mindepth = 0;
     ret.filename = dupstr("output.1");
+    ret.compress = false;
     ret.charset = CS_ASCII;
     ret.bullet = L"\x2022\0o\0\0";
     ret.rule = L"\x2500\0-\0\0";
@@ -170,6 +172,8 @@ static manconfig man_configure(paragraph *source, errorstate *es) {
 	    } else if (!ustricmp(p->keyword, L"man-filename")) {
 		sfree(ret.filename);
 		ret.filename = dupstr(adv(p->origkeyword));
+	    } else if (!ustricmp(p->keyword, L"man-compress")) {
+		ret.compress = utob(uadv(p->keyword));
 	    } else if (!ustricmp(p->keyword, L"man-bullet")) {
 		ret.bullet = uadv(p->keyword);
 	    } else if (!ustricmp(p->keyword, L"man-rule")) {
@@ -223,7 +227,7 @@ paragraph *man_config_filename(char *filename)
 void man_backend(paragraph *sourceform, keywordlist *keywords,
 		 indexdata *idx, void *unused, errorstate *es) {
     paragraph *p;
-    FILE *fp;
+    rdstringc out = { 0, 0, NULL };
     manconfig conf;
     bool had_described_thing;
 
@@ -233,53 +237,43 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 
     conf = man_configure(sourceform, es);
 
-    /*
-     * Open the output file.
-     */
-    if (!strcmp(conf.filename, "-"))
-	fp = stdout;
-    else
-	fp = fopen(conf.filename, "w");
-    if (!fp) {
-	err_cantopenw(es, conf.filename);
-	return;
-    }
-
-    fprintf(fp, ".\\\" This manual page generated by Halibut, %s\n", version);
+    rdaddsc(&out, ".\\\" This manual page generated by Halibut, ");
+    rdaddsc(&out, version);
+    rdaddc(&out, '\n');
 
     /* Do the version ID */
     for (p = sourceform; p; p = p->next)
 	if (p->type == para_VersionID) {
-	    fprintf(fp, ".\\\" ");
-	    man_text(fp, p->words, true, 0, &conf);
+	    rdaddsc(&out, ".\\\" ");
+	    man_text(&out, p->words, true, 0, &conf);
 	}
 
     /* Standard preamble */
     /* Dodge to try to get literal U+0027 in output when required,
      * bypassing groff's Unicode transform; pinched from pod2man */
-    fprintf(fp, ".ie \\n(.g .ds Aq \\(aq\n"
-	        ".el       .ds Aq '\n");
+    rdaddsc(&out, ".ie \\n(.g .ds Aq \\(aq\n"
+		  ".el       .ds Aq '\n");
 
     /* .TH name-of-program manual-section */
-    fprintf(fp, ".TH");
+    rdaddsc(&out, ".TH");
     if (conf.th && *conf.th) {
 	char *c;
 	wchar_t *wp;
 
 	for (wp = conf.th; *wp; wp = uadv(wp)) {
-	    fputs(" \"", fp);
+	    rdaddsc(&out, " \"");
 	    man_convert(wp, 0, &c, QUOTE_QUOTES, conf.charset, NULL);
-	    fputs(c, fp);
+	    rdaddsc(&out, c);
 	    sfree(c);
-	    fputc('"', fp);
+	    rdaddc(&out, '"');
 	}
     }
-    fputc('\n', fp);
+    rdaddc(&out, '\n');
 
     had_described_thing = false;
 #define cleanup_described_thing do { \
     if (had_described_thing) \
-	fprintf(fp, "\n"); \
+	rdaddsc(&out, "\n"); \
     had_described_thing = false; \
 } while (0)
 
@@ -316,15 +310,15 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 		depth = 0;
 	    if (depth >= conf.mindepth) {
 		if (depth > conf.mindepth)
-		    fprintf(fp, ".SS \"");
+		    rdaddsc(&out, ".SS \"");
 		else
-		    fprintf(fp, ".SH \"");
+		    rdaddsc(&out, ".SH \"");
 		if (conf.headnumbers && p->kwtext) {
-		    man_text(fp, p->kwtext, false, QUOTE_QUOTES, &conf);
-		    fprintf(fp, " ");
+		    man_text(&out, p->kwtext, false, QUOTE_QUOTES, &conf);
+		    rdaddsc(&out, " ");
 		}
-		man_text(fp, p->words, false, QUOTE_QUOTES, &conf);
-		fprintf(fp, "\"\n");
+		man_text(&out, p->words, false, QUOTE_QUOTES, &conf);
+		rdaddsc(&out, "\"\n");
 	    }
 	    break;
 	}
@@ -334,8 +328,8 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 	 */
       case para_Code:
 	cleanup_described_thing;
-	fprintf(fp, ".PP\n");
-	man_codepara(fp, p->words, conf.charset);
+	rdaddsc(&out, ".PP\n");
+	man_codepara(&out, p->words, conf.charset);
 	break;
 
 	/*
@@ -344,8 +338,8 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
       case para_Normal:
       case para_Copyright:
 	cleanup_described_thing;
-	fprintf(fp, ".PP\n");
-	man_text(fp, p->words, true, 0, &conf);
+	rdaddsc(&out, ".PP\n");
+	man_text(&out, p->words, true, 0, &conf);
 	break;
 
 	/*
@@ -362,12 +356,14 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 	    char *bullettext;
 	    man_convert(conf.bullet, -1, &bullettext, QUOTE_QUOTES,
 			conf.charset, NULL);
-	    fprintf(fp, ".IP \"\\fB%s\\fP\"\n", bullettext);
+	    rdaddsc(&out, ".IP \"\\fB");
+	    rdaddsc(&out, bullettext);
+	    rdaddsc(&out, "\\fP\"\n");
 	    sfree(bullettext);
 	} else if (p->type == para_NumberedList) {
-	    fprintf(fp, ".IP \"");
-	    man_text(fp, p->kwtext, false, QUOTE_QUOTES, &conf);
-	    fprintf(fp, "\"\n");
+	    rdaddsc(&out, ".IP \"");
+	    man_text(&out, p->kwtext, false, QUOTE_QUOTES, &conf);
+	    rdaddsc(&out, "\"\n");
 	} else if (p->type == para_Description) {
 	    if (had_described_thing) {
 		/*
@@ -380,22 +376,22 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 		 * A \dd without a preceding \dt is given a blank
 		 * one.
 		 */
-		fprintf(fp, ".IP \"\"\n");
+		rdaddsc(&out, ".IP \"\"\n");
 	    }
 	} else if (p->type == para_BiblioCited) {
-	    fprintf(fp, ".IP \"");
-	    man_text(fp, p->kwtext, false, QUOTE_QUOTES, &conf);
-	    fprintf(fp, "\"\n");
+	    rdaddsc(&out, ".IP \"");
+	    man_text(&out, p->kwtext, false, QUOTE_QUOTES, &conf);
+	    rdaddsc(&out, "\"\n");
 	}
-	man_text(fp, p->words, true, 0, &conf);
+	man_text(&out, p->words, true, 0, &conf);
 	had_described_thing = false;
 	break;
 
       case para_DescribedThing:
 	cleanup_described_thing;
-	fprintf(fp, ".IP \"");
-	man_text(fp, p->words, false, QUOTE_QUOTES, &conf);
-	fprintf(fp, "\"\n");
+	rdaddsc(&out, ".IP \"");
+	man_text(&out, p->words, false, QUOTE_QUOTES, &conf);
+	rdaddsc(&out, "\"\n");
 	had_described_thing = true;
 	break;
 
@@ -409,8 +405,10 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
 	     */
 	    cleanup_described_thing;
 	    man_convert(conf.rule, -1, &ruletext, 0, conf.charset, NULL);
-	    fprintf(fp, ".PP\n.ie t \\u\\l'\\n(.lu-\\n(.iu'\\d\n"
-		    ".el \\l'\\n(.lu-\\n(.iu\\&%s'\n", ruletext);
+	    rdaddsc(&out, ".PP\n.ie t \\u\\l'\\n(.lu-\\n(.iu'\\d\n"
+			  ".el \\l'\\n(.lu-\\n(.iu\\&");
+	    rdaddsc(&out, ruletext);
+	    rdaddsc(&out, "'\n");
 	    sfree(ruletext);
 	}
 	break;
@@ -418,21 +416,34 @@ void man_backend(paragraph *sourceform, keywordlist *keywords,
       case para_LcontPush:
       case para_QuotePush:
 	cleanup_described_thing;
-	fprintf(fp, ".RS\n");
+	rdaddsc(&out, ".RS\n");
       	break;
       case para_LcontPop:
       case para_QuotePop:
 	cleanup_described_thing;
-	fprintf(fp, ".RE\n");
+	rdaddsc(&out, ".RE\n");
 	break;
     }
     cleanup_described_thing;
 
+    /*
+     * Write the output file.
+     */
+    {
+	char *fname = dupstr(conf.filename);
+	if (conf.compress && strcmp(fname, "-")) {
+	    fname = sresize(fname, strlen(fname) + 4, char);
+	    strcat(fname, ".gz");
+	}
+	if (!write_whole_file(fname, out.text, out.pos, conf.compress))
+	    err_cantopenw(es, fname);
+	sfree(fname);
+    }
+
     /*
      * Tidy up.
      */
-    if (fp != stdout)
-	fclose(fp);
+    sfree(out.text);
     man_conf_cleanup(conf);
 }
 
@@ -682,20 +693,21 @@ static int man_rdaddwc(rdstringc *rs, word *text, word *end,
     return quote_props;
 }
 
-static void man_text(FILE *fp, word *text, bool newline,
+static void man_text(rdstringc *out, word *text, bool newline,
 		     int quote_props, manconfig *conf) {
     rdstringc t = { 0, 0, NULL };
     charset_state state = CHARSET_INIT_STATE;
 
     man_rdaddwc(&t, text, NULL, quote_props | QUOTE_INITCTRL, conf, &state);
-    fprintf(fp, "%s", t.text);
+    if (t.text)
+	rdaddsc(out, t.text);
     sfree(t.text);
     if (newline)
-	fputc('\n', fp);
+	rdaddc(out, '\n');
 }
 
-static void man_codepara(FILE *fp, word *text, int charset) {
-    fprintf(fp, ".nf\n");
+static void man_codepara(rdstringc *out, word *text, int charset) {
+    rdaddsc(out, ".nf\n");
     for (; text; text = text->next) if (text->type == word_WeakCode) {
 	char *c;
 	wchar_t *t, *e;
@@ -714,21 +726,22 @@ static void man_codepara(FILE *fp, word *text, int charset) {
 
 	    for (n = 0; t[n] && e[n] && e[n] == ec; n++);
 	    if (ec == 'i')
-		fprintf(fp, "\\fI");
+		rdaddsc(out, "\\fI");
 	    else if (ec == 'b')
-		fprintf(fp, "\\fB");
+		rdaddsc(out, "\\fB");
 	    man_convert(t, n, &c, quote_props, charset, NULL);
 	    quote_props &= ~QUOTE_INITCTRL;
-	    fprintf(fp, "%s", c);
+	    rdaddsc(out, c);
 	    sfree(c);
 	    if (ec == 'i' || ec == 'b')
-		fprintf(fp, "\\fP");
+		rdaddsc(out, "\\fP");
 	    t += n;
 	    e += n;
 	}
 	man_convert(t, 0, &c, quote_props, charset, NULL);
-	fprintf(fp, "%s\n", c);
+	rdaddsc(out, c);
+	rdaddc(out, '\n');
 	sfree(c);
     }
-    fprintf(fp, ".fi\n");
+    rdaddsc(out, ".fi\n");
 }
@@ -117,6 +117,8 @@ struct paper_conf_Tag {
     int base_width;
     int page_height;
     int index_colwidth;
+    /* The para_data for each paragraph, indexed by paragraph::index */
+    para_data **paras;
 };
 
 struct paper_idx_Tag {
@@ -138,6 +140,15 @@ enum {
     word_PageXref = word_NotWordType + 1
 };
 
+/*
+ * The word_PageXref words in the index's page number lists are made
+ * up by us, and carry a pointer to the page they refer to.
+ */
+typedef struct {
+    word w;			       /* must come first */
+    page_data *page;
+} page_ref_word;
+
 /* Flags for render_string() */
 #define RS_NOLIG	1
 
@@ -152,9 +163,10 @@ static int render_string(page_data *page, font_data *font, int fontsize,
 static int render_line(line_data *ldata, int left_x, int top_y,
 		       xref_dest *dest, keywordlist *keywords, indexdata *idx,
 		       paper_conf *conf);
-static void render_para(para_data *pdata, paper_conf *conf,
-			keywordlist *keywords, indexdata *idx,
-			paragraph *index_placeholder, page_data *index_page);
+static void render_paras(para_data *first, paper_conf *conf,
+			 keywordlist *keywords, indexdata *idx,
+			 paragraph *index_placeholder, page_data *index_page);
+static void emit_text(page_data *page);
 static int string_width(font_data *font, wchar_t const *string, bool *errs,
 			unsigned flags);
 static int paper_width_simple(para_data *pdata, word *text, paper_conf *conf);
@@ -334,7 +346,6 @@ static paper_conf paper_configure(paragraph *source, font_list *fontlist,
     }
 
     for (p = source; p; p = p->next) {
-	p->private_data = NULL;
 	if (p->type == para_Config) {
 	    if (!ustricmp(p->keyword, L"paper-quotes")) {
 		if (*uadv(p->keyword) && *uadv(uadv(p->keyword))) {
@@ -542,6 +553,80 @@ static paper_conf paper_configure(paragraph *source, font_list *fontlist,
     return ret;
 }
 
+/*
+ * Formatting a paragraph depends only on its own text, the
+ * indentation in force and the configuration, so paper_pre_backend
+ * hands them out to worker threads. The results go into the
+ * paragraph's slot in conf->paras, which no other job touches.
+ */
+struct format_job {
+    paragraph *p;
+    int indent;
+};
+
+struct format_ctx {
+    struct format_job *jobs;
+    paper_conf *conf;
+};
+
+static void format_para_job(void *vctx, int i)
+{
+    struct format_ctx *ctx = (struct format_ctx *)vctx;
+    paragraph *p = ctx->jobs[i].p;
+    int indent = ctx->jobs[i].indent;
+    paper_conf *conf = ctx->conf;
+    para_data *pdata;
+
+    switch (p->type) {
+	/*
+	 * This paragraph type is special. Process it specially.
+	 */
+      case para_Code:
+	pdata = code_paragraph(indent, p->words, conf);
+	if (pdata->first != pdata->last) {
+	    pdata->first->penalty_after += 100000;
+	    pdata->last->penalty_before += 100000;
+	}
+	break;
+
+	/*
+	 * This paragraph is also special.
+	 */
+      case para_Rule:
+	pdata = rule_paragraph(indent, conf);
+	break;
+
+	/*
+	 * All of these paragraph types require wrapping in the
+	 * ordinary way. So we must supply a set of fonts, a line
+	 * width and auxiliary information (e.g. bullet text) for
+	 * each one.
+	 */
+      case para_Chapter:
+      case para_Appendix:
+      case para_UnnumberedChapter:
+      case para_Heading:
+      case para_Subsect:
+      case para_Normal:
+      case para_BiblioCited:
+      case para_Bullet:
+      case para_NumberedList:
+      case para_DescribedThing:
+      case para_Description:
+      case para_Copyright:
+      case para_Title:
+	pdata = make_para_data(p->type, p->aux, indent, 0,
+			       p->kwtext, p->kwtext2, p->words, conf);
+	break;
+
+      default:
+	pdata = NULL;
+	break;
+    }
+
+    conf->paras[p->index] = pdata;
+}
+
 void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 			indexdata *idx, psdata *psd, errorstate *es) {
     paragraph *p;
@@ -566,6 +651,15 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
     ourconf = paper_configure(sourceform, fontlist, psd, es);
     conf = &ourconf;
 
+    {
+	int i, nparas;
+
+	doc_size(sourceform, &nparas, NULL);
+	conf->paras = snewn(nparas, para_data *);
+	for (i = 0; i < nparas; i++)
+	    conf->paras[i] = NULL;
+    }
+
     /*
      * Set up a data structure to collect page numbers for each
      * index entry.
@@ -683,93 +777,74 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
     }
 
     /*
-     * Do the main paragraph formatting.
+     * Do the main paragraph formatting. First we work out which
+     * paragraphs need formatting and at what indentation, which
+     * depends on the list and quote nesting around them; then we
+     * format them all, possibly in parallel (see format_para_job);
+     * then we link the results together in document order.
      */
-    indent = 0;
-    used_contents = false;
-    firstline = lastline = NULL;
-    for (p = sourceform; p; p = p->next) {
-	p->private_data = NULL;
+    {
+	struct format_ctx ctx;
+	int njobs = 0, jobsize = 0;
 
-	switch (p->type) {
-	    /*
-	     * These paragraph types are either invisible or don't
-	     * define text in the normal sense. Either way, they
-	     * don't require wrapping.
-	     */
-	  case para_IM:
-	  case para_BR:
-	  case para_Biblio:
-	  case para_NotParaType:
-	  case para_Config:
-	  case para_VersionID:
-	  case para_NoCite:
-	    break;
+	ctx.jobs = NULL;
+	ctx.conf = conf;
+	indent = 0;
+	for (p = sourceform; p; p = p->next) {
+	    switch (p->type) {
+		/*
+		 * These paragraph types are either invisible or
+		 * don't define text in the normal sense. Either
+		 * way, they don't require wrapping.
+		 */
+	      case para_IM:
+	      case para_BR:
+	      case para_Biblio:
+	      case para_NotParaType:
+	      case para_Config:
+	      case para_VersionID:
+	      case para_NoCite:
+		break;
 
-	    /*
-	     * These paragraph types don't require wrapping, but
-	     * they do affect the line width to which we wrap the
-	     * rest of the paragraphs, so we need to pay attention.
-	     */
-	  case para_LcontPush:
-	    indent += conf->indent_list; break;
-	  case para_LcontPop:
-	    indent -= conf->indent_list; assert(indent >= 0); break;
-	  case para_QuotePush:
-	    indent += conf->indent_quote; break;
-	  case para_QuotePop:
-	    indent -= conf->indent_quote; assert(indent >= 0); break;
+		/*
+		 * These paragraph types don't require wrapping,
+		 * but they do affect the line width to which we
+		 * wrap the rest of the paragraphs, so we need to
+		 * pay attention.
+		 */
+	      case para_LcontPush:
+		indent += conf->indent_list; break;
+	      case para_LcontPop:
+		indent -= conf->indent_list; assert(indent >= 0); break;
+	      case para_QuotePush:
+		indent += conf->indent_quote; break;
+	      case para_QuotePop:
+		indent -= conf->indent_quote; assert(indent >= 0); break;
 
-	    /*
-	     * This paragraph type is special. Process it
-	     * specially.
-	     */
-	  case para_Code:
-	    pdata = code_paragraph(indent, p->words, conf);
-	    p->private_data = pdata;
-	    if (pdata->first != pdata->last) {
-		pdata->first->penalty_after += 100000;
-		pdata->last->penalty_before += 100000;
+		/*
+		 * Everything else gets formatted.
+		 */
+	      default:
+		if (njobs >= jobsize) {
+		    jobsize = njobs * 3 / 2 + 64;
+		    ctx.jobs = sresize(ctx.jobs, jobsize, struct format_job);
+		}
+		ctx.jobs[njobs].p = p;
+		ctx.jobs[njobs].indent = indent;
+		njobs++;
+		break;
 	    }
-	    break;
-
-	    /*
-	     * This paragraph is also special.
-	     */
-	  case para_Rule:
-	    pdata = rule_paragraph(indent, conf);
-	    p->private_data = pdata;
-	    break;
-
-	    /*
-	     * All of these paragraph types require wrapping in the
-	     * ordinary way. So we must supply a set of fonts, a
-	     * line width and auxiliary information (e.g. bullet
-	     * text) for each one.
-	     */
-	  case para_Chapter:
-	  case para_Appendix:
-	  case para_UnnumberedChapter:
-	  case para_Heading:
-	  case para_Subsect:
-	  case para_Normal:
-	  case para_BiblioCited:
-	  case para_Bullet:
-	  case para_NumberedList:
-	  case para_DescribedThing:
-	  case para_Description:
-	  case para_Copyright:
-	  case para_Title:
-	    pdata = make_para_data(p->type, p->aux, indent, 0,
-				   p->kwtext, p->kwtext2, p->words, conf);
-
-	    p->private_data = pdata;
-
-	    break;
 	}
 
-	if (p->private_data) {
-	    pdata = (para_data *)p->private_data;
+	run_jobs(njobs, format_para_job, &ctx);
+	sfree(ctx.jobs);
+    }
+
+    used_contents = false;
+    firstline = lastline = NULL;
+    for (p = sourceform; p; p = p->next) {
+	if (conf->paras[p->index]) {
+	    pdata = conf->paras[p->index];
 
 	    /*
 	     * If this is the first non-title heading, we link the
@@ -849,6 +924,7 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	    first_index_page->first_line = NULL;
 	    first_index_page->last_line = NULL;
 	    first_index_page->first_text = first_index_page->last_text = NULL;
+	    first_index_page->first_run = first_index_page->last_run = NULL;
 	    first_index_page->first_xref = first_index_page->last_xref = NULL;
 	    first_index_page->first_rect = first_index_page->last_rect = NULL;
 
@@ -859,13 +935,10 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
     }
 
     /*
-     * Now we're ready to actually lay out the pages. We do this by
-     * looping over _paragraphs_, since we may need to track cross-
-     * references between lines and even across pages.
+     * Now we're ready to actually lay out the pages.
      */
-    for (pdata = firstpara; pdata; pdata = pdata->next)
-	render_para(pdata, conf, keywords, idx,
-		    &index_placeholder_para, first_index_page);
+    render_paras(firstpara, conf, keywords, idx,
+		 &index_placeholder_para, first_index_page);
 
     /*
      * Now we've laid out the main body pages, we should have
@@ -1019,9 +1092,8 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	/*
 	 * Render the index pages.
 	 */
-	for (pdata = firstidx; pdata; pdata = pdata->next)
-	    render_para(pdata, conf, keywords, idx,
-			&index_placeholder_para, first_index_page);
+	render_paras(firstidx, conf, keywords, idx,
+		     &index_placeholder_para, first_index_page);
 
 	/*
 	 * Link the index page list on to the end of the main page
@@ -1067,6 +1139,7 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 			  conf->left_margin + (conf->base_width - width)/2,
 			  conf->bottom_margin - conf->footer_distance,
 			  page->number, 0);
+	    emit_text(page);
 	}
     }
 
@@ -1120,6 +1193,8 @@ void *paper_pre_backend(paragraph *sourceform, keywordlist *keywords,
 	}
     }
 
+    sfree(conf->paras);
+
     return doc;
 }
 
@@ -1455,49 +1530,70 @@ static int sfmap_cmp(const void *a, const void *b, void *cmpctx)
     return 0;
 }
 
-int width_cmp(const void *a, const void *b, void *cmpctx)
+/*
+ * The font metric trees are keyed B-trees, since they're looked up
+ * in for every character laid out. A pair of glyphs is keyed by
+ * both together, left one first, which sorts the same way as
+ * comparing them in turn would.
+ */
+unsigned long width_key(const void *a)
 {
-    glyph_width const *wa = a, *wb = b;
+    glyph_width const *w = a;
 
-    if (wa->glyph < wb->glyph)
-	return -1;
-    if (wa->glyph > wb->glyph)
-	return 1;
-    return 0;
+    return w->glyph;
 }
 
-int kern_cmp(const void *a, const void *b, void *cmpctx)
+unsigned long kern_key(const void *a)
 {
-    kern_pair const *ka = a, *kb = b;
-
-    if (ka->left < kb->left)
-	return -1;
-    if (ka->left > kb->left)
-	return 1;
-    if (ka->right < kb->right)
-	return -1;
-    if (ka->right > kb->right)
-	return 1;
-    return 0;
+    kern_pair const *k = a;
+
+    return (unsigned long)k->left << 16 | k->right;
 }
 
-int lig_cmp(const void *a, const void *b, void *cmpctx)
+unsigned long lig_key(const void *a)
 {
-    ligature const *la = a, *lb = b;
-
-    if (la->left < lb->left)
-	return -1;
-    if (la->left > lb->left)
-	return 1;
-    if (la->right < lb->right)
-	return -1;
-    if (la->right > lb->right)
-	return 1;
-    return 0;
+    ligature const *l = a;
+
+    return (unsigned long)l->left << 16 | l->right;
+}
+
+void glyph_map_init(glyph_map *map)
+{
+    int i;
+
+    map->pagesize = 16;
+    map->pages = snewn(map->pagesize, glyph_page);
+    map->npages = 1;
+    for (i = 0; i < 256; i++)
+	map->pages[0][i] = NOGLYPH;
+    for (i = 0; i < (int)lenof(map->index); i++)
+	map->index[i] = 0;
+}
+
+void glyph_map_set(glyph_map *map, unsigned long u, glyph g)
+{
+    int i;
+
+    if (u >= UNICODE_LIMIT)
+	return;
+    if (!map->index[u >> 8]) {
+	if (map->npages >= map->pagesize) {
+	    map->pagesize = map->npages * 3 / 2;
+	    map->pages = sresize(map->pages, map->pagesize, glyph_page);
+	}
+	for (i = 0; i < 256; i++)
+	    map->pages[map->npages][i] = NOGLYPH;
+	map->index[u >> 8] = map->npages++;
+    }
+    map->pages[map->index[u >> 8]][u & 0xFF] = g;
 }
 
 static int utoglyph(font_info const *fi, wchar_t u) {
-    return (u < 0 || u > 0xFFFF ? NOGLYPH : fi->bmp[u]);
+    unsigned long c = u;
+
+    if (c >= UNICODE_LIMIT)
+	return NOGLYPH;
+    return fi->map.pages[fi->map.index[c >> 8]][c & 0xFF];
 }
 
 void listfonts(psdata *psd) {
@@ -1511,7 +1607,7 @@ void listfonts(psdata *psd) {
 static font_data *make_std_font(font_list *fontlist, psdata *psd,
                                 const char *name)
 {
-    font_info const *fi;
+    font_info *fi;
     font_data *f;
     font_encoding *fe;
     int i;
@@ -1521,7 +1617,7 @@ static font_data *make_std_font(font_list *fontlist, psdata *psd,
 	    return fe->font;
 
     for (fi = psd->all_fonts; fi; fi = fi->next)
-	if (strcmp(fi->name, name) == 0) break;
+	if (strcmp(fi->name, name) == 0 && font_load(fi, psd)) break;
     if (!fi) return NULL;
 
     f = snew(font_data);
@@ -1550,31 +1646,58 @@ static font_data *make_std_font(font_list *fontlist, psdata *psd,
     return f;
 }
 
-/* NB: arguments are glyph numbers from font->bmp. */
+/* NB: arguments are glyph numbers from utoglyph(). */
 int find_width(font_data *font, glyph index)
 {
     glyph_width wantw;
     glyph_width const *w;
 
     wantw.glyph = index;
-    w = find234(font->info->widths, &wantw);
+    w = findbt(font->info->widths, &wantw);
     if (!w) return 0;
     return w->width;
 }
 
+static glyph_class const *find_glyph_class(glyph_class const *classes,
+					   int n, glyph g)
+{
+    int lo = 0, hi = n;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (classes[mid].glyph == g)
+	    return &classes[mid];
+	if (classes[mid].glyph < g)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return NULL;
+}
+
 static int find_kern(font_data *font, int lindex, int rindex)
 {
     kern_pair wantkp;
     kern_pair const *kp;
+    kern_classes const *kc;
 
     if (lindex == NOGLYPH || rindex == NOGLYPH)
 	return 0;
     wantkp.left = lindex;
     wantkp.right = rindex;
-    kp = find234(font->info->kerns, &wantkp);
-    if (kp == NULL)
-	return 0;
-    return kp->kern;
+    kp = findbt(font->info->kerns, &wantkp);
+    if (kp != NULL)
+	return kp->kern;
+
+    /* The first class table covering the left glyph decides. */
+    for (kc = font->info->kern_classes; kc; kc = kc->next) {
+	glyph_class const *l, *r;
+	if ((l = find_glyph_class(kc->left, kc->nleft, lindex)) == NULL)
+	    continue;
+	r = find_glyph_class(kc->right, kc->nright, rindex);
+	return kc->kerns[l->cls * kc->nrclass + (r ? r->cls : 0)];
+    }
+    return 0;
 }
 
 static int find_lig(font_data *font, int lindex, int rindex)
@@ -1586,7 +1709,7 @@ static int find_lig(font_data *font, int lindex, int rindex)
 	return NOGLYPH;
     wantlig.left = lindex;
     wantlig.right = rindex;
-    lig = find234(font->info->ligs, &wantlig);
+    lig = findbt(font->info->ligs, &wantlig);
     if (lig == NULL)
 	return NOGLYPH;
     return lig->lig;
@@ -1965,6 +2088,7 @@ static page_data *page_breaks(line_data *first, line_data *last,
 	page->last_line = l->page_last[n];
 
 	page->first_text = page->last_text = NULL;
+	page->first_run = page->last_run = NULL;
 	page->first_xref = page->last_xref = NULL;
 	page->first_rect = page->last_rect = NULL;
 
@@ -2052,17 +2176,27 @@ static void add_string_to_page(page_data *page, int x, int y,
 
 /*
  * Returns the updated x coordinate.
+ *
+ * The glyphs aren't put into text fragments straight away, because
+ * that involves assigning each glyph to a subfont, and the subfonts
+ * depend on the order in which glyphs are first used. So they're
+ * queued on the page for emit_text() to deal with afterwards.
  */
 static int render_string(page_data *page, font_data *font, int fontsize,
 			 int x, int y, wchar_t *str, unsigned flags)
 {
-    char *text;
-    int textpos, textwid, kern, nglyph, glyph, oglyph, lig;
-    font_encoding *subfont = NULL, *sf;
-    subfont_map_entry *sme;
-
-    text = snewn(1 + ustrlen(str), char);
-    textpos = textwid = 0;
+    glyph_run *run;
+    struct run_glyph *rg;
+    int nglyph, glyph, oglyph, lig;
+
+    run = snew(glyph_run);
+    run->next = NULL;
+    run->x = x;
+    run->y = y;
+    run->font = font;
+    run->fontsize = fontsize;
+    run->glyphs = snewn(ustrlen(str), struct run_glyph);
+    run->nglyphs = 0;
 
     glyph = NOGLYPH;
     nglyph = utoglyph(font->info, *str);
@@ -2083,41 +2217,158 @@ static int render_string(page_data *page, font_data *font, int fontsize,
 	    continue;
 	}
 
-	/*
-	 * Find which subfont this character is going in.
-	 */
-	sme = encode_glyph(glyph, *str, font);
-	sf = sme->subfont;
+	rg = &run->glyphs[run->nglyphs];
+	rg->glyph = glyph;
+	rg->u = *str;
+	rg->kern = (run->nglyphs ? find_kern(font, oglyph, glyph) * fontsize : 0);
+	rg->width = find_width(font, glyph) * fontsize;
+	x += rg->kern + rg->width;
+	run->nglyphs++;
 
-	kern = find_kern(font, oglyph, glyph) * fontsize;
+	str++;
+    }
 
-	if (!subfont || sf != subfont || kern) {
-	    if (subfont) {
-		text[textpos] = '\0';
-		add_string_to_page(page, x, y, subfont, fontsize, text,
-				   textwid);
-		x += textwid + kern;
-	    } else {
-		assert(textpos == 0);
+    if (run->nglyphs == 0) {
+	sfree(run->glyphs);
+	sfree(run);
+	return x;
+    }
+
+    if (page->last_run)
+	page->last_run->next = run;
+    else
+	page->first_run = run;
+    page->last_run = run;
+
+    return x;
+}
+
+/*
+ * Turn the glyph runs queued on a page into text fragments. Pages
+ * must be passed to this function in the order their text was
+ * written, so that the subfonts come out the same however many
+ * pages were being rendered at once.
+ */
+static void emit_text(page_data *page)
+{
+    glyph_run *run, *next;
+    char *text;
+    int i, x, textpos, textwid;
+    font_encoding *subfont, *sf;
+    subfont_map_entry *sme;
+
+    for (run = page->first_run; run; run = next) {
+	next = run->next;
+
+	text = snewn(1 + run->nglyphs, char);
+	textpos = textwid = 0;
+	subfont = NULL;
+	x = run->x;
+
+	for (i = 0; i < run->nglyphs; i++) {
+	    struct run_glyph *rg = &run->glyphs[i];
+
+	    /*
+	     * Find which subfont this character is going in.
+	     */
+	    sme = encode_glyph(rg->glyph, rg->u, run->font);
+	    sf = sme->subfont;
+
+	    if (!subfont || sf != subfont || rg->kern) {
+		if (subfont) {
+		    text[textpos] = '\0';
+		    add_string_to_page(page, x, run->y, subfont,
+				       run->fontsize, text, textwid);
+		    x += textwid + rg->kern;
+		} else {
+		    assert(textpos == 0);
+		}
+		textpos = 0;
+		textwid = 0;
+		subfont = sf;
 	    }
-	    textpos = 0;
-	    textwid = 0;
-	    subfont = sf;
+
+	    text[textpos++] = sme->position;
+	    textwid += rg->width;
 	}
 
-	text[textpos++] = sme->position;
-	textwid += find_width(font, glyph) * fontsize;
+	text[textpos] = '\0';
+	add_string_to_page(page, x, run->y, subfont, run->fontsize,
+			   text, textwid);
 
-	str++;
+	sfree(text);
+	sfree(run->glyphs);
+	sfree(run);
     }
 
-    if (textpos > 0) {
-	text[textpos] = '\0';
-	add_string_to_page(page, x, y, subfont, fontsize, text, textwid);
-	x += textwid;
+    page->first_run = page->last_run = NULL;
+}
+
+/*
+ * Work out what string a word displays as, and in which font.
+ * Returns NULL for white space.
+ */
+static wchar_t *word_string(para_data *pdata, word *text, paper_conf *conf,
+			    int *findex, unsigned *flags)
+{
+    int style = towordstyle(text->type);
+    int type = removeattr(text->type);
+
+    *findex = (style == word_Normal ? FONT_NORMAL :
+	       style == word_Emph ? FONT_EMPH :
+	       style == word_Strong ? FONT_STRONG :
+	       FONT_CODE);
+
+    *flags = 0;
+    if (style == word_Code || style == word_WeakCode) *flags |= RS_NOLIG;
+    *flags |= pdata->extraflags;
+
+    if (type == word_Normal)
+	return text->text;
+    else if (type == word_WhiteSpace)
+	return NULL;
+    else /* if (type == word_Quote) */ {
+	if (text->aux == quote_Open)
+	    return conf->lquote;
+	else
+	    return conf->rquote;
     }
+}
 
-    return x;
+/*
+ * Find out where the cross-reference starting at a given word
+ * points.
+ */
+static void find_xref_dest(word *text, keywordlist *keywords,
+			   paper_conf *conf, xref_dest *dest)
+{
+    if (text->type == word_HyperLink) {
+	dest->type = URL;
+	dest->url = utoa_dup(text->text, CS_ASCII);
+	dest->page = NULL;
+    } else if (text->type == word_PageXref) {
+	dest->type = PAGE;
+	dest->url = NULL;
+	dest->page = ((page_ref_word *)text)->page;
+    } else {
+	keyword *kwl = kw_lookup(keywords, text->text);
+	para_data *pdata;
+
+	if (kwl) {
+	    pdata = conf->paras[kwl->para->index];
+	    assert(pdata);
+	    dest->type = PAGE;
+	    dest->page = pdata->first->page;
+	    dest->url = NULL;
+	} else {
+	    /*
+	     * Shouldn't happen, but *shrug*
+	     */
+	    dest->type = NONE;
+	    dest->page = NULL;
+	    dest->url = NULL;
+	}
+    }
 }
 
 /*
@@ -2129,11 +2380,11 @@ static int render_text(page_data *page, para_data *pdata, line_data *ldata,
 		       keywordlist *keywords, indexdata *idx, paper_conf *conf)
 {
     while (text && text != text_end) {
-	int style, type, findex;
+	int findex;
         bool errs;
 	wchar_t *str;
 	xref_dest dest;
-	unsigned flags = 0;
+	unsigned flags;
 
 	switch (text->type) {
 	    /*
@@ -2143,34 +2394,7 @@ static int render_text(page_data *page, para_data *pdata, line_data *ldata,
 	  case word_UpperXref:
 	  case word_LowerXref:
 	  case word_PageXref:
-
-	    if (text->type == word_HyperLink) {
-		dest.type = URL;
-		dest.url = utoa_dup(text->text, CS_ASCII);
-		dest.page = NULL;
-	    } else if (text->type == word_PageXref) {
-		dest.type = PAGE;
-		dest.url = NULL;
-		dest.page = (page_data *)text->private_data;
-	    } else {
-		keyword *kwl = kw_lookup(keywords, text->text);
-		para_data *pdata;
-
-		if (kwl) {
-		    assert(kwl->para->private_data);
-		    pdata = (para_data *) kwl->para->private_data;
-		    dest.type = PAGE;
-		    dest.page = pdata->first->page;
-		    dest.url = NULL;
-		} else {
-		    /*
-		     * Shouldn't happen, but *shrug*
-		     */
-		    dest.type = NONE;
-		    dest.page = NULL;
-		    dest.url = NULL;
-		}
-	    }
+	    find_xref_dest(text, keywords, conf, &dest);
 	    if (dest.type != NONE) {
 		*xr = snew(xref);
 		(*xr)->dest = dest;    /* structure copy */
@@ -2203,70 +2427,15 @@ static int render_text(page_data *page, para_data *pdata, line_data *ldata,
 	    goto nextword;
 
 	    /*
-	     * Add the current page number to the list of pages
-	     * referenced by an index entry.
+	     * Index references were dealt with by scan_text().
 	     */
 	  case word_IndexRef:
-	    /*
-	     * We don't create index references in contents entries.
-	     */
-	    if (!pdata->contents_entry) {
-		indextag *tag;
-		int i;
-
-		tag = index_findtag(idx, text->text);
-		if (!tag)
-		    goto nextword;
-
-		for (i = 0; i < tag->nrefs; i++) {
-		    indexentry *entry = tag->refs[i];
-		    paper_idx *pi = (paper_idx *)entry->backend_data;
-
-		    /*
-		     * If the same index term is indexed twice
-		     * within the same section, we only want to
-		     * mention it once in the index.
-		     */
-		    if (pi->lastpage != page) {
-			word **wp;
-
-			if (pi->lastword) {
-			    pi->lastword = pi->lastword->next =
-				fake_word(L",");
-			    pi->lastword = pi->lastword->next =
-				fake_space_word();
-			    wp = &pi->lastword->next;
-			} else
-			    wp = &pi->words;
-
-			pi->lastword = *wp =
-			    fake_page_ref(page);
-			pi->lastword = pi->lastword->next =
-			    fake_word(page->number);
-			pi->lastword = pi->lastword->next =
-			    fake_end_ref();
-		    }
-
-		    pi->lastpage = page;
-		}
-	    }
 	    goto nextword;
 	}
 
-	style = towordstyle(text->type);
-	type = removeattr(text->type);
-
-	findex = (style == word_Normal ? FONT_NORMAL :
-		  style == word_Emph ? FONT_EMPH :
-		  style == word_Strong ? FONT_STRONG :
-		  FONT_CODE);
-
-	if (style == word_Code || style == word_WeakCode) flags |= RS_NOLIG;
-	flags |= pdata->extraflags;
+	str = word_string(pdata, text, conf, &findex, &flags);
 
-	if (type == word_Normal) {
-	    str = text->text;
-	} else if (type == word_WhiteSpace) {
+	if (!str) {
 	    x += pdata->sizes[findex] *
 		string_width(pdata->fonts[findex], L" ", NULL, 0);
 	    if (nspaces && findex != FONT_CODE) {
@@ -2275,11 +2444,6 @@ static int render_text(page_data *page, para_data *pdata, line_data *ldata,
 		(*nspace)++;
 	    }
 	    goto nextword;
-	} else /* if (type == word_Quote) */ {
-	    if (text->aux == quote_Open)
-		str = conf->lquote;
-	    else
-		str = conf->rquote;
 	}
 
 	(void) string_width(pdata->fonts[findex], str, &errs, flags);
@@ -2390,63 +2554,137 @@ static int render_line(line_data *ldata, int left_x, int top_y,
     return ret;
 }
 
-static void render_para(para_data *pdata, paper_conf *conf,
-			keywordlist *keywords, indexdata *idx,
-			paragraph *index_placeholder, page_data *index_page)
-{
-    int last_x;
-    xref *cxref;
-    page_data *cxref_page;
-    xref_dest dest;
-    para_data *target;
+
+/*
+ * Rendering is done a page at a time, and possibly many pages at
+ * once, so anything that depends on what came earlier in the
+ * document has to be worked out beforehand. That's done by a serial
+ * pass over the paragraphs, which sorts the lines into pages, notes
+ * any cross-reference carried over on to each line from the one
+ * before, and adds each page to the page lists of the index terms
+ * mentioned on it.
+ */
+typedef struct {
     line_data *ldata;
+    word *xref_start;		       /* start of carried-over xref */
+} render_line_item;
 
-    dest.type = NONE;
-    cxref = NULL;
-    cxref_page = NULL;
+typedef struct {
+    page_data *page;
+    render_line_item *lines;
+    int nlines, linesize;
+} render_page;
+
+/*
+ * Do the serial part of render_text() for a list of words, and
+ * update *xref_start to point at the start of the cross-reference (if
+ * any) still in progress at the end.
+ */
+static void scan_text(page_data *page, para_data *pdata, word *text,
+		      word *text_end, word **xref_start, keywordlist *keywords,
+		      indexdata *idx, paper_conf *conf)
+{
+    while (text && text != text_end) {
+	int findex;
+        bool errs;
+	wchar_t *str;
+	unsigned flags;
+
+	switch (text->type) {
+	  case word_HyperLink:
+	  case word_UpperXref:
+	  case word_LowerXref:
+	  case word_PageXref:
+	    if (text->type == word_HyperLink ||
+		text->type == word_PageXref ||
+		kw_lookup(keywords, text->text))
+		*xref_start = text;
+	    goto nextword;
+
+	  case word_HyperEnd:
+	  case word_XrefEnd:
+	    *xref_start = NULL;
+	    goto nextword;
+
+	    /*
+	     * Add the current page number to the list of pages
+	     * referenced by an index entry.
+	     */
+	  case word_IndexRef:
+	    /*
+	     * We don't create index references in contents entries.
+	     */
+	    if (!pdata->contents_entry) {
+		indextag *tag;
+		int i;
+
+		tag = index_findtag(idx, text->text);
+		if (!tag)
+		    goto nextword;
+
+		for (i = 0; i < tag->nrefs; i++) {
+		    indexentry *entry = tag->refs[i];
+		    paper_idx *pi = (paper_idx *)entry->backend_data;
+
+		    /*
+		     * If the same index term is indexed twice
+		     * within the same section, we only want to
+		     * mention it once in the index.
+		     */
+		    if (pi->lastpage != page) {
+			word **wp;
+
+			if (pi->lastword) {
+			    pi->lastword = pi->lastword->next =
+				fake_word(L",");
+			    pi->lastword = pi->lastword->next =
+				fake_space_word();
+			    wp = &pi->lastword->next;
+			} else
+			    wp = &pi->words;
+
+			pi->lastword = *wp =
+			    fake_page_ref(page);
+			pi->lastword = pi->lastword->next =
+			    fake_word(page->number);
+			pi->lastword = pi->lastword->next =
+			    fake_end_ref();
+		    }
+
+		    pi->lastpage = page;
+		}
+	    }
+	    goto nextword;
+	}
 
-    assert(pdata->first);
-    for (ldata = pdata->first; ldata; ldata = ldata->next) {
 	/*
-	 * If this is a contents entry, we expect to have a single
-	 * enormous cross-reference rectangle covering the whole
-	 * thing. (Unless, of course, it spans multiple pages.)
+	 * The only other thing to worry about is a word which
+	 * render_text() will display using its alternative text.
 	 */
-	if (pdata->contents_entry && ldata->page != cxref_page) {
-	    cxref_page = ldata->page;
-	    cxref = snew(xref);
-	    cxref->next = NULL;
-	    cxref->dest.type = PAGE;
-	    if (pdata->contents_entry == index_placeholder) {
-		cxref->dest.page = index_page;
-	    } else {
-		assert(pdata->contents_entry->private_data);
-		target = (para_data *)pdata->contents_entry->private_data;
-		cxref->dest.page = target->first->page;
+	if (text->alt) {
+	    str = word_string(pdata, text, conf, &findex, &flags);
+	    if (str) {
+		(void) string_width(pdata->fonts[findex], str, &errs, flags);
+		if (errs)
+		    scan_text(page, pdata, text->alt, NULL, xref_start,
+			      keywords, idx, conf);
 	    }
-	    cxref->dest.url = NULL;
-	    if (ldata->page->last_xref)
-		ldata->page->last_xref->next = cxref;
-	    else
-		ldata->page->first_xref = cxref;
-	    ldata->page->last_xref = cxref;
-	    cxref->lx = conf->left_margin;
-	    cxref->rx = conf->paper_width - conf->right_margin;
-	    cxref->ty = conf->paper_height - conf->top_margin
-		- ldata->ypos + ldata->line_height;
-	}
-	if (pdata->contents_entry) {
-	    assert(cxref != NULL);
-	    cxref->by = conf->paper_height - conf->top_margin
-		- ldata->ypos;
 	}
 
-	last_x = render_line(ldata, conf->left_margin,
-			     conf->paper_height - conf->top_margin,
-			     &dest, keywords, idx, conf);
-	if (ldata == pdata->last)
-	    break;
+	nextword:
+	text = text->next;
     }
+}
+
+/*
+ * Draw the things that go at the end of a paragraph, after its last
+ * line.
+ */
+static void render_para_end(para_data *pdata, int last_x, paper_conf *conf,
+			    paragraph *index_placeholder,
+			    page_data *index_page)
+{
+    para_data *target;
 
     /*
      * If this is a contents entry, add leaders and a page
@@ -2461,8 +2699,8 @@ static void render_para(para_data *pdata, paper_conf *conf,
 	if (pdata->contents_entry == index_placeholder) {
 	    num = index_page->number;
 	} else {
-	    assert(pdata->contents_entry->private_data);
-	    target = (para_data *)pdata->contents_entry->private_data;
+	    target = conf->paras[pdata->contents_entry->index];
+	    assert(target);
 	    num = target->first->page->number;
 	}
 
@@ -2503,6 +2741,7 @@ static void render_para(para_data *pdata, paper_conf *conf,
 			 conf->chapter_underline_thickness);
 	break;
       case RECT_RULE:
+	assert(pdata->first->page == pdata->last->page);
 	add_rect_to_page(pdata->first->page,
 			 conf->left_margin + pdata->first->xpos,
 			 (conf->paper_height - conf->top_margin -
@@ -2516,6 +2755,154 @@ static void render_para(para_data *pdata, paper_conf *conf,
     }
 }
 
+struct render_ctx {
+    render_page *pages;
+    paper_conf *conf;
+    keywordlist *keywords;
+    indexdata *idx;
+    paragraph *index_placeholder;
+    page_data *index_page;
+};
+
+static void render_page_job(void *vctx, int i)
+{
+    struct render_ctx *ctx = (struct render_ctx *)vctx;
+    render_page *rp = &ctx->pages[i];
+    paper_conf *conf = ctx->conf;
+    para_data *pdata = NULL, *target;
+    line_data *ldata;
+    xref *cxref = NULL;
+    xref_dest dest;
+    int j, last_x;
+
+    for (j = 0; j < rp->nlines; j++) {
+	ldata = rp->lines[j].ldata;
+
+	if (ldata->pdata != pdata) {
+	    pdata = ldata->pdata;
+	    cxref = NULL;
+	}
+
+	/*
+	 * If this is a contents entry, we expect to have a single
+	 * enormous cross-reference rectangle covering the whole
+	 * thing. (Unless, of course, it spans multiple pages.)
+	 */
+	if (pdata->contents_entry && !cxref) {
+	    cxref = snew(xref);
+	    cxref->next = NULL;
+	    cxref->dest.type = PAGE;
+	    if (pdata->contents_entry == ctx->index_placeholder) {
+		cxref->dest.page = ctx->index_page;
+	    } else {
+		target = conf->paras[pdata->contents_entry->index];
+		assert(target);
+		cxref->dest.page = target->first->page;
+	    }
+	    cxref->dest.url = NULL;
+	    if (rp->page->last_xref)
+		rp->page->last_xref->next = cxref;
+	    else
+		rp->page->first_xref = cxref;
+	    rp->page->last_xref = cxref;
+	    cxref->lx = conf->left_margin;
+	    cxref->rx = conf->paper_width - conf->right_margin;
+	    cxref->ty = conf->paper_height - conf->top_margin
+		- ldata->ypos + ldata->line_height;
+	}
+	if (pdata->contents_entry) {
+	    cxref->by = conf->paper_height - conf->top_margin
+		- ldata->ypos;
+	}
+
+	if (rp->lines[j].xref_start)
+	    find_xref_dest(rp->lines[j].xref_start, ctx->keywords, conf, &dest);
+	else
+	    dest.type = NONE;
+
+	last_x = render_line(ldata, conf->left_margin,
+			     conf->paper_height - conf->top_margin,
+			     &dest, ctx->keywords, ctx->idx, conf);
+
+	if (ldata == pdata->last)
+	    render_para_end(pdata, last_x, conf, ctx->index_placeholder,
+			    ctx->index_page);
+    }
+}
+
+/*
+ * Render a list of paragraphs, which must already have been broken
+ * into pages.
+ */
+static void render_paras(para_data *first, paper_conf *conf,
+			 keywordlist *keywords, indexdata *idx,
+			 paragraph *index_placeholder, page_data *index_page)
+{
+    struct render_ctx ctx;
+    render_page *rp = NULL;
+    int npages = 0, pagesize = 0;
+    para_data *pdata;
+    line_data *ldata;
+    word *xref_start;
+    int i;
+
+    for (pdata = first; pdata; pdata = pdata->next) {
+	xref_start = NULL;
+
+	assert(pdata->first);
+	for (ldata = pdata->first; ldata; ldata = ldata->next) {
+	    if (!npages || rp[npages-1].page != ldata->page) {
+		if (npages >= pagesize) {
+		    pagesize = npages * 3 / 2 + 16;
+		    rp = sresize(rp, pagesize, render_page);
+		}
+		rp[npages].page = ldata->page;
+		rp[npages].lines = NULL;
+		rp[npages].nlines = rp[npages].linesize = 0;
+		npages++;
+	    }
+	    if (rp[npages-1].nlines >= rp[npages-1].linesize) {
+		rp[npages-1].linesize = rp[npages-1].nlines * 3 / 2 + 16;
+		rp[npages-1].lines = sresize(rp[npages-1].lines,
+					     rp[npages-1].linesize,
+					     render_line_item);
+	    }
+	    rp[npages-1].lines[rp[npages-1].nlines].ldata = ldata;
+	    rp[npages-1].lines[rp[npages-1].nlines].xref_start = xref_start;
+	    rp[npages-1].nlines++;
+
+	    if (ldata->aux_text) {
+		word *auxref = NULL;
+		scan_text(ldata->page, pdata, ldata->aux_text, NULL,
+			  &auxref, keywords, idx, conf);
+		if (ldata->aux_text_2)
+		    scan_text(ldata->page, pdata, ldata->aux_text_2, NULL,
+			      &auxref, keywords, idx, conf);
+	    }
+	    if (ldata->first)
+		scan_text(ldata->page, pdata, ldata->first, ldata->end,
+			  &xref_start, keywords, idx, conf);
+
+	    if (ldata == pdata->last)
+		break;
+	}
+    }
+
+    ctx.pages = rp;
+    ctx.conf = conf;
+    ctx.keywords = keywords;
+    ctx.idx = idx;
+    ctx.index_placeholder = index_placeholder;
+    ctx.index_page = index_page;
+    run_jobs(npages, render_page_job, &ctx);
+
+    for (i = 0; i < npages; i++) {
+	emit_text(rp[i].page);
+	sfree(rp[i].lines);
+    }
+    sfree(rp);
+}
+
 static para_data *code_paragraph(int indent, word *words, paper_conf *conf)
 {
     para_data *pdata = snew(para_data);
@@ -2586,6 +2973,7 @@ static para_data *code_paragraph(int indent, word *words, paper_conf *conf)
 	    w->text[t-start] = '\0';
 	    w->breaks = false;
 	    w->aux = 0;
+	    w->index = -1;
 
 	    if (ltail)
 		ltail->next = w;
@@ -2760,6 +3148,7 @@ static word *fake_word(wchar_t *text)
     ret->text = ustrdup(text);
     ret->breaks = false;
     ret->aux = 0;
+    ret->index = -1;
     return ret;
 }
 
@@ -2772,20 +3161,22 @@ static word *fake_space_word(void)
     ret->text = NULL;
     ret->breaks = true;
     ret->aux = 0;
+    ret->index = -1;
     return ret;
 }
 
 static word *fake_page_ref(page_data *page)
 {
-    word *ret = snew(word);
-    ret->next = NULL;
-    ret->alt = NULL;
-    ret->type = word_PageXref;
-    ret->text = NULL;
-    ret->breaks = false;
-    ret->aux = 0;
-    ret->private_data = page;
-    return ret;
+    page_ref_word *ret = snew(page_ref_word);
+    ret->w.next = NULL;
+    ret->w.alt = NULL;
+    ret->w.type = word_PageXref;
+    ret->w.text = NULL;
+    ret->w.breaks = false;
+    ret->w.aux = 0;
+    ret->w.index = -1;
+    ret->page = page;
+    return &ret->w;
 }
 
 static word *fake_end_ref(void)
@@ -2797,6 +3188,7 @@ static word *fake_end_ref(void)
     ret->text = NULL;
     ret->breaks = false;
     ret->aux = 0;
+    ret->index = -1;
     return ret;
 }
 
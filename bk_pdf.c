@@ -19,8 +19,8 @@ struct object_Tag {
     object *next;
     int number;
     rdstringc main, stream;
-    int size, fileoff;
-    char *final;
+    int fileoff;
+    rope final;
 };
 
 struct objlist_Tag {
@@ -44,6 +44,185 @@ static int make_outline(object *parent, outline_element *start, int n,
 			bool open);
 static int pdf_versionid(FILE *fp, word *words);
 
+/*
+ * Write the content stream for a single page. This only looks at
+ * the page itself, so it can be done for many pages at once.
+ */
+static void pdf_page_contents(page_data *page, object *cstr)
+{
+    rect *r;
+    text_fragment *frag, *frag_end;
+    char buf[256];
+    int x, y, lx, ly;
+
+    /*
+     * Render any rectangles on the page.
+     */
+    for (r = page->first_rect; r; r = r->next) {
+	char buf[512];
+	sprintf(buf, "%g %g %g %g re f\n",
+		r->x / FUNITS_PER_PT, r->y / FUNITS_PER_PT,
+		r->w / FUNITS_PER_PT, r->h / FUNITS_PER_PT);
+	objstream(cstr, buf);
+    }
+
+    objstream(cstr, "BT\n");
+
+    /*
+     * PDF tracks two separate current positions: the position
+     * given in the `line matrix' and the position given in the
+     * `text matrix'. We must therefore track both as well.
+     * They start off at -1 (unset).
+     */
+    lx = ly = -1;
+    x = y = -1;
+
+    frag = page->first_text;
+    while (frag) {
+	/*
+	 * For compactness, I'm going to group text fragments
+	 * into subsequences that use the same font+size. So
+	 * first find the end of this subsequence.
+	 */
+	for (frag_end = frag;
+	     (frag_end &&
+	      frag_end->fe == frag->fe &&
+	      frag_end->fontsize == frag->fontsize);
+	     frag_end = frag_end->next);
+
+	/*
+	 * Now select the text fragment, and prepare to display
+	 * the text.
+	 */
+	objstream(cstr, "/");
+	objstream(cstr, frag->fe->name);
+	sprintf(buf, " %d Tf ", frag->fontsize);
+	objstream(cstr, buf);
+
+	while (frag && frag != frag_end) {
+	    /*
+	     * Place the text position for the first piece of
+	     * text.
+	     */
+	    if (lx < 0) {
+		sprintf(buf, "1 0 0 1 %g %g Tm ",
+			frag->x/FUNITS_PER_PT, frag->y/FUNITS_PER_PT);
+	    } else {
+		sprintf(buf, "%g %g Td ",
+			(frag->x - lx)/FUNITS_PER_PT,
+			(frag->y - ly)/FUNITS_PER_PT);
+	    }
+	    objstream(cstr, buf);
+	    lx = x = frag->x;
+	    ly = y = frag->y;
+
+	    /*
+	     * See if we're going to use Tj (show a single
+	     * string) or TJ (show an array of strings with
+	     * x-spacings between them). We determine this by
+	     * seeing if there's more than one text fragment in
+	     * sequence with the same y-coordinate.
+	     */
+	    if (frag->next && frag->next != frag_end &&
+		frag->next->y == y) {
+		/*
+		 * The TJ strategy.
+		 */
+		objstream(cstr, "[");
+		while (frag && frag != frag_end && frag->y == y) {
+		    if (frag->x != x) {
+			sprintf(buf, "%g",
+				(x - frag->x) * 1000.0 /
+				(FUNITS_PER_PT * frag->fontsize));
+			objstream(cstr, buf);
+		    }
+		    pdf_string(objstream, cstr, frag->text);
+		    x = frag->x + frag->width;
+		    frag = frag->next;
+		}
+		objstream(cstr, "]TJ\n");
+	    } else
+	    {
+		/*
+		 * The Tj strategy.
+		 */
+		pdf_string(objstream, cstr, frag->text);
+		objstream(cstr, "Tj\n");
+		frag = frag->next;
+	    }
+	}
+    }
+    objstream(cstr, "ET");
+}
+
+struct pdf_jobs {
+    page_data **pages;
+    object **cstrs;
+    object **objs;
+};
+
+static void pdf_page_job(void *vctx, int i)
+{
+    struct pdf_jobs *ctx = (struct pdf_jobs *)vctx;
+    pdf_page_contents(ctx->pages[i], ctx->cstrs[i]);
+}
+
+/*
+ * Assemble the final linear form of an object. Objects are
+ * independent of each other by now, so this too can be done for
+ * many at once.
+ */
+static void pdf_finish_object(void *vctx, int i)
+{
+    struct pdf_jobs *ctx = (struct pdf_jobs *)vctx;
+    object *o = ctx->objs[i];
+    rope *r = &o->final;
+    char text[80];
+    deflate_compress_ctx *zcontext;
+    void *zbuf;
+    int zlen;
+
+    sprintf(text, "%d 0 obj\n", o->number);
+    rope_addsc(r, text);
+
+    if (o->stream.text) {
+	if (!o->main.text)
+	    rdaddsc(&o->main, "<<\n");
+#ifdef PDF_NOCOMPRESS
+	zlen = o->stream.pos;
+	zbuf = snewn(zlen, char);
+	memcpy(zbuf, o->stream.text, zlen);
+	sprintf(text, "/Length %d\n>>\n", zlen);
+#else
+	zcontext = deflate_compress_new(DEFLATE_TYPE_ZLIB);
+	deflate_compress_data(zcontext, o->stream.text, o->stream.pos,
+			      DEFLATE_END_OF_DATA, &zbuf, &zlen);
+	deflate_compress_free(zcontext);
+	sprintf(text, "/Filter/FlateDecode\n/Length %d\n>>\n", zlen);
+#endif
+	rdaddsc(&o->main, text);
+    }
+
+    /*
+     * The dictionary and the compressed stream become pieces of
+     * the object's rope as they are, rather than being copied.
+     */
+    assert(o->main.text);
+    rope_adopt(r, o->main.text, o->main.pos);
+
+    if (o->main.pos > 0 && o->main.text[o->main.pos-1] != '\n')
+	rope_add(r, "\n", 1);
+
+    if (o->stream.text) {
+	rope_addsc(r, "stream\n");
+	rope_adopt(r, zbuf, zlen);
+	rope_addsc(r, "\nendstream\n");
+	sfree(o->stream.text);
+    }
+
+    rope_addsc(r, "endobj\n");
+}
+
 void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 		 indexdata *idx, void *vdoc, errorstate *es) {
     document *doc = (document *)vdoc;
@@ -55,7 +234,8 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
     paragraph *p;
     objlist olist;
     object *o, *info, *cat, *outlines, *pages, *resources, *mediabox;
-    int fileoff;
+    struct pdf_jobs jobs;
+    int fileoff, npages, i;
 
     IGNORE(keywords);
     IGNORE(idx);
@@ -429,14 +609,18 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
     make_pages_node(pages, NULL, doc->pages, NULL, resources, mediabox);
 
     /*
-     * Create and render the individual pages.
+     * Create the individual pages. Their content streams are filled
+     * in afterwards, since each one depends only on its own page
+     * and so they can all be written at once.
      */
-    for (page = doc->pages; page; page = page->next) {
+    npages = 0;
+    for (page = doc->pages; page; page = page->next)
+	npages++;
+    jobs.pages = snewn(npages, page_data *);
+    jobs.cstrs = snewn(npages, object *);
+
+    for (page = doc->pages, i = 0; page; page = page->next, i++) {
 	object *opage, *cstr;
-	rect *r;
-	text_fragment *frag, *frag_end;
-	char buf[256];
-	int x, y, lx, ly;
 
 	opage = (object *)page->spare;
 	/*
@@ -462,105 +646,8 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	objtext(opage, "/Contents ");
 	objref(opage, cstr);
 	objtext(opage, "\n");
-
-	/*
-	 * Render any rectangles on the page.
-	 */
-	for (r = page->first_rect; r; r = r->next) {
-	    char buf[512];
-	    sprintf(buf, "%g %g %g %g re f\n",
-		    r->x / FUNITS_PER_PT, r->y / FUNITS_PER_PT,
-		    r->w / FUNITS_PER_PT, r->h / FUNITS_PER_PT);
-	    objstream(cstr, buf);
-	}
-
-	objstream(cstr, "BT\n");
-
-	/*
-	 * PDF tracks two separate current positions: the position
-	 * given in the `line matrix' and the position given in the
-	 * `text matrix'. We must therefore track both as well.
-	 * They start off at -1 (unset).
-	 */
-	lx = ly = -1;
-	x = y = -1;
-
-	frag = page->first_text;
-	while (frag) {
-	    /*
-	     * For compactness, I'm going to group text fragments
-	     * into subsequences that use the same font+size. So
-	     * first find the end of this subsequence.
-	     */
-	    for (frag_end = frag;
-		 (frag_end &&
-		  frag_end->fe == frag->fe &&
-		  frag_end->fontsize == frag->fontsize);
-		 frag_end = frag_end->next);
-
-	    /*
-	     * Now select the text fragment, and prepare to display
-	     * the text.
-	     */
-	    objstream(cstr, "/");
-	    objstream(cstr, frag->fe->name);
-	    sprintf(buf, " %d Tf ", frag->fontsize);
-	    objstream(cstr, buf);
-
-	    while (frag && frag != frag_end) {
-		/*
-		 * Place the text position for the first piece of
-		 * text.
-		 */
-		if (lx < 0) {
-		    sprintf(buf, "1 0 0 1 %g %g Tm ",
-			    frag->x/FUNITS_PER_PT, frag->y/FUNITS_PER_PT);
-		} else {
-		    sprintf(buf, "%g %g Td ",
-			    (frag->x - lx)/FUNITS_PER_PT,
-			    (frag->y - ly)/FUNITS_PER_PT);
-		}
-		objstream(cstr, buf);
-		lx = x = frag->x;
-		ly = y = frag->y;
-
-		/*
-		 * See if we're going to use Tj (show a single
-		 * string) or TJ (show an array of strings with
-		 * x-spacings between them). We determine this by
-		 * seeing if there's more than one text fragment in
-		 * sequence with the same y-coordinate.
-		 */
-		if (frag->next && frag->next != frag_end &&
-		    frag->next->y == y) {
-		    /*
-		     * The TJ strategy.
-		     */
-		    objstream(cstr, "[");
-		    while (frag && frag != frag_end && frag->y == y) {
-			if (frag->x != x) {
-			    sprintf(buf, "%g",
-				    (x - frag->x) * 1000.0 /
-				    (FUNITS_PER_PT * frag->fontsize));
-			    objstream(cstr, buf);
-			}
-			pdf_string(objstream, cstr, frag->text);
-			x = frag->x + frag->width;
-			frag = frag->next;
-		    }
-		    objstream(cstr, "]TJ\n");
-		} else
-		{
-		    /*
-		     * The Tj strategy.
-		     */
-		    pdf_string(objstream, cstr, frag->text);
-		    objstream(cstr, "Tj\n");
-		    frag = frag->next;
-		}
-	    }
-	}
-	objstream(cstr, "ET");
+	jobs.pages[i] = page;
+	jobs.cstrs[i] = cstr;
 
 	/*
 	 * Also, we want an annotation dictionary containing the
@@ -598,6 +685,10 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
 	objtext(opage, ">>\n");
     }
 
+    run_jobs(npages, pdf_page_job, &jobs);
+    sfree(jobs.pages);
+    sfree(jobs.cstrs);
+
     /*
      * Set up the outlines dictionary.
      */
@@ -615,54 +706,11 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
     /*
      * Assemble the final linear form of every object.
      */
-    for (o = olist.head; o; o = o->next) {
-	rdstringc rs = {0, 0, NULL};
-	char text[80];
-	deflate_compress_ctx *zcontext;
-	void *zbuf;
-	int zlen;
-
-	sprintf(text, "%d 0 obj\n", o->number);
-	rdaddsc(&rs, text);
-
-	if (o->stream.text) {
-	    if (!o->main.text)
-		rdaddsc(&o->main, "<<\n");
-#ifdef PDF_NOCOMPRESS
-	    zlen = o->stream.pos;
-	    zbuf = snewn(zlen, char);
-	    memcpy(zbuf, o->stream.text, zlen);
-	    sprintf(text, "/Length %d\n>>\n", zlen);
-#else
-	    zcontext = deflate_compress_new(DEFLATE_TYPE_ZLIB);
-	    deflate_compress_data(zcontext, o->stream.text, o->stream.pos,
-				  DEFLATE_END_OF_DATA, &zbuf, &zlen);
-	    deflate_compress_free(zcontext);
-	    sprintf(text, "/Filter/FlateDecode\n/Length %d\n>>\n", zlen);
-#endif
-	    rdaddsc(&o->main, text);
-	}
-
-	assert(o->main.text);
-	rdaddsc(&rs, o->main.text);
-	sfree(o->main.text);
-
-	if (rs.text[rs.pos-1] != '\n')
-	    rdaddc(&rs, '\n');
-
-	if (o->stream.text) {
-	    rdaddsc(&rs, "stream\n");
-	    rdaddsn(&rs, zbuf, zlen);
-	    rdaddsc(&rs, "\nendstream\n");
-	    sfree(o->stream.text);
-	    sfree(zbuf);
-	}
-
-	rdaddsc(&rs, "endobj\n");
-
-	o->final = rs.text;
-	o->size = rs.pos;
-    }
+    jobs.objs = snewn(olist.number - 1, object *);
+    for (o = olist.head, i = 0; o; o = o->next, i++)
+	jobs.objs[i] = o;
+    run_jobs(olist.number - 1, pdf_finish_object, &jobs);
+    sfree(jobs.objs);
 
     /*
      * Write out the PDF file.
@@ -693,8 +741,9 @@ void pdf_backend(paragraph *sourceform, keywordlist *keywords,
      */
     for (o = olist.head; o; o = o->next) {
 	o->fileoff = fileoff;
-	fwrite(o->final, 1, o->size, fp);
-	fileoff += o->size;
+	rope_write(&o->final, fp);
+	fileoff += o->final.len;
+	rope_free(&o->final);
     }
 
     /*
@@ -744,8 +793,7 @@ object *new_object(objlist *list)
 	list->head = obj;
     list->tail = obj;
 
-    obj->size = 0;
-    obj->final = NULL;
+    obj->final = empty_rope;
 
     return obj;
 }
@@ -12,15 +12,112 @@
 /* Absolute maximum characters per line, for use in DSC comments */
 #define PS_MAXWIDTH 255
 
+/*
+ * PostScript is written through one of these: straight to the
+ * output file, or into a buffer if fp is NULL. Pages are put
+ * together in buffers, so that they can be done on worker threads
+ * and then written out in order.
+ */
+typedef struct psout {
+    FILE *fp;
+    rdstringc rs;
+    int cc;			       /* characters on current line */
+} psout;
+
 static void ps_comment(FILE *fp, char const *leader, word *words);
-static void ps_string_len(FILE *fp, int *cc, char const *str, int len);
-static void ps_string(FILE *fp, int *cc, char const *str);
+static int pso_printf(psout *po, char const *fmt, ...);
+static void pso_token(psout *po, char const *fmt, ...);
+static void pso_string_len(psout *po, char const *str, int len);
+static void pso_string(psout *po, char const *str);
 
 paragraph *ps_config_filename(char *filename)
 {
     return cmdline_cfg_simple("ps-filename", filename, NULL);
 }
 
+/*
+ * Put together the PostScript for one page. The column count starts
+ * afresh with each page, so the output is the same however many
+ * threads are doing this.
+ */
+static void ps_page(psout *po, page_data *page, int pageno)
+{
+    text_fragment *frag, *frag_end;
+    rect *r;
+    xref *xr;
+    font_encoding *fe;
+    int fs;
+
+    po->fp = NULL;
+    po->rs = empty_rdstringc;
+    po->cc = 0;
+
+    pso_printf(po, "%%%%Page: %d %d\n", pageno, pageno);
+    pso_token(po, "save %s p\n", (char *)page->spare);
+
+    for (xr = page->first_xref; xr; xr = xr->next) {
+	pso_token(po, "[%g %g %g %g]",
+		  xr->lx/FUNITS_PER_PT, xr->by/FUNITS_PER_PT,
+		  xr->rx/FUNITS_PER_PT, xr->ty/FUNITS_PER_PT);
+	if (xr->dest.type == PAGE) {
+	    pso_token(po, "%s x\n", (char *)xr->dest.page->spare);
+	} else {
+	    pso_string(po, xr->dest.url);
+	    pso_token(po, "u\n");
+	}
+    }
+
+    for (r = page->first_rect; r; r = r->next) {
+	pso_token(po, "%g %g %g %g r\n",
+		  r->x / FUNITS_PER_PT, r->y / FUNITS_PER_PT,
+		  r->w / FUNITS_PER_PT, r->h / FUNITS_PER_PT);
+    }
+
+    frag = page->first_text;
+    fe = NULL;
+    fs = -1;
+    while (frag) {
+	/*
+	 * Collect all the adjacent text fragments with the
+	 * same y-coordinate.
+	 */
+	for (frag_end = frag;
+	     frag_end && frag_end->y == frag->y;
+	     frag_end = frag_end->next);
+
+	pso_token(po, "%g[", frag->y / FUNITS_PER_PT);
+
+	while (frag && frag != frag_end) {
+
+	    if (frag->fe != fe || frag->fontsize != fs)
+		pso_token(po, "[%s %d]",
+			  frag->fe->name, frag->fontsize);
+	    fe = frag->fe;
+	    fs = frag->fontsize;
+
+	    pso_token(po, "%g", frag->x/FUNITS_PER_PT);
+	    pso_string(po, frag->text);
+
+	    frag = frag->next;
+	}
+
+	pso_token(po, "]t\n");
+    }
+
+    pso_token(po, "restore showpage\n");
+}
+
+struct ps_pagejobs {
+    page_data **pages;
+    psout *out;
+};
+
+static void ps_page_job(void *vctx, int i)
+{
+    struct ps_pagejobs *ctx = (struct ps_pagejobs *)vctx;
+    ps_page(&ctx->out[i], ctx->pages[i], i + 1);
+}
+
 void ps_backend(paragraph *sourceform, keywordlist *keywords,
 		indexdata *idx, void *vdoc, errorstate *es) {
     document *doc = (document *)vdoc;
@@ -32,8 +129,9 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
     char *filename;
     paragraph *p;
     outline_element *oe;
-    int noe;
-    int cc; /* Character count on current line */
+    int noe, npages, i;
+    psout po;
+    struct ps_pagejobs jobs;
 
     IGNORE(keywords);
     IGNORE(idx);
@@ -61,9 +159,9 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
     fprintf(fp, "%%%%Creator: Halibut, %s\n", version);
     fprintf(fp, "%%%%DocumentData: Clean7Bit\n");
     fprintf(fp, "%%%%LanguageLevel: 1\n");
-    for (pageno = 0, page = doc->pages; page; page = page->next)
-	pageno++;
-    fprintf(fp, "%%%%Pages: %d\n", pageno);
+    for (npages = 0, page = doc->pages; page; page = page->next)
+	npages++;
+    fprintf(fp, "%%%%Pages: %d\n", npages);
     for (p = sourceform; p; p = p->next)
 	if (p->type == para_Title)
 	    ps_comment(fp, "%%Title: ", p->words);
@@ -160,30 +258,31 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
 	if (p->type == para_VersionID)
 	    ps_comment(fp, "% ", p->words);
 
-    cc = 0;
+    po.fp = fp;
+    po.cc = 0;
     /*
      * Request the correct page size.  We might want to bracket this
      * with "%%BeginFeature: *PageSize A4" or similar, and "%%EndFeature",
      * but that would require us to have a way of getting the name of
      * the page size given its dimensions.
      */
-    ps_token(fp, &cc, "/setpagedevice where {\n");
-    ps_token(fp, &cc, "  pop 2 dict dup /PageSize [%g %g] put setpagedevice\n",
+    pso_token(&po, "/setpagedevice where {\n");
+    pso_token(&po, "  pop 2 dict dup /PageSize [%g %g] put setpagedevice\n",
 	     doc->paper_width / FUNITS_PER_PT,
 	     doc->paper_height / FUNITS_PER_PT);
-    ps_token(fp, &cc, "} if\n");
+    pso_token(&po, "} if\n");
 
-    ps_token(fp, &cc, "[/PageMode/UseOutlines/DOCVIEW m\n");
+    pso_token(&po, "[/PageMode/UseOutlines/DOCVIEW m\n");
     noe = doc->n_outline_elements;
     for (oe = doc->outline_elements; noe; oe++, noe--) {
 	char *title;
-	int titlelen, count, i;
+	int titlelen, count;
 
 	title = pdf_outline_convert(oe->pdata->outline_title, &titlelen);
 	if (oe->level == 0) {
-	    ps_token(fp, &cc, "[/Title");
-	    ps_string_len(fp, &cc, title, titlelen);
-	    ps_token(fp, &cc, "/DOCINFO m\n");
+	    pso_token(&po, "[/Title");
+	    pso_string_len(&po, title, titlelen);
+	    pso_token(&po, "/DOCINFO m\n");
 	}
 
 	count = 0;
@@ -192,9 +291,9 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
 		count++;
 	if (oe->level > 0) count = -count;
 
-	ps_string_len(fp, &cc, title, titlelen);
+	pso_string_len(&po, title, titlelen);
 	sfree(title);
-	ps_token(fp, &cc, "%s %d o\n",
+	pso_token(&po, "%s %d o\n",
 		(char *)oe->pdata->first->page->spare, count);
     }
 
@@ -219,91 +318,38 @@ void ps_backend(paragraph *sourceform, keywordlist *keywords,
     font_index = 0;
     for (fe = doc->fonts->head; fe; fe = fe->next) {
 	char fname[40];
-	int i;
 
 	sprintf(fname, "f%d", font_index++);
 	fe->name = dupstr(fname);
 
-	ps_token(fp, &cc, "/%s findfont dup length dict begin\n",
+	pso_token(&po, "/%s findfont dup length dict begin\n",
 	    fe->font->info->name);
-	ps_token(fp, &cc, "{1 index /FID ne {def} {pop pop} ifelse} forall\n");
-	ps_token(fp, &cc, "/Encoding [\n");
+	pso_token(&po, "{1 index /FID ne {def} {pop pop} ifelse} forall\n");
+	pso_token(&po, "/Encoding [\n");
 	for (i = 0; i < 256; i++)
-	    ps_token(fp, &cc, "/%s", glyph_extern(doc->psd, fe->vector[i]));
-	ps_token(fp, &cc, "] def\n");
-	ps_token(fp, &cc, "currentdict end\n");
-	ps_token(fp, &cc, "/fontname-%s exch definefont /%s exch def\n",
+	    pso_token(&po, "/%s", glyph_extern(doc->psd, fe->vector[i]));
+	pso_token(&po, "] def\n");
+	pso_token(&po, "currentdict end\n");
+	pso_token(&po, "/fontname-%s exch definefont /%s exch def\n",
 		 fe->name, fe->name);
     }
     fprintf(fp, "%%%%EndSetup\n");
 
     /*
-     * Output the text and graphics.
+     * Output the text and graphics. Each page depends only on what's
+     * on it, so they can all be put together at once.
      */
-    pageno = 0;
-    for (page = doc->pages; page; page = page->next) {
-	text_fragment *frag, *frag_end;
-	rect *r;
-	xref *xr;
-	font_encoding *fe;
-	int fs;
-
-	pageno++;
-	fprintf(fp, "%%%%Page: %d %d\n", pageno, pageno);
-	cc = 0;
-	ps_token(fp, &cc, "save %s p\n", (char *)page->spare);
-	
-	for (xr = page->first_xref; xr; xr = xr->next) {
-	    ps_token(fp, &cc, "[%g %g %g %g]",
-		    xr->lx/FUNITS_PER_PT, xr->by/FUNITS_PER_PT,
-		    xr->rx/FUNITS_PER_PT, xr->ty/FUNITS_PER_PT);
-	    if (xr->dest.type == PAGE) {
-		ps_token(fp, &cc, "%s x\n", (char *)xr->dest.page->spare);
-	    } else {
-		ps_string(fp, &cc, xr->dest.url);
-		ps_token(fp, &cc, "u\n");
-	    }
-	}
-
-	for (r = page->first_rect; r; r = r->next) {
-	    ps_token(fp, &cc, "%g %g %g %g r\n",
-		    r->x / FUNITS_PER_PT, r->y / FUNITS_PER_PT,
-		    r->w / FUNITS_PER_PT, r->h / FUNITS_PER_PT);
-	}
-
-	frag = page->first_text;
-	fe = NULL;
-	fs = -1;
-	while (frag) {
-	    /*
-	     * Collect all the adjacent text fragments with the
-	     * same y-coordinate.
-	     */
-	    for (frag_end = frag;
-		 frag_end && frag_end->y == frag->y;
-		 frag_end = frag_end->next);
-
-	    ps_token(fp, &cc, "%g[", frag->y / FUNITS_PER_PT);
-
-	    while (frag && frag != frag_end) {
-
-		if (frag->fe != fe || frag->fontsize != fs)
-		    ps_token(fp, &cc, "[%s %d]",
-			     frag->fe->name, frag->fontsize);
-		fe = frag->fe;
-		fs = frag->fontsize;
-
-		ps_token(fp, &cc, "%g", frag->x/FUNITS_PER_PT);
-		ps_string(fp, &cc, frag->text);
-
-		frag = frag->next;
-	    }
-
-	    ps_token(fp, &cc, "]t\n");
-	}
-
-	ps_token(fp, &cc, "restore showpage\n");
+    jobs.pages = snewn(npages, page_data *);
+    jobs.out = snewn(npages, psout);
+    for (i = 0, page = doc->pages; page; page = page->next, i++)
+	jobs.pages[i] = page;
+    run_jobs(npages, ps_page_job, &jobs);
+    for (i = 0; i < npages; i++) {
+	fwrite(jobs.out[i].rs.text, 1, jobs.out[i].rs.pos, fp);
+	sfree(jobs.out[i].rs.text);
     }
+    sfree(jobs.pages);
+    sfree(jobs.out);
 
     fprintf(fp, "%%%%EOF\n");
 
@@ -357,21 +403,89 @@ static void ps_comment(FILE *fp, char const *leader, word *words) {
     fprintf(fp, "\n");
 }
 
-void ps_token(FILE *fp, int *cc, char const *fmt, ...) {
+/*
+ * Formatted output to a psout, returning the number of characters
+ * written. Output to a buffer goes straight into the space at the
+ * end if it fits, and otherwise the buffer is made big enough and
+ * it's written again.
+ */
+static int pso_vprintf(psout *po, char const *fmt, va_list ap)
+{
+    rdstringc *rs = &po->rs;
+    va_list ap2;
+    int len, room;
+
+    if (po->fp)
+	return vfprintf(po->fp, fmt, ap);
+
+    room = rs->size - rs->pos;
+    va_copy(ap2, ap);
+    len = vsnprintf(room > 0 ? rs->text + rs->pos : NULL,
+		    room > 0 ? room : 0, fmt, ap2);
+    va_end(ap2);
+    if (len <= 0)
+	return 0;
+    if (len >= room) {
+	rdaddc_rep(rs, ' ', len);      /* make room, including for the NUL */
+	rs->pos -= len;
+	vsnprintf(rs->text + rs->pos, len + 1, fmt, ap);
+    }
+    rs->pos += len;
+    return len;
+}
+
+static int pso_printf(psout *po, char const *fmt, ...)
+{
     va_list ap;
+    int len;
 
     va_start(ap, fmt);
-    if (*cc >= PS_WIDTH - 10) {
-	fprintf(fp, "\n");
-	*cc = 0;
+    len = pso_vprintf(po, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+static void pso_putc(psout *po, char c)
+{
+    if (po->fp)
+	fputc(c, po->fp);
+    else
+	rdaddc(&po->rs, c);
+}
+
+static void pso_vtoken(psout *po, char const *fmt, va_list ap)
+{
+    if (po->cc >= PS_WIDTH - 10) {
+	pso_putc(po, '\n');
+	po->cc = 0;
     }
-    *cc += vfprintf(fp, fmt, ap);
+    po->cc += pso_vprintf(po, fmt, ap);
     /* Assume that \n only occurs at the end of a string */
     if (fmt[strlen(fmt) - 1] == '\n')
-	*cc = 0;
+	po->cc = 0;
+}
+
+static void pso_token(psout *po, char const *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    pso_vtoken(po, fmt, ap);
+    va_end(ap);
+}
+
+void ps_token(FILE *fp, int *cc, char const *fmt, ...) {
+    psout po;
+    va_list ap;
+
+    po.fp = fp;
+    po.cc = *cc;
+    va_start(ap, fmt);
+    pso_vtoken(&po, fmt, ap);
+    va_end(ap);
+    *cc = po.cc;
 }
 
-static void ps_string_len(FILE *fp, int *cc, char const *str, int len) {
+static void pso_string_len(psout *po, char const *str, int len) {
     char const *c;
     int score = 0;
 
@@ -384,33 +498,36 @@ static void ps_string_len(FILE *fp, int *cc, char const *str, int len) {
 	    score -= 1;
     }
     if (score > 0) {
-	ps_token(fp, cc, "<");
+	pso_token(po, "<");
 	for (c = str; c < str+len; c++) {
-	    ps_token(fp, cc, "%02X", 0xFF & (int)*c);
+	    pso_token(po, "%02X", 0xFF & (int)*c);
 	}
-	ps_token(fp, cc, ">");
+	pso_token(po, ">");
     } else {
-	*cc += fprintf(fp, "(");
+	pso_putc(po, '(');
+	po->cc++;
 	for (c = str; c < str+len; c++) {
-	    if (*cc >= PS_WIDTH - 4) {
-		fprintf(fp, "\\\n");
-		*cc = 0;
+	    if (po->cc >= PS_WIDTH - 4) {
+		pso_putc(po, '\\');
+		pso_putc(po, '\n');
+		po->cc = 0;
 	    }
 	    if (*c < ' ' || *c > '~') {
-		*cc += fprintf(fp, "\\%03o", 0xFF & (int)*c);
+		po->cc += pso_printf(po, "\\%03o", 0xFF & (int)*c);
 	    } else {
 		if (*c == '(' || *c == ')' || *c == '\\') {
-		    fputc('\\', fp);
-		    (*cc)++;
+		    pso_putc(po, '\\');
+		    po->cc++;
 		}
-		fputc(*c, fp);
-		(*cc)++;
+		pso_putc(po, *c);
+		po->cc++;
 	    }
 	}
-	*cc += fprintf(fp, ")");
+	pso_putc(po, ')');
+	po->cc++;
     }
 }
 
-static void ps_string(FILE *fp, int *cc, char const *str) {
-    ps_string_len(fp, cc, str, strlen(str));
+static void pso_string(psout *po, char const *str) {
+    pso_string_len(po, str, strlen(str));
 }
@@ -30,10 +30,18 @@ typedef struct {
     wchar_t *listsuffix, *startemph, *endemph, *startstrong, *endstrong;
 } textconfig;
 
+/*
+ * Output is gathered in `out' and written to `fp' in large blocks.
+ * If `fp' is NULL, it is all kept in `out' instead.
+ */
+#define TEXT_BUFSIZE 65536
+
 typedef struct {
     FILE *fp;
+    rdstringc out;
     int charset;
     charset_state state;
+    bool ascii;			       /* ASCII can be copied straight out */
     errorstate *es;
 } textfile;
 
@@ -45,8 +53,12 @@ static void text_para(textfile *, word *, wchar_t *, word *, int, int, int,
 static void text_codepara(textfile *, word *, int, int);
 static void text_versionid(textfile *, word *, textconfig *);
 
+static void text_format(textfile *, paragraph *, textconfig *);
+static void text_setup(textfile *, FILE *, int, errorstate *);
 static void text_output(textfile *, const wchar_t *);
 static void text_output_many(textfile *, int, wchar_t);
+static void text_output_fill(textfile *, const wchar_t *, int);
+static void text_finish(textfile *);
 
 static alignment utoalign(wchar_t *p) {
     if (!ustricmp(p, L"centre") || !ustricmp(p, L"center"))
@@ -321,14 +333,9 @@ paragraph *text_config_filename(char *filename)
 
 void text_backend(paragraph *sourceform, keywordlist *keywords,
 		  indexdata *idx, void *unused, errorstate *es) {
-    paragraph *p;
     textconfig conf;
-    word *prefix, *body, *wp;
-    word spaceword;
     textfile tf;
-    wchar_t *prefixextra;
-    int nesting, nestbase, nestindent;
-    int indentb, indenta;
+    FILE *fp;
 
     IGNORE(unused);
     IGNORE(keywords);		       /* we don't happen to need this */
@@ -340,25 +347,67 @@ void text_backend(paragraph *sourceform, keywordlist *keywords,
      * Open the output file.
      */
     if (!strcmp(conf.filename, "-"))
-	tf.fp = stdout;
+	fp = stdout;
     else
-	tf.fp = fopen(conf.filename, "w");
-    if (!tf.fp) {
+	fp = fopen(conf.filename, "w");
+    if (!fp) {
 	err_cantopenw(es, conf.filename);
 	return;
     }
-    tf.charset = conf.charset;
-    tf.es = es;
-    tf.state = charset_init_state;
+
+    text_setup(&tf, fp, conf.charset, es);
+    text_format(&tf, sourceform, &conf);
+    text_finish(&tf);
+
+    /*
+     * Tidy up
+     */
+    if (fp != stdout)
+	fclose(fp);
+    sfree(conf.asect);
+    sfree(conf.filename);
+}
+
+/*
+ * Format the document as plain text in memory, without writing it
+ * anywhere, and return it (NUL-terminated) along with its length.
+ * This is the whole of the text backend minus the file I/O, which
+ * makes it convenient for timing the formatter on its own.
+ */
+char *text_backend_to_memory(paragraph *sourceform, int *len,
+			     errorstate *es) {
+    textconfig conf;
+    textfile tf;
+
+    conf = text_configure(sourceform, es);
+    text_setup(&tf, NULL, conf.charset, es);
+    text_format(&tf, sourceform, &conf);
+    text_finish(&tf);
+
+    sfree(conf.asect);
+    sfree(conf.filename);
+
+    *len = tf.out.pos;
+    return tf.out.text;
+}
+
+static void text_format(textfile *tf, paragraph *sourceform,
+			textconfig *cfg) {
+    paragraph *p;
+    word *prefix, *body, *wp;
+    word spaceword;
+    wchar_t *prefixextra;
+    int nesting, nestbase, nestindent;
+    int indentb, indenta;
 
     /* Do the title */
     for (p = sourceform; p; p = p->next)
 	if (p->type == para_Title)
-	    text_heading(&tf, NULL, NULL, p->words,
-			 conf.atitle, conf.indent, conf.width, &conf);
+	    text_heading(tf, NULL, NULL, p->words,
+			 cfg->atitle, cfg->indent, cfg->width, cfg);
 
-    nestindent = conf.listindentbefore + conf.listindentafter;
-    nestbase = (conf.indent_preambles ? 0 : -conf.indent);
+    nestindent = cfg->listindentbefore + cfg->listindentafter;
+    nestbase = (cfg->indent_preambles ? 0 : -cfg->indent);
     nesting = nestbase;
 
     /* Do the main document */
@@ -398,20 +447,20 @@ void text_backend(paragraph *sourceform, keywordlist *keywords,
       case para_Chapter:
       case para_Appendix:
       case para_UnnumberedChapter:
-	text_heading(&tf, p->kwtext, p->kwtext2, p->words,
-		     conf.achapter, conf.indent, conf.width, &conf);
+	text_heading(tf, p->kwtext, p->kwtext2, p->words,
+		     cfg->achapter, cfg->indent, cfg->width, cfg);
 	nesting = 0;
 	break;
 
       case para_Heading:
       case para_Subsect:
-	text_heading(&tf, p->kwtext, p->kwtext2, p->words,
-		     conf.asect[p->aux>=conf.nasect ? conf.nasect-1 : p->aux],
-		     conf.indent, conf.width, &conf);
+	text_heading(tf, p->kwtext, p->kwtext2, p->words,
+		     cfg->asect[p->aux>=cfg->nasect ? cfg->nasect-1 : p->aux],
+		     cfg->indent, cfg->width, cfg);
 	break;
 
       case para_Rule:
-	text_rule(&tf, conf.indent + nesting, conf.width - nesting, &conf);
+	text_rule(tf, cfg->indent + nesting, cfg->width - nesting, cfg);
 	break;
 
       case para_Normal:
@@ -422,20 +471,20 @@ void text_backend(paragraph *sourceform, keywordlist *keywords,
       case para_Bullet:
       case para_NumberedList:
 	if (p->type == para_Bullet) {
-	    prefix = &conf.bullet;
+	    prefix = &cfg->bullet;
 	    prefixextra = NULL;
-	    indentb = conf.listindentbefore;
-	    indenta = conf.listindentafter;
+	    indentb = cfg->listindentbefore;
+	    indenta = cfg->listindentafter;
 	} else if (p->type == para_NumberedList) {
 	    prefix = p->kwtext;
-	    prefixextra = conf.listsuffix;
-	    indentb = conf.listindentbefore;
-	    indenta = conf.listindentafter;
+	    prefixextra = cfg->listsuffix;
+	    indentb = cfg->listindentbefore;
+	    indenta = cfg->listindentafter;
 	} else if (p->type == para_Description) {
 	    prefix = NULL;
 	    prefixextra = NULL;
-	    indentb = conf.listindentbefore;
-	    indenta = conf.listindentafter;
+	    indentb = cfg->listindentbefore;
+	    indenta = cfg->listindentafter;
 	} else {
 	    prefix = NULL;
 	    prefixextra = NULL;
@@ -453,9 +502,9 @@ void text_backend(paragraph *sourceform, keywordlist *keywords,
 	    wp = NULL;
 	    body = p->words;
 	}
-	text_para(&tf, prefix, prefixextra, body,
-		  conf.indent + nesting + indentb, indenta,
-		  conf.width - nesting - indentb - indenta, &conf);
+	text_para(tf, prefix, prefixextra, body,
+		  cfg->indent + nesting + indentb, indenta,
+		  cfg->width - nesting - indentb - indenta, cfg);
 	if (wp) {
 	    wp->next = NULL;
 	    free_word_list(body);
@@ -463,61 +512,20 @@ void text_backend(paragraph *sourceform, keywordlist *keywords,
 	break;
 
       case para_Code:
-	text_codepara(&tf, p->words,
-		      conf.indent + nesting + conf.indent_code,
-		      conf.width - nesting - 2 * conf.indent_code);
+	text_codepara(tf, p->words,
+		      cfg->indent + nesting + cfg->indent_code,
+		      cfg->width - nesting - 2 * cfg->indent_code);
 	break;
     }
 
     /* Do the version ID */
-    if (conf.include_version_id) {
+    if (cfg->include_version_id) {
 	for (p = sourceform; p; p = p->next)
 	    if (p->type == para_VersionID)
- 		text_versionid(&tf, p->words, &conf);
-    }
-
-    /*
-     * Tidy up
-     */
-    text_output(&tf, NULL);	       /* end charset conversion */
-    if (tf.fp != stdout)
-	fclose(tf.fp);
-    sfree(conf.asect);
-    sfree(conf.filename);
-}
-
-static void text_output(textfile *tf, const wchar_t *s)
-{
-    char buf[256];
-    int ret, len;
-    const wchar_t **sp;
-
-    if (!s) {
-	sp = NULL;
-	len = 1;
-    } else {
-	sp = &s;
-	len = ustrlen(s);
-    }
-
-    while (len > 0) {
-	ret = charset_from_unicode(sp, &len, buf, lenof(buf),
-				   tf->charset, &tf->state, NULL);
-	if (!sp)
-	    len = 0;
-	fwrite(buf, 1, ret, tf->fp);
+ 		text_versionid(tf, p->words, cfg);
     }
 }
 
-static void text_output_many(textfile *tf, int n, wchar_t c)
-{
-    wchar_t s[2];
-    s[0] = c;
-    s[1] = L'\0';
-    while (n-- > 0)
-	text_output(tf, s);
-}
-
 static void text_rdaddw(rdstring *rs, word *text, word *end, textconfig *cfg) {
     for (; text && text != end; text = text->next) switch (text->type) {
       case word_HyperLink:
@@ -709,10 +717,7 @@ static void text_heading(textfile *tf, word *tprefix, word *nprefix,
 	text_output(tf, L"\n");
 	if (*align.underline) {
 	    text_output_many(tf, margin, L' ');
-	    while (length > 0) {
-		text_output(tf, align.underline);
-		length -= ustrwid(align.underline, cfg->charset);
-	    }
+	    text_output_fill(tf, align.underline, length);
 	    text_output(tf, L"\n");
 	}
 	if (align.align == LEFTPLUS)
@@ -730,10 +735,7 @@ static void text_heading(textfile *tf, word *tprefix, word *nprefix,
 
 static void text_rule(textfile *tf, int indent, int width, textconfig *cfg) {
     text_output_many(tf, indent, L' ');
-    while (width > 0) {
-	text_output(tf, cfg->rule);
-	width -= ustrwid(cfg->rule, cfg->charset);
-    }
+    text_output_fill(tf, cfg->rule, width);
     text_output_many(tf, 2, L'\n');
 }
 
@@ -806,3 +808,280 @@ static void text_versionid(textfile *tf, word *text, textconfig *cfg) {
     text_output(tf, t.text);
     sfree(t.text);
 }
+
+static void text_setup(textfile *tf, FILE *fp, int charset, errorstate *es)
+{
+    static const wchar_t printable[] =
+	L" !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	L"[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~\n";
+    const wchar_t *wp = printable;
+    int len = lenof(printable) - 1;
+    char buf[lenof(printable)];
+    charset_state state = CHARSET_INIT_STATE;
+    int i, ret;
+
+    tf->fp = fp;
+    tf->out = empty_rdstringc;
+    tf->charset = charset;
+    tf->state = charset_init_state;
+    tf->es = es;
+
+    /*
+     * Find out whether this charset writes printable ASCII as
+     * itself, without leaving its initial state. If so (as UTF-8
+     * and all the single-byte charsets do) then whenever we're in
+     * that state, ASCII text can be copied straight into the output
+     * buffer.
+     */
+    ret = charset_from_unicode(&wp, &len, buf, lenof(buf),
+			       charset, &state, NULL);
+    tf->ascii = (len == 0 && ret == lenof(printable) - 1 &&
+		 state.s0 == 0 && state.s1 == 0);
+    for (i = 0; tf->ascii && i < ret; i++)
+	if ((unsigned char)buf[i] != printable[i])
+	    tf->ascii = false;
+}
+
+static bool text_in_ascii(textfile *tf)
+{
+    return tf->ascii && tf->state.s0 == 0 && tf->state.s1 == 0;
+}
+
+/*
+ * Write out what's in the output buffer, if we have a file and the
+ * buffer has got big enough (or `all' is set).
+ */
+static void text_flush(textfile *tf, bool all)
+{
+    if (tf->fp && tf->out.pos > 0 && (all || tf->out.pos >= TEXT_BUFSIZE)) {
+	fwrite(tf->out.text, 1, tf->out.pos, tf->fp);
+	tf->out.pos = 0;
+    }
+}
+
+/*
+ * Make sure there's room for `len' more bytes (and a NUL) in the
+ * output buffer.
+ */
+static void text_reserve(textfile *tf, int len)
+{
+    rdstringc *out = &tf->out;
+
+    if (out->size - out->pos <= len) {
+	out->size = (out->pos + len) * 3 / 2 + 128;
+	out->text = sresize(out->text, out->size, char);
+    }
+}
+
+static void text_output(textfile *tf, const wchar_t *s)
+{
+    rdstringc *out = &tf->out;
+    int ret, len;
+    const wchar_t **sp;
+
+    if (!s) {
+	sp = NULL;
+	len = 1;
+    } else {
+	if (text_in_ascii(tf)) {
+	    /*
+	     * Copy any ASCII at the start of the string straight in.
+	     */
+	    const wchar_t *e;
+	    char *q;
+
+	    for (e = s; *e && *e < 0x80; e++);
+	    if (e > s) {
+		text_reserve(tf, e - s);
+		for (q = out->text + out->pos; s < e; s++)
+		    *q++ = (char)*s;
+		*q = '\0';
+		out->pos = q - out->text;
+	    }
+	}
+	sp = &s;
+	len = ustrlen(s);
+    }
+
+    /*
+     * Convert anything else through the charset library, directly
+     * into the spare room at the end of the buffer.
+     */
+    while (len > 0) {
+	text_reserve(tf, 256);
+	ret = charset_from_unicode(sp, &len, out->text + out->pos,
+				   out->size - out->pos - 1,
+				   tf->charset, &tf->state, NULL);
+	if (!sp)
+	    len = 0;
+	out->pos += ret;
+	out->text[out->pos] = '\0';
+    }
+
+    text_flush(tf, false);
+}
+
+static void text_output_many(textfile *tf, int n, wchar_t c)
+{
+    wchar_t s[2];
+
+    if (n > 0 && c < 0x80 && text_in_ascii(tf)) {
+	rdaddc_rep(&tf->out, (char)c, n);
+	text_flush(tf, false);
+	return;
+    }
+
+    s[0] = c;
+    s[1] = L'\0';
+    while (n-- > 0)
+	text_output(tf, s);
+}
+
+/*
+ * Output as many copies of `s' as it takes to fill `width' columns,
+ * for an underline or a horizontal rule.
+ */
+static void text_output_fill(textfile *tf, const wchar_t *s, int width)
+{
+    if (s[0] && !s[1] && ustrwid(s, tf->charset) == 1) {
+	text_output_many(tf, width, s[0]);
+	return;
+    }
+
+    while (width > 0) {
+	text_output(tf, s);
+	width -= ustrwid(s, tf->charset);
+    }
+}
+
+/*
+ * End charset conversion, and write out whatever is left in the
+ * buffer (or leave it there, if we aren't writing to a file).
+ */
+static void text_finish(textfile *tf)
+{
+    text_output(tf, NULL);
+    text_flush(tf, true);
+    if (tf->fp) {
+	sfree(tf->out.text);
+	tf->out = empty_rdstringc;
+    }
+}
+
+#ifdef TEST
+
+/*
+ * Timing harness for the text formatter. This reads and prepares
+ * the input files the same way main.c does, and then formats the
+ * document into memory with text_backend_to_memory() a number of
+ * times over, reporting how long that took. Since nothing is
+ * written out, the times are for the formatter and the charset
+ * conversion alone.
+ *
+ * Build it by compiling this file with TEST defined, and linking it
+ * with the rest of Halibut apart from main.c. For instance, after a
+ * CMake build in a directory `build':
+ *
+ *   cc -O2 -DTEST -I. -Icharset -c bk_text.c -o texttest.o
+ *   cc -o texttest texttest.o $(find build/CMakeFiles/halibut.dir \
+ *      -name '*.o' ! -name main.c.o ! -name bk_text.c.o) \
+ *      build/charset/libcharset.a -lpthread
+ *
+ * and run it as `texttest [-n<runs>] file.but...'. Any \cfg{text-*}
+ * directives in the input files apply as usual.
+ */
+
+#include <string.h>
+#include <time.h>
+
+/* From paper.h, which can't be included alongside this file. */
+psdata *psdata_new(void);
+void psdata_free(psdata *);
+
+int main(int argc, char **argv) {
+    input in;
+    paragraph *sourceform, *p;
+    indexdata *idx;
+    keywordlist *keywords;
+    psdata *psd;
+    errorstate es[1];
+    char **infiles, *text;
+    int nfiles = 0, runs = 20, run, len = 0, i;
+    double t, best = 0, total = 0;
+    clock_t start;
+
+    es->fatal = false;
+    es->deferred = NULL;
+
+    infiles = snewn(argc, char *);
+    for (i = 1; i < argc; i++) {
+	if (!strncmp(argv[i], "-n", 2) && atoi(argv[i] + 2) > 0)
+	    runs = atoi(argv[i] + 2);
+	else
+	    infiles[nfiles++] = argv[i];
+    }
+    if (nfiles == 0) {
+	fprintf(stderr, "usage: texttest [-n<runs>] file.but...\n");
+	return 1;
+    }
+
+    in.filenames = infiles;
+    in.nfiles = nfiles;
+    in.currfp = NULL;
+    in.currindex = 0;
+    in.npushback = in.pushbacksize = 0;
+    in.pushback = NULL;
+    in.reportcols = false;
+    in.stack = NULL;
+    in.nstack = in.stacksize = 0;
+    in.pushbase = 0;
+    in.defcharset = CS_ASCII;
+    in.es = es;
+
+    idx = make_index();
+    psd = psdata_new();
+    sourceform = read_input(&in, idx, psd);
+    if (es->fatal || !sourceform)
+	return 1;
+    sfree(in.pushback);
+
+    keywords = get_keywords(sourceform, es);
+    if (!keywords)
+	return 1;
+    gen_citations(sourceform, keywords, es);
+    subst_keywords(sourceform, keywords, es);
+    for (p = sourceform; p; p = p->next)
+	if (p->type == para_IM)
+	    index_merge(idx, true, p->keyword, p->words, &p->fpos, es);
+    build_index(idx);
+    for (p = sourceform; p; p = p->next)
+	mark_attr_ends(p->words);
+    {
+	indexentry *entry;
+
+	for (i = 0; (entry = index234(idx->entries, i)) != NULL; i++)
+	    mark_attr_ends(entry->text);
+    }
+    number_document(sourceform);
+
+    for (run = 0; run < runs; run++) {
+	start = clock();
+	text = text_backend_to_memory(sourceform, &len, es);
+	t = (double)(clock() - start) / CLOCKS_PER_SEC;
+	sfree(text);
+	total += t;
+	if (run == 0 || t < best)
+	    best = t;
+    }
+    printf("%d bytes of text, %d runs: best %.2f ms, mean %.2f ms\n",
+	   len, runs, best * 1e3, total * 1e3 / runs);
+
+    free_para_list(sourceform);
+    free_keywords(keywords);
+    cleanup_index(idx);
+    psdata_free(psd);
+    sfree(infiles);
+    return es->fatal ? 1 : 0;
+}
+
+#endif
@@ -19,6 +19,7 @@ struct bk_whlp_state {
     charset_state cstate;
     FILE *cntfp;
     int cnt_last_level, cnt_workaround;
+    WHLP_TOPIC *topics;		       /* indexed by paragraph::index */
 };
 
 typedef struct {
@@ -26,6 +27,8 @@ typedef struct {
     wchar_t *bullet, *lquote, *rquote, *titlepage, *sectsuffix, *listsuffix;
     wchar_t *contents_text;
     char *filename;
+    bool compress;
+    wchar_t **topicnames;	       /* indexed by paragraph::index */
 } whlpconf;
 
 /*
@@ -79,6 +82,15 @@ static whlpconf whlp_configure(paragraph *source) {
     ret.contents_text = L"Contents";
     ret.sectsuffix = L": ";
     ret.listsuffix = L".";
+    ret.compress = true;
+    {
+	int i, nparas;
+
+	doc_size(source, &nparas, NULL);
+	ret.topicnames = snewn(nparas, wchar_t *);
+	for (i = 0; i < nparas; i++)
+	    ret.topicnames[i] = NULL;
+    }
 
     /*
      * Two-pass configuration so that we can pick up global config
@@ -98,7 +110,6 @@ static whlpconf whlp_configure(paragraph *source) {
     }
 
     for (p = source; p; p = p->next) {
-	p->private_data = NULL;
 	if (p->type == para_Config) {
 	    /*
 	     * In principle we should support a `winhelp-charset'
@@ -107,9 +118,8 @@ static whlpconf whlp_configure(paragraph *source) {
 	     * find out, I'll support it.
 	     */
 	    if (p->parent && !ustricmp(p->keyword, L"winhelp-topic")) {
-		/* Store the topic name in the private_data field of the
-		 * containing section. */
-		p->parent->private_data = uadv(p->keyword);
+		/* Store the topic name for the containing section. */
+		ret.topicnames[p->parent->index] = uadv(p->keyword);
 	    } else if (!ustricmp(p->keyword, L"winhelp-filename")) {
 		sfree(ret.filename);
 		ret.filename = dupstr(adv(p->origkeyword));
@@ -119,6 +129,8 @@ static whlpconf whlp_configure(paragraph *source) {
 		ret.sectsuffix = uadv(p->keyword);
 	    } else if (!ustricmp(p->keyword, L"winhelp-list-suffix")) {
 		ret.listsuffix = uadv(p->keyword);
+	    } else if (!ustricmp(p->keyword, L"winhelp-compress")) {
+		ret.compress = utob(uadv(p->keyword));
 	    } else if (!ustricmp(p->keyword, L"winhelp-contents-titlepage")) {
 		ret.titlepage = uadv(p->keyword);
 	    } else if (!ustricmp(p->keyword, L"winhelp-quotes")) {
@@ -198,6 +210,7 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
     conf = whlp_configure(sourceform);
 
     state.charset = conf.charset;
+    whlp_compress_topics(h, conf.compress);
 
     /*
      * Ensure the output file name has a .hlp extension. This is
@@ -235,6 +248,14 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
 
     contents_topic = whlp_register_topic(h, "Top", NULL);
     whlp_primary_topic(h, contents_topic);
+    {
+	int i, nparas;
+
+	doc_size(sourceform, &nparas, NULL);
+	state.topics = snewn(nparas, WHLP_TOPIC);
+	for (i = 0; i < nparas; i++)
+	    state.topics[i] = NULL;
+    }
     for (p = sourceform; p; p = p->next) {
 	if (p->type == para_Chapter ||
 	    p->type == para_Appendix ||
@@ -245,11 +266,11 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
 	    rdstringc rs = { 0, 0, NULL };
 	    char *errstr;
 
-	    whlp_rdadds(&rs, (wchar_t *)p->private_data, &conf, NULL);
+	    whlp_rdadds(&rs, conf.topicnames[p->index], &conf, NULL);
 
-	    p->private_data = whlp_register_topic(h, rs.text, &errstr);
-	    if (!p->private_data) {
-		p->private_data = whlp_register_topic(h, NULL, NULL);
+	    state.topics[p->index] = whlp_register_topic(h, rs.text, &errstr);
+	    if (!state.topics[p->index]) {
+		state.topics[p->index] = whlp_register_topic(h, NULL, NULL);
 		err_winhelp_ctxclash(es, &p->fpos, rs.text, errstr);
 	    }
 	    sfree(rs.text);
@@ -449,7 +470,7 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
 	    char *macro, *topicid;
 	    charset_state cstate = CHARSET_INIT_STATE;
 
-	    new_topic = p->private_data;
+	    new_topic = state.topics[p->index];
 	    whlp_browse_link(h, state.curr_topic, new_topic);
 	    state.curr_topic = new_topic;
 
@@ -463,7 +484,7 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
 	    if (p->parent == NULL)
 		parent_topic = contents_topic;
 	    else
-		parent_topic = (WHLP_TOPIC)p->parent->private_data;
+		parent_topic = state.topics[p->parent->index];
 	    topicid = whlp_topic_id(parent_topic);
 	    macro = smalloc(100+strlen(topicid));
 	    sprintf(macro,
@@ -652,6 +673,8 @@ void whlp_backend(paragraph *sourceform, keywordlist *keywords,
 	sfree(ie->backend_data);
     }
 
+    sfree(state.topics);
+    sfree(conf.topicnames);
     sfree(conf.filename);
     sfree(cntname);
 }
@@ -684,7 +707,7 @@ static void whlp_contents_write(struct bk_whlp_state *state,
 static void whlp_navmenu(struct bk_whlp_state *state, paragraph *p,
 			 whlpconf *conf) {
     whlp_begin_para(state->h, WHLP_PARA_SCROLL);
-    whlp_start_hyperlink(state->h, (WHLP_TOPIC)p->private_data);
+    whlp_start_hyperlink(state->h, state->topics[p->index]);
     state->cstate = charset_init_state;
     if (p->kwtext) {
 	whlp_mkparagraph(state, FONT_NORMAL, p->kwtext, true, conf);
@@ -745,8 +768,7 @@ static void whlp_mkparagraph(struct bk_whlp_state *state,
             } else {
                 xref_target = kwl->para;
             }
-            whlp_start_hyperlink(state->h,
-                                 (WHLP_TOPIC)xref_target->private_data);
+            whlp_start_hyperlink(state->h, state->topics[xref_target->index]);
         }
 	break;
 
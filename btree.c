@@ -0,0 +1,1701 @@
+/*
+ * btree.c: counted B-trees with wide nodes
+ *
+ * This is an alternative to tree234.c with the same interface (see
+ * btree.h). Every node other than the root holds between BT_MIN
+ * and BT_MAX elements, and every non-leaf node has one more child
+ * than it has elements. Each non-leaf node also records how many
+ * elements there are under each of its children, which is what
+ * makes lookups by numeric index possible.
+ *
+ * Inserting splits full nodes on the way back up from the leaf the
+ * element went into; deleting fixes up nodes which have got too
+ * small on the way back up, by merging them with a neighbour or
+ * sharing out the elements of the two. Joins and splits are done
+ * in time proportional to the height of the tree, by pasting the
+ * shorter tree onto the edge of the taller one.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "halibut.h"
+
+/*
+ * BT_DEGREE is the minimum number of children of a non-root, non-
+ * leaf node. With 16, a node has between 15 and 31 elements, so a
+ * tree of a million elements is five levels deep at most. (It can
+ * be overridden at compile time, which the test code below uses to
+ * get deep trees out of only a few elements.)
+ */
+#ifndef BT_DEGREE
+#define BT_DEGREE 16
+#endif
+#define BT_MAX (2*BT_DEGREE - 1)
+#define BT_MIN (BT_DEGREE - 1)
+
+typedef struct btnode_Tag btnode;
+
+struct btree_Tag {
+    btnode *root;		       /* NULL if the tree is empty */
+    int count;
+    cmpfn234 cmp;
+    void *cmpctx;
+    keyfnbt keyfn;
+};
+
+/*
+ * Each array has room for one more than a node can hold, so that
+ * an insertion can overfill a node briefly before it's split.
+ * Leaves are allocated without the kids and counts; the keys are
+ * only filled in if the tree is keyed.
+ */
+struct btnode_Tag {
+    int nelems;
+    int height;			       /* 0 for a leaf */
+    void *elems[BT_MAX + 1];
+    unsigned long keys[BT_MAX + 1];
+    btnode *kids[BT_MAX + 2];
+    int counts[BT_MAX + 2];
+};
+
+/*
+ * What we're looking for, when searching a sorted tree: either an
+ * element to compare others with, or (if cmp is NULL) a key.
+ */
+typedef struct {
+    cmpfn234 cmp;
+    void *cmpctx;
+    const void *e;
+    unsigned long key;
+} btprobe;
+
+static btnode *newnodebt(int height) {
+    btnode *n = (btnode *)smalloc(height ? sizeof(btnode) :
+				  offsetof(btnode, kids));
+    n->nelems = 0;
+    n->height = height;
+    return n;
+}
+
+static void freenodesbt(btnode *n) {
+    int i;
+
+    if (n->height)
+	for (i = 0; i <= n->nelems; i++)
+	    freenodesbt(n->kids[i]);
+    sfree(n);
+}
+
+static int countnodebt(btnode *n) {
+    int i, count;
+
+    if (!n)
+	return 0;
+    count = n->nelems;
+    if (n->height)
+	for (i = 0; i <= n->nelems; i++)
+	    count += n->counts[i];
+    return count;
+}
+
+/*
+ * Move elements (with their keys, if any) or children (with their
+ * counts) around within a node or from one node to another.
+ */
+static void moveelemsbt(btree *t, btnode *dst, int di,
+			btnode *src, int si, int n) {
+    memmove(dst->elems + di, src->elems + si, n * sizeof(void *));
+    if (t->keyfn)
+	memmove(dst->keys + di, src->keys + si, n * sizeof(unsigned long));
+}
+
+static void movekidsbt(btnode *dst, int di, btnode *src, int si, int n) {
+    memmove(dst->kids + di, src->kids + si, n * sizeof(btnode *));
+    memmove(dst->counts + di, src->counts + si, n * sizeof(int));
+}
+
+static btree *newtreebt(cmpfn234 cmp, void *cmpctx, keyfnbt keyfn) {
+    btree *t = snew(btree);
+    t->root = NULL;
+    t->count = 0;
+    t->cmp = cmp;
+    t->cmpctx = cmpctx;
+    t->keyfn = keyfn;
+    return t;
+}
+
+btree *newbt(cmpfn234 cmp, void *cmpctx) {
+    return newtreebt(cmp, cmpctx, NULL);
+}
+
+btree *newkeyedbt(keyfnbt keyfn) {
+    return newtreebt(NULL, NULL, keyfn);
+}
+
+void freebt(btree *t) {
+    if (t->root)
+	freenodesbt(t->root);
+    sfree(t);
+}
+
+int countbt(btree *t) {
+    return t->count;
+}
+
+/*
+ * Set up a probe to search for e, using cmp or else however the
+ * tree is sorted. Returns false if the tree isn't sorted at all.
+ */
+static bool probebt(btree *t, btprobe *p, const void *e,
+		    cmpfn234 cmp, void *cmpctx) {
+    if (!cmp) {
+	cmp = t->cmp;
+	cmpctx = t->cmpctx;
+    }
+    if (!cmp && !t->keyfn)
+	return false;
+    p->cmp = cmp;
+    p->cmpctx = cmpctx;
+    p->e = e;
+    p->key = cmp ? 0 : t->keyfn(e);
+    return true;
+}
+
+/*
+ * Return the position of the first element in a node which doesn't
+ * compare less than the probe, and set *eq if it compares equal.
+ *
+ * Keys are searched by counting how many are smaller, which is
+ * quicker over an array this short than a binary search, since it
+ * has no branches to mispredict.
+ */
+static int searchbt(btnode *n, const btprobe *p, bool *eq) {
+    int lo = 0, hi = n->nelems, mid, c;
+
+    if (!p->cmp) {
+	const unsigned long *keys = n->keys;
+	unsigned long key = p->key;
+
+	for (mid = 0; mid < hi; mid++)
+	    lo += (keys[mid] < key);
+	*eq = (lo < hi && keys[lo] == key);
+	return lo;
+    }
+
+    *eq = false;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	c = p->cmp(p->e, n->elems[mid], p->cmpctx);
+	if (c == 0) {
+	    *eq = true;
+	    return mid;
+	}
+	if (c > 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Compare two elements of a sorted tree.
+ */
+static int cmpbt(btree *t, const void *a, const void *b) {
+    unsigned long ka, kb;
+
+    if (t->cmp)
+	return t->cmp(a, b, t->cmpctx);
+    ka = t->keyfn(a);
+    kb = t->keyfn(b);
+    return (ka < kb ? -1 : ka > kb ? +1 : 0);
+}
+
+/*
+ * Insert *e (with key *key) at position i in node n, with `left'
+ * and `right' as the subtrees either side of it (NULL in a leaf).
+ *
+ * If that overfills n, it's split in two. The new node holding the
+ * right half is returned, and *e and *key are replaced by the
+ * element which now belongs between the halves. Otherwise NULL is
+ * returned.
+ */
+static btnode *insertbt(btree *t, btnode *n, int i, void **e,
+			unsigned long *key, btnode *left, btnode *right) {
+    btnode *r;
+
+    moveelemsbt(t, n, i+1, n, i, n->nelems - i);
+    n->elems[i] = *e;
+    if (t->keyfn)
+	n->keys[i] = *key;
+    if (n->height) {
+	movekidsbt(n, i+2, n, i+1, n->nelems - i);
+	n->kids[i] = left;
+	n->counts[i] = countnodebt(left);
+	n->kids[i+1] = right;
+	n->counts[i+1] = countnodebt(right);
+    }
+    if (++n->nelems <= BT_MAX)
+	return NULL;
+
+    /*
+     * n now has 2*BT_DEGREE elements. Keep BT_DEGREE of them, pass
+     * the next one up, and move the remaining BT_DEGREE-1 into a
+     * new node.
+     */
+    r = newnodebt(n->height);
+    r->nelems = n->nelems - BT_DEGREE - 1;
+    moveelemsbt(t, r, 0, n, BT_DEGREE + 1, r->nelems);
+    if (n->height)
+	movekidsbt(r, 0, n, BT_DEGREE + 1, r->nelems + 1);
+    *e = n->elems[BT_DEGREE];
+    if (t->keyfn)
+	*key = n->keys[BT_DEGREE];
+    n->nelems = BT_DEGREE;
+    return r;
+}
+
+/*
+ * If a subtree has been split in two, put a new root above the
+ * halves. Returns the root of the whole thing.
+ */
+static btnode *growbt(btree *t, btnode *n, void *e, unsigned long key,
+		      btnode *right) {
+    btnode *root;
+
+    if (!right)
+	return n;
+    root = newnodebt(n->height + 1);
+    root->nelems = 1;
+    root->elems[0] = e;
+    if (t->keyfn)
+	root->keys[0] = key;
+    root->kids[0] = n;
+    root->counts[0] = countnodebt(n);
+    root->kids[1] = right;
+    root->counts[1] = countnodebt(right);
+    return root;
+}
+
+/*
+ * Add *e to the subtree at n: in its sorted place if p is non-NULL,
+ * or else at the given index. Returns the new right half if n had
+ * to be split, as insertbt() does.
+ *
+ * If p finds an element which compares equal, nothing is changed:
+ * *dup is set, and *e replaced with the existing element.
+ */
+static btnode *addbt_internal(btree *t, btnode *n, const btprobe *p,
+			      int index, void **e, unsigned long *key,
+			      bool *dup) {
+    btnode *right;
+    bool eq;
+    int i;
+
+    if (p) {
+	i = searchbt(n, p, &eq);
+	if (eq) {
+	    *e = n->elems[i];
+	    *dup = true;
+	    return NULL;
+	}
+    } else if (n->height) {
+	for (i = 0; index > n->counts[i]; i++)
+	    index -= n->counts[i] + 1;
+    } else {
+	i = index;
+    }
+
+    if (!n->height)
+	return insertbt(t, n, i, e, key, NULL, NULL);
+
+    right = addbt_internal(t, n->kids[i], p, index, e, key, dup);
+    if (*dup)
+	return NULL;
+    if (!right) {
+	n->counts[i]++;
+	return NULL;
+    }
+    return insertbt(t, n, i, e, key, n->kids[i], right);
+}
+
+static void *addbt_top(btree *t, const btprobe *p, int index, void *e) {
+    void *sep = e;
+    unsigned long key = (t->keyfn ? t->keyfn(e) : 0);
+    bool dup = false;
+    btnode *right;
+
+    if (!t->root)
+	t->root = newnodebt(0);
+    right = addbt_internal(t, t->root, p, index, &sep, &key, &dup);
+    if (dup)
+	return sep;
+    t->root = growbt(t, t->root, sep, key, right);
+    t->count++;
+    return e;
+}
+
+void *addbt(btree *t, void *e) {
+    btprobe p;
+
+    if (!probebt(t, &p, e, NULL, NULL))
+	return NULL;
+    return addbt_top(t, &p, 0, e);
+}
+
+void *addposbt(btree *t, void *e, int index) {
+    if (index < 0 || index > t->count || t->cmp || t->keyfn)
+	return NULL;
+    return addbt_top(t, NULL, index, e);
+}
+
+void *indexbt(btree *t, int index) {
+    btnode *n;
+    int i;
+
+    if (index < 0 || index >= t->count)
+	return NULL;
+
+    n = t->root;
+    while (n->height) {
+	for (i = 0; index > n->counts[i]; i++)
+	    index -= n->counts[i] + 1;
+	if (index == n->counts[i])
+	    return n->elems[i];
+	n = n->kids[i];
+    }
+    return n->elems[index];
+}
+
+static void *indexposbt(btree *t, int i, int *index) {
+    void *ret = indexbt(t, i);
+    if (ret && index)
+	*index = i;
+    return ret;
+}
+
+/*
+ * Find an element by comparison, in a single pass down the tree.
+ * On the way, we keep track of the nearest elements seen either
+ * side of the one we want, so that if it isn't there, the answer to
+ * an inexact search is whichever of those was seen last.
+ */
+void *findcmprelposbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx,
+		      int relation, int *index) {
+    btprobe p;
+    btnode *n;
+    void *lt = NULL, *gt = NULL;
+    int ltidx = 0, gtidx = 0, pos, i, j;
+    bool eq, wantpos;
+
+    if (!t->root)
+	return NULL;
+
+    if (e == NULL) {
+	assert(relation == REL234_LT || relation == REL234_GT);
+	return indexposbt(t, relation == REL234_LT ? t->count - 1 : 0, index);
+    }
+
+    if (!probebt(t, &p, e, cmp, cmpctx))
+	return NULL;
+
+    /*
+     * Keeping track of indices is only worth the effort if we'll
+     * need one.
+     */
+    wantpos = (index || relation == REL234_LT || relation == REL234_GT);
+
+    n = t->root;
+    pos = 0;			       /* index of n's first element */
+    while (1) {
+	i = searchbt(n, &p, &eq);
+
+	/* Work out the index of elems[i], or where it would be. */
+	if (wantpos) {
+	    pos += i;
+	    if (n->height)
+		for (j = 0; j <= i; j++)
+		    pos += n->counts[j];
+	}
+
+	if (eq) {
+	    if (relation == REL234_LT)
+		return indexposbt(t, pos - 1, index);
+	    if (relation == REL234_GT)
+		return indexposbt(t, pos + 1, index);
+	    if (index)
+		*index = pos;
+	    return n->elems[i];
+	}
+
+	if (i > 0) {
+	    lt = n->elems[i-1];
+	    ltidx = pos - 1 - (n->height ? n->counts[i] : 0);
+	}
+	if (i < n->nelems) {
+	    gt = n->elems[i];
+	    gtidx = pos;
+	}
+	if (!n->height)
+	    break;
+	if (wantpos)
+	    pos -= n->counts[i];
+	n = n->kids[i];
+    }
+
+    if (relation == REL234_LT || relation == REL234_LE) {
+	if (lt && index)
+	    *index = ltidx;
+	return lt;
+    }
+    if (relation == REL234_GT || relation == REL234_GE) {
+	if (gt && index)
+	    *index = gtidx;
+	return gt;
+    }
+    return NULL;
+}
+
+void *findbt(btree *t, const void *e) {
+    return findcmprelposbt(t, e, NULL, NULL, REL234_EQ, NULL);
+}
+void *findrelbt(btree *t, const void *e, int relation) {
+    return findcmprelposbt(t, e, NULL, NULL, relation, NULL);
+}
+void *findposbt(btree *t, const void *e, int *index) {
+    return findcmprelposbt(t, e, NULL, NULL, REL234_EQ, index);
+}
+void *findrelposbt(btree *t, const void *e, int relation, int *index) {
+    return findcmprelposbt(t, e, NULL, NULL, relation, index);
+}
+void *findcmpbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx) {
+    return findcmprelposbt(t, e, cmp, cmpctx, REL234_EQ, NULL);
+}
+void *findcmprelbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx,
+		   int relation) {
+    return findcmprelposbt(t, e, cmp, cmpctx, relation, NULL);
+}
+void *findcmpposbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx,
+		   int *index) {
+    return findcmprelposbt(t, e, cmp, cmpctx, REL234_EQ, index);
+}
+
+/*
+ * Given two neighbouring subtrees of the same height, with *e (and
+ * *key) as the element between them, make sure each has at least
+ * BT_MIN elements at the top.
+ *
+ * If they'll fit in a single node, everything is merged into l, r
+ * is freed, and false is returned. Otherwise the elements are
+ * shared out evenly, *e and *key are replaced by the new element
+ * between them, and true is returned.
+ */
+static bool rebalancebt(btree *t, btnode *l, void **e, unsigned long *key,
+			btnode *r) {
+    int total = l->nelems + 1 + r->nelems, nl, move;
+
+    if (total <= BT_MAX) {
+	l->elems[l->nelems] = *e;
+	if (t->keyfn)
+	    l->keys[l->nelems] = *key;
+	moveelemsbt(t, l, l->nelems + 1, r, 0, r->nelems);
+	if (l->height)
+	    movekidsbt(l, l->nelems + 1, r, 0, r->nelems + 1);
+	l->nelems = total;
+	sfree(r);
+	return false;
+    }
+
+    nl = total / 2;
+    if (nl > l->nelems) {
+	/* Move elements leftwards, through *e. */
+	move = nl - l->nelems;
+	l->elems[l->nelems] = *e;
+	if (t->keyfn)
+	    l->keys[l->nelems] = *key;
+	moveelemsbt(t, l, l->nelems + 1, r, 0, move - 1);
+	if (l->height)
+	    movekidsbt(l, l->nelems + 1, r, 0, move);
+	*e = r->elems[move - 1];
+	if (t->keyfn)
+	    *key = r->keys[move - 1];
+	moveelemsbt(t, r, 0, r, move, r->nelems - move);
+	if (r->height)
+	    movekidsbt(r, 0, r, move, r->nelems - move + 1);
+	l->nelems += move;
+	r->nelems -= move;
+    } else if (nl < l->nelems) {
+	/* Move elements rightwards, through *e. */
+	move = l->nelems - nl;
+	moveelemsbt(t, r, move, r, 0, r->nelems);
+	if (r->height)
+	    movekidsbt(r, move, r, 0, r->nelems + 1);
+	r->elems[move - 1] = *e;
+	if (t->keyfn)
+	    r->keys[move - 1] = *key;
+	moveelemsbt(t, r, 0, l, nl + 1, move - 1);
+	if (l->height)
+	    movekidsbt(r, 0, l, nl + 1, move);
+	*e = l->elems[nl];
+	if (t->keyfn)
+	    *key = l->keys[nl];
+	l->nelems -= move;
+	r->nelems += move;
+    }
+    return true;
+}
+
+/*
+ * Having removed an element from below child i of n, make sure
+ * that child still has enough elements, by rebalancing it with its
+ * neighbour on one side or the other.
+ */
+static void fixbt(btree *t, btnode *n, int i) {
+    void *e;
+    unsigned long key;
+
+    if (n->kids[i]->nelems >= BT_MIN)
+	return;
+    if (i == n->nelems)
+	i--;			       /* the last child: use its left */
+
+    e = n->elems[i];
+    key = (t->keyfn ? n->keys[i] : 0);
+    if (rebalancebt(t, n->kids[i], &e, &key, n->kids[i+1])) {
+	n->elems[i] = e;
+	if (t->keyfn)
+	    n->keys[i] = key;
+	n->counts[i] = countnodebt(n->kids[i]);
+	n->counts[i+1] = countnodebt(n->kids[i+1]);
+    } else {
+	n->counts[i] += 1 + n->counts[i+1];
+	moveelemsbt(t, n, i, n, i+1, n->nelems - i - 1);
+	movekidsbt(n, i+1, n, i+2, n->nelems - i - 1);
+	n->nelems--;
+    }
+}
+
+/*
+ * Remove the element at the given index in the subtree at n,
+ * returning it and its key. The top node of the subtree may be left
+ * with too few elements, for the caller to sort out.
+ */
+static void *delbt_internal(btree *t, btnode *n, int index,
+			    unsigned long *key) {
+    void *ret;
+    int i;
+
+    if (!n->height) {
+	ret = n->elems[index];
+	if (t->keyfn)
+	    *key = n->keys[index];
+	moveelemsbt(t, n, index, n, index+1, n->nelems - index - 1);
+	n->nelems--;
+	return ret;
+    }
+
+    for (i = 0; index > n->counts[i]; i++)
+	index -= n->counts[i] + 1;
+
+    if (index < n->counts[i]) {
+	ret = delbt_internal(t, n->kids[i], index, key);
+    } else {
+	/*
+	 * The element is in this node. Replace it with the last
+	 * element of the subtree to its left.
+	 */
+	unsigned long predkey = 0;
+
+	ret = n->elems[i];
+	if (t->keyfn)
+	    *key = n->keys[i];
+	n->elems[i] = delbt_internal(t, n->kids[i], n->counts[i] - 1,
+				     &predkey);
+	if (t->keyfn)
+	    n->keys[i] = predkey;
+    }
+    n->counts[i]--;
+    fixbt(t, n, i);
+    return ret;
+}
+
+void *delposbt(btree *t, int index) {
+    btnode *root;
+    unsigned long key;
+    void *ret;
+
+    if (index < 0 || index >= t->count)
+	return NULL;
+
+    root = t->root;
+    ret = delbt_internal(t, root, index, &key);
+    t->count--;
+    if (root->nelems == 0) {
+	t->root = (root->height ? root->kids[0] : NULL);
+	sfree(root);
+    }
+    return ret;
+}
+
+void *delbt(btree *t, void *e) {
+    int index;
+
+    if (!findrelposbt(t, e, REL234_EQ, &index))
+	return NULL;		       /* it wasn't in there anyway */
+    return delposbt(t, index);
+}
+
+/*
+ * Paste the subtree r, with *e between, onto the right-hand edge of
+ * the taller subtree at n. Returns the new right half if n had to
+ * be split, as insertbt() does.
+ */
+static btnode *joinrightbt(btree *t, btnode *n, void **e,
+			   unsigned long *key, btnode *r) {
+    int i = n->nelems;
+    btnode *right;
+
+    if (n->height > r->height + 1) {
+	right = joinrightbt(t, n->kids[i], e, key, r);
+	if (!right) {
+	    n->counts[i] = countnodebt(n->kids[i]);
+	    return NULL;
+	}
+	return insertbt(t, n, i, e, key, n->kids[i], right);
+    }
+
+    /*
+     * r becomes a child of n, so if it's the root of a tree which
+     * is too small, make up the numbers from its new neighbour.
+     */
+    if (r->nelems >= BT_MIN || rebalancebt(t, n->kids[i], e, key, r))
+	return insertbt(t, n, i, e, key, n->kids[i], r);
+    n->counts[i] = countnodebt(n->kids[i]);
+    return NULL;
+}
+
+/*
+ * The mirror image: paste l onto the left-hand edge of n.
+ */
+static btnode *joinleftbt(btree *t, btnode *n, void **e,
+			  unsigned long *key, btnode *l) {
+    btnode *right;
+
+    if (n->height > l->height + 1) {
+	right = joinleftbt(t, n->kids[0], e, key, l);
+	if (!right) {
+	    n->counts[0] = countnodebt(n->kids[0]);
+	    return NULL;
+	}
+	return insertbt(t, n, 0, e, key, n->kids[0], right);
+    }
+
+    if (l->nelems >= BT_MIN || rebalancebt(t, l, e, key, n->kids[0]))
+	return insertbt(t, n, 0, e, key, l, n->kids[0]);
+    n->kids[0] = l;
+    n->counts[0] = countnodebt(l);
+    return NULL;
+}
+
+/*
+ * Join the subtrees l and r, with e between them, and return the
+ * root of the result. Either subtree may be empty (NULL), and the
+ * top node of either may have fewer than BT_MIN elements, but not
+ * none at all.
+ */
+static btnode *joinbt_internal(btree *t, btnode *l, void *e,
+			       unsigned long key, btnode *r) {
+    btnode *right;
+    bool dup = false;
+
+    if (!l && !r) {
+	l = newnodebt(0);
+	insertbt(t, l, 0, &e, &key, NULL, NULL);
+	return l;
+    }
+    if (!r) {
+	right = addbt_internal(t, l, NULL, countnodebt(l), &e, &key, &dup);
+	return growbt(t, l, e, key, right);
+    }
+    if (!l) {
+	right = addbt_internal(t, r, NULL, 0, &e, &key, &dup);
+	return growbt(t, r, e, key, right);
+    }
+
+    if (l->height == r->height) {
+	if ((l->nelems >= BT_MIN && r->nelems >= BT_MIN) ||
+	    rebalancebt(t, l, &e, &key, r))
+	    return growbt(t, l, e, key, r);
+	return l;
+    }
+    if (l->height > r->height) {
+	right = joinrightbt(t, l, &e, &key, r);
+	return growbt(t, l, e, key, right);
+    }
+    right = joinleftbt(t, r, &e, &key, l);
+    return growbt(t, r, e, key, right);
+}
+
+/*
+ * Check that every element of t1 comes before every element of t2,
+ * if the trees are sorted.
+ */
+static bool inorderbt(btree *t1, btree *t2) {
+    if ((!t1->cmp && !t1->keyfn) || !t1->count || !t2->count)
+	return true;
+    return cmpbt(t1, indexbt(t1, t1->count - 1), indexbt(t2, 0)) < 0;
+}
+
+btree *joinbt(btree *t1, btree *t2) {
+    unsigned long key;
+    void *e;
+
+    if (t2->count > 0) {
+	if (!inorderbt(t1, t2))
+	    return NULL;
+	e = delposbt(t2, 0);
+	key = (t1->keyfn ? t1->keyfn(e) : 0);
+	t1->root = joinbt_internal(t1, t1->root, e, key, t2->root);
+	t1->count += t2->count + 1;
+	t2->root = NULL;
+	t2->count = 0;
+    }
+    return t1;
+}
+
+btree *joinbtr(btree *t1, btree *t2) {
+    unsigned long key;
+    void *e;
+
+    if (t1->count > 0) {
+	if (!inorderbt(t1, t2))
+	    return NULL;
+	e = delposbt(t1, t1->count - 1);
+	key = (t2->keyfn ? t2->keyfn(e) : 0);
+	t2->root = joinbt_internal(t2, t1->root, e, key, t2->root);
+	t2->count += t1->count + 1;
+	t1->root = NULL;
+	t1->count = 0;
+    }
+    return t2;
+}
+
+/*
+ * Split the subtree at n so that its first `index' elements end up
+ * in *lp and the rest in *rp, either of which may come out empty.
+ *
+ * Below the node where the split point falls, that's done by
+ * splitting the child it falls in. What's left of this node on
+ * each side is then joined back on to the half of that child on the
+ * same side.
+ */
+static void splitbt_internal(btree *t, btnode *n, int index,
+			     btnode **lp, btnode **rp) {
+    btnode *kl, *kr, *ln, *rn;
+    void *le = NULL, *re = NULL;
+    unsigned long lkey = 0, rkey = 0;
+    int i, nelems, nr;
+
+    if (!n->height) {
+	*lp = *rp = NULL;
+	if (index == 0)
+	    *rp = n;
+	else if (index == n->nelems)
+	    *lp = n;
+	else {
+	    rn = newnodebt(0);
+	    rn->nelems = n->nelems - index;
+	    moveelemsbt(t, rn, 0, n, index, rn->nelems);
+	    n->nelems = index;
+	    *lp = n;
+	    *rp = rn;
+	}
+	return;
+    }
+
+    for (i = 0; index > n->counts[i]; i++)
+	index -= n->counts[i] + 1;
+    splitbt_internal(t, n->kids[i], index, &kl, &kr);
+
+    /* What's to the right: elements i+1 onwards, after elems[i]. */
+    nelems = n->nelems;
+    nr = nelems - i - 1;
+    rn = NULL;
+    if (i < nelems) {
+	re = n->elems[i];
+	if (t->keyfn)
+	    rkey = n->keys[i];
+	if (nr > 0) {
+	    rn = newnodebt(n->height);
+	    rn->nelems = nr;
+	    moveelemsbt(t, rn, 0, n, i+1, nr);
+	    movekidsbt(rn, 0, n, i+1, nr+1);
+	} else {
+	    rn = n->kids[i+1];
+	}
+    }
+
+    /* What's to the left: elements up to i-2, before elems[i-1]. */
+    ln = NULL;
+    if (i > 0) {
+	le = n->elems[i-1];
+	if (t->keyfn)
+	    lkey = n->keys[i-1];
+    }
+    if (i > 1) {
+	n->nelems = i - 1;
+	ln = n;
+    } else {
+	if (i == 1)
+	    ln = n->kids[0];
+	sfree(n);
+    }
+
+    *lp = (i > 0 ? joinbt_internal(t, ln, le, lkey, kl) : kl);
+    *rp = (i < nelems ? joinbt_internal(t, kr, re, rkey, rn) : kr);
+}
+
+btree *splitposbt(btree *t, int index, bool before) {
+    btnode *l = NULL, *r = NULL;
+    btree *ret;
+
+    if (index < 0 || index > t->count)
+	return NULL;		       /* error */
+    ret = newtreebt(t->cmp, t->cmpctx, t->keyfn);
+    if (t->root)
+	splitbt_internal(t, t->root, index, &l, &r);
+    if (before) {
+	ret->root = l;
+	t->root = r;
+    } else {
+	t->root = l;
+	ret->root = r;
+    }
+    ret->count = countnodebt(ret->root);
+    t->count = countnodebt(t->root);
+    return ret;
+}
+
+btree *splitcmpbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx,
+		  int rel) {
+    bool before;
+    int index;
+
+    assert(rel != REL234_EQ);
+
+    if (rel == REL234_GT || rel == REL234_GE) {
+	before = true;
+	rel = (rel == REL234_GT ? REL234_LE : REL234_LT);
+    } else {
+	before = false;
+    }
+    if (!findcmprelposbt(t, e, cmp, cmpctx, rel, &index))
+	index = -1;
+
+    return splitposbt(t, index+1, before);
+}
+
+btree *splitbt(btree *t, const void *e, int rel) {
+    return splitcmpbt(t, e, NULL, NULL, rel);
+}
+
+static btnode *copynodebt(btree *t, btnode *n,
+			  copyfn234 copyfn, void *copyfnstate) {
+    btnode *n2 = newnodebt(n->height);
+    int i;
+
+    n2->nelems = n->nelems;
+    for (i = 0; i < n->nelems; i++)
+	n2->elems[i] = (copyfn ? copyfn(copyfnstate, n->elems[i]) :
+			n->elems[i]);
+    if (t->keyfn)
+	memcpy(n2->keys, n->keys, n->nelems * sizeof(unsigned long));
+    if (n->height) {
+	for (i = 0; i <= n->nelems; i++)
+	    n2->kids[i] = copynodebt(t, n->kids[i], copyfn, copyfnstate);
+	memcpy(n2->counts, n->counts, (n->nelems + 1) * sizeof(int));
+    }
+    return n2;
+}
+
+btree *copybt(btree *t, copyfn234 copyfn, void *copyfnstate) {
+    btree *t2 = newtreebt(t->cmp, t->cmpctx, t->keyfn);
+
+    if (t->root)
+	t2->root = copynodebt(t, t->root, copyfn, copyfnstate);
+    t2->count = t->count;
+    return t2;
+}
+
+/*
+ * Stable merge sort, as in tree234.c, using `tmp' (at least half
+ * the size) as workspace.
+ */
+static void sortbt(btree *t, void **a, void **tmp, int n) {
+    int h, i, j, k;
+
+    if (n < 2)
+	return;
+    h = n / 2;
+    sortbt(t, a, tmp, h);
+    sortbt(t, a + h, tmp, n - h);
+    if (cmpbt(t, a[h-1], a[h]) <= 0)
+	return;
+
+    for (i = 0; i < h; i++)
+	tmp[i] = a[i];
+    i = 0;
+    j = h;
+    k = 0;
+    while (i < h && j < n)
+	a[k++] = (cmpbt(t, a[j], tmp[i]) < 0 ? a[j++] : tmp[i++]);
+    while (i < h)
+	a[k++] = tmp[i++];
+}
+
+/*
+ * The largest number of elements a subtree of a given height can
+ * hold (leaves having height 0).
+ */
+static int maxsizebt(int height) {
+    int size = BT_MAX + 1;
+
+    while (height-- > 0) {
+	if (size > INT_MAX / (BT_MAX + 1))
+	    return INT_MAX;
+	size *= BT_MAX + 1;
+    }
+    return size - 1;
+}
+
+/*
+ * Build a subtree of the given height holding the n elements at
+ * `e'. Each node gets the fewest children that can hold everything
+ * below it, so that the nodes are as full as possible, except that
+ * a node other than the root can't have fewer than BT_DEGREE. The
+ * elements are shared out between the children as evenly as
+ * possible, which always gives each one a number that a subtree of
+ * its height can hold.
+ */
+static btnode *buildbt_internal(btree *t, void **e, int n, int height,
+				bool root) {
+    btnode *node = newnodebt(height);
+    int i, k, m, sub;
+
+    if (height == 0) {
+	assert(n >= (root ? 1 : BT_MIN) && n <= BT_MAX);
+	node->nelems = n;
+	memcpy(node->elems, e, n * sizeof(void *));
+	if (t->keyfn)
+	    for (i = 0; i < n; i++)
+		node->keys[i] = t->keyfn(e[i]);
+	return node;
+    }
+
+    k = n / (maxsizebt(height - 1) + 1) + 1;
+    if (!root && k < BT_DEGREE)
+	k = BT_DEGREE;
+    m = n - (k-1);
+    node->nelems = k - 1;
+    for (i = 0; i < k; i++) {
+	sub = m / k + (i < m % k);
+	node->kids[i] = buildbt_internal(t, e, sub, height - 1, false);
+	node->counts[i] = sub;
+	e += sub;
+	if (i < k-1) {
+	    node->elems[i] = *e++;
+	    if (t->keyfn)
+		node->keys[i] = t->keyfn(node->elems[i]);
+	}
+    }
+    return node;
+}
+
+void buildbt(btree *t, void **elems, int n) {
+    int height;
+
+    assert(!t->root);
+
+    if ((t->cmp || t->keyfn) && n > 1) {
+	void **tmp = snewn(n, void *);
+	int i, kept = 1, ndups = 0;
+
+	sortbt(t, elems, tmp, n);
+
+	/*
+	 * Keep the first of each run of equal elements, and move the
+	 * others to the end of the array.
+	 */
+	for (i = 1; i < n; i++) {
+	    if (cmpbt(t, elems[kept-1], elems[i]) == 0)
+		tmp[ndups++] = elems[i];
+	    else
+		elems[kept++] = elems[i];
+	}
+	for (i = 0; i < ndups; i++)
+	    elems[kept + i] = tmp[i];
+	n = kept;
+
+	sfree(tmp);
+    }
+
+    if (n > 0) {
+	for (height = 0; n > maxsizebt(height); height++);
+	t->root = buildbt_internal(t, elems, n, height, true);
+	t->count = n;
+    }
+}
+
+#ifdef TEST
+
+/*
+ * Test code for the B-tree. As in tree234.c, this keeps a second
+ * copy of the tree's contents in an array (using the obvious and
+ * slow insert and delete functions), and after every operation the
+ * verify() function checks that the tree still matches it and that
+ * all the tree properties are preserved:
+ *  - every node other than the root has between BT_MIN and BT_MAX
+ *    elements, and the root has at least one
+ *  - every child of a node is one level lower than it, so all the
+ *    leaves are at the same depth
+ *  - the counts in each node match the subtrees they describe
+ *  - in a keyed tree, the stored keys match the elements
+ *  - in a sorted tree, the elements are in strictly increasing order
+ *
+ * Random sequences of additions and deletions are run on sorted,
+ * keyed and unsorted trees, with every kind of find() checked
+ * against the array in between. Trees are also split at every
+ * possible point and joined back up, copied, and bulk-built.
+ *
+ * tree234.c has test code of its own under the same #define, so
+ * build it separately, along these lines:
+ *
+ *   cc -O2 -c tree234.c
+ *   cc -O2 -DTEST -I. -Icharset -o btreetest btree.c tree234.o
+ *
+ * It's worth adding -DBT_DEGREE=2 or 3 as well, which makes trees
+ * of a few hundred elements several levels deep. `btreetest bench'
+ * runs a timing comparison with tree234 instead of the tests.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+void *smalloc(int size) {
+    void *p = malloc(size);
+    if (!p) abort();
+    return p;
+}
+void *srealloc(void *p, int size) {
+    p = realloc(p, size);
+    if (!p) abort();
+    return p;
+}
+void sfree(void *p) {
+    free(p);
+}
+
+static int nerrors;
+
+/*
+ * This random number generator uses the `portable implementation'
+ * given in ANSI C99 draft N869, as tree234.c's test code does.
+ */
+static int randomnumber(unsigned *seed) {
+    *seed *= 1103515245;
+    *seed += 12345;
+    return ((*seed) / 65536) % 32768;
+}
+
+/*
+ * Error reporting function.
+ */
+static void error(char *fmt, ...) {
+    va_list ap;
+    printf("ERROR: ");
+    va_start(ap, fmt);
+    vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    printf("\n");
+    nerrors++;
+}
+
+/*
+ * The elements are pointers to ints, which sort in numeric order,
+ * and are their own keys in a keyed tree.
+ */
+#define NVALS 300
+static int vals[NVALS + 2];
+#define VAL(e) (*(const int *)(e))
+
+static int mycmp(const void *av, const void *bv, void *cmpctx) {
+    int a = VAL(av), b = VAL(bv);
+    (void)cmpctx;
+    return (a < b ? -1 : a > b ? +1 : 0);
+}
+
+static unsigned long mykey(const void *e) {
+    return VAL(e);
+}
+
+enum { SORTED, KEYED, UNSORTED };
+static const char *const kindnames[] = { "sorted", "keyed", "unsorted" };
+
+static btree *newtestbt(int kind) {
+    return (kind == SORTED ? newbt(mycmp, NULL) :
+	    kind == KEYED ? newkeyedbt(mykey) : newbt(NULL, NULL));
+}
+
+/* The array representation of the data. */
+static void **array;
+static int arraylen, arraysize;
+
+/* The tree representation of the same data. */
+static btree *tree;
+
+static int chknode(btree *t, btnode *n, bool root) {
+    int i, sub, count = n->nelems;
+
+    if (n->nelems < (root ? 1 : BT_MIN) || n->nelems > BT_MAX)
+	error("node %p: %d elements", n, n->nelems);
+    if (t->keyfn)
+	for (i = 0; i < n->nelems; i++)
+	    if (n->keys[i] != t->keyfn(n->elems[i]))
+		error("node %p: key %d is %lu, element's key is %lu",
+		      n, i, n->keys[i], t->keyfn(n->elems[i]));
+    if (n->height) {
+	for (i = 0; i <= n->nelems; i++) {
+	    if (n->kids[i]->height != n->height - 1) {
+		error("node %p: height %d but kid %d has height %d",
+		      n, n->height, i, n->kids[i]->height);
+		continue;
+	    }
+	    sub = chknode(t, n->kids[i], false);
+	    if (n->counts[i] != sub)
+		error("node %p kid %d: count says %d, subtree really has %d",
+		      n, i, n->counts[i], sub);
+	    count += sub;
+	}
+    }
+    return count;
+}
+
+static void verifytree(btree *t, void **array, int arraylen) {
+    int i, count = 0;
+    void *p;
+
+    if (t->root)
+	count = chknode(t, t->root, true);
+    if (count != t->count || countbt(t) != count)
+	error("tree really contains %d elements, countbt gave %d",
+	      count, countbt(t));
+    if (count != arraylen)
+	error("tree contains %d elements, array has %d", count, arraylen);
+    for (i = 0; i < arraylen; i++) {
+	if ((p = indexbt(t, i)) != array[i])
+	    error("index %d: array says %p, tree says %p", i, array[i], p);
+	if (i > 0 && (t->cmp || t->keyfn) && cmpbt(t, array[i-1], p) >= 0)
+	    error("index %d: elements out of order", i);
+    }
+    if (indexbt(t, -1) || indexbt(t, arraylen))
+	error("index out of range gave an element");
+}
+static void verify(void) { verifytree(tree, array, arraylen); }
+
+static void internal_addtest(void *elem, int index, void *realret) {
+    int j;
+
+    if (arraysize < arraylen+1) {
+	arraysize = arraylen+1+256;
+	array = sresize(array, arraysize, void *);
+    }
+    for (j = arraylen; j > index; j--)
+	array[j] = array[j-1];
+    array[index] = elem;
+    arraylen++;
+
+    if (realret != elem)
+	error("add: retval was %p expected %p", realret, elem);
+    verify();
+}
+
+/*
+ * Find where v is, or would go, in the array.
+ */
+static int arraypos(int v) {
+    int lo = 0, hi = arraylen, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (VAL(array[mid]) < v)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static void addtest(void *elem) {
+    int i = arraypos(VAL(elem));
+    void *realret = addbt(tree, elem);
+
+    if (i < arraylen && VAL(array[i]) == VAL(elem)) {
+	if (realret != array[i])
+	    error("add: retval was %p expected %p", realret, array[i]);
+	verify();
+    } else
+	internal_addtest(elem, i, realret);
+}
+
+static void addpostest(void *elem, int i) {
+    internal_addtest(elem, i, addposbt(tree, elem, i));
+}
+
+static void delpostest(int i, bool byvalue) {
+    void *elem = array[i], *ret;
+
+    memmove(array + i, array + i + 1, (arraylen - i - 1) * sizeof(void *));
+    arraylen--;
+
+    ret = (byvalue ? delbt(tree, elem) : delposbt(tree, i));
+    if (ret != elem)
+	error("del returned %p, expected %p", ret, elem);
+    verify();
+}
+
+static void deltest(void *elem, bool byvalue) {
+    int i = arraypos(VAL(elem));
+
+    if (i < arraylen && VAL(array[i]) == VAL(elem))
+	delpostest(i, byvalue);
+    else if (delbt(tree, elem) != NULL)
+	error("del of absent element %d succeeded", VAL(elem));
+}
+
+/*
+ * Work out what a find with the given relation ought to return.
+ */
+static int findindex(int v, int rel) {
+    int i = arraypos(v);
+    bool eq = (i < arraylen && VAL(array[i]) == v);
+
+    switch (rel) {
+      case REL234_EQ: return eq ? i : -1;
+      case REL234_LT: return i - 1;
+      case REL234_LE: return eq ? i : i - 1;
+      case REL234_GT: return eq ? i + 1 : i;
+      default: return i;	       /* REL234_GE */
+    }
+}
+
+static const int rels[] = {
+    REL234_EQ, REL234_LT, REL234_LE, REL234_GT, REL234_GE
+};
+static const char *const relnames[] = { "EQ", "LT", "LE", "GT", "GE" };
+
+static void findtest(void) {
+    int v, j, i, index;
+    void *ret, *realret;
+
+    for (v = 0; v <= NVALS + 1; v++) {
+	for (j = 0; j < (int)lenof(rels); j++) {
+	    i = findindex(v, rels[j]);
+	    ret = (i >= 0 && i < arraylen ? array[i] : NULL);
+
+	    index = -1;
+	    realret = findrelposbt(tree, &v, rels[j], &index);
+	    if (realret != ret || (ret && index != i))
+		error("find(%d,%s) gave %p(%d) should be %p(%d)",
+		      v, relnames[j], realret, index, ret, i);
+
+	    /* The same again, by explicit comparison and without
+	     * asking for the index. */
+	    realret = findcmprelbt(tree, &v, mycmp, NULL, rels[j]);
+	    if (realret != ret)
+		error("findcmp(%d,%s) gave %p should be %p",
+		      v, relnames[j], realret, ret);
+	}
+    }
+
+    realret = findrelposbt(tree, NULL, REL234_GT, &index);
+    if (arraylen ? (realret != array[0] || index != 0) : realret != NULL)
+	error("find(NULL,GT) gave %p(%d)", realret, index);
+    realret = findrelposbt(tree, NULL, REL234_LT, &index);
+    if (arraylen ? (realret != array[arraylen-1] || index != arraylen-1) :
+	realret != NULL)
+	error("find(NULL,LT) gave %p(%d)", realret, index);
+}
+
+static int ncopied;
+static void *copyelem(void *state, void *e) {
+    (void)state;
+    ncopied++;
+    return e;
+}
+
+/*
+ * Split a copy of t at every possible point, and join the halves
+ * back together, alternating between the two kinds of join. For a
+ * sorted tree, also split it by value.
+ */
+static void splittest(btree *t, void **array, int arraylen) {
+    int i, j, v, p;
+    btree *t3, *t4;
+
+    for (i = 0; i <= arraylen; i++) {
+	ncopied = 0;
+	t3 = copybt(t, (i & 1) ? copyelem : NULL, NULL);
+	if ((i & 1) && ncopied != arraylen)
+	    error("copy: copied %d of %d elements", ncopied, arraylen);
+	verifytree(t3, array, arraylen);
+
+	t4 = splitposbt(t3, i, (i & 2) != 0);
+	if (i & 2) {
+	    verifytree(t4, array, i);
+	    verifytree(t3, array+i, arraylen-i);
+	    if (joinbtr(t4, t3) != t3)
+		error("joinbtr failed");
+	    verifytree(t3, array, arraylen);
+	    freebt(t4);
+	} else {
+	    verifytree(t3, array, i);
+	    verifytree(t4, array+i, arraylen-i);
+	    if (joinbt(t3, t4) != t3)
+		error("joinbt failed");
+	    verifytree(t3, array, arraylen);
+	    freebt(t4);
+	}
+	freebt(t3);
+    }
+
+    if (!t->cmp && !t->keyfn)
+	return;
+    for (v = 0; v <= NVALS + 1; v += 7) {
+	for (j = 1; j < (int)lenof(rels); j++) {
+	    /*
+	     * The tree keeps the elements which stand in the given
+	     * relation to v, and the rest are split off.
+	     */
+	    p = findindex(v, (rels[j] == REL234_LT || rels[j] == REL234_GE) ?
+			  REL234_LT : REL234_LE) + 1;
+	    t3 = copybt(t, NULL, NULL);
+	    t4 = splitbt(t3, &v, rels[j]);
+	    if (rels[j] == REL234_LT || rels[j] == REL234_LE) {
+		verifytree(t3, array, p);
+		verifytree(t4, array+p, arraylen-p);
+	    } else {
+		verifytree(t4, array, p);
+		verifytree(t3, array+p, arraylen-p);
+	    }
+	    freebt(t3);
+	    freebt(t4);
+	}
+    }
+}
+
+/*
+ * Bulk-build a tree of n elements with values drawn from 1..range,
+ * and check it holds the first of each run of equal values, with
+ * the others left after it in the array.
+ */
+static void buildtest(int kind, int n, int range, unsigned *seed) {
+    int *vs = snewn(n + 1, int);
+    void **elems = snewn(n + 1, void *), **orig = snewn(n + 1, void *);
+    bool *kept = snewn(n + 1, bool);
+    btree *t = newtestbt(kind);
+    int i, j, count;
+
+    for (i = 0; i < n; i++) {
+	vs[i] = 1 + randomnumber(seed) % range;
+	orig[i] = elems[i] = &vs[i];
+	kept[i] = false;
+    }
+    buildbt(t, elems, n);
+    count = countbt(t);
+
+    /* Work out which elements should have been kept. */
+    arraylen = 0;
+    for (i = 0; i < n; i++) {
+	if (kind != UNSORTED) {
+	    for (j = 0; j < i; j++)
+		if (vs[j] == vs[i])
+		    break;
+	    if (j < i)
+		continue;
+	}
+	kept[i] = true;
+	if (arraysize < arraylen+1) {
+	    arraysize = arraylen+1+256;
+	    array = sresize(array, arraysize, void *);
+	}
+	j = (kind == UNSORTED ? arraylen : arraypos(vs[i]));
+	memmove(array + j + 1, array + j, (arraylen - j) * sizeof(void *));
+	array[j] = orig[i];
+	arraylen++;
+    }
+    verifytree(t, array, arraylen);
+    for (i = 0; i < count && i < arraylen; i++)
+	if (elems[i] != array[i])
+	    error("build %d: kept element %d is %p, should be %p",
+		  n, i, elems[i], array[i]);
+    for (i = count; i < n; i++)
+	if (kept[(int *)elems[i] - vs])
+	    error("build %d: element %d after the tree was kept", n, i);
+
+    freebt(t);
+    sfree(vs);
+    sfree(elems);
+    sfree(orig);
+    sfree(kept);
+}
+
+static void randomtest(int kind, int ntrials, unsigned *seed) {
+    int i, j, k;
+
+    tree = newtestbt(kind);
+    arraylen = 0;
+    verify();
+    for (i = 0; i < ntrials; i++) {
+	j = 1 + randomnumber(seed) % NVALS;
+	if (kind == UNSORTED) {
+	    k = randomnumber(seed) % (arraylen + 1);
+	    if (arraylen > NVALS || (arraylen && (randomnumber(seed) & 3) == 0))
+		delpostest(k % arraylen, false);
+	    else
+		addpostest(&vals[j], k);
+	} else {
+	    k = arraypos(j);
+	    if (k < arraylen && VAL(array[k]) == j)
+		deltest(&vals[j], (i & 1) != 0);
+	    else
+		addtest(&vals[j]);
+	    if (i % 16 == 0)
+		findtest();
+	}
+	if (i % 500 == 0)
+	    splittest(tree, array, arraylen);
+    }
+    if (kind != UNSORTED)
+	findtest();
+    splittest(tree, array, arraylen);
+
+    while (arraylen > 0)
+	delpostest(randomnumber(seed) % arraylen, kind != UNSORTED);
+    freebt(tree);
+}
+
+/*
+ * Join trees of all sorts of different sizes and shapes, some built
+ * in bulk (with nodes as full as they go) and some built one
+ * element at a time.
+ */
+static void jointest(unsigned *seed) {
+    int i, j, n1, n2, n;
+    btree *t1, *t2;
+    void **elems = snewn(2 * NVALS, void *);
+
+    for (i = 0; i < 200; i++) {
+	n1 = randomnumber(seed) % NVALS;
+	n2 = randomnumber(seed) % NVALS;
+	t1 = newtestbt(UNSORTED);
+	t2 = newtestbt(UNSORTED);
+	for (j = 0; j < n1 + n2; j++)
+	    elems[j] = &vals[1 + j % NVALS];
+	if (i & 1)
+	    buildbt(t1, elems, n1);
+	else
+	    for (j = 0; j < n1; j++)
+		addposbt(t1, elems[j], j);
+	if (i & 2)
+	    buildbt(t2, elems + n1, n2);
+	else
+	    for (j = 0; j < n2; j++)
+		addposbt(t2, elems[n1 + j], j);
+	n = n1 + n2;
+	if (i & 4) {
+	    joinbtr(t1, t2);
+	    verifytree(t2, elems, n);
+	    verifytree(t1, elems, 0);
+	} else {
+	    joinbt(t1, t2);
+	    verifytree(t1, elems, n);
+	    verifytree(t2, elems, 0);
+	}
+	freebt(t1);
+	freebt(t2);
+    }
+
+    /* Sorted trees must refuse to join out of order. */
+    t1 = newtestbt(SORTED);
+    t2 = newtestbt(KEYED);
+    addbt(t1, &vals[2]);
+    addbt(t2, &vals[2]);
+    elems[0] = &vals[2];
+    if (joinbt(t1, t2) || joinbtr(t1, t2))
+	error("join of out-of-order trees succeeded");
+    verifytree(t1, elems, 1);
+    verifytree(t2, elems, 1);
+    freebt(t1);
+    freebt(t2);
+
+    sfree(elems);
+}
+
+/*
+ * Timing comparison with tree234, on the sort of data that Halibut
+ * keeps in its trees: glyph widths keyed by glyph number, kerning
+ * pairs keyed by a pair of glyph numbers, and strings.
+ */
+typedef struct {
+    unsigned long key;
+    char name[32];
+} benchelem;
+
+static int benchcmp(const void *av, const void *bv, void *cmpctx) {
+    const benchelem *a = (const benchelem *)av, *b = (const benchelem *)bv;
+    (void)cmpctx;
+    return (a->key < b->key ? -1 : a->key > b->key ? +1 : 0);
+}
+static int benchstrcmp(const void *av, const void *bv, void *cmpctx) {
+    const benchelem *a = (const benchelem *)av, *b = (const benchelem *)bv;
+    (void)cmpctx;
+    return strcmp(a->name, b->name);
+}
+static unsigned long benchkey(const void *e) {
+    return ((const benchelem *)e)->key;
+}
+
+#define BENCH_FINDS 1000000
+
+static double benchtime(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void benchone(const char *name, int n, bool strings, unsigned *seed) {
+    benchelem *es = snewn(n, benchelem);
+    int *order = snewn(BENCH_FINDS, int);
+    tree234 *t234;
+    btree *tbt, *tkey;
+    double best[3][2];
+    int i, j, r;
+    clock_t start;
+    volatile void *sink;
+
+    for (i = 0; i < n; i++) {
+	if (!strcmp(name, "kern pairs"))
+	    es[i].key = ((unsigned long)(randomnumber(seed) % 4096) << 16 |
+			 (randomnumber(seed) % 4096));
+	else
+	    es[i].key = i * 3 + 1;
+	sprintf(es[i].name, "g%05lu_%d", es[i].key, i);
+    }
+    for (i = 0; i < BENCH_FINDS; i++)
+	order[i] = (randomnumber(seed) * 32768 + randomnumber(seed)) % n;
+    for (i = 0; i < 3; i++)
+	best[i][0] = best[i][1] = 1e9;
+
+    for (r = 0; r < 5; r++) {
+	double tm;
+
+	start = clock();
+	t234 = newtree234(strings ? benchstrcmp : benchcmp, NULL);
+	for (i = 0; i < n; i++)
+	    add234(t234, &es[i]);
+	if ((tm = benchtime(start)) < best[0][0]) best[0][0] = tm;
+
+	start = clock();
+	tbt = newbt(strings ? benchstrcmp : benchcmp, NULL);
+	for (i = 0; i < n; i++)
+	    addbt(tbt, &es[i]);
+	if ((tm = benchtime(start)) < best[1][0]) best[1][0] = tm;
+
+	start = clock();
+	tkey = newkeyedbt(benchkey);
+	for (i = 0; i < n && !strings; i++)
+	    addbt(tkey, &es[i]);
+	if ((tm = benchtime(start)) < best[2][0]) best[2][0] = tm;
+
+	start = clock();
+	for (j = 0; j < BENCH_FINDS; j++)
+	    sink = find234(t234, &es[order[j]]);
+	if ((tm = benchtime(start)) < best[0][1]) best[0][1] = tm;
+
+	start = clock();
+	for (j = 0; j < BENCH_FINDS; j++)
+	    sink = findbt(tbt, &es[order[j]]);
+	if ((tm = benchtime(start)) < best[1][1]) best[1][1] = tm;
+
+	start = clock();
+	for (j = 0; j < BENCH_FINDS && !strings; j++)
+	    sink = findbt(tkey, &es[order[j]]);
+	if ((tm = benchtime(start)) < best[2][1]) best[2][1] = tm;
+
+	freetree234(t234);
+	freebt(tbt);
+	freebt(tkey);
+    }
+    (void)sink;
+
+    printf("%-12s %6d  %8.1f %8.1f", name, n,
+	   best[0][1] * 1e9 / BENCH_FINDS, best[1][1] * 1e9 / BENCH_FINDS);
+    if (strings)
+	printf("        -");
+    else
+	printf(" %8.1f", best[2][1] * 1e9 / BENCH_FINDS);
+    printf("   %7.2f %7.2f", best[0][0] * 1e3, best[1][0] * 1e3);
+    if (strings)
+	printf("       -\n");
+    else
+	printf(" %7.2f\n", best[2][0] * 1e3);
+
+    sfree(es);
+    sfree(order);
+}
+
+static void bench(void) {
+    unsigned seed = 1;
+
+    printf("%29s %26s\n", "ns per find", "ms to add all");
+    printf("%-12s %6s  %8s %8s %8s   %7s %7s %7s\n", "", "n",
+	   "tree234", "B-tree", "keyed", "tree234", "B-tree", "keyed");
+    benchone("glyph widths", 300, false, &seed);
+    benchone("glyph widths", 20000, false, &seed);
+    benchone("kern pairs", 1000, false, &seed);
+    benchone("kern pairs", 100000, false, &seed);
+    benchone("strings", 50000, true, &seed);
+}
+
+int main(int argc, char **argv) {
+    unsigned seed = 0;
+    int i, kind;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+	bench();
+	return 0;
+    }
+
+    for (i = 0; i < (int)lenof(vals); i++)
+	vals[i] = i;
+
+    for (kind = SORTED; kind <= UNSORTED; kind++) {
+	printf("%s trees\n", kindnames[kind]);
+	randomtest(kind, 3000, &seed);
+	for (i = 0; i <= 4000; i += (i < 100 ? 1 : 97))
+	    buildtest(kind, i, kind == UNSORTED ? NVALS : 1 + i / 2, &seed);
+    }
+    printf("joins\n");
+    jointest(&seed);
+
+    sfree(array);
+    printf("BT_DEGREE %d: %d errors\n", BT_DEGREE, nerrors);
+    return nerrors != 0;
+}
+
+#endif
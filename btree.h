@@ -0,0 +1,146 @@
+/*
+ * btree.h: header defining functions in btree.c.
+ *
+ * These are counted B-trees with the same interface as the 2-3-4
+ * trees in tree234.h, apart from the names: each function here is
+ * named after its tree234 counterpart with `bt' in place of `234'
+ * (and `tree' dropped where it would be doubled up). The compare
+ * and copy function types and the REL234_* relations are shared.
+ *
+ * The difference is in the shape. A 2-3-4 tree node holds at most
+ * three elements, so finding something means a long chain of
+ * pointers to follow; a B-tree node holds dozens, in arrays that
+ * are scanned in one go, so the tree is only a few levels deep.
+ * That makes a B-tree the better choice for big tables which are
+ * built once and then looked up in a lot.
+ *
+ * A B-tree can also be `keyed': instead of a compare function, it
+ * has a function giving each element an integer key, and it's
+ * sorted by that. The keys are kept in the nodes next to the
+ * elements, so a lookup compares integers in place without making
+ * any function calls or touching the elements at all.
+ */
+
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stdbool.h>
+
+#include "tree234.h"
+
+/*
+ * This typedef is opaque outside btree.c itself.
+ */
+typedef struct btree_Tag btree;
+
+typedef unsigned long (*keyfnbt)(const void *element);
+
+/*
+ * Create a B-tree. If `cmp' is NULL, the tree is unsorted, and
+ * lookups by key will fail: you can only look things up by numeric
+ * index, and you have to use addposbt() and delposbt().
+ */
+btree *newbt(cmpfn234 cmp, void *cmpctx);
+
+/*
+ * Create a keyed B-tree, which is sorted into order of the keys
+ * `keyfn' returns. Two elements with the same key compare equal.
+ *
+ * The key of an element must not change while it's in the tree.
+ * When something is looked up, `keyfn' is called on the element
+ * passed in, so that only needs to be filled in enough to have
+ * the right key.
+ *
+ * Passing a compare function to the findcmp*bt() and splitcmpbt()
+ * functions works as normal, comparing elements rather than keys.
+ */
+btree *newkeyedbt(keyfnbt keyfn);
+
+/*
+ * Fill an empty B-tree in one go from an array of n elements, which
+ * is much quicker than adding them one at a time. This works just
+ * like buildtree234(): a sorted tree has the array sorted in place
+ * first, and where several elements compare equal, only the first
+ * goes into the tree, and the others are moved to the end of the
+ * array after the countbt() elements that are in the tree.
+ */
+void buildbt(btree *t, void **elems, int n);
+
+/*
+ * Free a B-tree (not including freeing the elements).
+ */
+void freebt(btree *t);
+
+/*
+ * Add an element e to a sorted B-tree t. Returns e on success, or
+ * if an existing element compares equal, returns that.
+ */
+void *addbt(btree *t, void *e);
+
+/*
+ * Add an element e to an unsorted B-tree t. Returns e on success,
+ * NULL on failure. (Failure should only occur if the index is out
+ * of range or the tree is sorted.)
+ *
+ * Index range can be from 0 to the tree's current element count,
+ * inclusive.
+ */
+void *addposbt(btree *t, void *e, int index);
+
+/*
+ * Look up the element at a given numeric index in a B-tree.
+ * Returns NULL if the index is out of range.
+ */
+void *indexbt(btree *t, int index);
+
+/*
+ * Find an element e in a sorted B-tree t. These behave exactly like
+ * find234() and friends, which see.
+ */
+void *findbt(btree *t, const void *e);
+void *findrelbt(btree *t, const void *e, int relation);
+void *findposbt(btree *t, const void *e, int *index);
+void *findrelposbt(btree *t, const void *e, int relation, int *index);
+void *findcmpbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx);
+void *findcmprelbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx,
+		   int relation);
+void *findcmpposbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx,
+		   int *index);
+void *findcmprelposbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx,
+		      int relation, int *index);
+
+/*
+ * Delete an element e in a B-tree, by value (delbt, sorted trees
+ * only) or by index (delposbt). Returns the element deleted, or
+ * NULL if it wasn't there.
+ */
+void *delbt(btree *t, void *e);
+void *delposbt(btree *t, int index);
+
+/*
+ * Return the total element count of a B-tree.
+ */
+int countbt(btree *t);
+
+/*
+ * Split a B-tree into two valid B-trees. These behave like
+ * splitpos234(), split234() and splitcmp234().
+ */
+btree *splitposbt(btree *t, int index, bool before);
+btree *splitbt(btree *t, const void *e, int rel);
+btree *splitcmpbt(btree *t, const void *e, cmpfn234 cmp, void *cmpctx,
+		  int rel);
+
+/*
+ * Join two B-trees together into a single one, like join234() and
+ * join234r().
+ */
+btree *joinbt(btree *t1, btree *t2);
+btree *joinbtr(btree *t1, btree *t2);
+
+/*
+ * Make a complete copy of a B-tree, like copytree234().
+ */
+btree *copybt(btree *t, copyfn234 copyfn, void *copyfnstate);
+
+#endif /* BTREE_H */
@@ -83,7 +83,8 @@ static bool write_big5(charset_spec const *charset, long int input_chr,
 }
 
 const charset_spec charset_CS_BIG5 = {
-    CS_BIG5, read_big5, write_big5, NULL
+    CS_BIG5, read_big5, write_big5, NULL,
+    NULL, NULL
 };
 
 #else /* ENUM_CHARSETS */
@@ -84,7 +84,8 @@ static bool write_cp949(charset_spec const *charset, long int input_chr,
 }
 
 const charset_spec charset_CS_CP949 = {
-    CS_CP949, read_cp949, write_cp949, NULL
+    CS_CP949, read_cp949, write_cp949, NULL,
+    NULL, NULL
 };
 
 #else /* ENUM_CHARSETS */
@@ -152,7 +152,8 @@ static const struct euc euc_cn = {
     {2,0,0}, euc_cn_to_ucs, euc_cn_from_ucs
 };
 const charset_spec charset_CS_EUC_CN = {
-    CS_EUC_CN, read_euc, write_euc, &euc_cn
+    CS_EUC_CN, read_euc, write_euc, &euc_cn,
+    NULL, NULL
 };
 
 /*
@@ -178,7 +179,8 @@ static const struct euc euc_kr = {
     {2,0,0}, euc_kr_to_ucs, euc_kr_from_ucs
 };
 const charset_spec charset_CS_EUC_KR = {
-    CS_EUC_KR, read_euc, write_euc, &euc_kr
+    CS_EUC_KR, read_euc, write_euc, &euc_kr,
+    NULL, NULL
 };
 
 /*
@@ -223,7 +225,8 @@ static const struct euc euc_jp = {
     {2,1,2}, euc_jp_to_ucs, euc_jp_from_ucs
 };
 const charset_spec charset_CS_EUC_JP = {
-    CS_EUC_JP, read_euc, write_euc, &euc_jp
+    CS_EUC_JP, read_euc, write_euc, &euc_jp,
+    NULL, NULL
 };
 
 /*
@@ -259,7 +262,8 @@ static const struct euc euc_tw = {
     {2,3,0}, euc_tw_to_ucs, euc_tw_from_ucs
 };
 const charset_spec charset_CS_EUC_TW = {
-    CS_EUC_TW, read_euc, write_euc, &euc_tw
+    CS_EUC_TW, read_euc, write_euc, &euc_tw,
+    NULL, NULL
 };
 
 #else /* ENUM_CHARSETS */
@@ -2,6 +2,8 @@
  * fromucs.c - convert Unicode to other character sets.
  */
 
+#include <limits.h>
+
 #include "charset.h"
 #include "internal.h"
 
@@ -52,9 +54,30 @@ int charset_from_unicode(const wchar_t **input, int *inlen,
 	*error = false;
 
     while (*inlen > 0) {
-	int lenbefore = param.writtenlen;
+	int lenbefore;
 	bool ret;
 
+	if (input && spec->writebuf && param.output && param.outlen != 0) {
+	    /*
+	     * Convert as much as the charset's buffer-oriented fast
+	     * path is willing to handle, and fall back to the
+	     * single-character function for whatever it stopped at.
+	     */
+	    int n = spec->writebuf(spec, input, inlen, param.output,
+				   param.outlen < 0 ? INT_MAX : param.outlen,
+				   &localstate);
+	    param.output += n;
+	    if (param.outlen > 0)
+		param.outlen -= n;
+	    param.writtenlen += n;
+	    if (state)
+		*state = localstate;   /* structure copy */
+	    if (*inlen <= 0)
+		break;
+	}
+
+	lenbefore = param.writtenlen;
+
 	if (input)
 	    ret = spec->write(spec, **input, &localstate,
 			      charset_emit, &param);
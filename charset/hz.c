@@ -132,7 +132,8 @@ static bool write_hz(charset_spec const *charset, long int input_chr,
 }
 
 const charset_spec charset_CS_HZ = {
-    CS_HZ, read_hz, write_hz, NULL
+    CS_HZ, read_hz, write_hz, NULL,
+    NULL, NULL
 };
 
 #else /* ENUM_CHARSETS */
@@ -45,6 +45,34 @@ struct charset_spec {
                   charset_state *state,
                   void (*emit)(void *ctx, long int output), void *emitctx);
     void const *data;
+
+    /*
+     * Optional buffer-oriented versions of `read' and `write', which
+     * convert a whole run of input at once instead of making an
+     * indirect call per byte in and per character out. Either may
+     * be NULL, in which case the single-character functions above
+     * are used throughout.
+     *
+     * These functions convert as much of the input as they can,
+     * advancing `*input' and decrementing `*inlen' to show how much
+     * they consumed, and return the number of output units they
+     * wrote. They stop when the input is exhausted, when there is
+     * no room in the output for the next whole character, or on
+     * reaching anything they would rather leave to the
+     * single-character function (encoding errors, unrepresentable
+     * characters, incomplete sequences, shift states and so on).
+     * So it is always acceptable for them to return having
+     * consumed nothing at all; the caller will then feed the next
+     * unit through `read' or `write' and try again afterwards.
+     *
+     * `output' is never NULL, and `outlen' is always positive.
+     */
+    int (*readbuf)(charset_spec const *charset,
+                   const unsigned char **input, int *inlen,
+                   wchar_t *output, int outlen, charset_state *state);
+    int (*writebuf)(charset_spec const *charset,
+                    const wchar_t **input, int *inlen,
+                    char *output, int outlen, charset_state *state);
 };
 
 /*
@@ -88,6 +116,12 @@ void read_sbcs(charset_spec const *charset, long int input_chr,
 bool write_sbcs(charset_spec const *charset, long int input_chr,
                 charset_state *state,
                 void (*emit)(void *ctx, long int output), void *emitctx);
+int readbuf_sbcs(charset_spec const *charset,
+                 const unsigned char **input, int *inlen,
+                 wchar_t *output, int outlen, charset_state *state);
+int writebuf_sbcs(charset_spec const *charset,
+                  const wchar_t **input, int *inlen,
+                  char *output, int outlen, charset_state *state);
 long int sbcs_to_unicode(const struct sbcs_data *sd, long int input_chr);
 long int sbcs_from_unicode(const struct sbcs_data *sd, long int input_chr);
 
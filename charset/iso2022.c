@@ -978,6 +978,101 @@ static void write_to_pointer(void *ctx, long int output)
     *(*ptr)++ = output;
 }
 
+/*
+ * Work out which subcharset an output character belongs to: return
+ * the first one in preference order that is enabled in `mode' and
+ * can represent it, and fill in its byte values in *c1 and *c2 (the
+ * latter zero for single-byte subcharsets). Returns
+ * lenof(iso2022_subcharsets) if nothing will do.
+ */
+static int find_subcharset(struct iso2022_mode const *mode,
+			   long int input_chr, long int *c1, long int *c2)
+{
+    int i;
+    struct iso2022_subcharset const *subcs;
+    to_dbcs_planar_t last_planar_dbcs = NULL;
+    int last_p, last_r, last_c;
+
+    /*
+     * The first subcharset in the list is ASCII, so printable ASCII
+     * characters need no searching for unless it's been disabled.
+     */
+    if (input_chr > 0x20 && input_chr < 0x7f &&
+	(mode->enable_mask & (1 << iso2022_subcharsets[0].enable))) {
+	*c1 = input_chr;
+	*c2 = 0;
+	return 0;
+    }
+
+    for (i = 0; (unsigned)i < lenof(iso2022_subcharsets); i++) {
+	subcs = &iso2022_subcharsets[i];
+	if (!(mode->enable_mask & (1 << subcs->enable)))
+	    continue;		       /* this charset is disabled */
+	if (subcs->sbcs_base) {
+	    *c1 = sbcs_from_unicode(subcs->sbcs_base, input_chr);
+	    *c1 -= subcs->offset;
+	    if (*c1 >= 0x20 && *c1 <= 0x7f) {
+		*c2 = 0;
+		break;
+	    }
+	} else if (subcs->to_dbcs) {
+	    if (subcs->to_dbcs_plane >= 0) {
+		/*
+		 * Since multiplanar DBCSes almost by definition
+		 * involve several entries in iso2022_subcharsets
+		 * with the same to_dbcs function and different
+		 * plane values, we remember the last such function
+		 * we called and what its result was, so that we
+		 * don't (for example) have to call
+		 * unicode_to_cns11643 seven times.
+		 */
+		if (last_planar_dbcs != REPLANARISE(subcs->to_dbcs)) {
+		    last_planar_dbcs = REPLANARISE(subcs->to_dbcs);
+		    if (!last_planar_dbcs(input_chr,
+					  &last_p, &last_r, &last_c))
+			last_p = -1;
+		}
+	    } else {
+		last_p = subcs->to_dbcs_plane;
+		if (!subcs->to_dbcs(input_chr, &last_r, &last_c))
+		    last_p = 0;	       /* cannot match since to_dbcs_plane<0 */
+	    }
+
+	    if (last_p == subcs->to_dbcs_plane) {
+		*c1 = last_r - subcs->offset;
+		*c2 = last_c - subcs->offset;
+		assert(*c1 >= 0x20 && *c1 <= 0x7f);
+		assert(*c2 >= 0x20 && *c2 <= 0x7f);
+		break;
+	    }
+	}
+    }
+
+    return i;
+}
+
+/*
+ * Decide whether output subcharset i should be designated into
+ * G0/GL or G1/GR.
+ *
+ * Any S6 or M6 subcharset has to go in GR because it won't fit in
+ * GL. In addition, the compound text rules state that any
+ * single-byte subcharset defined as the right-hand half of some
+ * SBCS must go in GR.
+ *
+ * M4 subcharsets can go in either half according to the rules. I
+ * choose to put them in GR always because it's a simple policy
+ * with reasonable behaviour (facilitates switching between them
+ * and ASCII).
+ */
+static bool subcharset_is_right(int i)
+{
+    struct iso2022_subcharset const *subcs = &iso2022_subcharsets[i];
+
+    return (subcs->type == S6 || subcs->type == M6 || subcs->type == M4 ||
+	    (subcs->sbcs_base && subcs->offset == 0x80));
+}
+
 /*
  * Writing full ISO-2022 is not useful in very many circumstances.
  * One of the few situations in which it _is_ useful is generating
@@ -1003,8 +1098,6 @@ static bool write_iso2022(charset_spec const *charset, long int input_chr,
     int i;
     struct iso2022_subcharset const *subcs;
     struct iso2022_mode const *mode = (struct iso2022_mode *)charset->data;
-    to_dbcs_planar_t last_planar_dbcs = NULL;
-    int last_p, last_r, last_c;
     long int c1, c2;
 
     /*
@@ -1070,70 +1163,10 @@ static bool write_iso2022(charset_spec const *charset, long int input_chr,
      * Analyse the input character and work out which subcharset it
      * belongs to.
      */
-    for (i = 0; (unsigned)i < lenof(iso2022_subcharsets); i++) {
-	subcs = &iso2022_subcharsets[i];
-	if (!(mode->enable_mask & (1 << subcs->enable)))
-	    continue;		       /* this charset is disabled */
-	if (subcs->sbcs_base) {
-	    c1 = sbcs_from_unicode(subcs->sbcs_base, input_chr);
-	    c1 -= subcs->offset;
-	    if (c1 >= 0x20 && c1 <= 0x7f) {
-		c2 = 0;
-		break;
-	    }
-	} else if (subcs->to_dbcs) {
-	    if (subcs->to_dbcs_plane >= 0) {
-		/*
-		 * Since multiplanar DBCSes almost by definition
-		 * involve several entries in iso2022_subcharsets
-		 * with the same to_dbcs function and different
-		 * plane values, we remember the last such function
-		 * we called and what its result was, so that we
-		 * don't (for example) have to call
-		 * unicode_to_cns11643 seven times.
-		 */
-		if (last_planar_dbcs != REPLANARISE(subcs->to_dbcs)) {
-		    last_planar_dbcs = REPLANARISE(subcs->to_dbcs);
-		    if (!last_planar_dbcs(input_chr,
-					  &last_p, &last_r, &last_c))
-			last_p = -1;
-		}
-	    } else {
-		last_p = subcs->to_dbcs_plane;
-		if (!subcs->to_dbcs(input_chr, &last_r, &last_c))
-		    last_p = 0;	       /* cannot match since to_dbcs_plane<0 */
-	    }
-
-	    if (last_p == subcs->to_dbcs_plane) {
-		c1 = last_r - subcs->offset;
-		c2 = last_c - subcs->offset;
-		assert(c1 >= 0x20 && c1 <= 0x7f);
-		assert(c2 >= 0x20 && c2 <= 0x7f);
-		break;
-	    }
-	}
-    }
+    i = find_subcharset(mode, input_chr, &c1, &c2);
 
     if ((unsigned)i < lenof(iso2022_subcharsets)) {
-	bool right;
-
-	/*
-	 * Our character is represented by c1 (and possibly also
-	 * c2) in subcharset `subcs'. So now we must decide whether
-	 * to designate that character set into G0/GL or G1/GR.
-	 * 
-	 * Any S6 or M6 subcharset has to go in GR because it won't
-	 * fit in GL. In addition, the compound text rules state
-	 * that any single-byte subcharset defined as the
-	 * right-hand half of some SBCS must go in GR.
-	 * 
-	 * M4 subcharsets can go in either half according to the
-	 * rules. I choose to put them in GR always because it's a
-	 * simple policy with reasonable behaviour (facilitates
-	 * switching between them and ASCII).
-	 */
-	right = (subcs->type == S6 || subcs->type == M6 || subcs->type == M4 ||
-		 (subcs->sbcs_base && subcs->offset == 0x80));
+	bool right = subcharset_is_right(i);
 
 	/*
 	 * If we're in a DOCS mode, leave it.
@@ -1214,6 +1247,131 @@ static bool write_iso2022(charset_spec const *charset, long int input_chr,
     return false;
 }
 
+/*
+ * Buffer-oriented versions of read_iso2022 and write_iso2022. These
+ * deal only with graphic characters and ordinary controls, starting
+ * with nothing half-accumulated, in whatever subcharsets are
+ * already designated and invoked. Escape sequences, shifts, DOCS
+ * and anything erroneous are left to the functions above, and
+ * these carry on from whatever state they leave behind.
+ */
+static int readbuf_iso2022(charset_spec const *charset,
+			   const unsigned char **input, int *inlen,
+			   wchar_t *output, int outlen, charset_state *state)
+{
+    const unsigned char *p = *input, *end = p + *inlen;
+    struct iso2022_subcharset const *gl, *gr, *subcs;
+    int n = 0;
+
+    UNUSEDARG(charset);
+
+    if (state->s1 == 0 || state->s0 != 0)
+	return 0;		       /* not started, or mid-sequence */
+
+    gl = &iso2022_subcharsets[(state->s1 >> ((state->s1 >> 30) * 7)) & 0x7f];
+    gr = &iso2022_subcharsets[(state->s1 >> (((state->s1 >> 28) & 3) * 7)) &
+			      0x7f];
+
+    while (p < end && n < outlen) {
+	int c = p[0], c7 = c & 0x7f, len = 1;
+	long int u;
+
+	if ((c & 0x60) == 0x00) {
+	    /* C0 or C1 control */
+	    if (c == ESC || c == LS0 || c == LS1 || c == SS2 || c == SS3)
+		break;
+	    output[n++] = c;
+	    p++;
+	    continue;
+	}
+
+	subcs = (c & 0x80 ? gr : gl);
+	if ((subcs->type == S4 || subcs->type == M4) &&
+	    (c7 == 0x20 || c7 == 0x7f)) {
+	    /* characters not in 94-char set */
+	    u = (c & 0x80 ? ERROR : c7);
+	} else if (subcs->type == M4 || subcs->type == M6) {
+	    int d, d7;
+
+	    if (end - p < 2)
+		break;
+	    d = p[1];
+	    d7 = d & 0x7f;
+	    if ((d & 0x60) == 0x00 || ((c ^ d) & 0x80) ||
+		(subcs->type == M4 && (d7 == 0x20 || d7 == 0x7f)))
+		break;
+	    u = subcs->from_dbcs(c7 + subcs->offset, d7 + subcs->offset);
+	    len = 2;
+	} else {
+	    u = (subcs->sbcs_base ?
+		 sbcs_to_unicode(subcs->sbcs_base, c7 + subcs->offset) :
+		 ERROR);
+	}
+
+	if (u == ERROR)
+	    break;		       /* let read_iso2022 report it */
+	output[n++] = u;
+	p += len;
+    }
+
+    *inlen -= p - *input;
+    *input = p;
+    return n;
+}
+
+static int writebuf_iso2022(charset_spec const *charset,
+			    const wchar_t **input, int *inlen,
+			    char *output, int outlen, charset_state *state)
+{
+    struct iso2022_mode const *mode = (struct iso2022_mode *)charset->data;
+    const wchar_t *p = *input, *end = p + *inlen;
+    char *q = output;
+
+    if (state->s1 == 0 || ((state->s1 >> 14) & 7) != 0)
+	return 0;		       /* not started, or in DOCS */
+
+    while (p < end) {
+	long int c = *p, c1, c2;
+	int i, need;
+	bool right;
+
+	if (c < 0)
+	    break;
+
+	if (c <= 0x20 || (c >= 0x7F && c < 0xA0)) {
+	    if (q - output >= outlen)
+		break;
+	    *q++ = c;
+	    p++;
+	    continue;
+	}
+
+	i = find_subcharset(mode, c, &c1, &c2);
+	if ((unsigned)i >= lenof(iso2022_subcharsets))
+	    break;		       /* DOCS or failure: up to write_iso2022 */
+	right = subcharset_is_right(i);
+
+	need = (c2 ? 2 : 1);
+	if (((state->s1 >> (right ? 24 : 17)) & 0x7F) != (unsigned)i) {
+	    struct iso2022_subcharset const *subcs = &iso2022_subcharsets[i];
+	    need += 3 + (subcs->type == M4 || subcs->type == M6) +
+		(subcs->i != 0);
+	}
+	if (outlen - (q - output) < need)
+	    break;
+
+	oselect(state, i, right, write_to_pointer, &q);
+	*q++ = (right ? c1 | 0x80 : c1);
+	if (c2)
+	    *q++ = (right ? c2 | 0x80 : c2);
+	p++;
+    }
+
+    *inlen -= p - *input;
+    *input = p;
+    return q - output;
+}
+
 /*
  * Full ISO 2022 output with all options on. Not entirely sure what
  * if anything this is useful for, but here it is anyway. All
@@ -1226,7 +1384,8 @@ static const struct iso2022_mode iso2022_all = {
 };
 
 const charset_spec charset_CS_ISO2022 = {
-    CS_ISO2022, read_iso2022, write_iso2022, &iso2022_all
+    CS_ISO2022, read_iso2022, write_iso2022, &iso2022_all,
+    readbuf_iso2022, writebuf_iso2022
 };
 
 /*
@@ -1239,7 +1398,8 @@ static const struct iso2022_mode iso2022_ctext = {
 };
 
 const charset_spec charset_CS_CTEXT = {
-    CS_CTEXT, read_iso2022, write_iso2022, &iso2022_ctext
+    CS_CTEXT, read_iso2022, write_iso2022, &iso2022_ctext,
+    readbuf_iso2022, writebuf_iso2022
 };
 
 #ifdef TESTMODE
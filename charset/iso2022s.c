@@ -491,7 +491,8 @@ static const struct iso2022 iso2022jp = {
     iso2022jp_to_ucs, iso2022jp_from_ucs
 };
 const charset_spec charset_CS_ISO2022_JP = {
-    CS_ISO2022_JP, read_iso2022s, write_iso2022s, &iso2022jp
+    CS_ISO2022_JP, read_iso2022s, write_iso2022s, &iso2022jp,
+    NULL, NULL
 };
 
 /*
@@ -533,7 +534,8 @@ static const struct iso2022 iso2022kr = {
     iso2022kr_to_ucs, iso2022kr_from_ucs
 };
 const charset_spec charset_CS_ISO2022_KR = {
-    CS_ISO2022_KR, read_iso2022s, write_iso2022s, &iso2022kr
+    CS_ISO2022_KR, read_iso2022s, write_iso2022s, &iso2022kr,
+    NULL, NULL
 };
 
 #else /* ENUM_CHARSETS */
@@ -322,10 +322,12 @@ bool write_iso6937(charset_spec const *charset, long int input_chr,
 extern const sbcs_data sbcsdata_ISO6937, sbcsdata_ISO6937_EURO;
 
 const charset_spec charset_CS_ISO6937 = {
-    CS_ISO6937, read_iso6937, write_iso6937, &sbcsdata_ISO6937
+    CS_ISO6937, read_iso6937, write_iso6937, &sbcsdata_ISO6937,
+    NULL, NULL
 };
 const charset_spec charset_CS_ISO6937_EURO = {
-    CS_ISO6937_EURO, read_iso6937, write_iso6937, &sbcsdata_ISO6937_EURO
+    CS_ISO6937_EURO, read_iso6937, write_iso6937, &sbcsdata_ISO6937_EURO,
+    NULL, NULL
 };
 
 #else /* ENUM_CHARSETS */
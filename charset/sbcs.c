@@ -28,6 +28,29 @@ void read_sbcs(charset_spec const *charset, long int input_chr,
     emit(emitctx, sbcs_to_unicode(sd, input_chr));
 }
 
+int readbuf_sbcs(charset_spec const *charset,
+                 const unsigned char **input, int *inlen,
+                 wchar_t *output, int outlen, charset_state *state)
+{
+    const struct sbcs_data *sd = charset->data;
+    const unsigned char *p = *input;
+    int n, i;
+
+    UNUSEDARG(state);
+
+    n = (*inlen < outlen ? *inlen : outlen);
+    for (i = 0; i < n; i++) {
+	unsigned long c = sd->sbcs2ucs[p[i]];
+	if (c == ERROR)
+	    break;		       /* let read_sbcs report the error */
+	output[i] = c;
+    }
+
+    *input += i;
+    *inlen -= i;
+    return i;
+}
+
 long int sbcs_from_unicode(const struct sbcs_data *sd, long int input_chr)
 {
     int i, j, k, c;
@@ -70,3 +93,33 @@ bool write_sbcs(charset_spec const *charset, long int input_chr,
     emit(emitctx, ret);
     return true;
 }
+
+int writebuf_sbcs(charset_spec const *charset,
+                  const wchar_t **input, int *inlen,
+                  char *output, int outlen, charset_state *state)
+{
+    const struct sbcs_data *sd = charset->data;
+    const wchar_t *p = *input;
+    int n, i;
+
+    UNUSEDARG(state);
+
+    n = (*inlen < outlen ? *inlen : outlen);
+    for (i = 0; i < n; i++) {
+	long int c = p[i], ret;
+
+	/*
+	 * Nearly every SBCS maps the ASCII range to itself, so check
+	 * that before bothering with the binary search.
+	 */
+	if (c >= 0 && c < 0x80 && sd->sbcs2ucs[c] == (unsigned long)c)
+	    ret = c;
+	else if ((ret = sbcs_from_unicode(sd, c)) == ERROR)
+	    break;		       /* let write_sbcs deal with it */
+	output[i] = ret;
+    }
+
+    *input += i;
+    *inlen -= i;
+    return i;
+}
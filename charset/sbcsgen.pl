@@ -173,6 +173,7 @@ sub outcharset($$$$) {
     print "};\n";
     unless ($tables_only) {
         print "const charset_spec charset_$name = {\n" .
-            "    $name, read_sbcs, write_sbcs, &sbcsdata_$name\n};\n\n";
+            "    $name, read_sbcs, write_sbcs, &sbcsdata_$name,\n" .
+            "    readbuf_sbcs, writebuf_sbcs\n};\n\n";
     }
 }
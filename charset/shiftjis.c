@@ -118,7 +118,8 @@ static bool write_sjis(charset_spec const *charset, long int input_chr,
 }
 
 const charset_spec charset_CS_SHIFT_JIS = {
-    CS_SHIFT_JIS, read_sjis, write_sjis, NULL
+    CS_SHIFT_JIS, read_sjis, write_sjis, NULL,
+    NULL, NULL
 };
 
 #else /* ENUM_CHARSETS */
@@ -2,6 +2,8 @@
  * toucs.c - convert charsets to Unicode.
  */
 
+#include <limits.h>
+
 #include "charset.h"
 #include "internal.h"
 
@@ -70,7 +72,32 @@ int charset_to_unicode(const char **input, int *inlen,
 	localstate = *state;	       /* structure copy */
 
     while (*inlen > 0) {
-	int lenbefore = param.writtenlen;
+	int lenbefore;
+
+	if (spec->readbuf && param.output && param.outlen != 0) {
+	    /*
+	     * Convert as much as the charset's buffer-oriented fast
+	     * path is willing to handle, and fall back to the
+	     * single-character function for whatever it stopped at.
+	     */
+	    const unsigned char *p = (const unsigned char *)*input;
+	    int len = *inlen;
+	    int n = spec->readbuf(spec, &p, &len, param.output,
+				  param.outlen < 0 ? INT_MAX : param.outlen,
+				  &localstate);
+	    param.output += n;
+	    if (param.outlen > 0)
+		param.outlen -= n;
+	    param.writtenlen += n;
+	    *input = (const char *)p;
+	    *inlen = len;
+	    if (state)
+		*state = localstate;   /* structure copy */
+	    if (*inlen <= 0)
+		break;
+	}
+
+	lenbefore = param.writtenlen;
 	spec->read(spec, (unsigned char)**input, &localstate,
 		   unicode_emit, &param);
 	if (param.stopped) {
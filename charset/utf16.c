@@ -203,19 +203,24 @@ static const struct utf16 utf16_littleendian_no_bom = { 0x10000, false };
 static const struct utf16 utf16_variable_endianness = { 0x30000, true };
 
 const charset_spec charset_CS_UTF16BE = {
-    CS_UTF16BE, read_utf16, write_utf16, &utf16_bigendian
+    CS_UTF16BE, read_utf16, write_utf16, &utf16_bigendian,
+    NULL, NULL
 };
 const charset_spec charset_CS_UTF16LE = {
-    CS_UTF16LE, read_utf16, write_utf16, &utf16_littleendian
+    CS_UTF16LE, read_utf16, write_utf16, &utf16_littleendian,
+    NULL, NULL
 };
 const charset_spec charset_CS_UTF16BE_NO_BOM = {
-    CS_UTF16BE_NO_BOM, read_utf16, write_utf16, &utf16_bigendian_no_bom
+    CS_UTF16BE_NO_BOM, read_utf16, write_utf16, &utf16_bigendian_no_bom,
+    NULL, NULL
 };
 const charset_spec charset_CS_UTF16LE_NO_BOM = {
-    CS_UTF16LE_NO_BOM, read_utf16, write_utf16, &utf16_littleendian_no_bom
+    CS_UTF16LE_NO_BOM, read_utf16, write_utf16, &utf16_littleendian_no_bom,
+    NULL, NULL
 };
 const charset_spec charset_CS_UTF16 = {
-    CS_UTF16, read_utf16, write_utf16, &utf16_variable_endianness
+    CS_UTF16, read_utf16, write_utf16, &utf16_variable_endianness,
+    NULL, NULL
 };
 
 #else /* ENUM_CHARSETS */
@@ -279,12 +279,172 @@ static bool write_utf7(charset_spec const *charset, long int input_chr,
     return true;
 }
 
+/*
+ * Buffer-oriented versions of read_utf7 and write_utf7. These run
+ * exactly the same state machines, keeping the state in local
+ * variables and writing straight into the output buffer, and they
+ * leave anything that would be an error to the functions above.
+ */
+static int readbuf_utf7(charset_spec const *charset,
+                        const unsigned char **input, int *inlen,
+                        wchar_t *output, int outlen, charset_state *state)
+{
+    const unsigned char *p = *input, *end = p + *inlen;
+    unsigned long s0 = state->s0, s1 = state->s1;
+    int n = 0;
+
+    UNUSEDARG(charset);
+
+    /*
+     * Every input byte produces at most one output character, so
+     * we need only check for room once per byte.
+     */
+    while (p < end && n < outlen) {
+	int c = *p;
+	unsigned long acc, hw;
+
+	if (!s0) {
+	    if (c == '+')
+		s0 = 2;
+	    else
+		output[n++] = c;
+	    p++;
+	    continue;
+	}
+
+	if (!SET_B(c)) {
+	    if (c != '-')
+		output[n++] = c;
+	    else if (s0 == 2)
+		output[n++] = '+';
+	    s0 = 0;
+	    p++;
+	    continue;
+	}
+
+	acc = (s0 == 2 ? 1 : s0);
+	acc = (acc << 6) | base64_value(c);
+	if (!(acc & 0xFFFF0000)) {
+	    s0 = acc;
+	    p++;
+	    continue;
+	}
+
+	if (acc & 0x00100000) {
+	    hw = (acc >> 4) & 0xFFFF;
+	    acc = (acc & 0xF) | 0x10;
+	} else if (acc & 0x00040000) {
+	    hw = (acc >> 2) & 0xFFFF;
+	    acc = (acc & 3) | 4;
+	} else {
+	    hw = acc & 0xFFFF;
+	    acc = 1;
+	}
+
+	if (s1) {
+	    if (hw < 0xDC00 || hw >= 0xE000)
+		break;		       /* let read_utf7 report the error */
+	    output[n++] = (((s1 & 0x3FF) << 10) | (hw & 0x3FF)) + 0x10000;
+	    s1 = 0;
+	} else if (hw >= 0xDC00 && hw < 0xE000) {
+	    break;		       /* likewise */
+	} else if (hw >= 0xD800 && hw < 0xDC00) {
+	    s1 = hw;
+	} else {
+	    output[n++] = hw;
+	}
+	s0 = acc;
+	p++;
+    }
+
+    state->s0 = s0;
+    state->s1 = s1;
+    *inlen -= p - *input;
+    *input = p;
+    return n;
+}
+
+static int writebuf_utf7(charset_spec const *charset,
+                         const wchar_t **input, int *inlen,
+                         char *output, int outlen, charset_state *state)
+{
+    const wchar_t *p = *input, *end = p + *inlen;
+    unsigned long s0 = state->s0, s1 = state->s1;
+    int n = 0;
+
+    while (p < end) {
+	long int c = *p;
+	int need;
+
+	if (c < 0 || (c >= 0xD800 && c < 0xE000) || c >= 0x110000)
+	    break;		       /* let write_utf7 refuse it */
+
+	if (SET_D(c) || (charset->charset == CS_UTF7 && SET_O(c)) ||
+	    (!s0 && c == '+')) {
+	    need = (s0 ? 2 : 0) + (c == '+' ? 2 : 1);
+	    if (outlen - n < need)
+		break;
+	    if (s0) {
+		s0 <<= 6 - s1;
+		output[n++] = base64_chars[s0 & 0x3F];
+		output[n++] = '-';
+		s0 = s1 = 0;
+	    }
+	    output[n++] = c;
+	    if (c == '+')
+		output[n++] = '-';
+	} else {
+	    unsigned long hws[2];
+	    int nhws, i;
+
+	    if (c < 0x10000) {
+		nhws = 1;
+		hws[0] = c;
+	    } else {
+		c -= 0x10000;
+		nhws = 2;
+		hws[0] = 0xD800 | ((c >> 10) & 0x3FF);
+		hws[1] = 0xDC00 | (c & 0x3FF);
+	    }
+
+	    need = (s0 ? 0 : 1) + ((s0 ? s1 : 0) + 16 * nhws) / 6;
+	    if (outlen - n < need)
+		break;
+	    if (!s0) {
+		output[n++] = '+';
+		s0 = 1;
+		s1 = 0;
+	    }
+	    for (i = 0; i < nhws; i++) {
+		s0 = (s0 << 16) | hws[i];
+		s1 += 16;
+		while (s1 >= 6) {
+		    unsigned long topbit;
+
+		    output[n++] = base64_chars[(s0 >> (s1 - 6)) & 0x3F];
+		    s1 -= 6;
+		    topbit = 1UL << s1;
+		    s0 = (s0 & (topbit-1)) | topbit;
+		}
+	    }
+	}
+	p++;
+    }
+
+    state->s0 = s0;
+    state->s1 = s1;
+    *inlen -= p - *input;
+    *input = p;
+    return n;
+}
+
 const charset_spec charset_CS_UTF7 = {
-    CS_UTF7, read_utf7, write_utf7, NULL
+    CS_UTF7, read_utf7, write_utf7, NULL, readbuf_utf7, writebuf_utf7
 };
 
 const charset_spec charset_CS_UTF7_CONSERVATIVE = {
-    CS_UTF7_CONSERVATIVE, read_utf7, write_utf7, NULL
+    CS_UTF7_CONSERVATIVE, read_utf7, write_utf7, NULL,
+    readbuf_utf7, writebuf_utf7
 };
 
 #else /* ENUM_CHARSETS */
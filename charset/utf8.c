@@ -252,6 +252,122 @@ bool write_utf8(charset_spec const *charset, long int input_chr,
     }
 }
 
+/*
+ * Buffer-oriented fast paths for UTF-8. These only handle the
+ * common case of well-formed input with the state at rest, and
+ * hand everything else (errors, overlong sequences, surrogates,
+ * sequences split across buffers) back to read_utf8 and
+ * write_utf8 above.
+ */
+static int readbuf_utf8(charset_spec const *charset,
+                        const unsigned char **input, int *inlen,
+                        wchar_t *output, int outlen, charset_state *state)
+{
+    const unsigned char *p = *input, *end = p + *inlen;
+    int n = 0;
+
+    UNUSEDARG(charset);
+
+    if (state->s0 != 0)
+	return 0;		       /* mid-character: leave to read_utf8 */
+
+    while (p < end && n < outlen) {
+	unsigned long c = p[0];
+	int len, i;
+
+	if (c < 0x80) {
+	    output[n++] = c;
+	    p++;
+	    continue;
+	} else if (c >= 0xC2 && c < 0xE0) {
+	    len = 2;
+	    c &= 0x1F;
+	} else if (c >= 0xE0 && c < 0xF0) {
+	    len = 3;
+	    c &= 0x0F;
+	} else if (c >= 0xF0 && c < 0xF5) {
+	    len = 4;
+	    c &= 0x07;
+	} else {
+	    break;
+	}
+
+	if (end - p < len)
+	    break;
+	for (i = 1; i < len; i++) {
+	    if ((p[i] & 0xC0) != 0x80)
+		break;
+	    c = (c << 6) | (p[i] & 0x3F);
+	}
+	if (i < len)
+	    break;
+
+	/*
+	 * Reject overlong forms, surrogates, the two non-characters
+	 * and anything beyond U+10FFFF, all of which read_utf8 will
+	 * turn into errors.
+	 */
+	if ((len == 3 && c < 0x800) || (len == 4 && c < 0x10000) ||
+	    (c >= 0xD800 && c < 0xE000) || c == 0xFFFE || c == 0xFFFF ||
+	    c > 0x10FFFF)
+	    break;
+
+	output[n++] = c;
+	p += len;
+    }
+
+    *inlen -= p - *input;
+    *input = p;
+    return n;
+}
+
+static int writebuf_utf8(charset_spec const *charset,
+                         const wchar_t **input, int *inlen,
+                         char *output, int outlen, charset_state *state)
+{
+    const wchar_t *p = *input, *end = p + *inlen;
+    int n = 0;
+
+    UNUSEDARG(charset);
+    UNUSEDARG(state);
+
+    while (p < end) {
+	unsigned long c = *p;
+
+	if (c < 0x80) {
+	    if (n >= outlen)
+		break;
+	    output[n++] = c;
+	} else if (c < 0x800) {
+	    if (outlen - n < 2)
+		break;
+	    output[n++] = 0xC0 | (0x1F & (c >>  6));
+	    output[n++] = 0x80 | (0x3F & (c      ));
+	} else if (c < 0x10000) {
+	    if (outlen - n < 3 || (c >= 0xD800 && c < 0xE000) ||
+		c == 0xFFFE || c == 0xFFFF)
+		break;
+	    output[n++] = 0xE0 | (0x0F & (c >> 12));
+	    output[n++] = 0x80 | (0x3F & (c >>  6));
+	    output[n++] = 0x80 | (0x3F & (c      ));
+	} else if (c < 0x110000) {
+	    if (outlen - n < 4)
+		break;
+	    output[n++] = 0xF0 | (0x07 & (c >> 18));
+	    output[n++] = 0x80 | (0x3F & (c >> 12));
+	    output[n++] = 0x80 | (0x3F & (c >>  6));
+	    output[n++] = 0x80 | (0x3F & (c      ));
+	} else {
+	    break;
+	}
+	p++;
+    }
+
+    *inlen -= p - *input;
+    *input = p;
+    return n;
+}
+
 #ifdef TESTMODE
 
 #include <stdio.h>
@@ -897,7 +1013,7 @@ int main(void)
 #endif /* TESTMODE */
 
 const charset_spec charset_CS_UTF8 = {
-    CS_UTF8, read_utf8, write_utf8, NULL
+    CS_UTF8, read_utf8, write_utf8, NULL, readbuf_utf8, writebuf_utf8
 };
 
 #else /* ENUM_CHARSETS */
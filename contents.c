@@ -55,6 +55,7 @@ static void dotext(word ***wret, wchar_t *text) {
     mnewword->next = NULL;
     mnewword->breaks = false;
     mnewword->aux = 0;
+    mnewword->index = -1;
     **wret = mnewword;
     *wret = &mnewword->next;
 }
@@ -67,6 +68,7 @@ static void dospace(word ***wret) {
     mnewword->next = NULL;
     mnewword->breaks = false;
     mnewword->aux = 0;
+    mnewword->index = -1;
     **wret = mnewword;
     *wret = &mnewword->next;
 }
@@ -0,0 +1,679 @@
+/*
+ * fontcache.c: load font files on demand, and cache their metrics
+ *
+ * Reading a font file given on the command line only goes as far as
+ * finding the font's name. Everything else - the widths, kerning
+ * pairs, ligatures and Unicode mapping - is left until something
+ * asks for the font by name, since most documents only use a few of
+ * the fonts they're given, and for a large TrueType font parsing
+ * those tables is most of the work.
+ *
+ * If the user gives us a cache directory, we also save the results
+ * of parsing each font there, in a compact binary form named after
+ * a hash of the font file, so that the next run given the same file
+ * can skip the parse altogether. Nothing goes wrong if the cache is
+ * missing, unwritable or full of rubbish: we just parse the font.
+ *
+ * A cache file is a sequence of big-endian 32-bit numbers and
+ * strings (a 16-bit length followed by that many bytes):
+ *
+ *  - magic number, file length, font name
+ *  - the font's metadata: FontBBox, CapHeight, XHeight, Ascender,
+ *    Descender, StdVW, StdHW and ItalicAngle, as decimal strings
+ *  - VM usage (TrueType only; zero otherwise)
+ *  - a table of glyph names, referred to below by index
+ *  - for TrueType, the glyph name of each glyph index in the font
+ *  - (glyph, width) pairs
+ *  - (left, right, kern) triples
+ *  - (left, right, ligature) triples
+ *  - (Unicode character, glyph) pairs
+ *  - class-based kerning tables, each giving the numbers of left
+ *    and right classes, (glyph, class) pairs for each side, and the
+ *    matrix of kerns
+ *
+ * each table preceded by its length.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "halibut.h"
+#include "paper.h"
+
+#define CACHE_MAGIC 0x48664D32	       /* "HfM2" */
+
+static char *cachedir = NULL;
+
+void set_font_cache(char const *dir)
+{
+    sfree(cachedir);
+    cachedir = dir ? dupstr(dir) : NULL;
+}
+
+font_pending *font_pending_new(bool (*parse)(font_info *, psdata *,
+					     errorstate *),
+			       char *data, size_t len, bool owned,
+			       filepos const *pos, errorstate *es)
+{
+    font_pending *fp = snew(font_pending);
+
+    fp->parse = parse;
+    fp->data = data;
+    fp->len = len;
+    fp->owned = owned;
+    fp->pos = *pos;
+    fp->es = es;
+    fp->hash[0] = '\0';
+    fp->failed = false;
+    return fp;
+}
+
+/*
+ * Work out the font file's hash, if we haven't already. This reads
+ * the whole file, so we leave it until we know there's a cache.
+ */
+static void font_hash(font_pending *fp)
+{
+    unsigned long hi = 0xCBF29CE4, lo = 0x84222325;
+    size_t i;
+
+    if (fp->hash[0])
+	return;
+
+    /*
+     * 64-bit FNV-1a, done in two halves so as not to need a 64-bit
+     * type. The prime is 2^40 + 0x1B3.
+     */
+    for (i = 0; i < fp->len; i++) {
+	unsigned long nlo, nhi;
+	lo ^= (unsigned char)fp->data[i];
+	nlo = (lo & 0xFFFF) * 0x1B3;
+	nhi = (lo >> 16) * 0x1B3 + (nlo >> 16);
+	nlo = (nlo & 0xFFFF) | ((nhi & 0xFFFF) << 16);
+	nhi = (nhi >> 16) + hi * 0x1B3 + (lo << 8);
+	lo = nlo & 0xFFFFFFFF;
+	hi = nhi & 0xFFFFFFFF;
+    }
+    sprintf(fp->hash, "%08lx%08lx", hi, lo);
+}
+
+static char *cache_filename(font_pending const *fp, char const *suffix)
+{
+    char *name = snewn(strlen(cachedir) + 40, char);
+    sprintf(name, "%s/%s%s", cachedir, fp->hash, suffix);
+    return name;
+}
+
+/*
+ * Gathering up a font's glyph names for writing out.
+ */
+struct cache_name {
+    glyph g;
+    unsigned long idx;
+};
+
+static int cache_name_cmp(const void *av, const void *bv, void *cmpctx)
+{
+    struct cache_name const *a = av, *b = bv;
+    if (a->g < b->g) return -1;
+    if (a->g > b->g) return 1;
+    return 0;
+}
+
+struct cache_writer {
+    rdstringc out;
+    tree234 *names;
+    glyph *byidx;
+    unsigned long nnames, namesize;
+};
+
+static void put32(struct cache_writer *w, unsigned long v)
+{
+    rdaddc(&w->out, (char)((v >> 24) & 0xFF));
+    rdaddc(&w->out, (char)((v >> 16) & 0xFF));
+    rdaddc(&w->out, (char)((v >> 8) & 0xFF));
+    rdaddc(&w->out, (char)(v & 0xFF));
+}
+
+static void putstr(struct cache_writer *w, char const *s)
+{
+    size_t len = strlen(s);
+    assert(len < 0x10000);
+    rdaddc(&w->out, (char)((len >> 8) & 0xFF));
+    rdaddc(&w->out, (char)(len & 0xFF));
+    while (*s)
+	rdaddc(&w->out, *s++);
+}
+
+/* Enough digits to get the same float back */
+static void putfloat(struct cache_writer *w, float f)
+{
+    char buf[40];
+    sprintf(buf, "%.9g", (double)f);
+    putstr(w, buf);
+}
+
+static unsigned long name_index(struct cache_writer *w, glyph g)
+{
+    struct cache_name *cn = snew(struct cache_name), *ret;
+
+    cn->g = g;
+    cn->idx = w->nnames;
+    ret = add234(w->names, cn);
+    if (ret != cn) {
+	sfree(cn);
+	return ret->idx;
+    }
+    if (w->nnames >= w->namesize) {
+	w->namesize = w->nnames * 3 / 2 + 64;
+	w->byidx = sresize(w->byidx, w->namesize, glyph);
+    }
+    w->byidx[w->nnames++] = g;
+    return cn->idx;
+}
+
+static void cache_write(font_info const *fi, psdata *psd)
+{
+    struct cache_writer w;
+    rdstringc body = empty_rdstringc;
+    font_pending const *fp = fi->pending;
+    unsigned long nglyphs = 0, i, n;
+    unsigned minmem = 0, maxmem = 0;
+    struct cache_name *cn;
+    glyph_width const *gw;
+    kern_pair const *kp;
+    ligature const *lig;
+    kern_classes const *kc;
+    char *tmpname, *name;
+    FILE *fp_out;
+
+    w.out = empty_rdstringc;
+    w.names = newtree234(cache_name_cmp, NULL);
+    w.byidx = NULL;
+    w.nnames = w.namesize = 0;
+
+    /*
+     * Write the tables first, numbering the glyph names as we meet
+     * them, and then put the header and the name table in front.
+     */
+    if (fi->filetype == TRUETYPE) {
+	sfnt *sf = fi->fontfile;
+	nglyphs = sfnt_nglyphs(sf);
+	sfnt_memory(sf, &minmem, &maxmem);
+	for (i = 0; i < nglyphs; i++)
+	    put32(&w, name_index(&w, sfnt_indextoglyph(sf, i)));
+    }
+    put32(&w, countbt(fi->widths));
+    for (i = 0; (gw = indexbt(fi->widths, i)) != NULL; i++) {
+	put32(&w, name_index(&w, gw->glyph));
+	put32(&w, (unsigned long)gw->width & 0xFFFFFFFF);
+    }
+    put32(&w, countbt(fi->kerns));
+    for (i = 0; (kp = indexbt(fi->kerns, i)) != NULL; i++) {
+	put32(&w, name_index(&w, kp->left));
+	put32(&w, name_index(&w, kp->right));
+	put32(&w, (unsigned long)kp->kern & 0xFFFFFFFF);
+    }
+    put32(&w, countbt(fi->ligs));
+    for (i = 0; (lig = indexbt(fi->ligs, i)) != NULL; i++) {
+	put32(&w, name_index(&w, lig->left));
+	put32(&w, name_index(&w, lig->right));
+	put32(&w, name_index(&w, lig->lig));
+    }
+    for (n = i = 0; i < UNICODE_LIMIT; i++)
+	if (fi->map.pages[fi->map.index[i >> 8]][i & 0xFF] != NOGLYPH)
+	    n++;
+    put32(&w, n);
+    for (i = 0; i < UNICODE_LIMIT; i++) {
+	glyph g;
+	if (!fi->map.index[i >> 8]) {
+	    i |= 0xFF;
+	    continue;
+	}
+	g = fi->map.pages[fi->map.index[i >> 8]][i & 0xFF];
+	if (g != NOGLYPH) {
+	    put32(&w, i);
+	    put32(&w, name_index(&w, g));
+	}
+    }
+    for (n = 0, kc = fi->kern_classes; kc; kc = kc->next)
+	n++;
+    put32(&w, n);
+    for (kc = fi->kern_classes; kc; kc = kc->next) {
+	int j;
+	put32(&w, kc->nlclass);
+	put32(&w, kc->nrclass);
+	put32(&w, kc->nleft);
+	for (j = 0; j < kc->nleft; j++) {
+	    put32(&w, name_index(&w, kc->left[j].glyph));
+	    put32(&w, kc->left[j].cls);
+	}
+	put32(&w, kc->nright);
+	for (j = 0; j < kc->nright; j++) {
+	    put32(&w, name_index(&w, kc->right[j].glyph));
+	    put32(&w, kc->right[j].cls);
+	}
+	for (j = 0; j < kc->nlclass * kc->nrclass; j++)
+	    put32(&w, (unsigned long)kc->kerns[j] & 0xFFFFFFFF);
+    }
+
+    body = w.out;
+    w.out = empty_rdstringc;
+    put32(&w, CACHE_MAGIC);
+    put32(&w, (unsigned long)fp->len & 0xFFFFFFFF);
+    putstr(&w, fi->name);
+    for (i = 0; i < 4; i++)
+	putfloat(&w, fi->fontbbox[i]);
+    putfloat(&w, fi->capheight);
+    putfloat(&w, fi->xheight);
+    putfloat(&w, fi->ascent);
+    putfloat(&w, fi->descent);
+    putfloat(&w, fi->stemv);
+    putfloat(&w, fi->stemh);
+    putfloat(&w, fi->italicangle);
+    put32(&w, minmem);
+    put32(&w, maxmem);
+    put32(&w, w.nnames);
+    for (i = 0; i < w.nnames; i++)
+	putstr(&w, glyph_extern(psd, w.byidx[i]));
+    put32(&w, nglyphs);
+
+    /*
+     * Write to a temporary file and rename it into place, so that
+     * a concurrent run never sees half a cache file.
+     */
+    tmpname = cache_filename(fp, ".tmp");
+    name = cache_filename(fp, ".hfm");
+    fp_out = fopen(tmpname, "wb");
+    if (fp_out) {
+	bool ok = (fwrite(w.out.text, 1, w.out.pos, fp_out) ==
+		   (size_t)w.out.pos &&
+		   fwrite(body.text, 1, body.pos, fp_out) == (size_t)body.pos);
+	if (fclose(fp_out) != 0)
+	    ok = false;
+	if (ok && rename(tmpname, name) != 0) {
+	    remove(name);	       /* Windows won't rename over it */
+	    ok = (rename(tmpname, name) == 0);
+	}
+	if (!ok)
+	    remove(tmpname);
+    }
+    sfree(tmpname);
+    sfree(name);
+
+    while ((cn = delpos234(w.names, 0)) != NULL)
+	sfree(cn);
+    freetree234(w.names);
+    sfree(w.byidx);
+    sfree(w.out.text);
+    sfree(body.text);
+}
+
+/*
+ * Reading a cache file back. Everything is checked before any of it
+ * is used, so a damaged file just means we parse the font instead.
+ */
+struct cache_reader {
+    unsigned char const *p, *end;
+    bool bad;
+};
+
+static unsigned long get32(struct cache_reader *r)
+{
+    unsigned long v;
+    if (r->end - r->p < 4) {
+	r->bad = true;
+	return 0;
+    }
+    v = ((unsigned long)r->p[0] << 24) | ((unsigned long)r->p[1] << 16) |
+	((unsigned long)r->p[2] << 8) | r->p[3];
+    r->p += 4;
+    return v;
+}
+
+static int toint(unsigned long v)
+{
+    if (v & 0x80000000)
+	return -(int)(0xFFFFFFFF - v) - 1;
+    return (int)v;
+}
+
+static char *getstr(struct cache_reader *r)
+{
+    size_t len;
+    char *s;
+    if (r->end - r->p < 2) {
+	r->bad = true;
+	return NULL;
+    }
+    len = (r->p[0] << 8) | r->p[1];
+    r->p += 2;
+    if ((size_t)(r->end - r->p) < len) {
+	r->bad = true;
+	return NULL;
+    }
+    s = snewn(len + 1, char);
+    memcpy(s, r->p, len);
+    s[len] = '\0';
+    r->p += len;
+    return s;
+}
+
+static float getfloat(struct cache_reader *r)
+{
+    char *s = getstr(r);
+    float f;
+    if (!s)
+	return 0;
+    f = (float)atof(s);
+    sfree(s);
+    return f;
+}
+
+/* Read a table of n entries, each of k numbers, all < limits[j] */
+static unsigned long *gettable(struct cache_reader *r, unsigned long *n,
+			       int k, unsigned long const *limits)
+{
+    unsigned long *t, i;
+    int j;
+
+    *n = get32(r);
+    if (r->bad || *n > (unsigned long)(r->end - r->p) / (4 * k)) {
+	r->bad = true;
+	return NULL;
+    }
+    t = snewn(*n * k + 1, unsigned long);
+    for (i = 0; i < *n; i++)
+	for (j = 0; j < k; j++) {
+	    t[i*k+j] = get32(r);
+	    if (limits[j] && t[i*k+j] >= limits[j])
+		r->bad = true;
+	}
+    return t;
+}
+
+/* A kern_classes as read from the cache, before it's checked */
+struct cached_classes {
+    struct cached_classes *next;
+    unsigned long nlclass, nrclass, nleft, nright;
+    unsigned long *left, *right, *kerns;
+};
+
+static bool cache_read(font_info *fi, psdata *psd)
+{
+    font_pending const *fp = fi->pending;
+    struct cache_reader r;
+    char *name, *data, *fontname = NULL, **names = NULL;
+    unsigned long *byidx = NULL, *widths = NULL, *kerns = NULL;
+    unsigned long *ligs = NULL, *map = NULL;
+    unsigned long nnames = 0, nbyidx, nwidths, nkerns, nligs, nmap, nkc, i, j;
+    unsigned long nelems;
+    void **elems;
+    struct cached_classes *cached = NULL, **cctail = &cached, *cc;
+    kern_classes **kctail;
+    unsigned long limits[3];
+    glyph *glyphs;
+    float metrics[11];
+    unsigned minmem, maxmem;
+    size_t len = 0, size = 4096, got;
+    FILE *fp_in;
+    bool ok = false;
+
+    name = cache_filename(fp, ".hfm");
+    fp_in = fopen(name, "rb");
+    sfree(name);
+    if (!fp_in)
+	return false;
+    data = snewn(size, char);
+    while ((got = fread(data + len, 1, size - len, fp_in)) > 0) {
+	len += got;
+	if (len == size) {
+	    size *= 2;
+	    data = sresize(data, size, char);
+	}
+    }
+    fclose(fp_in);
+
+    r.p = (unsigned char const *)data;
+    r.end = r.p + len;
+    r.bad = false;
+
+    if (get32(&r) != CACHE_MAGIC ||
+	get32(&r) != ((unsigned long)fp->len & 0xFFFFFFFF))
+	goto out;
+    fontname = getstr(&r);
+    if (r.bad || strcmp(fontname, fi->name))
+	goto out;
+    for (i = 0; i < lenof(metrics); i++)
+	metrics[i] = getfloat(&r);
+    minmem = get32(&r);
+    maxmem = get32(&r);
+    nnames = get32(&r);
+    if (r.bad || nnames > (unsigned long)(r.end - r.p) / 2)
+	goto out;
+    names = snewn(nnames + 1, char *);
+    for (i = 0; i < nnames; i++)
+	names[i] = NULL;
+    for (i = 0; i < nnames; i++)
+	if ((names[i] = getstr(&r)) == NULL)
+	    goto out;
+
+    limits[0] = limits[1] = limits[2] = nnames;
+    nbyidx = get32(&r);
+    if (r.bad || nbyidx != (fi->filetype == TRUETYPE ?
+			    sfnt_nglyphs(fi->fontfile) : 0) ||
+	nbyidx > (unsigned long)(r.end - r.p) / 4)
+	goto out;
+    byidx = snewn(nbyidx + 1, unsigned long);
+    for (i = 0; i < nbyidx; i++)
+	if ((byidx[i] = get32(&r)) >= nnames)
+	    r.bad = true;
+    limits[1] = 0;
+    widths = gettable(&r, &nwidths, 2, limits);
+    if (r.bad) goto out;
+    limits[1] = nnames;
+    limits[2] = 0;
+    kerns = gettable(&r, &nkerns, 3, limits);
+    if (r.bad) goto out;
+    limits[2] = nnames;
+    ligs = gettable(&r, &nligs, 3, limits);
+    if (r.bad) goto out;
+    limits[0] = UNICODE_LIMIT;
+    limits[1] = nnames;
+    map = gettable(&r, &nmap, 2, limits);
+    if (r.bad) goto out;
+    nkc = get32(&r);
+    if (r.bad || nkc > (unsigned long)(r.end - r.p) / 12)
+	goto out;
+    for (i = 0; i < nkc; i++) {
+	struct cached_classes *cc = snew(struct cached_classes);
+	cc->left = cc->right = cc->kerns = NULL;
+	cc->next = NULL;
+	*cctail = cc;
+	cctail = &cc->next;
+	cc->nlclass = get32(&r);
+	cc->nrclass = get32(&r);
+	if (r.bad || cc->nlclass == 0 || cc->nrclass == 0 ||
+	    cc->nlclass > 0xFFFF || cc->nrclass > 0xFFFF)
+	    goto out;
+	limits[0] = nnames;
+	limits[1] = cc->nlclass;
+	cc->left = gettable(&r, &cc->nleft, 2, limits);
+	limits[1] = cc->nrclass;
+	cc->right = gettable(&r, &cc->nright, 2, limits);
+	if (r.bad ||
+	    cc->nlclass * cc->nrclass > (unsigned long)(r.end - r.p) / 4)
+	    goto out;
+	cc->kerns = snewn(cc->nlclass * cc->nrclass, unsigned long);
+	for (j = 0; j < cc->nlclass * cc->nrclass; j++)
+	    cc->kerns[j] = get32(&r);
+    }
+    if (r.bad || r.p != r.end) goto out;
+
+    /*
+     * It all looks sensible, so now we can fill in the font_info.
+     */
+    glyphs = snewn(nnames + 1, glyph);
+    for (i = 0; i < nnames; i++)
+	glyphs[i] = glyph_intern(psd, names[i]);
+    for (i = 0; i < 4; i++)
+	fi->fontbbox[i] = metrics[i];
+    fi->capheight = metrics[4];
+    fi->xheight = metrics[5];
+    fi->ascent = metrics[6];
+    fi->descent = metrics[7];
+    fi->stemv = metrics[8];
+    fi->stemh = metrics[9];
+    fi->italicangle = metrics[10];
+    if (fi->filetype == TRUETYPE) {
+	glyph *gbi = snewn(nbyidx + 1, glyph);
+	for (i = 0; i < nbyidx; i++)
+	    gbi[i] = glyphs[byidx[i]];
+	sfnt_setglyphs(fi->fontfile, gbi, minmem, maxmem);
+    }
+
+    /*
+     * The font's trees are still empty, so fill them in one go. (The
+     * cache lists everything in order, so there's no real sorting to
+     * do.)
+     */
+    nelems = (nwidths > nkerns ? nwidths : nkerns);
+    if (nligs > nelems)
+	nelems = nligs;
+    elems = snewn(nelems + 1, void *);
+    for (i = 0; i < nwidths; i++) {
+	glyph_width *w = snew(glyph_width);
+	w->glyph = glyphs[widths[2*i]];
+	w->width = toint(widths[2*i+1]);
+	elems[i] = w;
+    }
+    buildbt(fi->widths, elems, nwidths);
+    for (i = countbt(fi->widths); i < nwidths; i++)
+	sfree(elems[i]);
+    for (i = 0; i < nkerns; i++) {
+	kern_pair *kp = snew(kern_pair);
+	kp->left = glyphs[kerns[3*i]];
+	kp->right = glyphs[kerns[3*i+1]];
+	kp->kern = toint(kerns[3*i+2]);
+	elems[i] = kp;
+    }
+    buildbt(fi->kerns, elems, nkerns);
+    for (i = countbt(fi->kerns); i < nkerns; i++)
+	sfree(elems[i]);
+    for (i = 0; i < nligs; i++) {
+	ligature *lig = snew(ligature);
+	lig->left = glyphs[ligs[3*i]];
+	lig->right = glyphs[ligs[3*i+1]];
+	lig->lig = glyphs[ligs[3*i+2]];
+	elems[i] = lig;
+    }
+    buildbt(fi->ligs, elems, nligs);
+    for (i = countbt(fi->ligs); i < nligs; i++)
+	sfree(elems[i]);
+    sfree(elems);
+    for (i = 0; i < nmap; i++)
+	glyph_map_set(&fi->map, map[2*i], glyphs[map[2*i+1]]);
+    kctail = &fi->kern_classes;
+    for (cc = cached; cc; cc = cc->next) {
+	kern_classes *kc = snew(kern_classes);
+	kc->next = NULL;
+	kc->nlclass = cc->nlclass;
+	kc->nrclass = cc->nrclass;
+	kc->nleft = cc->nleft;
+	kc->left = snewn(cc->nleft + 1, glyph_class);
+	for (j = 0; j < cc->nleft; j++) {
+	    kc->left[j].glyph = glyphs[cc->left[2*j]];
+	    kc->left[j].cls = cc->left[2*j+1];
+	}
+	kc->nright = cc->nright;
+	kc->right = snewn(cc->nright + 1, glyph_class);
+	for (j = 0; j < cc->nright; j++) {
+	    kc->right[j].glyph = glyphs[cc->right[2*j]];
+	    kc->right[j].cls = cc->right[2*j+1];
+	}
+	kc->kerns = snewn(cc->nlclass * cc->nrclass, int);
+	for (j = 0; j < cc->nlclass * cc->nrclass; j++)
+	    kc->kerns[j] = toint(cc->kerns[j]);
+	/* Glyph numbers may not be in the same order as last time. */
+	qsort(kc->left, kc->nleft, sizeof(*kc->left), glyph_class_cmp);
+	qsort(kc->right, kc->nright, sizeof(*kc->right), glyph_class_cmp);
+	*kctail = kc;
+	kctail = &kc->next;
+    }
+    sfree(glyphs);
+    ok = true;
+
+  out:
+    if (names)
+	for (i = 0; i < nnames; i++)
+	    sfree(names[i]);
+    sfree(names);
+    sfree(byidx);
+    sfree(widths);
+    sfree(kerns);
+    sfree(ligs);
+    sfree(map);
+    while (cached) {
+	cc = cached;
+	cached = cc->next;
+	sfree(cc->left);
+	sfree(cc->right);
+	sfree(cc->kerns);
+	sfree(cc);
+    }
+    sfree(fontname);
+    sfree(data);
+    return ok;
+}
+
+/*
+ * Make sure a font is fully loaded, from the cache if possible and
+ * by parsing its file otherwise. Returns false if the font turned
+ * out to be unusable, having reported why.
+ */
+bool font_load(font_info *fi, psdata *psd)
+{
+    font_pending *fp = fi->pending;
+    errorstate pes;
+    bool ok, clean;
+
+    if (!fp)
+	return true;
+    if (fp->failed)
+	return false;
+
+    if (cachedir)
+	font_hash(fp);
+    if (cachedir && cache_read(fi, psd)) {
+	ok = true;
+    } else {
+	/*
+	 * Collect the parser's complaints, so that we know not to
+	 * cache anything they might have been about.
+	 */
+	err_defer(&pes);
+	ok = fp->parse(fi, psd, &pes);
+	clean = (pes.deferred->pos == 0);
+	if (fp->es->deferred) {
+	    if (pes.deferred->pos)
+		rdaddsc(fp->es->deferred, pes.deferred->text);
+	} else {
+	    err_release(&pes, -1);
+	}
+	if (pes.fatal)
+	    fp->es->fatal = true;
+	err_undefer(&pes);
+	if (ok && clean && cachedir)
+	    cache_write(fi, psd);
+    }
+
+    if (!ok) {
+	fp->failed = true;
+	return false;
+    }
+    if (fp->owned)
+	sfree(fp->data);
+    sfree(fp);
+    fi->pending = NULL;
+    return true;
+}
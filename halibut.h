@@ -23,6 +23,7 @@
 #define IGNORE(x) ( (x) = (x) )
 
 #include "tree234.h"
+#include "btree.h"
 
 /*
  * Structure tags
@@ -50,6 +51,41 @@ struct filepos_Tag {
     int line, col;
 };
 
+/*
+ * Growable strings, used all over the place (the functions that
+ * work on them are in misc.c)
+ */
+typedef struct tagRdstring rdstring;
+struct tagRdstring {
+    int pos, size;
+    wchar_t *text;
+};
+typedef struct tagRdstringc rdstringc;
+struct tagRdstringc {
+    int pos, size;
+    char *text;
+};
+
+/*
+ * Ropes, for large outputs put together from pieces built
+ * separately: a list of pieces of text, written out one after
+ * another (the functions that work on them are also in misc.c)
+ */
+typedef struct tagRopepiece ropepiece;
+struct tagRopepiece {
+    const char *text;
+    int len;
+    char *owned;		       /* freed along with the rope, or NULL */
+};
+typedef struct tagRope rope;
+struct tagRope {
+    int npieces, piecesize;
+    ropepiece *pieces;
+    int len;			       /* total length of all the pieces */
+    int copied;			       /* how much of that is in our chunks */
+    int room;			       /* space left to append to last piece */
+};
+
 /*
  * Data structure to hold all the file names etc for input
  */
@@ -68,11 +104,16 @@ struct input_Tag {
     filepos pos;
     bool reportcols;                   /* report column numbers in errors */
     macrostack *stack;		       /* macro expansions in force */
+    int nstack, stacksize;
+    int pushbase;		       /* pushback belonging to outer levels */
     int defcharset, charset;	       /* character sets for input files */
     charset_state csstate;
     wchar_t wc[16];		       /* wide chars from input conversion */
     int nwc, wcpos;		       /* size of, and position in, wc[] */
-    char *pushback_chars;	       /* used to save input-encoding data */
+    bool asciiok[128];		       /* bytes that decode to themselves */
+    rdstring tokbuf;		       /* text of the current token */
+    rdstringc origbuf;		       /* same again in original charset */
+    rdstringc pushback_chars;	       /* used to save input-encoding data */
     errorstate *es;
 };
 
@@ -83,6 +124,7 @@ struct input_Tag {
 struct paragraph_Tag {
     paragraph *next;
     int type;
+    int index;			       /* see number_document() */
     wchar_t *keyword;		       /* for most special paragraphs */
     char *origkeyword;		       /* same again in original charset */
     word *words;		       /* list of words in paragraph */
@@ -94,8 +136,6 @@ struct paragraph_Tag {
     filepos fpos;
 
     paragraph *parent, *child, *sibling;   /* for hierarchy navigation */
-
-    void *private_data; 	       /* for temp use in backends */
 };
 enum {
     para_IM,			       /* index merge */
@@ -137,11 +177,10 @@ struct word_Tag {
     word *next, *alt;
     int type;
     int aux;
+    int index;			       /* see number_document() */
     bool breaks;                       /* can a line break after it? */
     wchar_t *text;
     filepos fpos;
-
-    void *private_data; 	       /* for temp use in backends */
 };
 enum {
     /* ORDERING CONSTRAINT: these normal-word types ... */
@@ -208,7 +247,15 @@ enum {
  */
 struct errorstate_Tag {
     bool fatal;
+    rdstringc *deferred;	       /* if non-NULL, save messages here */
+    int released;		       /* how much of that has been printed */
 };
+/* save messages up for later instead of printing them */
+void err_defer(errorstate *es);
+/* print saved messages, up to a given offset in the buffer or -1 */
+void err_release(errorstate *es, int upto);
+/* discard a deferring errorstate's buffer */
+void err_undefer(errorstate *es);
 /* out of memory */
 void fatalerr_nomemory(void) NORETURN;
 /* option `-%s' requires an argument */
@@ -430,16 +477,6 @@ void stk_push(stack, void *);
 void *stk_pop(stack);
 void *stk_top(stack);
 
-typedef struct tagRdstring rdstring;
-struct tagRdstring {
-    int pos, size;
-    wchar_t *text;
-};
-typedef struct tagRdstringc rdstringc;
-struct tagRdstringc {
-    int pos, size;
-    char *text;
-};
 extern const rdstring empty_rdstring;
 extern const rdstringc empty_rdstringc;
 void rdadd(rdstring *rs, wchar_t c);
@@ -451,10 +488,24 @@ void rdaddsc(rdstringc *rs, char const *p);
 void rdaddsn(rdstringc *rc, char const *p, int len);
 char *rdtrimc(rdstringc *rs);
 
+extern const rope empty_rope;
+/* append a copy of some text */
+void rope_add(rope *r, const char *p, int len);
+void rope_addsc(rope *r, const char *p);
+/* append a buffer by reference, which must outlive the rope */
+void rope_addref(rope *r, const char *p, int len);
+/* append a dynamically allocated buffer, to be freed with the rope */
+void rope_adopt(rope *r, char *p, int len);
+void rope_write(const rope *r, FILE *fp);
+void rope_free(rope *r);
+
 int compare_wordlists(word *a, word *b);
 
 void mark_attr_ends(word *words);
 
+void number_document(paragraph *source);
+void doc_size(paragraph *source, int *nparas, int *nwords);
+
 typedef struct tagWrappedLine wrappedline;
 struct tagWrappedLine {
     wrappedline *next;
@@ -469,12 +520,27 @@ paragraph *cmdline_cfg_new(void);
 paragraph *cmdline_cfg_simple(char *string, ...);
 
 time_t current_time(void);             /* use in place of time(NULL) */
+bool write_whole_file(const char *filename, const char *data, int len,
+                      bool compress);
+bool write_rope_file(const char *filename, const rope *r, bool compress);
+
+/*
+ * workers.c
+ */
+void set_worker_threads(int n);
+int worker_threads(void);
+void run_jobs(int njobs, void (*fn)(void *ctx, int job), void *ctx);
 
 /*
  * input.c
  */
 paragraph *read_input(input *in, indexdata *idx, psdata *psd);
 
+/*
+ * fontcache.c
+ */
+void set_font_cache(char const *dir);
+
 /*
  * in_afm.c
  */
@@ -578,6 +644,8 @@ void gen_citations(paragraph *, keywordlist *, errorstate *);
 void text_backend(paragraph *, keywordlist *, indexdata *, void *,
                   errorstate *);
 paragraph *text_config_filename(char *filename);
+/* format as text into a string, for timing without file I/O */
+char *text_backend_to_memory(paragraph *, int *len, errorstate *);
 
 /*
  * bk_html.c
@@ -20,6 +20,8 @@ static const char *const helptext[] = {
     "         --list-charsets       display supported character set names",
     "         --list-fonts          display supported font names",
     "         --precise             report column numbers in error messages",
+    "         --threads=n           use at most n threads (default: one per CPU)",
+    "         --font-cache=dir      keep parsed font metrics in dir",
     "         --help                display this text",
     "         --version             display version number",
     "         --licence             display licence text",
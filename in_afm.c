@@ -3,33 +3,44 @@
 #include "halibut.h"
 #include "paper.h"
 
-char *afm_read_line(input *in) {
+/*
+ * AFM files are read into memory when they're first seen, and parsed
+ * from there: once then to find the font's name, and again in full
+ * when the font is wanted (see font_load()).
+ */
+struct afm_reader {
+    char const *p, *end;
+    filepos pos;
+    errorstate *es;
+};
+
+static char *afm_read_line(struct afm_reader *r) {
     int i, len = 256;
     int c;
     char *line;
 
     do {
 	i = 0;
-	in->pos.line++;
-	c = getc(in->currfp);
-	if (c == EOF) {
-	    err_afmeof(in->es, &in->pos);
+	r->pos.line++;
+	if (r->p == r->end) {
+	    err_afmeof(r->es, &r->pos);
 	    return NULL;
 	}
+	c = (unsigned char)*r->p++;
 	line = snewn(len, char);
-	while (c != EOF && c != '\r' && c != '\n') {
+	while (c != '\r' && c != '\n') {
 	    if (i >= len - 1) {
 		len += 256;
 		line = sresize(line, len, char);
 	    }
 	    line[i++] = c;
-	    c = getc(in->currfp);
+	    if (r->p == r->end)
+		break;
+	    c = (unsigned char)*r->p++;
 	}
-	if (c == '\r') {
+	if (c == '\r' && r->p < r->end && *r->p == '\n') {
 	    /* Cope with CRLF terminated lines */
-	    c = getc(in->currfp);
-	    if (c != '\n' && c != EOF)
-		ungetc(c, in->currfp);
+	    r->p++;
 	}
 	line[i] = 0;
     } while (line[(strspn(line, " \t"))] == 0 ||
@@ -39,121 +50,125 @@ char *afm_read_line(input *in) {
     return line;
 }
 
-static bool afm_require_key(char *line, char const *expected, input *in) {
+static bool afm_require_key(char *line, char const *expected,
+			    struct afm_reader *r) {
     char *key = strtok(line, " \t");
 
     if (strcmp(key, expected) == 0)
 	return true;
-    err_afmkey(in->es, &in->pos, expected);
+    err_afmkey(r->es, &r->pos, expected);
     return false;
 }
 
-void read_afm_file(input *in, psdata *psd) {
+/*
+ * Parse an AFM file. If header_only is set, stop as soon as the
+ * global font information is over, having found the font's name.
+ */
+static bool afm_parse(font_info *fi, psdata *psd, struct afm_reader *r,
+		      bool header_only) {
     char *line, *key, *val;
-    font_info *fi;
-    size_t i;
 
-    fi = snew(font_info);
-    fi->name = NULL;
-    fi->widths = newtree234(width_cmp, NULL);
-    fi->fontfile = NULL;
-    fi->kerns = newtree234(kern_cmp, NULL);
-    fi->ligs = newtree234(lig_cmp, NULL);
-    fi->fontbbox[0] = fi->fontbbox[1] = fi->fontbbox[2] = fi->fontbbox[3] = 0;
-    fi->capheight = fi->xheight = fi->ascent = fi->descent = 0;
-    fi->stemh = fi->stemv = fi->italicangle = 0;
-    for (i = 0; i < lenof(fi->bmp); i++)
-	    fi->bmp[i] = 0xFFFF;
-    in->pos.line = 0;
-    line = afm_read_line(in);
-    if (!line || !afm_require_key(line, "StartFontMetrics", in))
+    line = afm_read_line(r);
+    if (!line || !afm_require_key(line, "StartFontMetrics", r))
 	goto giveup;
     if (!(val = strtok(NULL, " \t"))) {
-	err_afmval(in->es, &in->pos, "StartFontMetrics", 1);
+	err_afmval(r->es, &r->pos, "StartFontMetrics", 1);
 	goto giveup;
     }
     if (atof(val) >= 5.0) {
-	err_afmvers(in->es, &in->pos);
+	err_afmvers(r->es, &r->pos);
 	goto giveup;
     }
     sfree(line);
     for (;;) {
-	line = afm_read_line(in);
+	line = afm_read_line(r);
 	if (line == NULL)
 	    goto giveup;
 	key = strtok(line, " \t");
-	if (strcmp(key, "EndFontMetrics") == 0) {
-	    fi->next = psd->all_fonts;
-	    psd->all_fonts = fi;
-	    fclose(in->currfp);
-	    return;
+	if (header_only &&
+	    (strcmp(key, "EndFontMetrics") == 0 ||
+	     strcmp(key, "StartCharMetrics") == 0 ||
+	     strcmp(key, "StartKernPairs") == 0 ||
+	     strcmp(key, "StartKernPairs0") == 0)) {
+	    sfree(line);
+	    if (!fi->name) {
+		err_afmkey(r->es, &r->pos, "FontName");
+		return false;
+	    }
+	    return true;
+	} else if (strcmp(key, "EndFontMetrics") == 0) {
+	    sfree(line);
+	    return true;
 	} else if (strcmp(key, "FontName") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
-	    fi->name = dupstr(val);
+	    if (header_only) {
+		sfree((char *)fi->name);
+		fi->name = dupstr(val);
+	    }
 	} else if (strcmp(key, "FontBBox") == 0) {
 	    int i;
 	    for (i = 0; i < 3; i++) {
 		if (!(val = strtok(NULL, " \t"))) {
-		    err_afmval(in->es, &in->pos, key, 4);
+		    err_afmval(r->es, &r->pos, key, 4);
 		    goto giveup;
 		}
 		fi->fontbbox[i] = atof(val);
 	    }
 	} else if (strcmp(key, "CapHeight") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    fi->capheight = atof(val);
 	} else if (strcmp(key, "XHeight") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    fi->xheight = atof(val);
 	} else if (strcmp(key, "Ascender") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    fi->ascent = atof(val);
 	} else if (strcmp(key, "Descender") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    fi->descent = atof(val);
 	} else if (strcmp(key, "CapHeight") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    fi->capheight = atof(val);
 	} else if (strcmp(key, "StdHW") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    fi->stemh = atof(val);
 	} else if (strcmp(key, "StdVW") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    fi->stemv = atof(val);
 	} else if (strcmp(key, "ItalicAngle") == 0) {
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    fi->italicangle = atof(val);
 	} else if (strcmp(key, "StartCharMetrics") == 0) {
 	    int nglyphs, i;
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    nglyphs = atoi(val);
@@ -162,7 +177,7 @@ void read_afm_file(input *in, psdata *psd) {
 		int width = 0;
 		glyph g = NOGLYPH;
 
-		line = afm_read_line(in);
+		line = afm_read_line(r);
 		if (line == NULL)
 		    goto giveup;
 		key = strtok(line, " \t");
@@ -170,14 +185,14 @@ void read_afm_file(input *in, psdata *psd) {
 		    if (strcmp(key, "WX") == 0 || strcmp(key, "W0X") == 0) {
 			if (!(val = strtok(NULL, " \t")) ||
 			    !strcmp(val, ";")) {
-			    err_afmval(in->es, &in->pos, key, 1);
+			    err_afmval(r->es, &r->pos, key, 1);
 			    goto giveup;
 			}
 			width = atoi(val);
 		    } else if (strcmp(key, "N") == 0) {
 			if (!(val = strtok(NULL, " \t")) ||
 			    !strcmp(val, ";")) {
-			    err_afmval(in->es, &in->pos, key, 1);
+			    err_afmval(r->es, &r->pos, key, 1);
 			    goto giveup;
 			}
 			g = glyph_intern(psd, val);
@@ -185,13 +200,13 @@ void read_afm_file(input *in, psdata *psd) {
 			glyph succ, lig;
 			if (!(val = strtok(NULL, " \t")) ||
 			    !strcmp(val, ";")) {
-			    err_afmval(in->es, &in->pos, key, 1);
+			    err_afmval(r->es, &r->pos, key, 1);
 			    goto giveup;
 			}
 			succ = glyph_intern(psd, val);
 			if (!(val = strtok(NULL, " \t")) ||
 			    !strcmp(val, ";")) {
-			    err_afmval(in->es, &in->pos, key, 1);
+			    err_afmval(r->es, &r->pos, key, 1);
 			    goto giveup;
 			}
 			lig = glyph_intern(psd, val);
@@ -201,7 +216,7 @@ void read_afm_file(input *in, psdata *psd) {
 			    l->left = g;
 			    l->right = succ;
 			    l->lig = lig;
-			    add234(fi->ligs, l);
+			    addbt(fi->ligs, l);
 			}
 		    }
 		    do {
@@ -215,14 +230,14 @@ void read_afm_file(input *in, psdata *psd) {
 		    glyph_width *w = snew(glyph_width);
 		    w->glyph = g;
 		    w->width = width;
-		    add234(fi->widths, w);
+		    addbt(fi->widths, w);
 		    ucs = ps_glyph_to_unicode(g);
 		    if (ucs < 0xFFFF)
-			fi->bmp[ucs] = g;
+			glyph_map_set(&fi->map, ucs, g);
 		}
 	    }
-	    line = afm_read_line(in);
-	    if (!line || !afm_require_key(line, "EndCharMetrics", in))
+	    line = afm_read_line(r);
+	    if (!line || !afm_require_key(line, "EndCharMetrics", r))
 		goto giveup;
 	    sfree(line);
 
@@ -230,45 +245,99 @@ void read_afm_file(input *in, psdata *psd) {
 		   strcmp(key, "StartKernPairs0") == 0) {
 	    int nkerns, i;
 	    if (!(val = strtok(NULL, " \t"))) {
-		err_afmval(in->es, &in->pos, key, 1);
+		err_afmval(r->es, &r->pos, key, 1);
 		goto giveup;
 	    }
 	    nkerns = atoi(val);
 	    sfree(line);
 	    for (i = 0; i < nkerns; i++) {
-		line = afm_read_line(in);
+		line = afm_read_line(r);
 		if (line == NULL)
 		    goto giveup;
 		key = strtok(line, " \t");
 		if (strcmp(key, "KPX") == 0) {
 		    char *nl, *nr;
-		    int l, r;
+		    int gl, gr;
 		    kern_pair *kp;
 		    nl = strtok(NULL, " \t");
 		    nr = strtok(NULL, " \t");
 		    val = strtok(NULL, " \t");
 		    if (!val) {
-			err_afmval(in->es, &in->pos, key, 3);
+			err_afmval(r->es, &r->pos, key, 3);
 			goto giveup;
 		    }
-		    l = glyph_intern(psd, nl);
-		    r = glyph_intern(psd, nr);
-		    if (l == -1 || r == -1) continue;
+		    gl = glyph_intern(psd, nl);
+		    gr = glyph_intern(psd, nr);
+		    if (gl == -1 || gr == -1) continue;
 		    kp = snew(kern_pair);
-		    kp->left = l;
-		    kp->right = r;
+		    kp->left = gl;
+		    kp->right = gr;
 		    kp->kern = atoi(val);
-		    add234(fi->kerns, kp);
+		    addbt(fi->kerns, kp);
 		}
 	    }
-	    line = afm_read_line(in);
-	    if (!line || !afm_require_key(line, "EndKernPairs", in))
+	    line = afm_read_line(r);
+	    if (!line || !afm_require_key(line, "EndKernPairs", r))
 		goto giveup;
 	    sfree(line);
 	}
     }
   giveup:
-    sfree(fi);
+    sfree(line);
+    return false;
+}
+
+static bool afm_load(font_info *fi, psdata *psd, errorstate *es) {
+    struct afm_reader r;
+
+    r.p = fi->pending->data;
+    r.end = r.p + fi->pending->len;
+    r.pos = fi->pending->pos;
+    r.es = es;
+    return afm_parse(fi, psd, &r, false);
+}
+
+void read_afm_file(input *in, psdata *psd) {
+    struct afm_reader r;
+    font_info *fi;
+    char *data;
+    size_t len = 0, size = 32768, got;
+
+    data = snewn(size, char);
+    for (;;) {
+	got = fread(data + len, 1, size - len, in->currfp);
+	len += got;
+	if (len != size) break;
+	size *= 2;
+	data = sresize(data, size, char);
+    }
     fclose(in->currfp);
-    return;
+
+    fi = snew(font_info);
+    fi->name = NULL;
+    fi->widths = newkeyedbt(width_key);
+    fi->fontfile = NULL;
+    fi->filetype = TYPE1;
+    fi->kerns = newkeyedbt(kern_key);
+    fi->kern_classes = NULL;
+    fi->ligs = newkeyedbt(lig_key);
+    fi->fontbbox[0] = fi->fontbbox[1] = fi->fontbbox[2] = fi->fontbbox[3] = 0;
+    fi->capheight = fi->xheight = fi->ascent = fi->descent = 0;
+    fi->stemh = fi->stemv = fi->italicangle = 0;
+    glyph_map_init(&fi->map);
+    in->pos.line = 0;
+
+    r.p = data;
+    r.end = data + len;
+    r.pos = in->pos;
+    r.es = in->es;
+    if (!afm_parse(fi, psd, &r, true)) {
+	sfree(data);
+	sfree(fi);
+	return;
+    }
+    fi->pending = font_pending_new(afm_load, data, len, true, &in->pos,
+				   in->es);
+    fi->next = psd->all_fonts;
+    psd->all_fonts = fi;
 }
@@ -24,6 +24,11 @@
 #include "halibut.h"
 #include "paper.h"
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 typedef struct sfnt_decode_Tag sfnt_decode;
 struct sfnt_decode_Tag {
     void (*decoder)(void *src, void *dest);
@@ -105,6 +110,52 @@ static void *decoden(const sfnt_decode *dec, void *src, void *end, void *dest,
     return src;
 }
 
+/*
+ * Arrays too big to be worth decoding into a copy - glyph metrics,
+ * kerning pairs, character maps and the like - are read in place
+ * instead. An sfnt_array describes n records of the same size,
+ * having checked that they all lie within their table, and the
+ * accessors below read one field of one record.
+ */
+typedef struct sfnt_array_Tag sfnt_array;
+struct sfnt_array_Tag {
+    unsigned char const *base;
+    size_t size, n;
+};
+
+static bool sfnt_array_init(sfnt_array *a, void *start, void *end,
+			    size_t size, size_t n) {
+    if ((char *)start > (char *)end ||
+	n > (size_t)((char *)end - (char *)start) / size)
+	return false;
+    a->base = start;
+    a->size = size;
+    a->n = n;
+    return true;
+}
+
+static unsigned char const *sfnt_array_at(sfnt_array const *a, size_t i,
+					  size_t off, size_t len) {
+    assert(i < a->n && off + len <= a->size);
+    return a->base + i * a->size + off;
+}
+
+static unsigned sfnt_uint16(sfnt_array const *a, size_t i, size_t off) {
+    unsigned char const *p = sfnt_array_at(a, i, off, 2);
+    return (p[0] << 8) | p[1];
+}
+
+static int sfnt_int16(sfnt_array const *a, size_t i, size_t off) {
+    unsigned v = sfnt_uint16(a, i, off);
+    return v & 0x8000 ? (int)v - 0x10000 : (int)v;
+}
+
+static unsigned long sfnt_uint32(sfnt_array const *a, size_t i, size_t off) {
+    unsigned char const *p = sfnt_array_at(a, i, off, 4);
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+	((unsigned long)p[2] << 8) | p[3];
+}
+
 /* Decoding specs for simple data types */
 const sfnt_decode uint16_decode[] = { { d_uint16, 0 }, { d_end } };
 const sfnt_decode int16_decode[]  = { { d_int16,  0 }, { d_end } };
@@ -124,6 +175,8 @@ const sfnt_decode offsubdir_decode[] = {
 };
 
 #define sfnt_00010000	0x00010000
+#define TAG_GPOS	0x47504f53
+#define TAG_GSUB	0x47535542
 #define TAG_OS_2	0x4f532f32
 #define TAG_cmap	0x636d6170
 #define TAG_glyf	0x676c7966
@@ -237,6 +290,19 @@ const sfnt_decode cmap4_decode[] = {
     { d_skip(6) }, /* searchRange, entrySelector, rangeShift */
     { d_end }
 };
+typedef struct cmap12_Tag cmap12;
+struct cmap12_Tag {
+    unsigned length;
+    unsigned nGroups;
+};
+const sfnt_decode cmap12_decode[] = {
+    { d_skip(4) }, /* format, reserved */
+    { d_uint32, offsetof(cmap12, length) },
+    { d_skip(4) }, /* language */
+    { d_uint32, offsetof(cmap12, nGroups) },
+    { d_end }
+};
+/* followed by nGroups of (startCharCode, endCharCode, startGlyphID) */
 
 /* Font Header ('head') table */
 typedef struct t_head_Tag t_head;
@@ -286,12 +352,7 @@ const sfnt_decode t_hhea_decode[] = {
     { d_end }
 };
 
-/* Horizontal Metrics ('hmtx') table */
-const sfnt_decode longhormetric_decode[] = {
-    { d_uint16, 0 },
-    { d_skip(2) },
-    { d_end }
-};
+/* Horizontal Metrics ('hmtx') table: (advanceWidth, lsb) pairs */
 
 /* Kerning ('kern') table */
 typedef struct t_kern_Tag t_kern;
@@ -352,18 +413,7 @@ const sfnt_decode kern_f0_decode[] = {
     { d_skip(6) }, /* searchRange, entrySelector, rangeShift */
     { d_end }
 };
-typedef struct kern_f0_pair_Tag kern_f0_pair;
-struct kern_f0_pair_Tag {
-    unsigned left;
-    unsigned right;
-    int value;
-};
-const sfnt_decode kern_f0_pair_decode[] = {
-    { d_uint16, offsetof(kern_f0_pair, left) },
-    { d_uint16, offsetof(kern_f0_pair, right) },
-    { d_int16, offsetof(kern_f0_pair, value) },
-    { d_end }
-};
+/* followed by nPairs of (left, right, value) */
 
 /* Maximum profile ('maxp') table */
 typedef struct t_maxp_Tag t_maxp;
@@ -458,8 +508,14 @@ static bool sfnt_findtable(sfnt *sf, unsigned tag,
 
     for (i = 0; i < sf->osd.numTables; i++) {
 	if (sf->td[i].tag == tag) {
+	    /* Don't trust the table directory to stay inside the file. */
+	    if (sf->td[i].offset > sf->len)
+		return false;
 	    *startp = (char *)sf->data + sf->td[i].offset;
-	    *endp = (char *)*startp + sf->td[i].length;
+	    if (sf->td[i].length > sf->len - sf->td[i].offset)
+		*endp = sf->end;
+	    else
+		*endp = (char *)*startp + sf->td[i].length;
 	    return true;
 	}
     }
@@ -519,6 +575,18 @@ static int glyphsbyname_cmp_search(void const *a, void const *b) {
     return 0;
 }
 
+/* Construct glyphsbyname from glyphsbyindex */
+static void sfnt_sortglyphs(sfnt *sf) {
+    unsigned i;
+
+    sf->glyphsbyname = snewn(sf->nglyphs, unsigned short);
+    for (i = 0; i < sf->nglyphs; i++)
+	sf->glyphsbyname[i] = i;
+    cmp_glyphsbyindex = sf->glyphsbyindex;
+    qsort(sf->glyphsbyname, sf->nglyphs, sizeof(*sf->glyphsbyname),
+	  glyphsbyname_cmp);
+}
+
 /* Generate an name for a glyph that doesn't have one. */
 static glyph genglyph(psdata *psd, unsigned idx) {
     char buf[64];
@@ -574,12 +642,15 @@ static void sfnt_mapglyphs(font_info *fi, psdata *psd, errorstate *es) {
 	    nextras = 0;
 	    for (sptr = (unsigned char *)ptr + 2*sf->nglyphs;
 		 sptr < (unsigned char *)end;
-		 sptr += *sptr+1)
+		 sptr += *sptr+1) {
+		if (*sptr >= (unsigned char *)end - sptr)
+		    break;
 		nextras++;
+	    }
 	    extraglyphs = snewn(nextras, glyph);
 	    i = 0;
 	    for (sptr = (unsigned char *)ptr + 2*sf->nglyphs;
-		 sptr < (unsigned char *)end;
+		 i < nextras;
 		 sptr += *sptr+1) {
 		memcpy(tmp, sptr + 1, *sptr);
 		tmp[*sptr] = 0;
@@ -613,13 +684,7 @@ static void sfnt_mapglyphs(font_info *fi, psdata *psd, errorstate *es) {
 	for (i = 0; i < sf->nglyphs; i++)
 	    sf->glyphsbyindex[i] = genglyph(psd, i);
     }
-    /* Construct glyphsbyname */
-    sf->glyphsbyname = snewn(sf->nglyphs, unsigned short);
-    for (i = 0; i < sf->nglyphs; i++)
-	sf->glyphsbyname[i] = i;
-    cmp_glyphsbyindex = sf->glyphsbyindex;
-    qsort(sf->glyphsbyname, sf->nglyphs, sizeof(*sf->glyphsbyname),
-	  glyphsbyname_cmp);
+    sfnt_sortglyphs(sf);
     /*
      * It's possible for fonts to specify the same name for multiple
      * glyphs, which would make one of them inaccessible.  Check for
@@ -666,6 +731,24 @@ unsigned sfnt_nglyphs(sfnt *sf) {
     return sf->nglyphs;
 }
 
+void sfnt_memory(sfnt *sf, unsigned *minmem, unsigned *maxmem) {
+    *minmem = sf->minmem;
+    *maxmem = sf->maxmem;
+}
+
+/*
+ * Install glyph names and VM usage that sfnt_mapglyphs() found on
+ * some earlier run (see fontcache.c). glyphsbyindex must be in
+ * dynamic memory, and becomes the sfnt's.
+ */
+void sfnt_setglyphs(sfnt *sf, glyph *glyphsbyindex,
+		    unsigned minmem, unsigned maxmem) {
+    sf->glyphsbyindex = glyphsbyindex;
+    sf->minmem = minmem;
+    sf->maxmem = maxmem;
+    sfnt_sortglyphs(sf);
+}
+
 unsigned sfnt_glyphtoindex(sfnt *sf, glyph g) {
     cmp_glyphsbyindex = sf->glyphsbyindex;
     return *(unsigned short *)bsearch(&g, sf->glyphsbyname, sf->nglyphs,
@@ -682,7 +765,8 @@ void sfnt_getmetrics(font_info *fi, errorstate *es) {
     t_OS_2 OS_2;
     void *ptr, *end;
     unsigned i, j;
-    unsigned *hmtx;
+    sfnt_array hmtx;
+    void **elems;
 
     /* First, the bounding box from the 'head' table. */
     fi->fontbbox[0] = sf->head.xMin * FUNITS_PER_PT /  sf->head.unitsPerEm;
@@ -711,19 +795,25 @@ void sfnt_getmetrics(font_info *fi, errorstate *es) {
 	err_sfntnotable(es, &sf->pos, "hmtx");
 	return;
     }
-    hmtx = snewn(hhea.numOfLongHorMetrics, unsigned);
-    if (decoden(longhormetric_decode, ptr, end, hmtx, sizeof(*hmtx),
-		hhea.numOfLongHorMetrics) == NULL) {
+    if (!sfnt_array_init(&hmtx, ptr, end, 4, hhea.numOfLongHorMetrics) ||
+	(hhea.numOfLongHorMetrics == 0 && sf->nglyphs > 0)) {
 	err_sfntbadtable(es, &sf->pos, "hmtx");
 	return;
     }
+    elems = snewn(sf->nglyphs + 1, void *);
     for (i = 0; i < sf->nglyphs; i++) {
 	glyph_width *w = snew(glyph_width);
 	w->glyph = sfnt_indextoglyph(sf, i);
 	j = i < hhea.numOfLongHorMetrics ? i : hhea.numOfLongHorMetrics - 1;
-	w->width = hmtx[j] * UNITS_PER_PT / sf->head.unitsPerEm;
-	add234(fi->widths, w);
+	w->width = sfnt_uint16(&hmtx, j, 0) * UNITS_PER_PT /
+	    sf->head.unitsPerEm;
+	elems[i] = w;
     }
+    /* There's one width per glyph, so build the tree in one go. */
+    buildbt(fi->widths, elems, sf->nglyphs);
+    for (i = countbt(fi->widths); i < sf->nglyphs; i++)
+	sfree(elems[i]);
+    sfree(elems);
     /* Now see if the 'OS/2' table has any useful metrics */
     if (!sfnt_findtable(sf, TAG_OS_2, &ptr, &end))
 	return;
@@ -773,6 +863,7 @@ static void sfnt_getkern(font_info *fi, errorstate *es) {
     if (ptr == NULL) goto bad;
     for (i = 0; i < kern.nTables; i++) {
 	kern_f0 f0;
+	sfnt_array pairs;
 	kern_pair *kerns;
 	if (version == 0) {
 	    kern_v0_subhdr sub;
@@ -798,17 +889,19 @@ static void sfnt_getkern(font_info *fi, errorstate *es) {
 	}
 	ptr = decode(kern_f0_decode, ptr, end, &f0);
 	if (ptr == NULL) goto bad;
+	if (!sfnt_array_init(&pairs, ptr, end, 6, f0.nPairs)) goto bad;
+	ptr = (char *)ptr + 6 * f0.nPairs;
 	kerns = snewn(f0.nPairs, kern_pair);
 	for (j = 0; j < f0.nPairs; j++) {
-	    kern_f0_pair p;
+	    unsigned left = sfnt_uint16(&pairs, j, 0);
+	    unsigned right = sfnt_uint16(&pairs, j, 2);
 	    kern_pair *kp = kerns + j;
-	    ptr = decode(kern_f0_pair_decode, ptr, end, &p);
-	    if (ptr == NULL) goto bad;
-	    if (p.left >= sf->nglyphs || p.right >= sf->nglyphs) goto bad;
-	    kp->left = sfnt_indextoglyph(sf, p.left);
-	    kp->right = sfnt_indextoglyph(sf, p.right);
-	    kp->kern = p.value * UNITS_PER_PT / (int)sf->head.unitsPerEm;
-	    add234(fi->kerns, kp);
+	    if (left >= sf->nglyphs || right >= sf->nglyphs) goto bad;
+	    kp->left = sfnt_indextoglyph(sf, left);
+	    kp->right = sfnt_indextoglyph(sf, right);
+	    kp->kern = sfnt_int16(&pairs, j, 4) * UNITS_PER_PT /
+		(int)sf->head.unitsPerEm;
+	    addbt(fi->kerns, kp);
 	}
     }
     return;
@@ -817,13 +910,482 @@ static void sfnt_getkern(font_info *fi, errorstate *es) {
     return;
 }
 
+/*
+ * OpenType layout tables ('GPOS' and 'GSUB') are a maze of 16-bit
+ * offsets, any of which might point anywhere. Rather than check
+ * each one as we follow it, we read them through an otl_table,
+ * which checks every access and remembers if any went outside the
+ * table. A failed read returns 0, which makes every count we might
+ * be looping over zero, so once something's gone wrong the parse
+ * quickly winds down.
+ */
+typedef struct otl_table_Tag otl_table;
+struct otl_table_Tag {
+    unsigned char const *base;
+    size_t len;
+    bool bad;
+};
+
+static unsigned otl_uint16(otl_table *t, size_t off) {
+    if (off > t->len || t->len - off < 2) {
+	t->bad = true;
+	return 0;
+    }
+    return (t->base[off] << 8) | t->base[off + 1];
+}
+
+static int otl_int16(otl_table *t, size_t off) {
+    unsigned v = otl_uint16(t, off);
+    return v & 0x8000 ? (int)v - 0x10000 : (int)v;
+}
+
+static unsigned long otl_uint32(otl_table *t, size_t off) {
+    return ((unsigned long)otl_uint16(t, off) << 16) | otl_uint16(t, off + 2);
+}
+
+#define OTL_FEATURE_kern	0x6b65726e
+#define OTL_FEATURE_liga	0x6c696761
+
+/*
+ * Find the lookups used by a feature, in the order they should be
+ * applied (which is their order in the LookupList, not the order
+ * the feature lists them). We don't distinguish between scripts and
+ * languages: any feature with the right tag will do.
+ */
+static size_t otl_feature_lookups(otl_table *t, unsigned long tag,
+				  size_t **lookupsp) {
+    size_t featurelist = otl_uint16(t, 6);
+    size_t lookuplist = otl_uint16(t, 8);
+    unsigned nfeatures = otl_uint16(t, featurelist);
+    unsigned nlookups = otl_uint16(t, lookuplist);
+    unsigned i, j;
+    bool *used = snewn(nlookups + 1, bool);
+    size_t *lookups, n = 0;
+
+    for (i = 0; i < nlookups; i++)
+	used[i] = false;
+    for (i = 0; i < nfeatures && !t->bad; i++) {
+	size_t rec = featurelist + 2 + 6 * i;
+	size_t feature;
+	unsigned nindices;
+	if (otl_uint32(t, rec) != tag)
+	    continue;
+	feature = featurelist + otl_uint16(t, rec + 4);
+	nindices = otl_uint16(t, feature + 2);
+	for (j = 0; j < nindices; j++) {
+	    unsigned idx = otl_uint16(t, feature + 4 + 2 * j);
+	    if (idx < nlookups)
+		used[idx] = true;
+	}
+    }
+    lookups = snewn(nlookups + 1, size_t);
+    for (i = 0; i < nlookups; i++)
+	if (used[i])
+	    lookups[n++] = lookuplist + otl_uint16(t, lookuplist + 2 + 2 * i);
+    sfree(used);
+    *lookupsp = lookups;
+    return n;
+}
+
+/*
+ * Find subtable k of a lookup, looking through Extension subtables
+ * (lookup type exttype) to the real thing.
+ */
+static size_t otl_subtable(otl_table *t, size_t lookup, unsigned k,
+			   unsigned exttype, unsigned *typep) {
+    size_t sub = lookup + otl_uint16(t, lookup + 6 + 2 * k);
+
+    *typep = otl_uint16(t, lookup);
+    if (*typep == exttype) {
+	*typep = otl_uint16(t, sub + 2);
+	sub += otl_uint32(t, sub + 4);
+    }
+    return sub;
+}
+
+/*
+ * Read a Coverage table into an array of glyph indices, in coverage
+ * index order.
+ */
+static unsigned otl_coverage(otl_table *t, size_t cov, unsigned **glyphsp) {
+    unsigned format = otl_uint16(t, cov);
+    unsigned n = otl_uint16(t, cov + 2), count = 0, i, g;
+    unsigned *glyphs = NULL;
+
+    if (format == 1) {
+	glyphs = snewn(n + 1, unsigned);
+	for (i = 0; i < n; i++)
+	    glyphs[count++] = otl_uint16(t, cov + 4 + 2 * i);
+    } else if (format == 2) {
+	size_t size = 0;
+	for (i = 0; i < n && !t->bad; i++) {
+	    size_t range = cov + 4 + 6 * i;
+	    unsigned start = otl_uint16(t, range);
+	    unsigned end = otl_uint16(t, range + 2);
+	    for (g = start; g <= end; g++) {
+		if (count >= size) {
+		    size = size * 3 / 2 + 64;
+		    glyphs = sresize(glyphs, size, unsigned);
+		}
+		glyphs[count++] = g;
+	    }
+	}
+    } else {
+	t->bad = true;
+    }
+    *glyphsp = glyphs;
+    return count;
+}
+
+/*
+ * Read a ClassDef table into classes[], indexed by glyph index.
+ * Glyphs it doesn't mention stay in class 0.
+ */
+static void otl_classdef(otl_table *t, size_t cd, unsigned short *classes,
+			 unsigned nglyphs) {
+    unsigned format = otl_uint16(t, cd);
+    unsigned i, g;
+
+    for (i = 0; i < nglyphs; i++)
+	classes[i] = 0;
+    if (format == 1) {
+	unsigned start = otl_uint16(t, cd + 2);
+	unsigned n = otl_uint16(t, cd + 4);
+	for (i = 0; i < n && start + i < nglyphs; i++)
+	    classes[start + i] = otl_uint16(t, cd + 6 + 2 * i);
+    } else if (format == 2) {
+	unsigned n = otl_uint16(t, cd + 2);
+	for (i = 0; i < n && !t->bad; i++) {
+	    size_t range = cd + 4 + 6 * i;
+	    unsigned start = otl_uint16(t, range);
+	    unsigned end = otl_uint16(t, range + 2);
+	    unsigned cls = otl_uint16(t, range + 4);
+	    for (g = start; g <= end && g < nglyphs; g++)
+		classes[g] = cls;
+	}
+    } else {
+	t->bad = true;
+    }
+}
+
+/* Bytes in a GPOS ValueRecord with the given format */
+static size_t otl_valuesize(unsigned format) {
+    size_t size = 0;
+    for (; format; format >>= 1)
+	if (format & 1)
+	    size += 2;
+    return size;
+}
+#define OTL_VALUE_XADVANCE	0x0004
+/* Offset of XAdvance in a ValueRecord containing it */
+#define otl_xadvance(format) otl_valuesize((format) & (OTL_VALUE_XADVANCE-1))
+
+int glyph_class_cmp(void const *a, void const *b) {
+    glyph ga = ((glyph_class const *)a)->glyph;
+    glyph gb = ((glyph_class const *)b)->glyph;
+    if (ga < gb) return -1;
+    if (ga > gb) return 1;
+    return 0;
+}
+
+/*
+ * GPOS PairPos format 1: explicit pairs, which go in the kerns tree
+ * like those from a 'kern' table. Where more than one subtable has
+ * something to say about a pair, the first one wins.
+ */
+static bool otl_pairpos1(font_info *fi, otl_table *t, size_t sub) {
+    sfnt *sf = fi->fontfile;
+    unsigned vf1 = otl_uint16(t, sub + 4), vf2 = otl_uint16(t, sub + 6);
+    unsigned nsets = otl_uint16(t, sub + 8);
+    size_t recsize = 2 + otl_valuesize(vf1) + otl_valuesize(vf2);
+    size_t xadv = 2 + otl_xadvance(vf1);
+    unsigned *first, nfirst, i, j;
+    bool found = false;
+
+    if (!(vf1 & OTL_VALUE_XADVANCE))
+	return false;
+    nfirst = otl_coverage(t, sub + otl_uint16(t, sub + 2), &first);
+    for (i = 0; i < nfirst && i < nsets && !t->bad; i++) {
+	size_t set = sub + otl_uint16(t, sub + 10 + 2 * i);
+	unsigned npairs = otl_uint16(t, set);
+	if (first[i] >= sf->nglyphs)
+	    continue;
+	for (j = 0; j < npairs && !t->bad; j++) {
+	    size_t rec = set + 2 + recsize * j;
+	    unsigned second = otl_uint16(t, rec);
+	    kern_pair *kp;
+	    if (second >= sf->nglyphs)
+		continue;
+	    kp = snew(kern_pair);
+	    kp->left = sfnt_indextoglyph(sf, first[i]);
+	    kp->right = sfnt_indextoglyph(sf, second);
+	    kp->kern = otl_int16(t, rec + xadv) * UNITS_PER_PT /
+		(int)sf->head.unitsPerEm;
+	    if (addbt(fi->kerns, kp) != kp)
+		sfree(kp);
+	    found = true;
+	}
+    }
+    sfree(first);
+    return found;
+}
+
+/*
+ * GPOS PairPos format 2: class-based kerning, which we keep as a
+ * kern_classes rather than expanding it.
+ */
+static kern_classes *otl_pairpos2(font_info *fi, otl_table *t, size_t sub) {
+    sfnt *sf = fi->fontfile;
+    unsigned vf1 = otl_uint16(t, sub + 4), vf2 = otl_uint16(t, sub + 6);
+    size_t cd1 = sub + otl_uint16(t, sub + 8);
+    size_t cd2 = sub + otl_uint16(t, sub + 10);
+    unsigned nclass1 = otl_uint16(t, sub + 12);
+    unsigned nclass2 = otl_uint16(t, sub + 14);
+    size_t recsize = otl_valuesize(vf1) + otl_valuesize(vf2);
+    size_t xadv = otl_xadvance(vf1);
+    unsigned short *classes;
+    unsigned *first, nfirst, i, j;
+    kern_classes *kc;
+
+    if (!(vf1 & OTL_VALUE_XADVANCE) || nclass1 == 0 || nclass2 == 0)
+	return NULL;
+    /* Check the matrix is all there before allocating for it. */
+    if (sub + 16 > t->len ||
+	(t->len - sub - 16) / recsize / nclass2 < nclass1) {
+	t->bad = true;
+	return NULL;
+    }
+
+    kc = snew(kern_classes);
+    kc->next = NULL;
+    kc->nlclass = nclass1;
+    kc->nrclass = nclass2;
+    kc->kerns = snewn(nclass1 * nclass2, int);
+    for (i = 0; i < nclass1 * nclass2; i++)
+	kc->kerns[i] = otl_int16(t, sub + 16 + recsize * i + xadv) *
+	    UNITS_PER_PT / (int)sf->head.unitsPerEm;
+
+    classes = snewn(sf->nglyphs + 1, unsigned short);
+    otl_classdef(t, cd1, classes, sf->nglyphs);
+    nfirst = otl_coverage(t, sub + otl_uint16(t, sub + 2), &first);
+    kc->left = snewn(nfirst + 1, glyph_class);
+    kc->nleft = 0;
+    for (i = 0; i < nfirst; i++) {
+	if (first[i] >= sf->nglyphs)
+	    continue;
+	kc->left[kc->nleft].glyph = sfnt_indextoglyph(sf, first[i]);
+	kc->left[kc->nleft].cls =
+	    classes[first[i]] < nclass1 ? classes[first[i]] : 0;
+	kc->nleft++;
+    }
+    sfree(first);
+
+    otl_classdef(t, cd2, classes, sf->nglyphs);
+    for (i = j = 0; i < sf->nglyphs; i++)
+	if (classes[i] != 0 && classes[i] < nclass2)
+	    j++;
+    kc->right = snewn(j + 1, glyph_class);
+    kc->nright = 0;
+    for (i = 0; i < sf->nglyphs; i++) {
+	if (classes[i] != 0 && classes[i] < nclass2) {
+	    kc->right[kc->nright].glyph = sfnt_indextoglyph(sf, i);
+	    kc->right[kc->nright].cls = classes[i];
+	    kc->nright++;
+	}
+    }
+    sfree(classes);
+
+    qsort(kc->left, kc->nleft, sizeof(*kc->left), glyph_class_cmp);
+    qsort(kc->right, kc->nright, sizeof(*kc->right), glyph_class_cmp);
+
+    /*
+     * Even a subtable whose kerns are all zero matters, because it
+     * hides later ones for the glyphs it covers.
+     */
+    if (kc->nleft == 0) {
+	sfree(kc->left);
+	sfree(kc->right);
+	sfree(kc->kerns);
+	sfree(kc);
+	return NULL;
+    }
+    return kc;
+}
+
+/*
+ * Get kerning from the 'kern' feature of a 'GPOS' table. Returns
+ * true if the feature had anything in it, in which case the 'kern'
+ * table, if any, should be ignored.
+ */
+static bool sfnt_getgpos(font_info *fi, errorstate *es) {
+    sfnt *sf = fi->fontfile;
+    otl_table t;
+    void *ptr, *end;
+    size_t *lookups, nlookups, i;
+    kern_classes **tail = &fi->kern_classes;
+    bool found = false;
+
+    if (!sfnt_findtable(sf, TAG_GPOS, &ptr, &end))
+	return false;
+    t.base = ptr;
+    t.len = (char *)end - (char *)ptr;
+    t.bad = false;
+    nlookups = otl_feature_lookups(&t, OTL_FEATURE_kern, &lookups);
+    for (i = 0; i < nlookups && !t.bad; i++) {
+	unsigned nsub = otl_uint16(&t, lookups[i] + 4), k, type;
+	for (k = 0; k < nsub && !t.bad; k++) {
+	    size_t sub = otl_subtable(&t, lookups[i], k, 9, &type);
+	    if (type != 2)	       /* PairPos */
+		continue;
+	    switch (otl_uint16(&t, sub)) {
+	      case 1:
+		if (otl_pairpos1(fi, &t, sub))
+		    found = true;
+		break;
+	      case 2:
+		if ((*tail = otl_pairpos2(fi, &t, sub)) != NULL) {
+		    tail = &(*tail)->next;
+		    found = true;
+		}
+		break;
+	    }
+	}
+    }
+    sfree(lookups);
+    if (t.bad)
+	err_sfntbadtable(es, &sf->pos, "GPOS");
+    return found;
+}
+
+/*
+ * Get ligatures from the 'liga' feature of a 'GSUB' table.
+ *
+ * Halibut only knows about ligatures of two glyphs, but it applies
+ * them repeatedly, so that for instance "ffi" can be made by turning
+ * "f" and "f" into "ff" and then "ff" and "i" into "ffi". So a
+ * ligature of more than two glyphs can be used if the font also has
+ * one for all but its last glyph, and otherwise it's ignored.
+ */
+struct otl_lig {
+    unsigned ncomp;
+    size_t comps;		       /* index of first in the comps array */
+    unsigned lig;
+};
+
+static int otl_lig_cmp(void const *a, void const *b) {
+    struct otl_lig const *la = a, *lb = b;
+    if (la->ncomp < lb->ncomp) return -1;
+    if (la->ncomp > lb->ncomp) return 1;
+    /* keep the font's order otherwise, since the first one wins */
+    if (la->comps < lb->comps) return -1;
+    if (la->comps > lb->comps) return 1;
+    return 0;
+}
+
+static void sfnt_getgsub(font_info *fi, errorstate *es) {
+    sfnt *sf = fi->fontfile;
+    otl_table t;
+    void *ptr, *end;
+    size_t *lookups, nlookups, i;
+    struct otl_lig *ligs = NULL;
+    unsigned *comps = NULL;
+    size_t nligs = 0, ligsize = 0, ncomps = 0, compsize = 0;
+
+    if (!sfnt_findtable(sf, TAG_GSUB, &ptr, &end))
+	return;
+    t.base = ptr;
+    t.len = (char *)end - (char *)ptr;
+    t.bad = false;
+    nlookups = otl_feature_lookups(&t, OTL_FEATURE_liga, &lookups);
+    for (i = 0; i < nlookups && !t.bad; i++) {
+	unsigned nsub = otl_uint16(&t, lookups[i] + 4), k, type;
+	for (k = 0; k < nsub && !t.bad; k++) {
+	    size_t sub = otl_subtable(&t, lookups[i], k, 7, &type);
+	    unsigned *first, nfirst, nsets, j, l, c;
+	    if (type != 4 || otl_uint16(&t, sub) != 1)  /* LigatureSubst */
+		continue;
+	    nsets = otl_uint16(&t, sub + 4);
+	    nfirst = otl_coverage(&t, sub + otl_uint16(&t, sub + 2), &first);
+	    for (j = 0; j < nfirst && j < nsets && !t.bad; j++) {
+		size_t set = sub + otl_uint16(&t, sub + 6 + 2 * j);
+		unsigned nset = otl_uint16(&t, set);
+		for (l = 0; l < nset && !t.bad; l++) {
+		    size_t lig = set + otl_uint16(&t, set + 2 + 2 * l);
+		    unsigned n = otl_uint16(&t, lig + 2);
+		    if (n < 2)
+			continue;
+		    if (nligs >= ligsize) {
+			ligsize = ligsize * 3 / 2 + 16;
+			ligs = sresize(ligs, ligsize, struct otl_lig);
+		    }
+		    if (ncomps + n > compsize) {
+			compsize = (ncomps + n) * 3 / 2 + 64;
+			comps = sresize(comps, compsize, unsigned);
+		    }
+		    ligs[nligs].ncomp = n;
+		    ligs[nligs].comps = ncomps;
+		    ligs[nligs].lig = otl_uint16(&t, lig);
+		    comps[ncomps++] = first[j];
+		    for (c = 1; c < n; c++)
+			comps[ncomps++] = otl_uint16(&t, lig + 4 + 2 * (c-1));
+		    nligs++;
+		}
+	    }
+	    sfree(first);
+	}
+    }
+    sfree(lookups);
+    if (t.bad)
+	err_sfntbadtable(es, &sf->pos, "GSUB");
+
+    /*
+     * Now add them to the font, shortest first so that the ones
+     * we need to build longer ones out of are there already.
+     */
+    if (nligs > 0)
+	qsort(ligs, nligs, sizeof(*ligs), otl_lig_cmp);
+    for (i = 0; i < nligs; i++) {
+	unsigned const *comp = comps + ligs[i].comps;
+	unsigned n = ligs[i].ncomp, c;
+	ligature wantlig, *lig;
+
+	if (ligs[i].lig >= sf->nglyphs)
+	    continue;
+	for (c = 0; c < n; c++)
+	    if (comp[c] >= sf->nglyphs)
+		break;
+	if (c < n)
+	    continue;
+	wantlig.left = sfnt_indextoglyph(sf, comp[0]);
+	for (c = 1; c < n - 1; c++) {
+	    ligature const *prefix;
+	    wantlig.right = sfnt_indextoglyph(sf, comp[c]);
+	    if ((prefix = findbt(fi->ligs, &wantlig)) == NULL)
+		break;
+	    wantlig.left = prefix->lig;
+	}
+	if (c < n - 1)
+	    continue;
+	lig = snew(ligature);
+	lig->left = wantlig.left;
+	lig->right = sfnt_indextoglyph(sf, comp[n - 1]);
+	lig->lig = sfnt_indextoglyph(sf, ligs[i].lig);
+	if (addbt(fi->ligs, lig) != lig)
+	    sfree(lig);
+    }
+    sfree(ligs);
+    sfree(comps);
+}
+
 /*
  * Get mapping data from 'cmap' table
  *
- * We look for either a (0, 0), (0, 2), (0, 3), or (3, 1) table, all
- * of these being versions of UCS-2.  We ignore (0, 1), since it's
- * Unicode 1.1 with precomposed Hangul syllables.  We only handle
- * format 4 of this table, since that seems to be the only one in use.
+ * If there's a format 12 (0, 4) or (3, 10) table, we use that, since
+ * it covers all of Unicode and not just the BMP.  Otherwise we look
+ * for either a (0, 0), (0, 2), (0, 3), or (3, 1) table, all of these
+ * being versions of UCS-2.  We ignore (0, 1), since it's Unicode 1.1
+ * with precomposed Hangul syllables.  We only handle format 4 of
+ * those, since that seems to be the only one in use.
  */
 static void sfnt_getmap(font_info *fi, errorstate *es) {
     sfnt *sf = fi->fontfile;
@@ -833,9 +1395,6 @@ static void sfnt_getmap(font_info *fi, errorstate *es) {
     unsigned i;
     unsigned format;
 
-
-    for (i = 0; i < lenof(fi->bmp); i++)
-	    fi->bmp[i] = 0xFFFF;
     if (!sfnt_findtable(sf, TAG_cmap, &ptr, &end)) {
 	err_sfntnotable(es, &sf->pos, "cmap");
         return;
@@ -847,6 +1406,45 @@ static void sfnt_getmap(font_info *fi, errorstate *es) {
     ptr = decoden(encodingrec_decode, ptr, end, esd, sizeof(*esd),
 		  cmap.numTables);
     if (ptr == NULL) goto bad;
+    for (i = 0; i < cmap.numTables; i++) {
+	if (!decode(uint16_decode, (char *)base + esd[i].offset, end, &format))
+	    goto bad;
+	if (format == 12 &&
+	    ((esd[i].platformID == 0 && esd[i].encodingID == 4) ||
+	     (esd[i].platformID == 3 && esd[i].encodingID == 10))) {
+	    /* UCS-4 encoding */
+	    sfnt_array groups;
+	    cmap12 cmap12;
+	    unsigned j;
+
+	    ptr = decode(cmap12_decode, (char *)base + esd[i].offset, end,
+			 &cmap12);
+	    if (!ptr) goto bad;
+	    if (!sfnt_array_init(&groups, ptr, end, 12, cmap12.nGroups))
+		goto bad;
+
+	    for (j = 0; j < cmap12.nGroups; j++) {
+		unsigned long k, idx;
+		unsigned long startCharCode = sfnt_uint32(&groups, j, 0);
+		unsigned long endCharCode = sfnt_uint32(&groups, j, 4);
+		unsigned long startGlyphID = sfnt_uint32(&groups, j, 8);
+
+		if (endCharCode >= UNICODE_LIMIT)
+		    endCharCode = UNICODE_LIMIT - 1;
+		for (k = startCharCode; k <= endCharCode; k++) {
+		    idx = startGlyphID + (k - startCharCode);
+		    if (idx != 0) {
+			if (idx >= sf->nglyphs) {
+			    err_sfntbadglyph(es, &sf->pos, k);
+			    continue;
+			}
+			glyph_map_set(&fi->map, k, sfnt_indextoglyph(sf, idx));
+		    }
+		}
+	    }
+	    return;
+	}
+    }
     for (i = 0; i < cmap.numTables; i++) {
 	if (!decode(uint16_decode, (char *)base + esd[i].offset, end, &format))
 	    goto bad;
@@ -859,8 +1457,7 @@ static void sfnt_getmap(font_info *fi, errorstate *es) {
 			&format))
 		goto bad;
 	    if (format == 4) {
-		unsigned *data, *endCode, *startCode, *idDelta, *idRangeOffset;
-		unsigned *glyphIndexArray;
+		sfnt_array words;
 		unsigned segcount, nword, nglyphindex, j;
 		cmap4 cmap4;
 
@@ -868,52 +1465,63 @@ static void sfnt_getmap(font_info *fi, errorstate *es) {
 			     &cmap4);
 		if (!ptr) goto bad;
 		segcount = cmap4.segCountX2 / 2;
+		if (cmap4.length < 14) goto bad;
 		nword = cmap4.length / 2 - 7;
-		data = snewn(nword, unsigned);
-		if (!decoden(uint16_decode, ptr, (char *)ptr + nword * 2,
-			     data, sizeof(*data), nword)) goto bad;
-		endCode = data;
-		startCode = data + segcount + 1;
-		idDelta = startCode + segcount;
-		idRangeOffset = idDelta + segcount;
-		glyphIndexArray = idRangeOffset + segcount;
+		if (nword < segcount * 4 + 1) goto bad;
+		if (!sfnt_array_init(&words, ptr, end, 2, nword)) goto bad;
+		/*
+		 * The subtable is a run of 16-bit words: endCode[],
+		 * a reserved word, startCode[], idDelta[],
+		 * idRangeOffset[], and glyphIndexArray[].
+		 */
+#define endCode(j)	  sfnt_uint16(&words, (j), 0)
+#define startCode(j)	  sfnt_uint16(&words, segcount + 1 + (j), 0)
+#define idDelta(j)	  sfnt_uint16(&words, segcount * 2 + 1 + (j), 0)
+#define idRangeOffset(j)  sfnt_uint16(&words, segcount * 3 + 1 + (j), 0)
+#define glyphIndexArray(j) sfnt_uint16(&words, segcount * 4 + 1 + (j), 0)
 		nglyphindex = nword - segcount * 4 - 1;
 
 		for (j = 0; j < segcount; j++) {
 		    unsigned k, idx;
 
-		    if (idRangeOffset[j] == 0) {
-			for (k = startCode[j]; k <= endCode[j]; k++) {
-			    idx = (k + idDelta[j]) & 0xffff;
+		    if (idRangeOffset(j) == 0) {
+			for (k = startCode(j); k <= endCode(j); k++) {
+			    idx = (k + idDelta(j)) & 0xffff;
 			    if (idx != 0) {
-				if (idx > sf->nglyphs)  {
+				if (idx >= sf->nglyphs)  {
 				    err_sfntbadglyph(es, &sf->pos, k);
 				    continue;
 				}
-				fi->bmp[k] = sfnt_indextoglyph(sf, idx);
+				glyph_map_set(&fi->map, k,
+					      sfnt_indextoglyph(sf, idx));
 			    }
 			}
 		    } else {
-			unsigned startidx = idRangeOffset[j]/2 - segcount + j;
-			for (k = startCode[j]; k <= endCode[j]; k++) {
-			    if (startidx + k - startCode[j] >=
+			unsigned startidx = idRangeOffset(j)/2 - segcount + j;
+			for (k = startCode(j); k <= endCode(j); k++) {
+			    if (startidx + k - startCode(j) >=
 				nglyphindex) {
 				err_sfntbadglyph(es, &sf->pos, k);
 				continue;
 			    }
-			    idx = glyphIndexArray[startidx + k - startCode[j]];
+			    idx = glyphIndexArray(startidx + k - startCode(j));
 			    if (idx != 0) {
-				idx = (idx + idDelta[j]) & 0xffff;
-				if (idx > sf->nglyphs) {
+				idx = (idx + idDelta(j)) & 0xffff;
+				if (idx >= sf->nglyphs) {
 				    err_sfntbadglyph(es, &sf->pos, k);
 				    continue;
 				}
-				fi->bmp[k] = sfnt_indextoglyph(sf, idx);
+				glyph_map_set(&fi->map, k,
+					      sfnt_indextoglyph(sf, idx));
 			    }
 			}
 		    }
 		}
-		sfree(data);
+#undef endCode
+#undef startCode
+#undef idDelta
+#undef idRangeOffset
+#undef glyphIndexArray
 		return;
 	    }
 	}
@@ -924,6 +1532,48 @@ static void sfnt_getmap(font_info *fi, errorstate *es) {
     err_sfntbadtable(es, &sf->pos, "cmap");
 }
 
+/*
+ * Map a font file into memory rather than reading it, if we can.
+ * Big CJK fonts run to tens of megabytes, nearly all of it glyph
+ * outlines we never look at, only copy to the output; this way we
+ * never need to hold a copy of our own, and the parts we don't
+ * touch needn't be read at all.
+ */
+static bool sfnt_map(sfnt *sf, FILE *fp) {
+#ifdef HAVE_MMAP
+    struct stat st;
+    void *p;
+
+    if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode) ||
+	st.st_size <= 0 || (off_t)(size_t)st.st_size != st.st_size)
+	return false;
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (p == MAP_FAILED)
+	return false;
+    sf->data = p;
+    sf->len = st.st_size;
+    return true;
+#else
+    IGNORE(sf);
+    IGNORE(fp);
+    return false;
+#endif
+}
+
+/*
+ * Read everything about the font that read_sfnt_file() left until
+ * it was needed.
+ */
+static bool sfnt_load(font_info *fi, psdata *psd, errorstate *es) {
+    sfnt_mapglyphs(fi, psd, es);
+    sfnt_getmetrics(fi, es);
+    if (!sfnt_getgpos(fi, es))
+	sfnt_getkern(fi, es);
+    sfnt_getgsub(fi, es);
+    sfnt_getmap(fi, es);
+    return true;
+}
+
 void read_sfnt_file(input *in, psdata *psd) {
     sfnt *sf = snew(sfnt);
     size_t off = 0, got;
@@ -933,31 +1583,38 @@ void read_sfnt_file(input *in, psdata *psd) {
     t_maxp maxp;
 
     fi->name = NULL;
-    fi->widths = newtree234(width_cmp, NULL);
-    fi->kerns = newtree234(kern_cmp, NULL);
-    fi->ligs = newtree234(lig_cmp, NULL);
+    fi->widths = newkeyedbt(width_key);
+    fi->kerns = newkeyedbt(kern_key);
+    fi->kern_classes = NULL;
+    fi->ligs = newkeyedbt(lig_key);
     fi->fontbbox[0] = fi->fontbbox[1] = fi->fontbbox[2] = fi->fontbbox[3] = 0;
     fi->capheight = fi->xheight = fi->ascent = fi->descent = 0;
     fi->stemh = fi->stemv = fi->italicangle = 0;
     fi->fontfile = sf;
     fi->filetype = TRUETYPE;
+    glyph_map_init(&fi->map);
 
-    sf->len = 32768;
-    sf->data = snewn(sf->len, unsigned char);
-    for (;;) {
-	got = fread((char *)sf->data + off, 1, sf->len - off, fp);
-	off += got;
-	if (off != sf->len) break;
-	sf->len *= 2;
+    if (!sfnt_map(sf, fp)) {
+	sf->len = 32768;
+	sf->data = snewn(sf->len, unsigned char);
+	for (;;) {
+	    got = fread((char *)sf->data + off, 1, sf->len - off, fp);
+	    off += got;
+	    if (off != sf->len) break;
+	    sf->len *= 2;
+	    sf->data = sresize(sf->data, sf->len, unsigned char);
+	}
+	sf->len = off;
 	sf->data = sresize(sf->data, sf->len, unsigned char);
     }
     fclose(in->currfp);
-    sf->len = off;
-    sf->data = sresize(sf->data, sf->len, unsigned char);
     sf->end = (char *)sf->data + sf->len;
     sf->pos = in->pos;
     sf->pos.line = 0;
     sf->nglyphs = 0;
+    sf->glyphsbyname = NULL;
+    sf->glyphsbyindex = NULL;
+    sf->minmem = sf->maxmem = 0;
     ptr = decode(offsubdir_decode, sf->data, sf->end, &sf->osd);
     if (ptr == NULL) {
 	err_sfntbadhdr(in->es, &sf->pos);
@@ -997,10 +1654,8 @@ void read_sfnt_file(input *in, psdata *psd) {
     sf->nglyphs = maxp.numGlyphs;
     fi->name = sfnt_psname(fi, in->es);
     if (fi->name == NULL) return;
-    sfnt_mapglyphs(fi, psd, in->es);
-    sfnt_getmetrics(fi, in->es);
-    sfnt_getkern(fi, in->es);
-    sfnt_getmap(fi, in->es);
+    fi->pending = font_pending_new(sfnt_load, sf->data, sf->len, false,
+				   &sf->pos, in->es);
     fi->next = psd->all_fonts;
     psd->all_fonts = fi;
 }
@@ -1022,7 +1677,7 @@ void sfnt_writeps(font_info const *fi, FILE *ofp, psdata *psd, errorstate *es) {
     sfnt *sf = fi->fontfile;
     size_t *breaks, glyfoff, glyflen;
     void *glyfptr, *glyfend, *locaptr, *locaend;
-    unsigned *loca;
+    sfnt_array loca;
     int cc = 0;
 
     /* XXX Unclear that this is the correct format. */
@@ -1071,30 +1726,28 @@ void sfnt_writeps(font_info const *fi, FILE *ofp, psdata *psd, errorstate *es) {
 	err_sfntnotable(es, &sf->pos, "loca");
 	return;
     }
-    loca = snewn(sf->nglyphs, unsigned);
-    if (sf->head.indexToLocFormat == 0) {
-	if (!decoden(uint16_decode, locaptr, locaend, loca, sizeof(*loca),
-		     sf->nglyphs)) goto badloca;
-	for (i = 0; i < sf->nglyphs; i++) loca[i] *= 2;
-    } else {
-	if (!decoden(uint32_decode, locaptr, locaend, loca, sizeof(*loca),
-		     sf->nglyphs)) goto badloca;
-    }
+    if (!sfnt_array_init(&loca, locaptr, locaend,
+			 sf->head.indexToLocFormat == 0 ? 2 : 4, sf->nglyphs))
+	goto badloca;
     for (i = 1; i < sf->nglyphs; i++) {
-	if (loca[i] > glyflen) goto badloca;
-	breaks[sf->osd.numTables + i - 1] = loca[i] + glyfoff;
+	unsigned long off = sf->head.indexToLocFormat == 0 ?
+	    sfnt_uint16(&loca, i, 0) * 2UL : sfnt_uint32(&loca, i, 0);
+	if (off > glyflen) goto badloca;
+	breaks[sf->osd.numTables + i - 1] = off + glyfoff;
     }
     breaks[sf->osd.numTables + sf->nglyphs - 1] = sf->len;
     qsort(breaks, sf->osd.numTables + sf->nglyphs, sizeof(*breaks), sizecmp);
     j = lastbreak = 0;
     for (i = 0; i < sf->len; i++) {
-	if ((i - lastbreak) % 38 == 0) fprintf(ofp, "\n");
+	unsigned char c = ((unsigned char *)sf->data)[i];
+	if ((i - lastbreak) % 38 == 0) putc('\n', ofp);
 	if (i == breaks[j]) {
 	    while (i == breaks[j]) j++;
 	    lastbreak = i;
-	    fprintf(ofp, "00><\n");
+	    fputs("00><\n", ofp);
 	}
-	fprintf(ofp, "%02x", *((unsigned char *)sf->data + i));
+	putc("0123456789abcdef"[c >> 4], ofp);
+	putc("0123456789abcdef"[c & 0xF], ofp);
     }
     fprintf(ofp, "00>] readonly def\n");
     sfree(breaks);
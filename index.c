@@ -164,11 +164,18 @@ void index_merge(indexdata *idx, bool is_explicit, wchar_t *tags, word *text,
  */
 void build_index(indexdata *i) {
     indextag *t;
+    indexentry **ents;
     word **ta;
     filepos *fa;
     int ti;
-    int j;
+    int j, nents, entsize, nkept;
 
+    /*
+     * Make an entry for every reference, and then build the tree of
+     * entries out of all of them at once.
+     */
+    ents = NULL;
+    nents = entsize = 0;
     for (ti = 0; (t = (indextag *)index234(i->tags, ti)) != NULL; ti++) {
 	if (t->implicit_text) {
 	    t->nrefs = 1;
@@ -185,12 +192,32 @@ void build_index(indexdata *i) {
 		indexentry *ent = snew(indexentry);
 		ent->text = *ta++;
 		ent->fpos = *fa++;
-		t->refs[j] = add234(i->entries, ent);
-		if (t->refs[j] != ent)     /* duplicate */
-		    sfree(ent);
+		t->refs[j] = ent;
+		if (nents >= entsize) {
+		    entsize = nents * 3 / 2 + 64;
+		    ents = sresize(ents, entsize, indexentry *);
+		}
+		ents[nents++] = ent;
 	    }
 	}
     }
+
+    freetree234(i->entries);
+    i->entries = buildtree234(compare_entries, NULL, (void **)ents, nents);
+
+    /*
+     * Duplicate entries were left out of the tree. Point their
+     * references at the entry that went in instead, and free them.
+     */
+    nkept = count234(i->entries);
+    if (nkept < nents) {
+	for (ti = 0; (t = (indextag *)index234(i->tags, ti)) != NULL; ti++)
+	    for (j = 0; j < t->nrefs; j++)
+		t->refs[j] = find234(i->entries, t->refs[j]);
+	for (j = nkept; j < nents; j++)
+	    sfree(ents[j]);
+    }
+    sfree(ents);
 }
 
 void cleanup_index(indexdata *i) {
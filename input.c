@@ -32,44 +32,105 @@ static void unget(input *in, int c, filepos *pos) {
 typedef struct macro_Tag macro;
 struct macro_Tag {
     wchar_t *name, *text;
+    int len;
+    int file;			       /* index of the file defining it */
 };
+/*
+ * Macro expansions in progress are kept in an array in the input
+ * structure, which is reused from one expansion to the next.
+ */
 struct macrostack_Tag {
-    macrostack *next;
     wchar_t *text;
-    int ptr, npushback;
+    int ptr, len, npushback;
     filepos pos;
 };
+
+/*
+ * Everything read_file() needs besides the lexer state. Normally
+ * this just points at the document-wide macro table and index; but
+ * when files are parsed speculatively on worker threads (see
+ * read_input()), each gets its own macro table, the macros found
+ * in earlier files by the pre-scan, a record of which of those it
+ * used and which macro names it failed to find, and a list of
+ * index merges to be done later.
+ */
+typedef struct srcfile_Tag srcfile;
+struct srcfile_Tag {
+    tree234 *macros;		       /* macros visible to this file */
+    tree234 *seeds;		       /* macros from the pre-scan, or NULL */
+    tree234 *hits;		       /* which of those we used */
+    tree234 *misses;		       /* unknown macro names, or NULL */
+    bool defsonly;		       /* pre-scan: only \define and \cfg */
+    indexdata *idx;		       /* NULL to defer index merges */
+    struct idxmerge {
+	wchar_t *tags;
+	word *text;
+	filepos fpos;
+	int errpos;		       /* es->deferred->pos when we got here */
+    } *merges;
+    int nmerges, mergesize;
+    const struct tm *date;	       /* for \date */
+};
+
 static int macrocmp(const void *av, const void *bv, void *cmpctx) {
     macro *a = (macro *)av, *b = (macro *)bv;
     return ustrcmp(a->name, b->name);
 }
+static int misscmp(const void *av, const void *bv, void *cmpctx) {
+    return ustrcmp((wchar_t *)av, (wchar_t *)bv);
+}
 static void macrodef(tree234 *macros, wchar_t *name, wchar_t *text,
-		     filepos fpos, errorstate *es) {
+		     filepos fpos, input *in) {
     macro *m = snew(macro);
     m->name = name;
     m->text = text;
+    m->len = text ? ustrlen(text) : 0;
+    m->file = in->currindex;
     if (add234(macros, m) != m) {
-	err_macroexists(es, &fpos, name);
+	err_macroexists(in->es, &fpos, name);
 	sfree(name);
 	sfree(text);
     }
 }
-static bool macrolookup(tree234 *macros, input *in, wchar_t *name,
+static bool macrolookup(srcfile *sf, input *in, wchar_t *name,
                         filepos *pos) {
     macro m, *gotit;
     m.name = name;
-    gotit = find234(macros, &m);
+    gotit = find234(sf->macros, &m);
+    if (!gotit && sf->seeds) {
+	/*
+	 * Try the definitions the pre-scan found in earlier files,
+	 * noting any we use so that they can be checked later.
+	 */
+	gotit = find234(sf->seeds, &m);
+	if (gotit && gotit->file < in->currindex)
+	    add234(sf->hits, gotit);
+	else
+	    gotit = NULL;
+    }
     if (gotit) {
-	macrostack *expansion = snew(macrostack);
-	expansion->next = in->stack;
+	macrostack *expansion;
+	if (gotit->len == 0)
+	    return true;	       /* nothing to expand */
+	if (in->nstack >= in->stacksize) {
+	    in->stacksize = in->nstack * 3 / 2 + 8;
+	    in->stack = sresize(in->stack, in->stacksize, macrostack);
+	}
+	expansion = &in->stack[in->nstack++];
 	expansion->text = gotit->text;
+	expansion->len = gotit->len;
 	expansion->pos = *pos;	       /* structure copy */
 	expansion->ptr = 0;
-	expansion->npushback = in->npushback;
-	in->stack = expansion;
+	expansion->npushback = in->pushbase = in->npushback;
 	return true;
-    } else
+    } else {
+	if (sf->misses) {
+	    wchar_t *miss = ustrdup(name);
+	    if (add234(sf->misses, miss) != miss)
+		sfree(miss);
+	}
 	return false;
+    }
 }
 static void macrocleanup(tree234 *macros) {
     int ti;
@@ -82,12 +143,65 @@ static void macrocleanup(tree234 *macros) {
     freetree234(macros);
 }
 
+/*
+ * Pass an implicit index entry on to index_merge(), or save it up
+ * for later if this file is being read speculatively. Takes
+ * ownership of `tags'.
+ */
+static void merge_index(srcfile *sf, wchar_t *tags, word *text,
+			filepos *fpos, errorstate *es) {
+    struct idxmerge *im;
+
+    if (sf->idx) {
+	index_merge(sf->idx, false, tags, text, fpos, es);
+	sfree(tags);
+	return;
+    }
+
+    if (sf->nmerges >= sf->mergesize) {
+	sf->mergesize = sf->nmerges * 3 / 2 + 16;
+	sf->merges = sresize(sf->merges, sf->mergesize, struct idxmerge);
+    }
+    im = &sf->merges[sf->nmerges++];
+    im->tags = tags;
+    im->text = text;
+    im->fpos = *fpos;		       /* structure copy */
+    im->errpos = es->deferred->pos;
+}
+
+/*
+ * Select the input character set. As well as recording it, we work
+ * out which ASCII bytes decode to themselves when the conversion
+ * state is at rest, so that get() can skip the charset library
+ * entirely for those.
+ */
+static void set_input_charset(input *in, int charset) {
+    int i;
+
+    in->charset = charset;
+    in->asciiok[0] = false;	       /* so zero bytes get reported */
+    for (i = 1; i < (int)lenof(in->asciiok); i++) {
+	charset_state state = CHARSET_INIT_STATE;
+	char buf[1];
+	char const *p = buf;
+	int inlen = 1;
+	wchar_t wc[lenof(in->wc)];
+	int nwc;
+
+	buf[0] = (char)i;
+	nwc = charset_to_unicode(&p, &inlen, wc, lenof(wc), charset,
+				 &state, NULL, 0);
+	in->asciiok[i] = (nwc == 1 && wc[0] == i &&
+			  state.s0 == 0 && state.s1 == 0);
+    }
+}
+
 static void input_configure(input *in, paragraph *cfg) {
     assert(cfg->type == para_Config);
 
     if (!ustricmp(cfg->keyword, L"input-charset")) {
-	in->charset = charset_from_ustr(&cfg->fpos, uadv(cfg->keyword),
-                                        in->es);
+	set_input_charset(in, charset_from_ustr(&cfg->fpos,
+                                                uadv(cfg->keyword), in->es));
     }
 }
 
@@ -95,21 +209,20 @@ static void input_configure(input *in, paragraph *cfg) {
  * Can return EOF
  */
 static int get(input *in, filepos *pos, rdstringc *rsc) {
-    int pushbackpt = in->stack ? in->stack->npushback : 0;
-    if (in->npushback > pushbackpt) {
+    if (in->npushback > in->pushbase) {
 	--in->npushback;
 	if (pos)
 	    *pos = in->pushback[in->npushback].pos;   /* structure copy */
 	return in->pushback[in->npushback].chr;
     }
-    else if (in->stack) {
-	wchar_t c = in->stack->text[in->stack->ptr];
+    else if (in->nstack) {
+	macrostack *top = &in->stack[in->nstack - 1];
+	wchar_t c = top->text[top->ptr];
         if (pos)
-            *pos = in->stack->pos;
-	if (in->stack->text[++in->stack->ptr] == L'\0') {
-	    macrostack *tmp = in->stack;
-	    in->stack = tmp->next;
-	    sfree(tmp);
+            *pos = top->pos;
+	if (++top->ptr == top->len) {
+	    in->nstack--;
+	    in->pushbase = in->nstack ? top[-1].npushback : 0;
 	}
 	return c;
     }
@@ -153,9 +266,15 @@ static int get(input *in, filepos *pos, rdstringc *rsc) {
 
 	    /*
 	     * Do input character set translation, so that we return
-	     * Unicode.
+	     * Unicode. Plain ASCII in an ASCII-compatible charset can
+	     * skip the conversion.
 	     */
-	    {
+	    if (c < 0x80 && in->asciiok[c] &&
+		in->csstate.s0 == 0 && in->csstate.s1 == 0) {
+		in->wc[0] = c;
+		in->nwc = 1;
+		in->wcpos = 0;
+	    } else {
 		char buf[1];
 		char const *p;
 		int inlen;
@@ -256,84 +375,157 @@ enum {
     c_versionid			       /* document RCS id */
 };
 
+/*
+ * Character classes used by the lexer, looked up in a table rather
+ * than by a chain of comparisons since they're tested on every
+ * character of the input.
+ */
+enum {
+    CC_WHITE = 1,		       /* whitespace */
+    CC_DEC = 2,			       /* decimal digit */
+    CC_HEX = 4,			       /* hex digit */
+    CC_CMD = 8,			       /* can appear in a command name */
+    CC_WORDEND = 16		       /* terminates a tok_word */
+};
+#define S_ (CC_WHITE | CC_WORDEND)
+#define D_ (CC_DEC | CC_HEX | CC_CMD)
+#define X_ (CC_HEX | CC_CMD)
+#define A_ CC_CMD
+#define E_ CC_WORDEND
+static const unsigned char charclass[128] = {
+    0,  0,  0,  0,  0,  0,  0,  0,     /* 0x00 */
+    0,  S_, S_, 0,  0,  S_, 0,  0,     /* 0x08: \t \n \r */
+    0,  0,  0,  0,  0,  0,  0,  0,     /* 0x10 */
+    0,  0,  0,  0,  0,  0,  0,  0,     /* 0x18 */
+    S_, 0,  0,  0,  0,  0,  0,  0,     /* 0x20: space */
+    0,  0,  0,  0,  0,  0,  0,  0,     /* 0x28 */
+    D_, D_, D_, D_, D_, D_, D_, D_,    /* 0x30: 0-7 */
+    D_, D_, 0,  0,  0,  0,  0,  0,     /* 0x38: 8-9 */
+    0,  X_, X_, X_, X_, X_, X_, A_,    /* 0x40: A-G */
+    A_, A_, A_, A_, A_, A_, A_, A_,    /* 0x48: H-O */
+    A_, A_, A_, A_, A_, A_, A_, A_,    /* 0x50: P-W */
+    A_, A_, A_, 0,  E_, 0,  0,  0,     /* 0x58: X-Z \\ */
+    0,  X_, X_, X_, X_, X_, X_, A_,    /* 0x60: a-g */
+    A_, A_, A_, A_, A_, A_, A_, A_,    /* 0x68: h-o */
+    A_, A_, A_, A_, A_, A_, A_, A_,    /* 0x70: p-w */
+    A_, A_, A_, E_, 0,  E_, 0,  0,     /* 0x78: x-z { } */
+};
+#undef S_
+#undef D_
+#undef X_
+#undef A_
+#undef E_
+#define cclass(c, m) ( (unsigned)(c) < lenof(charclass) && \
+                       (charclass[(c)] & (m)) )
+
 /* Perhaps whitespace should be defined in a more Unicode-friendly way? */
-#define iswhite(c) ( (c)==32 || (c)==9 || (c)==13 || (c)==10 )
+#define iswhite(c) cclass(c, CC_WHITE)
 #define isnl(c) ( (c)==10 )
-#define isdec(c) ( ((c)>='0'&&(c)<='9') )
+#define isdec(c) cclass(c, CC_DEC)
 #define fromdec(c) ( (c)-'0' )
-#define ishex(c) ( ((c)>='0'&&(c)<='9') || ((c)>='A'&&(c)<='F') || ((c)>='a'&&(c)<='f'))
+#define ishex(c) cclass(c, CC_HEX)
 #define fromhex(c) ( (c)<='9' ? (c)-'0' : ((c)&0xDF) - ('A'-10) )
-#define iscmd(c) ( ((c)>='0'&&(c)<='9') || ((c)>='A'&&(c)<='Z') || ((c)>='a'&&(c)<='z'))
+#define iscmd(c) cclass(c, CC_CMD)
+#define iswordend(c) ( (c) == EOF || cclass(c, CC_WORDEND) )
 
 /*
- * Keyword comparison function. Like strcmp, but between a wchar_t *
- * and a char *.
+ * Hash function for command names, looking only at the length and
+ * the first and last characters. The multipliers were chosen to
+ * give no collisions among the keywords in match_kw() within a
+ * table of KWHASH_SIZE entries; if a new keyword ever breaks that,
+ * the assertion in match_kw() will say so.
  */
-static int kwcmp(wchar_t const *p, char const *q) {
+#define KWHASH_SIZE 128
+static unsigned kwhash(wchar_t const *p, int len) {
+    return ((unsigned)len + 12 * (unsigned)p[0] + 59 * (unsigned)p[len-1])
+	& (KWHASH_SIZE - 1);
+}
+
+/*
+ * FIXME. The ids are explicit in here so as to allow long-name
+ * equivalents to the various very short keywords.
+ */
+static const struct { char const *name; int id; } keywords[] = {
+    {"#", c__comment},		       /* comment command (\#) */
+    {"-", c__escaped},		       /* nonbreaking hyphen */
+    {".", c__nop},		       /* no-op */
+    {"A", c_A},			       /* appendix heading */
+    {"B", c_B},			       /* bibliography entry */
+    {"BR", c_BR},		       /* bibliography rewrite */
+    {"C", c_C},			       /* chapter heading */
+    {"H", c_H},			       /* heading */
+    {"I", c_I},			       /* invisible index mark */
+    {"IM", c_IM},		       /* index merge/rewrite */
+    {"K", c_K},			       /* capitalised cross-reference */
+    {"U", c_U},			       /* unnumbered-chapter heading */
+    {"W", c_W},			       /* Web hyperlink */
+    {"\\", c__escaped},		       /* escaped backslash (\\) */
+    {"_", c__nbsp},		       /* nonbreaking space (\_) */
+    {"b", c_b},			       /* bulletted list */
+    {"c", c_c},			       /* code */
+    {"cfg", c_cfg},		       /* configuration directive */
+    {"copyright", c_copyright},	       /* copyright statement */
+    {"cq", c_cq},		       /* quoted code (sugar for \q{\cw{x}}) */
+    {"cw", c_cw},		       /* weak code */
+    {"date", c_date},		       /* document processing date */
+    {"dd", c_dd},		       /* description list: description */
+    {"define", c_define},	       /* macro definition */
+    {"dt", c_dt},		       /* description list: described thing */
+    {"e", c_e},			       /* emphasis */
+    {"i", c_i},			       /* visible index mark */
+    {"ii", c_ii},		       /* uncapitalised visible index mark */
+    {"k", c_k},			       /* uncapitalised cross-reference */
+    {"lcont", c_lcont},		       /* continuation para(s) for list item */
+    {"n", c_n},			       /* numbered list */
+    {"nocite", c_nocite},	       /* bibliography trickery */
+    {"preamble", c_preamble},	       /* (obsolete) preamble text */
+    {"q", c_q},			       /* quote marks */
+    {"quote", c_quote},		       /* block-quoted paragraphs */
+    {"rule", c_rule},		       /* horizontal rule */
+    {"s", c_s},			       /* strong */
+    {"title", c_title},		       /* document title */
+    {"versionid", c_versionid},	       /* document RCS id */
+    {"{", c__escaped},		       /* escaped lbrace (\{) */
+    {"}", c__escaped},		       /* escaped rbrace (\}) */
+};
+
+/*
+ * Hash table mapping kwhash() values to (1 + index into keywords[]),
+ * or 0 for an empty slot. Built by read_input() before it does
+ * anything else, so that it's ready before any worker threads start.
+ */
+static unsigned char kwtable[KWHASH_SIZE];
+static bool kwtable_built = false;
+
+static void build_kwtable(void) {
     int i;
-    do {
-	i = *p - *q;
-    } while (*p++ && *q++ && !i);
-    return i;
+
+    if (kwtable_built)
+	return;
+    for (i = 0; i < (int)lenof(keywords); i++) {
+	wchar_t wname[16];
+	int j;
+	unsigned h;
+
+	for (j = 0; (wname[j] = keywords[i].name[j]) != 0; j++)
+	    assert(j+1 < (int)lenof(wname));
+	h = kwhash(wname, j);
+	assert(!kwtable[h]);	       /* kwhash must stay collision-free */
+	kwtable[h] = i + 1;
+    }
+    kwtable_built = true;
 }
 
 /*
  * Match a keyword.
  */
 static void match_kw(token *tok) {
-    /*
-     * FIXME. The ids are explicit in here so as to allow long-name
-     * equivalents to the various very short keywords.
-     */
-    static const struct { char const *name; int id; } keywords[] = {
-	{"#", c__comment},	       /* comment command (\#) */
-	{"-", c__escaped},	       /* nonbreaking hyphen */
-	{".", c__nop},		       /* no-op */
-	{"A", c_A},		       /* appendix heading */
-	{"B", c_B},		       /* bibliography entry */
-	{"BR", c_BR},		       /* bibliography rewrite */
-	{"C", c_C},		       /* chapter heading */
-	{"H", c_H},		       /* heading */
-	{"I", c_I},		       /* invisible index mark */
-	{"IM", c_IM},		       /* index merge/rewrite */
-	{"K", c_K},		       /* capitalised cross-reference */
-	{"U", c_U},		       /* unnumbered-chapter heading */
-	{"W", c_W},		       /* Web hyperlink */
-	{"\\", c__escaped},	       /* escaped backslash (\\) */
-	{"_", c__nbsp},		       /* nonbreaking space (\_) */
-	{"b", c_b},		       /* bulletted list */
-	{"c", c_c},		       /* code */
-	{"cfg", c_cfg},		       /* configuration directive */
-	{"copyright", c_copyright},    /* copyright statement */
-	{"cq", c_cq},		       /* quoted code (sugar for \q{\cw{x}}) */
-	{"cw", c_cw},		       /* weak code */
-	{"date", c_date},	       /* document processing date */
-	{"dd", c_dd},		       /* description list: description */
-	{"define", c_define},	       /* macro definition */
-	{"dt", c_dt},		       /* description list: described thing */
-	{"e", c_e},		       /* emphasis */
-	{"i", c_i},		       /* visible index mark */
-	{"ii", c_ii},		       /* uncapitalised visible index mark */
-	{"k", c_k},		       /* uncapitalised cross-reference */
-	{"lcont", c_lcont},	       /* continuation para(s) for list item */
-	{"n", c_n},		       /* numbered list */
-	{"nocite", c_nocite},	       /* bibliography trickery */
-	{"preamble", c_preamble},      /* (obsolete) preamble text */
-	{"q", c_q},		       /* quote marks */
-	{"quote", c_quote},	       /* block-quoted paragraphs */
-	{"rule", c_rule},	       /* horizontal rule */
-	{"s", c_s},		       /* strong */
-	{"title", c_title},	       /* document title */
-	{"versionid", c_versionid},    /* document RCS id */
-	{"{", c__escaped},	       /* escaped lbrace (\{) */
-	{"}", c__escaped},	       /* escaped rbrace (\}) */
-    };
-    int i, j, k, c;
+    int i, len;
 
     /*
      * Special cases: \S{0,1,2,...} and \uABCD. If the syntax
      * doesn't match correctly, we just fall through to the
-     * binary-search phase.
+     * hash lookup.
      */
     if (tok->text[0] == 'S') {
 	/* We expect numeric characters thereafter. */
@@ -370,24 +562,53 @@ static void match_kw(token *tok) {
 	}
     }
 
-    i = -1;
-    j = sizeof(keywords)/sizeof(*keywords);
-    while (j-i > 1) {
-	k = (i+j)/2;
-	c = kwcmp(tok->text, keywords[k].name);
-	if (c < 0)
-	    j = k;
-	else if (c > 0)
-	    i = k;
-	else /* c == 0 */ {
-	    tok->cmd = keywords[k].id;
-	    return;
+    len = ustrlen(tok->text);
+    if (len > 0) {
+	i = kwtable[kwhash(tok->text, len)];
+	if (i) {
+	    char const *q = keywords[i-1].name;
+	    wchar_t const *p = tok->text;
+	    while (*q && *p == (unsigned char)*q)
+		p++, q++;
+	    if (!*p && !*q) {
+		tok->cmd = keywords[i-1].id;
+		return;
+	    }
 	}
     }
 
     tok->cmd = c__invalid;
 }
 
+/*
+ * The text of each token is accumulated in buffers belonging to the
+ * input structure, which are reused from one token to the next so
+ * that lexing doesn't cost a couple of mallocs per token. Hence a
+ * token's `text' and `origtext' are only valid until the next call
+ * to get_token() or get_codepar_token(), and anything that wants to
+ * keep them must copy them.
+ */
+static void tok_start(input *in) {
+    in->tokbuf.pos = 0;
+    in->tokbuf.text[0] = L'\0';
+    in->origbuf.pos = 0;
+    rdaddsn(&in->origbuf, in->pushback_chars.text, in->pushback_chars.pos);
+    in->pushback_chars.pos = 0;
+}
+
+/*
+ * Finish off a token whose input-encoding text ends at `prevpos' in
+ * origbuf. Anything read beyond that point belongs to the next
+ * token, so save it for then.
+ */
+static void tok_finish(input *in, token *tok, int prevpos) {
+    rdaddsn(&in->pushback_chars, in->origbuf.text + prevpos,
+	    in->origbuf.pos - prevpos);
+    in->origbuf.pos = prevpos;
+    in->origbuf.text[prevpos] = '\0';
+    tok->text = in->tokbuf.text;
+    tok->origtext = in->origbuf.text;
+}
 
 /*
  * Read a token from the input file, in the normal way (`normal' in
@@ -398,18 +619,14 @@ token get_token(input *in) {
     int nls;
     int prevpos;
     token ret;
-    rdstring rs = { 0, 0, NULL };
-    rdstringc rsc = { 0, 0, NULL };
+    rdstring *rs = &in->tokbuf;
+    rdstringc *rsc = &in->origbuf;
     filepos cpos;
 
     ret.text = NULL;		       /* default */
     ret.origtext = NULL;	       /* default */
-    if (in->pushback_chars) {
-	rdaddsc(&rsc, in->pushback_chars);
-	sfree(in->pushback_chars);
-	in->pushback_chars = NULL;
-    }
-    c = get(in, &cpos, &rsc);
+    tok_start(in);
+    c = get(in, &cpos, rsc);
     ret.pos = cpos;
     if (iswhite(c)) {		       /* tok_white or tok_eop */
 	nls = 0;
@@ -417,46 +634,43 @@ token get_token(input *in) {
 	do {
 	    if (isnl(c))
 		nls++;
-	    prevpos = rsc.pos;
-	} while ((c = get(in, &cpos, &rsc)) != EOF && iswhite(c));
+	    prevpos = rsc->pos;
+	} while ((c = get(in, &cpos, rsc)) != EOF && iswhite(c));
 	if (c == EOF) {
 	    ret.type = tok_eof;
-	    sfree(rsc.text);
 	    return ret;
 	}
-	if (rsc.text) {
-	    in->pushback_chars = dupstr(rsc.text + prevpos);
-	    sfree(rsc.text);
-	}
+	tok_finish(in, &ret, prevpos);
+	ret.text = NULL;
+	ret.origtext = NULL;
 	unget(in, c, &cpos);
 	ret.type = (nls > 1 ? tok_eop : tok_white);
 	return ret;
     } else if (c == EOF) {	       /* tok_eof */
 	ret.type = tok_eof;
-	sfree(rsc.text);
 	return ret;
     } else if (c == '\\') {	       /* tok_cmd */
-	rsc.pos = prevpos = 0;
-	c = get(in, &cpos, &rsc);
+	rsc->pos = prevpos = 0;
+	c = get(in, &cpos, rsc);
 	if (c == '-' || c == '\\' || c == '_' ||
 	    c == '#' || c == '{' || c == '}' || c == '.') {
 	    /* single-char command */
-	    rdadd(&rs, c);
-	    prevpos = rsc.pos;
+	    rdadd(rs, c);
+	    prevpos = rsc->pos;
 	} else if (c == 'u') {
 	    int len = 0;
 	    do {
-		rdadd(&rs, c);
+		rdadd(rs, c);
 		len++;
-		prevpos = rsc.pos;
-		c = get(in, &cpos, &rsc);
+		prevpos = rsc->pos;
+		c = get(in, &cpos, rsc);
 	    } while (ishex(c) && len < 5);
 	    unget(in, c, &cpos);
 	} else if (iscmd(c)) {
 	    do {
-		rdadd(&rs, c);
-		prevpos = rsc.pos;
-		c = get(in, &cpos, &rsc);
+		rdadd(rs, c);
+		prevpos = rsc->pos;
+		c = get(in, &cpos, rsc);
 	    } while (iscmd(c));
 	    unget(in, c, &cpos);
 	}
@@ -465,25 +679,14 @@ token get_token(input *in) {
 	 * ones.
 	 */
 	ret.type = tok_cmd;
-	ret.text = ustrdup(rs.text);
-	if (rsc.text) {
-	    in->pushback_chars = dupstr(rsc.text + prevpos);
-	    rsc.text[prevpos] = '\0';
-	    ret.origtext = dupstr(rsc.text);
-	} else {
-	    ret.origtext = dupstr("");
-	}
+	tok_finish(in, &ret, prevpos);
 	match_kw(&ret);
-	sfree(rs.text);
-	sfree(rsc.text);
 	return ret;
     } else if (c == '{') {	       /* tok_lbrace */
 	ret.type = tok_lbrace;
-	sfree(rsc.text);
 	return ret;
     } else if (c == '}') {	       /* tok_rbrace */
 	ret.type = tok_rbrace;
-	sfree(rsc.text);
 	return ret;
     } else {			       /* tok_word */
 	/*
@@ -497,32 +700,23 @@ token get_token(input *in) {
 	ret.aux = false;	       /* assumed for now */
 	prevpos = 0;
 	while (1) {
-	    if (iswhite(c) || c=='{' || c=='}' || c=='\\' || c==EOF) {
+	    if (iswordend(c)) {
 		/* Put back the character that caused termination */
 		unget(in, c, &cpos);
 		break;
 	    } else {
-		rdadd(&rs, c);
+		rdadd(rs, c);
 		if (c == '-') {
-		    prevpos = rsc.pos;
+		    prevpos = rsc->pos;
 		    ret.aux = true;
 		    break;	       /* hyphen terminates word */
 		}
 	    }
-	    prevpos = rsc.pos;
-	    c = get(in, &cpos, &rsc);
+	    prevpos = rsc->pos;
+	    c = get(in, &cpos, rsc);
 	}
 	ret.type = tok_word;
-	ret.text = ustrdup(rs.text);
-	if (rsc.text) {
-	    in->pushback_chars = dupstr(rsc.text + prevpos);
-	    rsc.text[prevpos] = '\0';
-	    ret.origtext = dupstr(rsc.text);
-	} else {
-	    ret.origtext = dupstr("");
-	}
-	sfree(rs.text);
-	sfree(rsc.text);
+	tok_finish(in, &ret, prevpos);
 	return ret;
     }
 }
@@ -548,11 +742,13 @@ bool isbrace(input *in) {
 token get_codepar_token(input *in) {
     int c;
     token ret;
-    rdstring rs = { 0, 0, NULL };
+    rdstring *rs = &in->tokbuf;
     filepos cpos;
 
     ret.type = tok_word;
     ret.origtext = NULL;
+    rs->pos = 0;
+    rs->text[0] = L'\0';
     c = get(in, &cpos, NULL);	       /* expect (and discard) one space */
     ret.pos = cpos;
     if (c == ' ') {
@@ -564,11 +760,10 @@ token get_codepar_token(input *in) {
 	c = get(in, &cpos, NULL);
 	/* Discard \r just before \n. */
 	if (c2 != 13 || !isnl(c))
-	    rdadd(&rs, c2);
+	    rdadd(rs, c2);
     }
     unget(in, c, &cpos);
-    ret.text = ustrdup(rs.text);
-    sfree(rs.text);
+    ret.text = rs->text;
     return ret;
 }
 
@@ -580,7 +775,7 @@ static word *addword(word newword, word ***hptrptr) {
     if (!hptrptr)
 	return NULL;
     mnewword = snew(word);
-    newword.private_data = NULL;       /* placate gcc warning */
+    newword.index = -1;
     *mnewword = newword;	       /* structure copy */
     mnewword->next = NULL;
     **hptrptr = mnewword;
@@ -600,17 +795,10 @@ static paragraph *addpara(paragraph newpara, paragraph ***hptrptr) {
     return mnewpara;
 }
 
-/*
- * Destructor before token is reassigned; should catch most memory
- * leaks
- */
-#define dtor(t) ( sfree(t.text), sfree(t.origtext) )
-
 /*
  * Reads a single file (ie until get() returns EOF)
  */
-static void read_file(paragraph ***ret, input *in, indexdata *idx,
-		      tree234 *macros) {
+static void read_file(paragraph ***ret, input *in, srcfile *sf) {
     token t;
     paragraph par;
     word wd, **whptr, **idximplicit = NULL;
@@ -683,7 +871,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	 */
 	do {
 	    if (!already) {
-		dtor(t), t = get_token(in);
+		t = get_token(in);
 	    }
 	    already = false;
 	} while (t.type == tok_eop);
@@ -699,7 +887,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	    par.type = para_Code;
 	    par.fpos = t.pos;
 	    while (1) {
-		dtor(t), t = get_codepar_token(in);
+		t = get_codepar_token(in);
 		wd.type = wtype;
 		wd.breaks = false;     /* shouldn't need this... */
 		wd.text = ustrdup(t.text);
@@ -707,12 +895,12 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
                 wd.aux = 0;
 		wd.fpos = t.pos;
 		addword(wd, &whptr);
-		dtor(t), t = get_token(in);
+		t = get_token(in);
 		if (t.type == tok_white) {
 		    /*
 		     * The newline after a code-paragraph line
 		     */
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		}
 		if (t.type == tok_eop || t.type == tok_eof ||
 		    t.type == tok_rbrace) { /* might be } terminating \lcont */
@@ -732,7 +920,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    prev_para_type = par.type;
 		    addpara(par, ret);
 		    while (t.type != tok_eop)   /* error recovery: */
-			dtor(t), t = get_token(in);   /* eat rest of paragraph */
+			t = get_token(in);   /* eat rest of paragraph */
 		    goto codeparabroken;   /* ick, but such is life */
 		}
 	    }
@@ -755,7 +943,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	    /*
 	     * Expect, and swallow, an open brace.
 	     */
-	    dtor(t), t = get_token(in);
+	    t = get_token(in);
 	    if (t.type != tok_lbrace) {
 		err_explbr(in->es, &t.pos);
 		continue;
@@ -767,7 +955,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	     * surprising).
 	     */
 	    do {
-		dtor(t), t = get_token(in);
+		t = get_token(in);
 	    } while (t.type == tok_white);
 	    already = true;
 
@@ -849,8 +1037,21 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	}
 
 	while (t.type == tok_cmd &&
-	       macrolookup(macros, in, t.text, &t.pos)) {
-	    dtor(t), t = get_token(in);
+	       macrolookup(sf, in, t.text, &t.pos)) {
+	    t = get_token(in);
+	}
+
+	/*
+	 * When pre-scanning for macro definitions, skip anything
+	 * else, apart from \cfg (which might change the input
+	 * character set).
+	 */
+	if (sf->defsonly &&
+	    !(t.type == tok_cmd && (t.cmd == c_define || t.cmd == c_cfg))) {
+	    while (t.type != tok_eop && t.type != tok_eof)
+		t = get_token(in);
+	    already = true;
+	    continue;
 	}
 
 	/*
@@ -880,7 +1081,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    break;	       /* `\#{': isn't a comment para */
 		}
 		do {
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		} while (t.type != tok_eop && t.type != tok_eof);
 		continue;	       /* next paragraph */
 		/*
@@ -943,7 +1144,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		filepos fp;
 
 		/* Get keywords. */
-		dtor(t), t = get_token(in);
+		t = get_token(in);
 		fp = t.pos;
 		while (t.type == tok_lbrace ||
 		       (t.type == tok_white && (needkw & 24))) {
@@ -957,14 +1158,14 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		     * user to wrap the line between them.
 		     */
 		    if (t.type == tok_white) {
-			dtor(t), t = get_token(in); /* eat the space */
+			t = get_token(in); /* eat the space */
 			continue;
 		    }
 		    /* This is a keyword. */
 		    nkeys++;
 		    /* FIXME: there will be bugs if anyone specifies an
 		     * empty keyword (\foo{}), so trap this case. */
-		    while (dtor(t), t = get_token(in),
+		    while (t = get_token(in),
 			   t.type == tok_word || 
 			   t.type == tok_white ||
 			   (t.type == tok_cmd && t.cmd == c__nbsp) ||
@@ -989,7 +1190,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    }
 		    rdadd(&rs, 0);     /* add string terminator */
 		    rdaddc(&rsc, 0);   /* add string terminator */
-		    dtor(t), t = get_token(in); /* eat right brace */
+		    t = get_token(in); /* eat right brace */
 		}
 
 		rdadd(&rs, 0);	       /* add string terminator */
@@ -1012,15 +1213,15 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		     */
 		    rdstring macrotext = { 0, 0, NULL };
 		    while (1) {
-			dtor(t), t = get_codepar_token(in);
+			t = get_codepar_token(in);
 			if (macrotext.pos > 0)
 			    rdadd(&macrotext, L'\n');
 			rdadds(&macrotext, t.text);
-			dtor(t), t = get_token(in);
+			t = get_token(in);
 			if (t.type == tok_eop || t.type == tok_eof)
                             break;
 		    }
-		    macrodef(macros, rs.text, macrotext.text, fp, in->es);
+		    macrodef(sf->macros, rs.text, macrotext.text, fp, in);
 		    continue;	       /* next paragraph */
 		}
 
@@ -1031,7 +1232,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		if (needkw & 24) {
 		    /* We allow whitespace even when we expect no para body */
 		    while (t.type == tok_white)
-			dtor(t), t = get_token(in);
+			t = get_token(in);
 		    if (t.type != tok_eop && t.type != tok_eof &&
 			(start_cmd == c__invalid ||
 			 t.type != tok_cmd || t.cmd != start_cmd)) {
@@ -1040,7 +1241,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			while (t.type != tok_eop && t.type != tok_eof &&
 			       (start_cmd == c__invalid ||
 				t.type != tok_cmd || t.cmd != start_cmd))
-			    dtor(t), t = get_token(in);
+			    t = get_token(in);
 		    }
 		    if (t.type == tok_cmd)
 			already = true;/* inhibit get_token at top of loop */
@@ -1089,7 +1290,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	    }
 
 	    if (t.type == tok_cmd && t.cmd == c__nop) {
-		dtor(t), t = get_token(in);
+		t = get_token(in);
 		continue;	       /* do nothing! */
 	    }
 
@@ -1099,8 +1300,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 	    }
 	    if (t.type == tok_cmd && t.cmd == c__nbsp) {
 		t.type = tok_word;     /* nice and simple */
-		sfree(t.text);
-		t.text = ustrdup(L" ");  /* text is ` ' not `_' */
+		t.text[0] = L' ';      /* text is ` ' not `_' */
 		t.aux = 0;	       /* (nonbreaking) */
 	    }
 	    switch (t.type) {
@@ -1120,7 +1320,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		 * directive.
 		 */
 		if (start_cmd != c__invalid) {
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		    already = true;
 		    if (t.type == tok_cmd && t.cmd == start_cmd)
 			break;
@@ -1194,9 +1394,8 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			}
 			indexing = false;
 			rdadd(&indexstr, L'\0');
-			index_merge(idx, false, indexstr.text,
+			merge_index(sf, indexstr.text,
 				    idxwordlist, &sitem->fpos, in->es);
-			sfree(indexstr.text);
 		    }
 		    if (sitem->type & stack_hyper) {
 			wd.text = NULL;
@@ -1237,13 +1436,13 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		     * eat whitespace after the close brace _if_
 		     * there was whitespace before the \#.
 		     */
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		    if (t.type != tok_lbrace) {
 			err_explbr(in->es, &t.pos);
 		    } else {
 			int braces = 1;
 			while (braces > 0) {
-			    dtor(t), t = get_token(in);
+			    t = get_token(in);
 			    if (t.type == tok_lbrace)
 				braces++;
 			    else if (t.type == tok_rbrace)
@@ -1256,7 +1455,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    }
 		    if (seenwhite) {
 			already = true;
-			dtor(t), t = get_token(in);
+			t = get_token(in);
 			if (t.type == tok_white) {
 			    iswhite = true;
 			    already = false;
@@ -1266,7 +1465,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		  case c_q:
                   case c_cq: {
                     int type = t.cmd;
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		    if (t.type != tok_lbrace) {
 			err_explbr(in->es, &t.pos);
 		    } else {
@@ -1335,13 +1534,11 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			wd.type = word_HyperLink;
 		    else
 			wd.type = word_Normal;
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		    if (t.type != tok_lbrace) {
 			if (wd.type == word_Normal) {
-			    time_t thetime = current_time();
-			    struct tm *broken = localtime(&thetime);
 			    already = true;
-			    wdtext = ustrftime(NULL, broken);
+			    wdtext = ustrftime(NULL, sf->date);
 			    wd.type = style;
 			} else {
 			    err_explbr(in->es, &t.pos);
@@ -1349,7 +1546,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			}
 		    } else {
 			rdstring rs = { 0, 0, NULL };
-			while (dtor(t), t = get_token(in),
+			while (t = get_token(in),
 			       t.type == tok_word || t.type == tok_white) {
 			    if (t.type == tok_white)
 				rdadd(&rs, ' ');
@@ -1357,9 +1554,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 				rdadds(&rs, t.text);
 			}
 			if (wd.type == word_Normal) {
-			    time_t thetime = current_time();
-			    struct tm *broken = localtime(&thetime);
-			    wdtext = ustrftime(rs.text, broken);
+			    wdtext = ustrftime(rs.text, sf->date);
 			    wd.type = style;
 			} else {
 			    wdtext = ustrdup(rs.text);
@@ -1386,7 +1581,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			 * expect another left brace, to begin
 			 * delimiting the text marked by the link.
 			 */
-			dtor(t), t = get_token(in);
+			t = get_token(in);
 			sitem = snew(struct stack_item);
 			sitem->fpos = wd.fpos;
 			sitem->type = stack_hyper;
@@ -1419,7 +1614,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 
 				sitem->type |= stack_idx;
 			    }
-			    dtor(t), t = get_token(in);
+			    t = get_token(in);
 			}
 			/*
 			 * Special cases: \W{}\c, \W{}\e, \W{}\s, \W{}\cw
@@ -1437,7 +1632,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 				spcstyle = tospacestyle(style);
 				sitem->type |= stack_style;
 			    }
-			    dtor(t), t = get_token(in);
+			    t = get_token(in);
 			}
 			if (t.type != tok_lbrace) {
 			    err_explbr(in->es, &t.pos);
@@ -1455,13 +1650,13 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    if (style != word_Normal) {
 			err_nestedstyles(in->es, &t.pos);
 			/* Error recovery: eat lbrace, push nop. */
-			dtor(t), t = get_token(in);
+			t = get_token(in);
 			sitem = snew(struct stack_item);
 			sitem->fpos = t.pos;
 			sitem->type = stack_nop;
 			stk_push(parsestk, sitem);
 		    }
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		    if (t.type != tok_lbrace) {
 			err_explbr(in->es, &t.pos);
 		    } else {
@@ -1484,7 +1679,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    if (indexing) {
 			err_nestedindex(in->es, &t.pos);
 			/* Error recovery: eat lbrace, push nop. */
-			dtor(t), t = get_token(in);
+			t = get_token(in);
 			sitem = snew(struct stack_item);
 			sitem->fpos = t.pos;
 			sitem->type = stack_nop;
@@ -1493,7 +1688,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    sitem = snew(struct stack_item);
 		    sitem->fpos = t.pos;
 		    sitem->type = stack_idx;
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		    /*
 		     * Special cases: \i\c, \i\e, \i\s, \i\cw
 		     */
@@ -1511,7 +1706,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			    spcstyle = tospacestyle(style);
 			    sitem->type |= stack_style;
 			}
-			dtor(t), t = get_token(in);
+			t = get_token(in);
 		    }
 		    if (t.type != tok_lbrace) {
 			sfree(sitem);
@@ -1559,7 +1754,7 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 			iword = addword(wd, &idximplicit);
 		    } else
 			iword = NULL;
-		    dtor(t), t = get_token(in);
+		    t = get_token(in);
 		    if (t.type == tok_lbrace) {
 			/*
 			 * \u with a left brace. Until the brace
@@ -1582,13 +1777,13 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
 		    }
 		    break;
 		  default:
-		    if (!macrolookup(macros, in, t.text, &t.pos))
+		    if (!macrolookup(sf, in, t.text, &t.pos))
 			err_badmidcmd(in->es, t.text, &t.pos);
 		    break;
 		}
 	    }
 	    if (!already)
-		dtor(t), t = get_token(in);
+		t = get_token(in);
 	    seenwhite = iswhite;
 	}
 	finished_para:
@@ -1627,8 +1822,6 @@ static void read_file(paragraph ***ret, input *in, indexdata *idx,
      * We break to here rather than returning, because otherwise
      * this cleanup doesn't happen.
      */
-    dtor(t);
-
     stk_free(crossparastk);
 }
 
@@ -1646,64 +1839,394 @@ const struct {
     { "true",		   4, true,  &read_sfnt_file },
 };
 
-paragraph *read_input(input *in, indexdata *idx, psdata *psd) {
-    paragraph *head = NULL;
-    paragraph **hptr = &head;
-    tree234 *macros;
+typedef void (*reader_fn)(input *, psdata *);
+
+/*
+ * Set up the lexer's buffers. The token buffers are allocated up
+ * front, so they're never NULL; the macro stack grows on demand.
+ */
+static void lexbufs_init(input *in) {
+    in->stack = NULL;
+    in->nstack = in->stacksize = 0;
+    in->pushbase = 0;
+    in->tokbuf = empty_rdstring;
+    in->origbuf = in->pushback_chars = empty_rdstringc;
+    rdadd(&in->tokbuf, L'\0');
+    rdaddc(&in->origbuf, '\0');
+    rdaddc(&in->pushback_chars, '\0');
+}
+
+static void lexbufs_free(input *in) {
+    sfree(in->stack);
+    sfree(in->tokbuf.text);
+    sfree(in->origbuf.text);
+    sfree(in->pushback_chars.text);
+}
+
+/*
+ * Reset the lexer and open input file number in->currindex, leaving
+ * in->currfp NULL if we can't. Returns the function to read it with
+ * if it's one of the non-Halibut file types, or NULL if it's source.
+ */
+static reader_fn open_input_file(input *in) {
     char mag[16];
     size_t len, i;
     bool binary;
-    void (*reader)(input *, psdata *);
+    reader_fn reader;
 
-    macros = newtree234(macrocmp, NULL);
+    setpos(in, in->filenames[in->currindex]);
+    set_input_charset(in, in->defcharset);
+    in->csstate = charset_init_state;
+    in->wcpos = in->nwc = 0;
+    in->pushback_chars.pos = 0;
 
-    while (in->currindex < in->nfiles) {
-	setpos(in, in->filenames[in->currindex]);
-	in->charset = in->defcharset;
-	in->csstate = charset_init_state;
-	in->wcpos = in->nwc = 0;
-	in->pushback_chars = NULL;
-
-	if (!in->filenames[in->currindex]) {
-	    in->currfp = stdin;
-	    in->wantclose = false;     /* don't fclose stdin */
-	    /*
-	     * When reading standard input, we always expect to see
-	     * an actual Halibut file and not any of the unusual
-	     * input types like fonts.
-	     */
-	    reader = NULL;
-	} else {
-	    /*
-	     * Open the file in binary mode to look for magic
-	     * numbers. We'll switch to text mode if we find we're
-	     * looking at a text file type.
-	     */
-	    in->currfp = fopen(in->filenames[in->currindex], "rb");
-	    binary = false; /* default to Halibut source, which is text */
-            reader = NULL;
-	    if (in->currfp) {
-		in->wantclose = true;
-		len = fread(mag, 1, sizeof(mag), in->currfp);
-		for (i = 0; i < lenof(magics); i++) {
-		    if (len >= magics[i].nmagic &&
-			memcmp(mag, magics[i].magic, magics[i].nmagic) == 0) {
-			reader = magics[i].reader;
-			binary = magics[i].binary;
-			break;
-		    }
+    if (!in->filenames[in->currindex]) {
+	in->currfp = stdin;
+	in->wantclose = false;	       /* don't fclose stdin */
+	/*
+	 * When reading standard input, we always expect to see
+	 * an actual Halibut file and not any of the unusual
+	 * input types like fonts.
+	 */
+	reader = NULL;
+    } else {
+	/*
+	 * Open the file in binary mode to look for magic
+	 * numbers. We'll switch to text mode if we find we're
+	 * looking at a text file type.
+	 */
+	in->currfp = fopen(in->filenames[in->currindex], "rb");
+	binary = false; /* default to Halibut source, which is text */
+	reader = NULL;
+	if (in->currfp) {
+	    in->wantclose = true;
+	    len = fread(mag, 1, sizeof(mag), in->currfp);
+	    for (i = 0; i < lenof(magics); i++) {
+		if (len >= magics[i].nmagic &&
+		    memcmp(mag, magics[i].magic, magics[i].nmagic) == 0) {
+		    reader = magics[i].reader;
+		    binary = magics[i].binary;
+		    break;
 		}
-		rewind(in->currfp);
 	    }
-	    if (!binary) {
-                if (in->currfp)
-                    fclose(in->currfp);
-		in->currfp = fopen(in->filenames[in->currindex], "r");
+	    rewind(in->currfp);
+	}
+	if (!binary) {
+	    if (in->currfp)
+		fclose(in->currfp);
+	    in->currfp = fopen(in->filenames[in->currindex], "r");
+	}
+    }
+    return reader;
+}
+
+/*
+ * When there are several input files, we parse the source files
+ * among them in parallel before doing anything else. The only
+ * things one file can do to affect the parsing of another are to
+ * define macros, and to report errors and index entries, whose
+ * order matters; so each file is parsed against a macro table of
+ * its own, with its errors and index merges saved up.
+ *
+ * To give each file the macros it should see, a quick pass in
+ * sequence beforehand collects the definitions in all the files
+ * (see prescan_macros()), and each file is allowed to use the ones
+ * from files before it. That pass needn't be exact, because we
+ * check each file's parse afterwards: going through the files in
+ * order, if every macro a file used from the pre-scan has the same
+ * definition in the real macro table, and it neither defined nor
+ * failed to find a name that an earlier file really defined, then
+ * its speculative parse is exactly what we'd have got by reading
+ * it in sequence, so we keep it; otherwise we throw it away and
+ * read the file again. (Font files are always read in sequence.)
+ */
+struct parsejob {
+    input in;
+    errorstate es;
+    srcfile sf;
+    paragraph *head;
+    bool parsed;
+};
+
+struct parsejobs {
+    input *in;
+    struct parsejob *jobs;
+    tree234 *seeds;
+    const struct tm *date;
+};
+
+/*
+ * Cheaply check whether a file contains the text `\define' at all,
+ * so that the pre-scan can leave alone the files that don't.
+ */
+static bool mentions_define(const char *filename) {
+    static const char needle[] = "\\define";
+    const size_t nlen = sizeof(needle) - 1;
+    char buf[8192];
+    size_t keep = 0, len, i;
+    bool found = false;
+    FILE *fp = fopen(filename, "rb");
+
+    if (!fp)
+	return false;
+    while (!found &&
+	   (len = fread(buf + keep, 1, sizeof(buf) - keep, fp)) > 0) {
+	const char *p = buf, *end;
+
+	len += keep;
+	end = buf + len;
+	while ((p = memchr(p, '\\', end - p)) != NULL &&
+	       (size_t)(end - p) >= nlen) {
+	    if (!memcmp(p, needle, nlen)) {
+		found = true;
+		break;
+	    }
+	    p++;
+	}
+
+	/* Carry over anything that might be the start of a match */
+	keep = (len < nlen - 1 ? len : nlen - 1);
+	for (i = 0; i < keep; i++)
+	    buf[i] = buf[len - keep + i];
+    }
+    fclose(fp);
+    return found;
+}
+
+/*
+ * Collect the macro definitions from all the source files, in
+ * order, into a table in which each one records the file it came
+ * from; where several files define the same name, the first wins,
+ * just as it would when reading them in sequence. Only the \define
+ * and \cfg paragraphs of files mentioning \define are parsed, and
+ * any errors are thrown away, since each file will be read
+ * properly later.
+ */
+static tree234 *prescan_macros(input *in, int firstfile,
+			       const struct tm *date) {
+    tree234 *seeds = newtree234(macrocmp, NULL);
+    paragraph *head, **hptr;
+    errorstate es;
+    input scan;
+    srcfile sf;
+    int i, j;
+
+    sf.macros = seeds;
+    sf.seeds = sf.hits = sf.misses = NULL;
+    sf.defsonly = true;
+    sf.idx = NULL;
+    sf.merges = NULL;
+    sf.nmerges = sf.mergesize = 0;
+    sf.date = date;
+
+    for (i = firstfile; i < in->nfiles; i++) {
+	if (!in->filenames[i] || !mentions_define(in->filenames[i]))
+	    continue;
+
+	scan = *in;		       /* structure copy */
+	scan.currindex = i;
+	scan.pushback = NULL;
+	scan.npushback = scan.pushbacksize = 0;
+	err_defer(&es);
+	scan.es = &es;
+	lexbufs_init(&scan);
+
+	head = NULL;
+	hptr = &head;
+	if (open_input_file(&scan)) {
+	    if (scan.currfp && scan.wantclose)
+		fclose(scan.currfp);
+	} else if (scan.currfp) {
+	    read_file(&hptr, &scan, &sf);
+	}
+
+	free_para_list(head);
+	for (j = 0; j < sf.nmerges; j++) {
+	    free_word_list(sf.merges[j].text);
+	    sfree(sf.merges[j].tags);
+	}
+	sf.nmerges = 0;
+	err_undefer(&es);
+	lexbufs_free(&scan);
+	sfree(scan.pushback);
+    }
+
+    sfree(sf.merges);
+    return seeds;
+}
+
+static void parse_job(void *vctx, int i) {
+    struct parsejobs *ctx = (struct parsejobs *)vctx;
+    struct parsejob *job = &ctx->jobs[i];
+    input *in = &job->in;
+    paragraph **hptr = &job->head;
+    reader_fn reader;
+
+    *in = *ctx->in;		       /* structure copy */
+    in->currindex += i;
+    in->pushback = NULL;
+    in->npushback = in->pushbacksize = 0;
+    err_defer(&job->es);
+    in->es = &job->es;
+    lexbufs_init(in);
+
+    job->head = NULL;
+    job->parsed = false;
+    if (in->filenames[in->currindex]) {
+	reader = open_input_file(in);
+	if (in->currfp && reader) {
+	    if (in->wantclose)
+		fclose(in->currfp);
+	} else if (in->currfp) {
+	    job->sf.macros = newtree234(macrocmp, NULL);
+	    job->sf.seeds = ctx->seeds;
+	    job->sf.hits = newtree234(macrocmp, NULL);
+	    job->sf.misses = newtree234(misscmp, NULL);
+	    job->sf.defsonly = false;
+	    job->sf.idx = NULL;
+	    job->sf.merges = NULL;
+	    job->sf.nmerges = job->sf.mergesize = 0;
+	    job->sf.date = ctx->date;
+	    read_file(&hptr, in, &job->sf);
+	    job->parsed = true;
+	}
+    }
+
+    if (!job->parsed)
+	err_undefer(&job->es);
+    lexbufs_free(in);
+    sfree(in->pushback);
+}
+
+/*
+ * Decide whether a speculatively parsed file came out the same as it
+ * would have done given the macros defined by the files before it.
+ */
+static bool parse_job_valid(struct parsejob *job, tree234 *macros) {
+    wchar_t *name;
+    macro m, *mp, *real;
+    int i;
+
+    for (i = 0; (mp = index234(job->sf.hits, i)) != NULL; i++) {
+	real = find234(macros, mp);
+	if (!real || real->len != mp->len ||
+	    (mp->len && ustrcmp(real->text, mp->text)))
+	    return false;
+    }
+    for (i = 0; (name = index234(job->sf.misses, i)) != NULL; i++) {
+	m.name = name;
+	if (find234(macros, &m))
+	    return false;
+    }
+    for (i = 0; (mp = index234(job->sf.macros, i)) != NULL; i++)
+	if (find234(macros, mp))
+	    return false;
+    return true;
+}
+
+/*
+ * Dispose of a speculatively parsed file, either committing its
+ * results to the document or discarding them.
+ */
+static void parse_job_finish(struct parsejob *job, bool keep,
+			     paragraph ***hptr, tree234 *macros,
+			     indexdata *idx, errorstate *es) {
+    macro *m;
+    wchar_t *name;
+    int i;
+
+    for (i = 0; i < job->sf.nmerges; i++) {
+	struct idxmerge *im = &job->sf.merges[i];
+	if (keep) {
+	    err_release(&job->es, im->errpos);
+	    index_merge(idx, false, im->tags, im->text, &im->fpos, es);
+	} else {
+	    free_word_list(im->text);
+	}
+	sfree(im->tags);
+    }
+    sfree(job->sf.merges);
+
+    if (keep) {
+	err_release(&job->es, -1);
+	if (job->es.fatal)
+	    es->fatal = true;
+	while ((m = delpos234(job->sf.macros, 0)) != NULL)
+	    add234(macros, m);
+	freetree234(job->sf.macros);
+	**hptr = job->head;
+	while (**hptr)
+	    *hptr = &(**hptr)->next;
+    } else {
+	macrocleanup(job->sf.macros);
+	free_para_list(job->head);
+    }
+    err_undefer(&job->es);
+
+    while ((name = delpos234(job->sf.misses, 0)) != NULL)
+	sfree(name);
+    freetree234(job->sf.misses);
+    freetree234(job->sf.hits);
+}
+
+paragraph *read_input(input *in, indexdata *idx, psdata *psd) {
+    paragraph *head = NULL;
+    paragraph **hptr = &head;
+    struct parsejob *jobs = NULL;
+    tree234 *seeds = NULL;
+    int firstfile = in->currindex;
+    time_t thetime;
+    struct tm date;
+    srcfile sf;
+    reader_fn reader;
+
+    build_kwtable();
+
+    /*
+     * Work out the date for \date once, up front, since localtime()
+     * isn't safe to call from worker threads.
+     */
+    thetime = current_time();
+    date = *localtime(&thetime);       /* structure copy */
+
+    sf.macros = newtree234(macrocmp, NULL);
+    sf.seeds = sf.hits = sf.misses = NULL;
+    sf.defsonly = false;
+    sf.idx = idx;
+    sf.merges = NULL;
+    sf.nmerges = sf.mergesize = 0;
+    sf.date = &date;
+
+    if (worker_threads() > 1 && in->nfiles - firstfile > 1) {
+	struct parsejobs ctx;
+
+	seeds = prescan_macros(in, firstfile, &date);
+	jobs = snewn(in->nfiles - firstfile, struct parsejob);
+	ctx.in = in;
+	ctx.jobs = jobs;
+	ctx.seeds = seeds;
+	ctx.date = &date;
+	run_jobs(in->nfiles - firstfile, parse_job, &ctx);
+    }
+
+    lexbufs_init(in);
+
+    while (in->currindex < in->nfiles) {
+	if (jobs && jobs[in->currindex - firstfile].parsed) {
+	    struct parsejob *job = &jobs[in->currindex - firstfile];
+	    bool keep = parse_job_valid(job, sf.macros);
+
+	    parse_job_finish(job, keep, &hptr, sf.macros, idx, in->es);
+	    if (keep) {
+		in->currindex++;
+		continue;
 	    }
 	}
+
+	reader = open_input_file(in);
 	if (in->currfp) {
 	    if (reader == NULL) {
-		read_file(&hptr, in, idx, macros);
+		read_file(&hptr, in, &sf);
 	    } else {
 		(*reader)(in, psd);
 	    }
@@ -1713,7 +2236,11 @@ paragraph *read_input(input *in, indexdata *idx, psdata *psd) {
 	in->currindex++;
     }
 
-    macrocleanup(macros);
+    sfree(jobs);
+    if (seeds)
+	macrocleanup(seeds);
+    macrocleanup(sf.macros);
+    lexbufs_free(in);
 
     return head;
 }
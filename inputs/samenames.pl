@@ -0,0 +1,58 @@
+#!/usr/bin/env perl -w
+
+# This script writes out a synthetic Halibut document with thousands
+# of sections that all have the same title, for timing how the HTML
+# backend picks unique file names and fragment names when they clash.
+#
+# Mixed in with the repeated sections are some whose literal titles
+# look like suffixed versions of the repeated one ("Options-2",
+# "Options-10"), and some with all-digit titles ("123"), which have
+# no usable name characters and are all renamed to "anon".
+#
+# Usage:
+#
+#   perl samenames.pl [--count=N] [--title=T] [--filenames] > big.but
+#   halibut --html big.but
+#
+# By default every section gets a fragment named after its title in
+# a single file. With --filenames every section instead gets its own
+# file named after its title.
+
+$count = 5000;
+$title = "Options";
+$filenames = 0;
+
+while (@ARGV) {
+    if ($ARGV[0] =~ m/^--count=(\d+)$/) {
+        $count = $1;
+    } elsif ($ARGV[0] =~ m/^--title=(.+)$/) {
+        $title = $1;
+    } elsif ($ARGV[0] eq "--filenames") {
+        $filenames = 1;
+    } else {
+        die "usage: samenames.pl [--count=N] [--title=T] [--filenames]\n";
+    }
+    shift;
+}
+
+print "\\title Sections with the same name\n\n";
+if ($filenames) {
+    print "\\cfg{html-template-filename}{%N.html}\n";
+    print "\\cfg{html-leaf-level}{infinite}\n\n";
+} else {
+    print "\\cfg{html-template-fragment}{%N}\n";
+    print "\\cfg{html-leaf-level}{1}\n\n";
+}
+
+print "\\C{main} Main chapter\n\n";
+for ($i = 1; $i <= $count; $i++) {
+    printf "\\H{s%d} %s\n\nSection %d.\n\n", $i, $title, $i;
+    # Every hundredth section, add sections whose literal names
+    # collide with the suffixes the repeated title will be given,
+    # and one that has no name characters at all.
+    if ($i % 100 == 0) {
+        printf "\\H{l%d} %s-2\n\nLiteral section.\n\n", $i, $title;
+        printf "\\H{l%da} %s-%d\n\nLiteral section.\n\n", $i, $title, $i + 10;
+        printf "\\H{n%d} 123\n\nNumeric section.\n\n", $i;
+    }
+}
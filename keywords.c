@@ -141,6 +141,7 @@ void subst_keywords(paragraph *source, keywordlist *kl, errorstate *es) {
 		close->fpos = ptr->fpos;
 		close->breaks = false;
 		close->aux = 0;
+		close->index = -1;
 
 		close->next = ptr->next;
 		ptr->next = subst;
@@ -39,10 +39,12 @@ struct LZ77InternalContext {
     int winsize;
     struct WindowEntry *win; /* [winsize] */
     unsigned char *data; /* [winsize] */
+    unsigned char *patchable; /* [winsize] */
 
     int winpos;
     struct HashEntry hashtab[HASHMAX];
     unsigned char pending[HASHCHARS];
+    unsigned char pendpatch[HASHCHARS];
     int npending;
 };
 
@@ -63,9 +65,12 @@ void lz77_init(struct LZ77Context *ctx, int winsize)
     st->winsize = winsize;
     st->win = snewn(st->winsize, struct WindowEntry);
     st->data = snewn(st->winsize, unsigned char);
+    st->patchable = snewn(st->winsize, unsigned char);
 
-    for (i = 0; i < st->winsize; i++)
+    for (i = 0; i < st->winsize; i++) {
 	st->win[i].next = st->win[i].prev = st->win[i].hashval = INVALID;
+	st->patchable[i] = 0;
+    }
     for (i = 0; i < HASHMAX; i++)
 	st->hashtab[i].first = INVALID;
     st->winpos = 0;
@@ -78,11 +83,12 @@ void lz77_cleanup(struct LZ77Context *ctx)
     struct LZ77InternalContext *st = ctx->ictx;
     sfree(st->win);
     sfree(st->data);
+    sfree(st->patchable);
     sfree(st);
 }
 
 static void lz77_advance(struct LZ77InternalContext *st,
-			 unsigned char c, int hash)
+			 unsigned char c, int hash, bool patchable)
 {
     int off;
 
@@ -98,15 +104,22 @@ static void lz77_advance(struct LZ77InternalContext *st,
 
     /*
      * Create a new entry at winpos and add it to the head of its
-     * hash chain.
+     * hash chain. A patchable byte goes on no chain at all, since
+     * nothing may match against it.
      */
-    st->win[st->winpos].hashval = hash;
-    st->win[st->winpos].prev = INVALID;
-    off = st->win[st->winpos].next = st->hashtab[hash].first;
-    st->hashtab[hash].first = st->winpos;
-    if (off != INVALID)
-	st->win[off].prev = st->winpos;
+    if (patchable) {
+	st->win[st->winpos].hashval = INVALID;
+	st->win[st->winpos].prev = st->win[st->winpos].next = INVALID;
+    } else {
+	st->win[st->winpos].hashval = hash;
+	st->win[st->winpos].prev = INVALID;
+	off = st->win[st->winpos].next = st->hashtab[hash].first;
+	st->hashtab[hash].first = st->winpos;
+	if (off != INVALID)
+	    st->win[off].prev = st->winpos;
+    }
     st->data[st->winpos] = c;
+    st->patchable[st->winpos] = patchable;
 
     /*
      * Advance the window pointer.
@@ -114,10 +127,12 @@ static void lz77_advance(struct LZ77InternalContext *st,
     st->winpos = (st->winpos + 1) % st->winsize;
 }
 
-#define CHARAT(k) ( (k)<0 ? st->data[(st->winpos+k)%st->winsize] : data[k] )
+#define CHARAT(k) ( (k)<0 ? st->data[(st->winpos+(k)+st->winsize)%st->winsize] : data[k] )
+#define PATCHAT(k) ( (k)<0 && st->patchable[(st->winpos+(k)+st->winsize)%st->winsize] )
 
-void lz77_compress(struct LZ77Context *ctx,
-                   const unsigned char *data, int len, bool compress)
+static void lz77_compress_internal(struct LZ77Context *ctx,
+				   const unsigned char *data, int len,
+				   bool compress, bool patchable)
 {
     struct LZ77InternalContext *st = ctx->ictx;
     int i, hash, distance, off, nmatch, matchlen, advance;
@@ -133,14 +148,16 @@ void lz77_compress(struct LZ77Context *ctx,
 	int j;
 	if (len + st->npending - i < HASHCHARS) {
 	    /* Update the pending array. */
-	    for (j = i; j < st->npending; j++)
+	    for (j = i; j < st->npending; j++) {
 		st->pending[j - i] = st->pending[j];
+		st->pendpatch[j - i] = st->pendpatch[j];
+	    }
 	    break;
 	}
 	for (j = 0; j < HASHCHARS; j++)
 	    foo[j] = (i + j < st->npending ? st->pending[i + j] :
 		      data[i + j - st->npending]);
-	lz77_advance(st, foo[0], lz77_hash(foo));
+	lz77_advance(st, foo[0], lz77_hash(foo), st->pendpatch[i]);
     }
     st->npending -= i;
 
@@ -167,7 +184,8 @@ void lz77_compress(struct LZ77Context *ctx,
 		distance = st->winsize -
                     (off + st->winsize - st->winpos) % st->winsize;
 		for (i = 0; i < HASHCHARS; i++)
-		    if (CHARAT(i) != CHARAT(i - distance))
+		    if (PATCHAT(i - distance) ||
+			CHARAT(i) != CHARAT(i - distance))
 			break;
 		if (i == HASHCHARS) {
 		    matches[nmatch].distance = distance;
@@ -192,7 +210,8 @@ void lz77_compress(struct LZ77Context *ctx,
 	    while (matchlen < len) {
 		int j;
 		for (i = j = 0; i < nmatch; i++) {
-		    if (CHARAT(matchlen) ==
+		    if (!PATCHAT(matchlen - matches[i].distance) &&
+			CHARAT(matchlen) ==
 			CHARAT(matchlen - matches[i].distance)) {
 			matches[j++] = matches[i];
 		    }
@@ -250,8 +269,9 @@ void lz77_compress(struct LZ77Context *ctx,
 	 */
 	while (advance > 0) {
 	    if (len >= HASHCHARS) {
-		lz77_advance(st, *data, lz77_hash(data));
+		lz77_advance(st, *data, lz77_hash(data), patchable);
 	    } else {
+		st->pendpatch[st->npending] = patchable;
 		st->pending[st->npending++] = *data;
 	    }
 	    data++;
@@ -261,3 +281,14 @@ void lz77_compress(struct LZ77Context *ctx,
     }
 }
 
+void lz77_compress(struct LZ77Context *ctx,
+                   const unsigned char *data, int len, bool compress)
+{
+    lz77_compress_internal(ctx, data, len, compress, false);
+}
+
+void lz77_compress_patchable(struct LZ77Context *ctx,
+                             const unsigned char *data, int len)
+{
+    lz77_compress_internal(ctx, data, len, false, true);
+}
@@ -33,3 +33,13 @@ void lz77_cleanup(struct LZ77Context *ctx);
  */
 void lz77_compress(struct LZ77Context *ctx,
                    const unsigned char *data, int len, bool compress);
+
+/*
+ * Supply data which the caller means to overwrite in the output
+ * after compression (for example, offsets which aren't known yet).
+ * Every byte of it is passed to literal(), and no later match will
+ * ever copy from it, so changing those literals afterwards changes
+ * nothing else in the decompressed output.
+ */
+void lz77_compress_patchable(struct LZ77Context *ctx,
+                             const unsigned char *data, int len);
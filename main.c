@@ -79,6 +79,7 @@ int main(int argc, char **argv) {
     backendbits = 0;
     cfg = cfg_tail = NULL;
     es->fatal = false;
+    es->deferred = NULL;
 
     if (argc == 1) {
 	usage();
@@ -159,6 +160,18 @@ int main(int argc, char **argv) {
 			    list_fonts = true;
 			} else if (!strcmp(opt, "-precise")) {
 			    reportcols = true;
+			} else if (!strcmp(opt, "-threads")) {
+			    if (!val) {
+				err_optnoarg(es, opt);
+			    } else {
+				set_worker_threads(atoi(val));
+			    }
+			} else if (!strcmp(opt, "-font-cache")) {
+			    if (!val) {
+				err_optnoarg(es, opt);
+			    } else {
+				set_font_cache(val);
+			    }
 			} else {
 			    err_nosuchopt(es, opt);
 			}
@@ -305,6 +318,8 @@ int main(int argc, char **argv) {
 	in.pushback = NULL;
 	in.reportcols = reportcols;
 	in.stack = NULL;
+	in.nstack = in.stacksize = 0;
+	in.pushbase = 0;
 	in.defcharset = input_charset;
         in.es = es;
 
@@ -365,6 +380,8 @@ int main(int argc, char **argv) {
 		mark_attr_ends(entry->text);
 	}
 
+	number_document(sourceform);
+
 	if (debug) {
 	    index_debug(idx);
 	    dbg_prtkws(keywords);
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include "halibut.h"
+#include "deflate.h"
 
 char *adv(char *s) {
     return s + 1 + strlen(s);
@@ -58,13 +59,17 @@ void *stk_top(stack s) {
 
 /*
  * Small routines to amalgamate a string from an input source.
+ *
+ * The buffer grows by half as much again each time it fills, so
+ * building up a long string costs time in proportion to its length
+ * however it is done.
  */
 const rdstring empty_rdstring = {0, 0, NULL};
 const rdstringc empty_rdstringc = {0, 0, NULL};
 
 void rdadd(rdstring *rs, wchar_t c) {
     if (rs->pos >= rs->size-1) {
-	rs->size = rs->pos + 128;
+	rs->size = rs->pos * 3 / 2 + 128;
 	rs->text = sresize(rs->text, rs->size, wchar_t);
     }
     rs->text[rs->pos++] = c;
@@ -73,7 +78,7 @@ void rdadd(rdstring *rs, wchar_t c) {
 void rdadds(rdstring *rs, wchar_t const *p) {
     int len = ustrlen(p);
     if (rs->pos >= rs->size - len) {
-	rs->size = rs->pos + len + 128;
+	rs->size = (rs->pos + len) * 3 / 2 + 128;
 	rs->text = sresize(rs->text, rs->size, wchar_t);
     }
     ustrcpy(rs->text + rs->pos, p);
@@ -86,7 +91,7 @@ wchar_t *rdtrim(rdstring *rs) {
 
 void rdaddc(rdstringc *rs, char c) {
     if (rs->pos >= rs->size-1) {
-	rs->size = rs->pos + 128;
+	rs->size = rs->pos * 3 / 2 + 128;
 	rs->text = sresize(rs->text, rs->size, char);
     }
     rs->text[rs->pos++] = c;
@@ -97,7 +102,7 @@ void rdaddsc(rdstringc *rs, char const *p) {
 }
 void rdaddsn(rdstringc *rs, char const *p, int len) {
     if (rs->pos >= rs->size - len) {
-	rs->size = rs->pos + len + 128;
+	rs->size = (rs->pos + len) * 3 / 2 + 128;
 	rs->text = sresize(rs->text, rs->size, char);
     }
     memcpy(rs->text + rs->pos, p, len);
@@ -110,7 +115,7 @@ void rdaddc_rep(rdstringc *rs, char c, int len) {
         return;
     }
     if (rs->pos >= rs->size - len) {
-	rs->size = rs->pos + len + 128;
+	rs->size = (rs->pos + len) * 3 / 2 + 128;
 	rs->text = sresize(rs->text, rs->size, char);
     }
     memset(rs->text + rs->pos, c, len);
@@ -122,6 +127,92 @@ char *rdtrimc(rdstringc *rs) {
     return rs->text;
 }
 
+/*
+ * Ropes, for putting together a large output out of pieces without
+ * copying them all into one buffer. Small additions are copied into
+ * chunks belonging to the rope, which are never moved once
+ * allocated; large buffers can be added by reference, or handed
+ * over to be freed along with the rope.
+ */
+const rope empty_rope = {0, 0, NULL, 0, 0, 0};
+
+#define ROPE_MINCHUNK 64
+#define ROPE_MAXCHUNK 0x100000
+
+static void rope_addpiece(rope *r, const char *text, int len, char *owned)
+{
+    ropepiece *rp;
+
+    if (r->npieces >= r->piecesize) {
+	r->piecesize = r->npieces * 3 / 2 + 16;
+	r->pieces = sresize(r->pieces, r->piecesize, ropepiece);
+    }
+    rp = &r->pieces[r->npieces++];
+    rp->text = text;
+    rp->len = len;
+    rp->owned = owned;
+    r->len += len;
+}
+
+void rope_add(rope *r, const char *p, int len) {
+    ropepiece *rp;
+
+    if (len <= 0)
+	return;
+    if (len > r->room) {
+	/*
+	 * Start a fresh chunk, sized in proportion to what has been
+	 * copied into the rope already, so that a rope built out of
+	 * many small pieces doesn't end up as very many small chunks.
+	 */
+	int size = r->copied;
+	char *chunk;
+
+	if (size < ROPE_MINCHUNK)
+	    size = ROPE_MINCHUNK;
+	if (size > ROPE_MAXCHUNK)
+	    size = ROPE_MAXCHUNK;
+	if (size < len)
+	    size = len;
+	chunk = snewn(size, char);
+	rope_addpiece(r, chunk, 0, chunk);
+	r->room = size;
+    }
+    rp = &r->pieces[r->npieces - 1];
+    memcpy(rp->owned + rp->len, p, len);
+    rp->len += len;
+    r->len += len;
+    r->copied += len;
+    r->room -= len;
+}
+void rope_addsc(rope *r, const char *p) {
+    rope_add(r, p, strlen(p));
+}
+void rope_addref(rope *r, const char *p, int len) {
+    if (len > 0) {
+	rope_addpiece(r, p, len, NULL);
+	r->room = 0;
+    }
+}
+void rope_adopt(rope *r, char *p, int len) {
+    rope_addpiece(r, p, len, p);
+    r->room = 0;
+}
+void rope_write(const rope *r, FILE *fp) {
+    int i;
+
+    for (i = 0; i < r->npieces; i++)
+	fwrite(r->pieces[i].text, 1, r->pieces[i].len, fp);
+}
+void rope_free(rope *r) {
+    int i;
+
+    for (i = 0; i < r->npieces; i++)
+	sfree(r->pieces[i].owned);
+    sfree(r->pieces);
+    *r = empty_rope;
+}
+
 static int compare_wordlists_literally(word *a, word *b) {
     int t;
     while (a && b) {
@@ -281,6 +372,61 @@ void mark_attr_ends(word *words)
     }
 }
 
+/*
+ * Give every paragraph in the document, and every word in those
+ * paragraphs (including \u alternatives, but not section numbers
+ * and the like in kwtext), a serial number in its `index' field.
+ * This is done once the document is complete, so that backends can
+ * keep their own per-paragraph and per-word data in arrays indexed
+ * by those numbers rather than hanging it off the document itself.
+ * Words made later on have index -1, except that dup_word_list()
+ * copies a word's number along with the rest of it.
+ */
+static void number_words(word *w, int *n)
+{
+    for (; w; w = w->next) {
+	w->index = (*n)++;
+	number_words(w->alt, n);
+    }
+}
+
+void number_document(paragraph *source)
+{
+    int np = 0, nw = 0;
+
+    for (; source; source = source->next) {
+	source->index = np++;
+	number_words(source->words, &nw);
+    }
+}
+
+static void max_word_index(word *w, int *max)
+{
+    for (; w; w = w->next) {
+	if (*max < w->index)
+	    *max = w->index;
+	max_word_index(w->alt, max);
+    }
+}
+
+/*
+ * Find the sizes of the arrays needed to hold one entry per
+ * paragraph and per word numbered by number_document().
+ */
+void doc_size(paragraph *source, int *nparas, int *nwords)
+{
+    int maxpara = -1, maxword = -1;
+
+    for (; source; source = source->next) {
+	maxpara = source->index;
+	max_word_index(source->words, &maxword);
+    }
+    if (nparas)
+	*nparas = maxpara + 1;
+    if (nwords)
+	*nwords = maxword + 1;
+}
+
 /*
  * This function implements the optimal paragraph wrapping
  * algorithm, pretty much as used in TeX. A cost function is
@@ -612,3 +758,63 @@ time_t current_time(void)
 
     return time(NULL);
 }
+
+/*
+ * Write out a whole output file whose text a backend has already
+ * built in memory, as a rope, gzipping it on the way if `compress'
+ * is set. A filename of "-" means standard output. Returns false if
+ * the file couldn't be opened, and leaves it to the caller to say
+ * so.
+ */
+bool write_rope_file(const char *filename, const rope *r, bool compress)
+{
+    FILE *fp;
+
+    if (!strcmp(filename, "-"))
+        fp = stdout;
+    else if (!(fp = fopen(filename, compress ? "wb" : "w")))
+        return false;
+
+    if (compress) {
+        deflate_compress_ctx *dc = deflate_compress_new(DEFLATE_TYPE_GZIP);
+        void *out;
+        int i, outlen;
+
+        /* Compress the pieces in turn, then finish the stream. */
+        for (i = 0; i <= r->npieces; i++) {
+            out = NULL;
+            outlen = 0;
+            if (i < r->npieces)
+                deflate_compress_data(dc, r->pieces[i].text, r->pieces[i].len,
+                                      DEFLATE_NO_FLUSH, &out, &outlen);
+            else
+                deflate_compress_data(dc, "", 0, DEFLATE_END_OF_DATA,
+                                      &out, &outlen);
+            if (outlen > 0)
+                fwrite(out, 1, outlen, fp);
+            sfree(out);
+        }
+        deflate_compress_free(dc);
+    } else {
+        rope_write(r, fp);
+    }
+
+    if (fp != stdout)
+        fclose(fp);
+    return true;
+}
+
+/*
+ * The same, for text that's all in one buffer.
+ */
+bool write_whole_file(const char *filename, const char *data, int len,
+                      bool compress)
+{
+    rope r = empty_rope;
+    bool ret;
+
+    rope_addref(&r, data, len);
+    ret = write_rope_file(filename, &r, compress);
+    rope_free(&r);
+    return ret;
+}
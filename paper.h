@@ -19,8 +19,12 @@ typedef unsigned short glyph;
 typedef struct document_Tag document;
 typedef struct glyph_width_Tag glyph_width;
 typedef struct kern_pair_Tag kern_pair;
+typedef struct glyph_class_Tag glyph_class;
+typedef struct kern_classes_Tag kern_classes;
 typedef struct ligature_Tag ligature;
+typedef struct glyph_map_Tag glyph_map;
 typedef struct font_info_Tag font_info;
+typedef struct font_pending_Tag font_pending;
 typedef struct font_data_Tag font_data;
 typedef struct font_encoding_Tag font_encoding;
 typedef struct font_list_Tag font_list;
@@ -29,6 +33,7 @@ typedef struct line_data_Tag line_data;
 typedef struct page_data_Tag page_data;
 typedef struct subfont_map_entry_Tag subfont_map_entry;
 typedef struct text_fragment_Tag text_fragment;
+typedef struct glyph_run_Tag glyph_run;
 typedef struct xref_Tag xref;
 typedef struct xref_dest_Tag xref_dest;
 typedef struct rect_Tag rect;
@@ -66,6 +71,33 @@ struct kern_pair_Tag {
     int kern;
 };
 
+/*
+ * OpenType fonts often kern by class instead: the left and right
+ * glyphs are each looked up in a table of classes, and the kern
+ * comes from a matrix indexed by the two. Storing that as it is
+ * keeps it small, where expanding it into kern_pairs could take
+ * millions of them.
+ */
+struct glyph_class_Tag {
+    glyph glyph;
+    int cls;
+};
+struct kern_classes_Tag {
+    kern_classes *next;
+    /*
+     * The left glyphs this applies to, sorted by glyph; a left glyph
+     * not in here is left to the next kern_classes in the list.
+     */
+    glyph_class *left;
+    int nleft;
+    /* Right glyphs with a class other than 0, sorted by glyph */
+    glyph_class *right;
+    int nright;
+    /* Kern amounts in internal units, indexed [lclass * nrclass + rclass] */
+    int nlclass, nrclass;
+    int *kerns;
+};
+
 /*
  * ... and this one represents a ligature.
  */
@@ -73,6 +105,22 @@ struct ligature_Tag {
     glyph left, right, lig;
 };
 
+/*
+ * This data structure maps Unicode characters to glyphs. It's a
+ * two-level table: the top level is indexed by the character code
+ * divided by 256, and gives the number of a 256-entry page of
+ * glyphs. Only the pages of Unicode a font actually covers need
+ * pages of their own; all the rest share page 0, which maps
+ * everything to NOGLYPH.
+ */
+#define UNICODE_LIMIT 0x110000
+typedef glyph glyph_page[256];
+struct glyph_map_Tag {
+    unsigned short index[UNICODE_LIMIT >> 8];
+    glyph_page *pages;
+    int npages, pagesize;
+};
+
 /*
  * This data structure holds static information about a font that doesn't
  * depend on the particular document.  It gets generated when the font's
@@ -91,19 +139,18 @@ struct font_info_Tag {
     void *fontfile;
     enum { TYPE1, TRUETYPE } filetype;
     /* A tree of glyph_widths */
-    tree234 *widths;
+    btree *widths;
     /* A tree of kern_pairs */
-    tree234 *kerns;
+    btree *kerns;
+    /* Class-based kerning, consulted in turn if kerns has no pair */
+    kern_classes *kern_classes;
     /* ... and one of ligatures */
-    tree234 *ligs;
+    btree *ligs;
     /*
-     * For reasonably speedy lookup, we set up a 65536-element
-     * table representing the Unicode BMP (I can conveniently
-     * restrict myself to the BMP for the moment since I happen to
-     * know that no glyph in the Adobe Glyph List falls outside
-     * it), whose elements are indices into the above two arrays.
+     * For reasonably speedy lookup, a table mapping each Unicode
+     * character to its glyph.
      */
-    glyph bmp[65536];
+    glyph_map map;
     /*
      * Various bits of metadata needed for the /FontDescriptor dictionary
      * in PDF.
@@ -116,6 +163,25 @@ struct font_info_Tag {
     float stemv;
     float stemh;
     float italicangle;
+    /*
+     * Fonts read from files aren't fully parsed until something
+     * asks for them by name: until then, only the name and the
+     * font file are valid, and this says how to do the rest. See
+     * font_load().
+     */
+    font_pending *pending;
+};
+
+struct font_pending_Tag {
+    /* Fill in everything else in the font_info; false if unusable. */
+    bool (*parse)(font_info *fi, psdata *psd, errorstate *es);
+    char *data;			       /* the whole file */
+    size_t len;
+    bool owned;			       /* free data once loaded */
+    filepos pos;
+    errorstate *es;		       /* where to report parse errors */
+    char hash[17];		       /* of data, once we need it */
+    bool failed;
 };
 
 /*
@@ -181,11 +247,12 @@ enum {
 };
 
 /*
- * This is the data structure which is stored in the private_data
- * field of each paragraph. It divides the paragraph up into a
- * linked list of lines, while at the same time providing for those
- * lines to be linked together into a much longer list spanning the
- * whole document for page-breaking purposes.
+ * This is the data structure which bk_paper.c keeps for each
+ * paragraph, in an array indexed by paragraph::index. It divides
+ * the paragraph up into a linked list of lines, while at the same
+ * time providing for those lines to be linked together into a much
+ * longer list spanning the whole document for page-breaking
+ * purposes.
  */
 
 struct para_data_Tag {
@@ -320,6 +387,12 @@ struct page_data_Tag {
      */
     text_fragment *first_text;
     text_fragment *last_text;
+    /*
+     * During text rendering: strings of glyphs which have not yet
+     * been assigned to subfonts, and so are not yet text fragments.
+     */
+    glyph_run *first_run;
+    glyph_run *last_run;
     /*
      * Cross-references.
      */
@@ -350,6 +423,19 @@ struct text_fragment_Tag {
     int width;
 };
 
+struct glyph_run_Tag {
+    glyph_run *next;
+    int x, y;
+    font_data *font;
+    int fontsize;
+    struct run_glyph {
+	glyph glyph;
+	wchar_t u;
+	int kern, width;	       /* already scaled by fontsize */
+    } *glyphs;
+    int nglyphs;
+};
+
 struct xref_dest_Tag {
     enum { NONE, PAGE, URL } type;
     page_data *page;
@@ -382,10 +468,21 @@ struct psdata_Tag {
 /*
  * Functions exported from bk_paper.c
  */
-int width_cmp(const void *, const void *, void *); /* use when setting up widths */
-int kern_cmp(const void *, const void *, void *); /* use when setting up kern_pairs */
-int lig_cmp(const void *, const void *, void *); /* use when setting up ligatures */
+unsigned long width_key(const void *); /* use when setting up widths */
+unsigned long kern_key(const void *); /* use when setting up kern_pairs */
+unsigned long lig_key(const void *); /* use when setting up ligatures */
 int find_width(font_data *, glyph);
+void glyph_map_init(glyph_map *);
+void glyph_map_set(glyph_map *, unsigned long, glyph);
+
+/*
+ * Functions exported from fontcache.c
+ */
+font_pending *font_pending_new(bool (*parse)(font_info *, psdata *,
+					     errorstate *),
+			       char *data, size_t len, bool owned,
+			       filepos const *pos, errorstate *es);
+bool font_load(font_info *fi, psdata *psd);
 
 /*
  * Functions and data exported from psdata.c.
@@ -433,5 +530,9 @@ unsigned sfnt_glyphtoindex(sfnt *sf, glyph g);
 unsigned sfnt_nglyphs(sfnt *sf);
 void sfnt_writeps(font_info const *fi, FILE *ofp, psdata *psd, errorstate *es);
 void sfnt_data(font_info *fi, char **bufp, size_t *lenp);
+void sfnt_memory(sfnt *sf, unsigned *minmem, unsigned *maxmem);
+int glyph_class_cmp(void const *a, void const *b);
+void sfnt_setglyphs(sfnt *sf, glyph *glyphsbyindex,
+		    unsigned minmem, unsigned maxmem);
 
 #endif
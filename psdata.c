@@ -1148,7 +1148,7 @@ psdata *psdata_new(void)
     psdata *psd = snew(psdata);
     psd->extraglyphs = NULL;
     psd->nextglyph = EXTRAGLYPHSOFFSET;
-    psd->extrabyname = newtree234(glyphcmp, NULL);
+    psd->extrabyname = newtree234(glyphcmp, psd);
     psd->all_fonts = NULL;
     return psd;
 }
@@ -1166,11 +1166,25 @@ void psdata_free(psdata *psd)
         font_info *fi = psd->all_fonts;
         glyph_width *w;
         psd->all_fonts = fi->next;
-        while ((w = delpos234(fi->widths, 0)) != NULL)
+        while ((w = delposbt(fi->widths, 0)) != NULL)
             sfree(w);
-        freetree234(fi->widths);
-        freetree234(fi->kerns);
-        freetree234(fi->ligs);
+        freebt(fi->widths);
+        freebt(fi->kerns);
+        while (fi->kern_classes) {
+            kern_classes *kc = fi->kern_classes;
+            fi->kern_classes = kc->next;
+            sfree(kc->left);
+            sfree(kc->right);
+            sfree(kc->kerns);
+            sfree(kc);
+        }
+        freebt(fi->ligs);
+        sfree(fi->map.pages);
+        if (fi->pending) {
+            if (fi->pending->owned)
+                sfree(fi->pending->data);
+            sfree(fi->pending);
+        }
         sfree(fi);
     }
     sfree(psd);
@@ -4575,39 +4589,70 @@ static const struct ps_std_font_data {
 };
 
 void init_std_fonts(psdata *psd) {
-    int i, j;
+    int i, j, n, size;
+    void **elems = NULL;
     ligature const *lig;
     kern_pair const *kern;
     static bool done = false;
 
     if (done) return;
+
+    /*
+     * The trees of widths, kerns and ligatures are each built in
+     * one go from an array of their elements.
+     */
+    size = lenof(ps_std_glyphs) - 1;
+    elems = snewn(size, void *);
+
     for (i = 0; i < (int)lenof(ps_std_fonts); i++) {
 	font_info *fi = snew(font_info);
 	fi->fontfile = NULL;
 	fi->name = ps_std_fonts[i].name;
         fi->filetype = TYPE1;   /* for purposes of making subset fonts */
-	fi->widths = newtree234(width_cmp, NULL);
-	for (j = 0; j < (int)lenof(fi->bmp); j++)
-	    fi->bmp[j] = NOGLYPH;
-	for (j = 0; j < (int)lenof(ps_std_glyphs) - 1; j++) {
+	fi->pending = NULL;
+	glyph_map_init(&fi->map);
+	n = lenof(ps_std_glyphs) - 1;
+	for (j = 0; j < n; j++) {
 	    glyph_width *w = snew(glyph_width);
 	    wchar_t ucs;
 	    w->glyph = glyph_intern(psd, ps_std_glyphs[j]);
 	    w->width = ps_std_fonts[i].widths[j];
-	    add234(fi->widths, w);
+	    elems[j] = w;
 	    ucs = ps_glyph_to_unicode(w->glyph);
 	    assert(ucs != 0xFFFF);
-	    fi->bmp[ucs] = w->glyph;
+	    glyph_map_set(&fi->map, ucs, w->glyph);
+	}
+	fi->widths = newkeyedbt(width_key);
+	buildbt(fi->widths, elems, n);
+	for (j = countbt(fi->widths); j < n; j++)
+	    sfree(elems[j]);	       /* duplicates */
+
+	for (n = 0, kern = ps_std_fonts[i].kerns; kern->left != NOGLYPH;
+	     kern++) {
+	    if (n >= size) {
+		size = n * 3 / 2 + 64;
+		elems = sresize(elems, size, void *);
+	    }
+	    elems[n++] = (void *)kern;
 	}
-	fi->kerns = newtree234(kern_cmp, NULL);
-	for (kern = ps_std_fonts[i].kerns; kern->left != NOGLYPH; kern++)
-	    add234(fi->kerns, (void *)kern);
-	fi->ligs = newtree234(lig_cmp, NULL);
-	for (lig = ps_std_fonts[i].ligs; lig->left != NOGLYPH; lig++)
-	    add234(fi->ligs, (void *)lig);
+	fi->kerns = newkeyedbt(kern_key);
+	buildbt(fi->kerns, elems, n);
+	fi->kern_classes = NULL;
+
+	for (n = 0, lig = ps_std_fonts[i].ligs; lig->left != NOGLYPH; lig++) {
+	    if (n >= size) {
+		size = n * 3 / 2 + 64;
+		elems = sresize(elems, size, void *);
+	    }
+	    elems[n++] = (void *)lig;
+	}
+	fi->ligs = newkeyedbt(lig_key);
+	buildbt(fi->ligs, elems, n);
+
 	fi->next = psd->all_fonts;
 	psd->all_fonts = fi;
     }
+    sfree(elems);
     done = true;
 }
 
@@ -27,6 +27,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <assert.h>
 
 #include "tree234.h"
@@ -43,11 +45,14 @@
 #endif
 
 typedef struct node234_Tag node234;
+typedef struct slab234_Tag slab234;
 
 struct tree234_Tag {
     node234 *root;
     cmpfn234 cmp;
     void *cmpctx;
+    slab234 *slab;		       /* where new nodes come from */
+    node234 *spare;		       /* freed nodes, linked by parent */
 };
 
 struct node234_Tag {
@@ -55,8 +60,73 @@ struct node234_Tag {
     node234 *kids[4];
     int counts[4];
     void *elems[3];
+    slab234 *slab;
 };
 
+/*
+ * Nodes are allocated in slabs rather than one at a time. Each tree
+ * carves new nodes out of its current slab, and starts a bigger one
+ * when that runs out; buildtree234() allocates a slab holding
+ * exactly the nodes it needs. Nodes a tree frees go on its spare
+ * list to be reused, and are only given back to their slabs when
+ * the tree itself is freed.
+ *
+ * Nodes can move between trees (by join234 and split234), so each
+ * node remembers its slab, and a slab is reference-counted: it goes
+ * away when all its nodes have, and no tree is still allocating
+ * from it. Trees which have shared nodes in this way must therefore
+ * be kept on the same thread.
+ */
+struct slab234_Tag {
+    int refs;			       /* live nodes, plus one if current */
+    int used, size;
+    node234 nodes[1];
+};
+
+#define SLAB234_MIN 4
+#define SLAB234_MAX 256
+
+static slab234 *newslab234(int size) {
+    slab234 *s = (slab234 *)smalloc(offsetof(slab234, nodes) +
+				    size * sizeof(node234));
+    s->refs = 1;
+    s->used = 0;
+    s->size = size;
+    return s;
+}
+
+static void unrefslab234(slab234 *s) {
+    if (s && --s->refs == 0)
+	sfree(s);
+}
+
+static node234 *newnode234(tree234 *t) {
+    node234 *n;
+
+    if (t->spare) {
+	n = t->spare;
+	t->spare = n->parent;
+	return n;
+    }
+
+    if (!t->slab || t->slab->used == t->slab->size) {
+	int size = t->slab ? t->slab->size * 2 : SLAB234_MIN;
+	if (size > SLAB234_MAX)
+	    size = SLAB234_MAX;
+	unrefslab234(t->slab);
+	t->slab = newslab234(size);
+    }
+    n = &t->slab->nodes[t->slab->used++];
+    n->slab = t->slab;
+    t->slab->refs++;
+    return n;
+}
+
+static void freenode234(tree234 *t, node234 *n) {
+    n->parent = t->spare;
+    t->spare = n;
+}
+
 /*
  * Create a 2-3-4 tree.
  */
@@ -66,23 +136,32 @@ tree234 *newtree234(cmpfn234 cmp, void *cmpctx) {
     ret->root = NULL;
     ret->cmp = cmp;
     ret->cmpctx = cmpctx;
+    ret->slab = NULL;
+    ret->spare = NULL;
     return ret;
 }
 
 /*
  * Free a 2-3-4 tree (not including freeing the elements).
  */
-static void freenode234(node234 *n) {
+static void releasenode234(node234 *n) {
     if (!n)
 	return;
-    freenode234(n->kids[0]);
-    freenode234(n->kids[1]);
-    freenode234(n->kids[2]);
-    freenode234(n->kids[3]);
-    sfree(n);
+    releasenode234(n->kids[0]);
+    releasenode234(n->kids[1]);
+    releasenode234(n->kids[2]);
+    releasenode234(n->kids[3]);
+    unrefslab234(n->slab);
 }
 void freetree234(tree234 *t) {
-    freenode234(t->root);
+    node234 *n;
+
+    releasenode234(t->root);
+    while ((n = t->spare) != NULL) {
+	t->spare = n->parent;
+	unrefslab234(n->slab);
+    }
+    unrefslab234(t->slab);
     sfree(t);
 }
 
@@ -116,7 +195,7 @@ int count234(tree234 *t) {
  * Propagate a node overflow up a tree until it stops. Returns 0 or
  * 1, depending on whether the root had to be split or not.
  */
-static int add234_insert(node234 *left, void *e, node234 *right,
+static int add234_insert(tree234 *t, node234 *left, void *e, node234 *right,
 			 node234 **root, node234 *n, int ki) {
     int lcount, rcount;
     /*
@@ -189,7 +268,7 @@ static int add234_insert(node234 *left, void *e, node234 *right,
 	    LOG(("  done\n"));
 	    break;
 	} else {
-	    node234 *m = snew(node234);
+	    node234 *m = newnode234(t);
 	    m->parent = n->parent;
 	    LOG(("  splitting a 4-node; created new node %p\n", m));
 	    /*
@@ -285,7 +364,7 @@ static int add234_insert(node234 *left, void *e, node234 *right,
 	return 0;		       /* root unchanged */
     } else {
 	LOG(("  root is overloaded, split into two\n"));
-	(*root) = snew(node234);
+	(*root) = newnode234(t);
 	(*root)->kids[0] = left;     (*root)->counts[0] = lcount;
 	(*root)->elems[0] = e;
 	(*root)->kids[1] = right;    (*root)->counts[1] = rcount;
@@ -316,7 +395,7 @@ static void *add234_internal(tree234 *t, void *e, int index) {
 
     LOG(("adding element \"%s\" to tree %p\n", e, t));
     if (t->root == NULL) {
-	t->root = snew(node234);
+	t->root = newnode234(t);
 	t->root->elems[1] = t->root->elems[2] = NULL;
 	t->root->kids[0] = t->root->kids[1] = NULL;
 	t->root->kids[2] = t->root->kids[3] = NULL;
@@ -384,7 +463,7 @@ static void *add234_internal(tree234 *t, void *e, int index) {
 	n = n->kids[ki];
     }
 
-    add234_insert(NULL, e, NULL, &t->root, n, ki);
+    add234_insert(t, NULL, e, NULL, &t->root, n, ki);
 
     return orig_e;
 }
@@ -792,7 +871,8 @@ static void trans234_subtree_left(node234 *n, int ki, int *k, int *index) {
  *   /     \       ->        |
  *  a   b B c C d      a A b B c C d
  */
-static void trans234_subtree_merge(node234 *n, int ki, int *k, int *index) {
+static void trans234_subtree_merge(tree234 *t, node234 *n, int ki,
+				   int *k, int *index) {
     node234 *left, *right;
     int i, leftlen, rightlen, lsize, rsize;
 
@@ -836,7 +916,7 @@ static void trans234_subtree_merge(node234 *n, int ki, int *k, int *index) {
 
     n->counts[ki] += rightlen + 1;
 
-    sfree(right);
+    freenode234(t, right);
 
     /*
      * Move the rest of n up by one.
@@ -963,7 +1043,7 @@ static void *delpos234_internal(tree234 *t, int index) {
 		 * ki is small with only small neighbours. Pick a
 		 * neighbour and merge with it.
 		 */
-		trans234_subtree_merge(n, ki>0 ? ki-1 : ki, &ki, &index);
+		trans234_subtree_merge(t, n, ki>0 ? ki-1 : ki, &ki, &index);
 		sub = n->kids[ki];
 
 		if (!n->elems[0]) {
@@ -974,7 +1054,7 @@ static void *delpos234_internal(tree234 *t, int index) {
 		    LOG(("  shifting root!\n"));
 		    t->root = sub;
 		    sub->parent = NULL;
-		    sfree(n);
+		    freenode234(t, n);
 		    n = NULL;
 		}
 	    }
@@ -1006,7 +1086,7 @@ static void *delpos234_internal(tree234 *t, int index) {
     if (!n->elems[0]) {
 	LOG(("  removed last element in tree, destroying empty root\n"));
 	assert(n == t->root);
-	sfree(n);
+	freenode234(t, n);
 	t->root = NULL;
     }
 
@@ -1038,7 +1118,7 @@ void *del234(tree234 *t, void *e) {
  * resulting tree is the same height as the original larger one, or
  * one higher.
  */
-static node234 *join234_internal(node234 *left, void *sep,
+static node234 *join234_internal(tree234 *t, node234 *left, void *sep,
 				 node234 *right, int *height) {
     node234 *root, *node;
     int relht = *height;
@@ -1053,7 +1133,7 @@ static node234 *join234_internal(node234 *left, void *sep,
 	 * nodes.
 	 */
 	node234 *newroot;
-	newroot = snew(node234);
+	newroot = newnode234(t);
 	newroot->kids[0] = left;     newroot->counts[0] = countnode234(left);
 	newroot->elems[0] = sep;
 	newroot->kids[1] = right;    newroot->counts[1] = countnode234(right);
@@ -1113,7 +1193,7 @@ static node234 *join234_internal(node234 *left, void *sep,
     /*
      * Now proceed as for addition.
      */
-    *height = add234_insert(left, sep, right, &root, node, ki);
+    *height = add234_insert(t, left, sep, right, &root, node, ki);
 
     return root;
 }
@@ -1141,7 +1221,7 @@ tree234 *join234(tree234 *t1, tree234 *t2) {
 
 	element = delpos234(t2, 0);
 	relht = height234(t1) - height234(t2);
-	t1->root = join234_internal(t1->root, element, t2->root, &relht);
+	t1->root = join234_internal(t1, t1->root, element, t2->root, &relht);
 	t2->root = NULL;
     }
     return t1;
@@ -1161,7 +1241,7 @@ tree234 *join234r(tree234 *t1, tree234 *t2) {
 
 	element = delpos234(t1, size1-1);
 	relht = height234(t1) - height234(t2);
-	t2->root = join234_internal(t1->root, element, t2->root, &relht);
+	t2->root = join234_internal(t2, t1->root, element, t2->root, &relht);
 	t1->root = NULL;
     }
     return t2;
@@ -1229,7 +1309,7 @@ static node234 *split234_internal(tree234 *t, int index) {
 	 * new node pointers in halves[0] and halves[1], and go up
 	 * a level.
 	 */
-	sib = snew(node234);
+	sib = newnode234(t);
 	for (i = 0; i < 3; i++) {
 	    if (i+ki < 3 && n->elems[i+ki]) {
 		sib->elems[i] = n->elems[i+ki];
@@ -1302,7 +1382,7 @@ static node234 *split234_internal(tree234 *t, int index) {
 	while (halves[half] && !halves[half]->elems[0]) {
 	    LOG(("  root %p is undersize, throwing away\n", halves[half]));
 	    halves[half] = halves[half]->kids[0];
-	    sfree(halves[half]->parent);
+	    freenode234(t, halves[half]->parent);
 	    halves[half]->parent = NULL;
 	    LOG(("  new root is %p\n", halves[half]));
 	}
@@ -1359,7 +1439,7 @@ static node234 *split234_internal(tree234 *t, int index) {
 		     * Neighbour is small, or possibly neighbour is
 		     * medium and we are undersize.
 		     */
-		    trans234_subtree_merge(n, merge, NULL, NULL);
+		    trans234_subtree_merge(t, n, merge, NULL, NULL);
 		    sub = n->kids[merge];
 		    if (!n->elems[0]) {
 			/*
@@ -1370,7 +1450,7 @@ static node234 *split234_internal(tree234 *t, int index) {
 			LOG(("  shifting root!\n"));
 			halves[half] = sub;
 			halves[half]->parent = NULL;
-			sfree(n);
+			freenode234(t, n);
 		    }
 		} else {
 		    /* Neighbour is big enough to move trees over. */
@@ -1432,9 +1512,10 @@ tree234 *split234(tree234 *t, const void *e, int rel)
     return splitcmp234(t, e, t->cmp, t->cmpctx, rel);
 }
 
-static node234 *copynode234(node234 *n, copyfn234 copyfn, void *copyfnstate) {
+static node234 *copynode234(tree234 *t, node234 *n,
+			    copyfn234 copyfn, void *copyfnstate) {
     int i;
-    node234 *n2 = snew(node234);
+    node234 *n2 = newnode234(t);
 
     for (i = 0; i < 3; i++) {
 	if (n->elems[i] && copyfn)
@@ -1445,7 +1526,7 @@ static node234 *copynode234(node234 *n, copyfn234 copyfn, void *copyfnstate) {
 
     for (i = 0; i < 4; i++) {
 	if (n->kids[i]) {
-	    n2->kids[i] = copynode234(n->kids[i], copyfn, copyfnstate);
+	    n2->kids[i] = copynode234(t, n->kids[i], copyfn, copyfnstate);
 	    n2->kids[i]->parent = n2;
 	} else {
 	    n2->kids[i] = NULL;
@@ -1460,7 +1541,7 @@ tree234 *copytree234(tree234 *t, copyfn234 copyfn, void *copyfnstate) {
 
     t2 = newtree234(t->cmp, t->cmpctx);
     if (t->root) {
-	t2->root = copynode234(t->root, copyfn, copyfnstate);
+	t2->root = copynode234(t2, t->root, copyfn, copyfnstate);
 	t2->root->parent = NULL;
     } else
 	t2->root = NULL;
@@ -1468,6 +1549,155 @@ tree234 *copytree234(tree234 *t, copyfn234 copyfn, void *copyfnstate) {
     return t2;
 }
 
+/*
+ * Sort an array of elements with a stable merge sort, using `tmp'
+ * (at least half the size) as workspace. Runs which are already in
+ * order are left alone, so sorting sorted input takes linear time.
+ */
+static void sort234(void **a, void **tmp, int n, cmpfn234 cmp, void *cmpctx) {
+    int h, i, j, k;
+
+    if (n < 2)
+	return;
+    h = n / 2;
+    sort234(a, tmp, h, cmp, cmpctx);
+    sort234(a + h, tmp, n - h, cmp, cmpctx);
+    if (cmp(a[h-1], a[h], cmpctx) <= 0)
+	return;
+
+    for (i = 0; i < h; i++)
+	tmp[i] = a[i];
+    i = 0;
+    j = h;
+    k = 0;
+    while (i < h && j < n)
+	a[k++] = (cmp(a[j], tmp[i], cmpctx) < 0 ? a[j++] : tmp[i++]);
+    while (i < h)
+	a[k++] = tmp[i++];
+}
+
+/*
+ * The largest number of elements a subtree of a given height can
+ * hold, which is when it's made entirely of 4-nodes. (The smallest
+ * is 2^height-1, when it's all 2-nodes.)
+ */
+static int maxsize234(int height) {
+    long size = 1;
+
+    while (height-- > 0 && size <= INT_MAX)
+	size *= 4;
+    return (size - 1 > INT_MAX ? INT_MAX : (int)(size - 1));
+}
+
+/*
+ * Decide how many children a node should have at the top of a
+ * subtree of the given height holding n elements: the fewest that
+ * can hold all the rest between them.
+ */
+static int nkids234(int n, int height) {
+    long cap = maxsize234(height - 1);
+    int k;
+
+    for (k = 2; k < 4; k++)
+	if (n - (k-1) <= k * cap)
+	    break;
+    return k;
+}
+
+/*
+ * Count the nodes build234() will use for a subtree of n elements.
+ */
+static int buildcount234(int n, int height) {
+    int i, k, m, count = 1;
+
+    if (height > 1) {
+	k = nkids234(n, height);
+	m = n - (k-1);
+	for (i = 0; i < k; i++)
+	    count += buildcount234(m / k + (i < m % k), height - 1);
+    }
+    return count;
+}
+
+/*
+ * Build a subtree of the given height holding the n elements at
+ * `e', by sharing out what's left after the node's own elements as
+ * evenly as possible among its children. Every leaf ends up at the
+ * same depth, since each child's share is within the range a
+ * subtree one level shorter can hold.
+ */
+static node234 *build234(tree234 *t, void **e, int n, int height) {
+    node234 *node = newnode234(t);
+    int i, k, m, sub;
+
+    for (i = 0; i < 4; i++) {
+	node->kids[i] = NULL;
+	node->counts[i] = 0;
+    }
+    for (i = 0; i < 3; i++)
+	node->elems[i] = NULL;
+
+    if (height == 1) {
+	assert(n >= 1 && n <= 3);
+	for (i = 0; i < n; i++)
+	    node->elems[i] = e[i];
+	return node;
+    }
+
+    k = nkids234(n, height);
+    m = n - (k-1);
+    for (i = 0; i < k; i++) {
+	sub = m / k + (i < m % k);
+	node->kids[i] = build234(t, e, sub, height - 1);
+	node->kids[i]->parent = node;
+	node->counts[i] = sub;
+	e += sub;
+	if (i < k-1)
+	    node->elems[i] = *e++;
+    }
+    return node;
+}
+
+/*
+ * Build a 2-3-4 tree in one go from an array of elements.
+ */
+tree234 *buildtree234(cmpfn234 cmp, void *cmpctx, void **elems, int n) {
+    tree234 *t = newtree234(cmp, cmpctx);
+    int height;
+
+    if (cmp && n > 1) {
+	void **tmp = (void **)smalloc(n * sizeof(void *));
+	int i, kept = 1, ndups = 0;
+
+	sort234(elems, tmp, n, cmp, cmpctx);
+
+	/*
+	 * Keep the first of each run of equal elements, and move the
+	 * others to the end of the array.
+	 */
+	for (i = 1; i < n; i++) {
+	    if (cmp(elems[kept-1], elems[i], cmpctx) == 0)
+		tmp[ndups++] = elems[i];
+	    else
+		elems[kept++] = elems[i];
+	}
+	for (i = 0; i < ndups; i++)
+	    elems[kept + i] = tmp[i];
+	n = kept;
+
+	sfree(tmp);
+    }
+
+    if (n > 0) {
+	for (height = 1; n > maxsize234(height); height++);
+	t->slab = newslab234(buildcount234(n, height));
+	t->root = build234(t, elems, n, height);
+	t->root->parent = NULL;
+    }
+
+    return t;
+}
+
 #ifdef TEST
 
 /*
@@ -46,6 +46,22 @@ typedef void *(*copyfn234)(void *state, void *element);
  */
 tree234 *newtree234(cmpfn234 cmp, void *cmpctx);
 
+/*
+ * Build a 2-3-4 tree in one go from an array of n elements, which
+ * is much quicker than adding them one at a time.
+ *
+ * If `cmp' is non-NULL, the tree is sorted and the array is sorted
+ * in place first. Where several elements compare equal, only the
+ * first of them in the original order goes into the tree, just as
+ * if they had been added in turn with add234(). The ones left out
+ * are moved to the end of the array, after the count234() elements
+ * that are in the tree, so that the caller can free them.
+ *
+ * If `cmp' is NULL, the tree is unsorted and holds the elements in
+ * the order given.
+ */
+tree234 *buildtree234(cmpfn234 cmp, void *cmpctx, void **elems, int n);
+
 /*
  * Free a 2-3-4 tree (not including freeing the elements).
  */
@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "halibut.h"
 #include "tree234.h"
@@ -63,9 +64,14 @@ static void guid(rdstringc *rs, unsigned long w0,
     rdaddc(rs, b7);
 }
 
-static void itsf(rdstringc *rs,
-                 const rdstringc *directory, const rdstringc *content0)
+/*
+ * Put together the whole output file: the header goes into `out'
+ * followed by the directory and the content section 0, which are
+ * added by reference rather than copied.
+ */
+static void itsf(rope *out, rdstringc *directory, const rdstringc *content0)
 {
+    rdstringc header = {0, 0, NULL}, *rs = &header;
     int headersize_field;
     int headersect_off, headersect_off_field, headersect_size_field;
     int directory_off_field, content0_off_field, filesize_field;
@@ -110,12 +116,15 @@ static void itsf(rdstringc *rs,
                         rs->pos - headersect_off);
 
     PUT_32BIT_LSB_FIRST(rs->text + directory_off_field, rs->pos);
-    rdaddsn(rs, directory->text, directory->pos);
-
-    PUT_32BIT_LSB_FIRST(rs->text + content0_off_field, rs->pos);
-    rdaddsn(rs, content0->text, content0->pos);
-
-    PUT_32BIT_LSB_FIRST(rs->text + filesize_field, rs->pos);
+    PUT_32BIT_LSB_FIRST(rs->text + content0_off_field,
+                        rs->pos + directory->pos);
+    PUT_32BIT_LSB_FIRST(rs->text + filesize_field,
+                        rs->pos + directory->pos + content0->pos);
+
+    rope_adopt(out, header.text, header.pos);
+    rope_adopt(out, directory->text, directory->pos);
+    *directory = empty_rdstringc;
+    rope_addref(out, content0->text, content0->pos);
 }
 
 static void encint(rdstringc *rs, unsigned val)
@@ -483,7 +492,7 @@ struct chm {
     tree234 *stringtab;
     rdstringc content0;                /* outer uncompressed container */
     rdstringc content1;                /* compressed subfile */
-    rdstringc outfile;
+    rope outfile;
     rdstringc stringsfile;
     char *title, *contents_filename, *index_filename, *default_topic;
     char *default_window;
@@ -562,7 +571,7 @@ struct chm *chm_new(void)
     chm->stringtab = newtree234(chm_stringtab_cmp, NULL);
     chm->content0 = empty_rdstringc;
     chm->content1 = empty_rdstringc;
-    chm->outfile = empty_rdstringc;
+    chm->outfile = empty_rope;
     chm->stringsfile = empty_rdstringc;
     chm->title = NULL;
     chm->contents_filename = NULL;
@@ -613,7 +622,7 @@ void chm_free(struct chm *chm)
 
     sfree(chm->content0.text);
     sfree(chm->content1.text);
-    sfree(chm->outfile.text);
+    rope_free(&chm->outfile);
     sfree(chm->stringsfile.text);
 
     sfree(chm->title);
@@ -821,7 +830,558 @@ static unsigned long chm_url_hash(const char *str)
     return hash;
 }
 
-const char *chm_build(struct chm *chm, int *outlen)
+/*
+ * Full-text search index, in the file $FIftiMain.
+ *
+ * We index the text of each topic's HTML file, as the help viewer
+ * will show it: markup is skipped, entities are decoded, and
+ * everything is folded to lower case. Then we sort each topic's
+ * words into a run, merge all the runs, and write out the index.
+ *
+ * The file begins with a 0x400-byte header. For each word, a 'word
+ * location code' block then lists the topics it appears in and its
+ * positions in each one. Finally comes a B-tree of the words,
+ * pointing at those blocks.
+ *
+ * Everything in a WLC block is written with the 'scale and root'
+ * encoding, with a scale of 2 throughout. A number with k
+ * significant bits is written in r+1 bits ('0' and then r bits) if
+ * k <= r. Otherwise it is written as k-r 1 bits, a 0, and its
+ * bottom k-1 bits. We choose each root r so that the index comes
+ * out as small as it can.
+ *
+ * The ENCINTs in the B-tree leaves are not the same as the ones in
+ * the directory, because they are little-endian. That is how every
+ * reader of this file I know of decodes them.
+ */
+#define FTS_HEADERLEN 0x400
+#define FTS_NODELEN 4096
+#define FTS_MAXWORD 99                 /* skip longer words than this */
+
+struct fts_posting {
+    const char *word;
+    int pos;                           /* word number within its topic */
+};
+
+struct fts_doc {
+    const char *html;
+    int len;
+    int topic;                         /* our index in #TOPICS */
+    char *words;                       /* lowercased, NUL-terminated */
+    struct fts_posting *postings;
+    int npostings, next;
+};
+
+struct fts_hit {
+    int topic, firstpos, npos;         /* npos positions in fts_index.pos */
+};
+
+struct fts_word {
+    const char *word;
+    int firsthit, nhits;
+    int wlc_offset, wlc_size;
+};
+
+struct fts_index {
+    struct fts_word *words;
+    int nwords, wordsize;
+    struct fts_hit *hits;
+    int nhits, hitsize;
+    int *pos;
+    int npos, possize;
+};
+
+/*
+ * Fold a Windows-1252 character to lower case, or return 0 if it
+ * can't be part of a word.
+ */
+static int fts_wordchar(int c)
+{
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z'))
+        return c;
+    if (c >= 'A' && c <= 'Z')
+        return c + 'a' - 'A';
+    if (c == 0x8A || c == 0x8C || c == 0x8E)
+        return c + 0x10;               /* S/OE/Z with caron or ligature */
+    if (c == 0x9A || c == 0x9C || c == 0x9E)
+        return c;
+    if (c == 0x9F)
+        return 0xFF;                   /* Y with diaeresis */
+    if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+        return c + 0x20;
+    if (c >= 0xDF && c != 0xF7)
+        return c;
+    return 0;
+}
+
+static int fts_posting_cmp(const void *av, const void *bv)
+{
+    const struct fts_posting *a = (const struct fts_posting *)av;
+    const struct fts_posting *b = (const struct fts_posting *)bv;
+    int cmp = strcmp(a->word, b->word);
+    if (cmp)
+        return cmp;
+    return a->pos < b->pos ? -1 : a->pos > b->pos ? +1 : 0;
+}
+
+/*
+ * Break one topic's HTML into words and sort them into a run. The
+ * topics are independent of each other, so this is done in
+ * parallel.
+ */
+static void fts_tokenise_job(void *ctx, int job)
+{
+    struct fts_doc *doc = (struct fts_doc *)ctx + job;
+    const char *p = doc->html, *end = doc->html + doc->len;
+    char *out, *wordstart;
+    int size = 0, pos = 0;
+    bool done = false;
+
+    doc->words = out = snewn(doc->len + 1, char);
+    doc->postings = NULL;
+    doc->npostings = doc->next = 0;
+
+    /* The viewer doesn't show anything before <body>. */
+    for (; p < end; p++)
+        if (*p == '<' && end - p >= 5 && fts_wordchar(p[1]) == 'b' &&
+            fts_wordchar(p[2]) == 'o' && fts_wordchar(p[3]) == 'd' &&
+            fts_wordchar(p[4]) == 'y')
+            break;
+    if (p == end)
+        p = doc->html;
+
+    wordstart = out;
+    while (!done) {
+        int c;
+
+        if (p == end) {
+            c = 0;
+            done = true;
+        } else if (*p == '<') {
+            while (p < end && *p != '>')
+                p++;
+            if (p < end)
+                p++;
+            c = 0;
+        } else if (*p == '&') {
+            const char *q = ++p;
+            while (q < end && *q != ';' && q - p < 10)
+                q++;
+            c = 0;
+            if (q < end && *q == ';') {
+                if (*p == '#' && (p[1] == 'x' || p[1] == 'X'))
+                    c = strtol(p+2, NULL, 16);
+                else if (*p == '#')
+                    c = strtol(p+1, NULL, 10);
+                /* Characters outside Windows-1252 separate words. */
+                if ((c >= 0x80 && c < 0xA0) || c > 0xFF)
+                    c = 0;
+                p = q + 1;
+            }
+        } else {
+            c = (unsigned char)*p++;
+        }
+
+        c = fts_wordchar(c);
+        if (c) {
+            *out++ = c;
+        } else if (out > wordstart) {
+            *out++ = '\0';
+            if (out - wordstart - 1 <= FTS_MAXWORD) {
+                if (doc->npostings >= size) {
+                    size = doc->npostings * 3 / 2 + 64;
+                    doc->postings = sresize(doc->postings, size,
+                                            struct fts_posting);
+                }
+                doc->postings[doc->npostings].word = wordstart;
+                doc->postings[doc->npostings].pos = pos;
+                doc->npostings++;
+            }
+            pos++;
+            wordstart = out;
+        }
+    }
+
+    qsort(doc->postings, doc->npostings, sizeof(*doc->postings),
+          fts_posting_cmp);
+}
+
+/*
+ * Order the merge heap: by the next word in each run, then by topic.
+ */
+static bool fts_heap_less(struct fts_doc *docs, int a, int b)
+{
+    int cmp = strcmp(docs[a].postings[docs[a].next].word,
+                     docs[b].postings[docs[b].next].word);
+    return cmp < 0 || (cmp == 0 && docs[a].topic < docs[b].topic);
+}
+
+static void fts_heap_down(struct fts_doc *docs, int *heap, int n, int i)
+{
+    while (1) {
+        int c = 2*i+1;
+        if (c >= n)
+            break;
+        if (c+1 < n && fts_heap_less(docs, heap[c+1], heap[c]))
+            c++;
+        if (!fts_heap_less(docs, heap[c], heap[i]))
+            break;
+        { int tmp = heap[c]; heap[c] = heap[i]; heap[i] = tmp; }
+        i = c;
+    }
+}
+
+/*
+ * Merge the sorted runs into one list of distinct words, each with
+ * its topics in order and its positions in each topic in order.
+ */
+static void fts_merge(struct fts_index *ix, struct fts_doc *docs, int ndocs)
+{
+    int *heap = snewn(ndocs, int);
+    int i, n = 0;
+
+    for (i = 0; i < ndocs; i++)
+        if (docs[i].npostings)
+            heap[n++] = i;
+    for (i = n/2; i-- > 0 ;)
+        fts_heap_down(docs, heap, n, i);
+
+    while (n > 0) {
+        struct fts_doc *doc = &docs[heap[0]];
+        const char *word = doc->postings[doc->next].word;
+        struct fts_hit *hit;
+
+        if (!ix->nwords || strcmp(ix->words[ix->nwords-1].word, word)) {
+            if (ix->nwords >= ix->wordsize) {
+                ix->wordsize = ix->nwords * 3 / 2 + 256;
+                ix->words = sresize(ix->words, ix->wordsize, struct fts_word);
+            }
+            ix->words[ix->nwords].word = word;
+            ix->words[ix->nwords].firsthit = ix->nhits;
+            ix->words[ix->nwords].nhits = 0;
+            ix->nwords++;
+        }
+
+        if (ix->nhits >= ix->hitsize) {
+            ix->hitsize = ix->nhits * 3 / 2 + 256;
+            ix->hits = sresize(ix->hits, ix->hitsize, struct fts_hit);
+        }
+        hit = &ix->hits[ix->nhits++];
+        ix->words[ix->nwords-1].nhits++;
+        hit->topic = doc->topic;
+        hit->firstpos = ix->npos;
+        hit->npos = 0;
+        do {
+            if (ix->npos >= ix->possize) {
+                ix->possize = ix->npos * 3 / 2 + 1024;
+                ix->pos = sresize(ix->pos, ix->possize, int);
+            }
+            ix->pos[ix->npos++] = doc->postings[doc->next].pos;
+            hit->npos++;
+            doc->next++;
+        } while (doc->next < doc->npostings &&
+                 !strcmp(doc->postings[doc->next].word, word));
+
+        if (doc->next == doc->npostings)
+            heap[0] = heap[--n];
+        fts_heap_down(docs, heap, n, 0);
+    }
+
+    sfree(heap);
+}
+
+static int fts_bitlen(unsigned val)
+{
+    int k = 0;
+    while (val >> k)
+        k++;
+    return k;
+}
+
+/*
+ * Choose the root which encodes a set of numbers in the fewest
+ * bits, given a histogram of their bit lengths.
+ */
+static int fts_best_root(const unsigned long *hist)
+{
+    int r, k, best = 1;
+    unsigned long bits, bestbits = 0;
+
+    for (r = 1; r < 32; r++) {
+        bits = 0;
+        for (k = 0; k <= 32; k++)
+            bits += hist[k] * (k <= r ? 1 + r : (k - r) + 1 + (k - 1));
+        if (r == 1 || bits < bestbits) {
+            best = r;
+            bestbits = bits;
+        }
+    }
+    return best;
+}
+
+struct fts_bits {
+    rdstringc *rs;
+    int bit;                           /* next bit to write in last byte */
+};
+
+static void fts_putbit(struct fts_bits *b, int val)
+{
+    if (b->bit < 0) {
+        rdaddc(b->rs, 0);
+        b->bit = 7;
+    }
+    if (val)
+        b->rs->text[b->rs->pos - 1] |= 1 << b->bit;
+    b->bit--;
+}
+
+static void fts_sr(struct fts_bits *b, unsigned val, int root)
+{
+    int k = fts_bitlen(val), n;
+
+    if (k <= root) {
+        fts_putbit(b, 0);
+        n = root;
+    } else {
+        for (n = root; n < k; n++)
+            fts_putbit(b, 1);
+        fts_putbit(b, 0);
+        n = k - 1;
+    }
+    while (n-- > 0)
+        fts_putbit(b, (val >> n) & 1);
+}
+
+static void fts_encint(rdstringc *rs, unsigned val)
+{
+    while (val >= 0x80) {
+        rdaddc(rs, (val & 0x7F) | 0x80);
+        val >>= 7;
+    }
+    rdaddc(rs, val);
+}
+
+/*
+ * Start and finish a B-tree node.
+ */
+static void fts_node_start(rdstringc *rs, bool leaf)
+{
+    if (leaf) {
+        RDADD_32BIT_LSB_FIRST(rs, 0);  /* next leaf; fill in later */
+        RDADD_16BIT_LSB_FIRST(rs, 0);  /* unknown */
+        RDADD_16BIT_LSB_FIRST(rs, 0);  /* free space; fill in later */
+    } else {
+        RDADD_16BIT_LSB_FIRST(rs, 0);  /* free space; fill in later */
+    }
+}
+
+static void fts_node_end(rdstringc *rs, int nodestart, bool leaf)
+{
+    int free = FTS_NODELEN - (rs->pos - nodestart);
+    rdaddc_rep(rs, 0, free);
+    PUT_16BIT_LSB_FIRST(rs->text + nodestart + (leaf ? 6 : 0), free);
+}
+
+/*
+ * Write a word into a B-tree node, as a suffix of the previous
+ * word in the same node.
+ */
+static void fts_node_word(rdstringc *rs, const char *word, const char *prev)
+{
+    int pfx = 0;
+
+    if (prev)
+        while (pfx < 255 && word[pfx] && word[pfx] == prev[pfx])
+            pfx++;
+    rdaddc(rs, strlen(word + pfx) + 1);
+    rdaddc(rs, pfx);
+    rdaddsc(rs, word + pfx);
+}
+
+static void chm_fulltext(struct chm *chm, int ntopics)
+{
+    rdstringc fts = {0, 0, NULL};
+    struct fts_index ix = {NULL, 0, 0, NULL, 0, 0, NULL, 0, 0};
+    struct fts_doc *docs;
+    struct chm_section *sect;
+    struct fts_bits bits;
+    unsigned long hist[3][33];
+    int roots[3];
+    int ndocs, i, j, k, depth, maxword, nlevel;
+    int *nodes, nnodes, *lastword;
+
+    /*
+     * Find each topic's HTML and split it into words.
+     */
+    ndocs = 0;
+    for (sect = chm->allsecthead; sect; sect = sect->next)
+        ndocs++;
+    docs = snewn(ndocs, struct fts_doc);
+    for (i = 0, sect = chm->allsecthead; sect; i++, sect = sect->next) {
+        char *name = add_leading_slash(sect->url);
+        struct chm_directory_entry *ent = chm_find_file(chm, name);
+        sfree(name);
+        docs[i].topic = sect->topic_index;
+        docs[i].html = ent ? chm->content1.text +
+            ent->offset_in_content_section : "";
+        docs[i].len = ent ? ent->file_size : 0;
+    }
+    run_jobs(ndocs, fts_tokenise_job, docs);
+
+    fts_merge(&ix, docs, ndocs);
+
+    /*
+     * Choose the roots for the topic numbers, the number of
+     * positions within each topic, and the positions themselves,
+     * all of which are stored as differences from the one before.
+     */
+    memset(hist, 0, sizeof(hist));
+    maxword = 0;
+    for (i = 0; i < ix.nwords; i++) {
+        struct fts_word *w = &ix.words[i];
+        int prevtopic = 0;
+        if (maxword < (int)strlen(w->word))
+            maxword = strlen(w->word);
+        for (j = 0; j < w->nhits; j++) {
+            struct fts_hit *hit = &ix.hits[w->firsthit + j];
+            int prevpos = 0;
+            hist[0][fts_bitlen(hit->topic - prevtopic)]++;
+            prevtopic = hit->topic;
+            hist[1][fts_bitlen(hit->npos)]++;
+            for (k = 0; k < hit->npos; k++) {
+                hist[2][fts_bitlen(ix.pos[hit->firstpos + k] - prevpos)]++;
+                prevpos = ix.pos[hit->firstpos + k];
+            }
+        }
+    }
+    for (i = 0; i < 3; i++)
+        roots[i] = fts_best_root(hist[i]);
+
+    /*
+     * Write the WLC blocks straight after the header.
+     */
+    rdaddc_rep(&fts, 0, FTS_HEADERLEN);
+    bits.rs = &fts;
+    for (i = 0; i < ix.nwords; i++) {
+        struct fts_word *w = &ix.words[i];
+        int prevtopic = 0;
+        w->wlc_offset = fts.pos;
+        for (j = 0; j < w->nhits; j++) {
+            struct fts_hit *hit = &ix.hits[w->firsthit + j];
+            int prevpos = 0;
+            bits.bit = -1;             /* each topic starts a new byte */
+            fts_sr(&bits, hit->topic - prevtopic, roots[0]);
+            prevtopic = hit->topic;
+            fts_sr(&bits, hit->npos, roots[1]);
+            for (k = 0; k < hit->npos; k++) {
+                fts_sr(&bits, ix.pos[hit->firstpos + k] - prevpos, roots[2]);
+                prevpos = ix.pos[hit->firstpos + k];
+            }
+        }
+        w->wlc_size = fts.pos - w->wlc_offset;
+    }
+
+    /*
+     * Write the leaf nodes, remembering the offset and last word of
+     * each one for the level above.
+     */
+    nodes = snewn(ix.nwords + 1, int);
+    lastword = snewn(ix.nwords + 1, int);
+    nnodes = 0;
+    i = 0;
+    do {
+        int start = fts.pos;
+        const char *prev = NULL;
+
+        fts_node_start(&fts, true);
+        if (nnodes > 0)
+            PUT_32BIT_LSB_FIRST(fts.text + nodes[nnodes-1], start);
+        nodes[nnodes] = start;
+        for (; i < ix.nwords; i++) {
+            struct fts_word *w = &ix.words[i];
+            int size = 2 + (int)strlen(w->word) + 1 + 5 + 4 + 2 + 5;
+            if (prev && fts.pos - start + size > FTS_NODELEN)
+                break;
+            fts_node_word(&fts, w->word, prev);
+            rdaddc(&fts, 0);           /* found in body text, not title */
+            fts_encint(&fts, w->nhits);
+            RDADD_32BIT_LSB_FIRST(&fts, w->wlc_offset);
+            RDADD_16BIT_LSB_FIRST(&fts, 0); /* unknown */
+            fts_encint(&fts, w->wlc_size);
+            prev = w->word;
+        }
+        lastword[nnodes++] = i - 1;
+        fts_node_end(&fts, start, true);
+    } while (i < ix.nwords);
+
+    /*
+     * Write index nodes above them until there's only one node at
+     * the top. An index node entry names the last word in its
+     * child, so that a reader looking for a word descends into the
+     * first child whose entry is not less than it.
+     */
+    depth = 1;
+    while (nnodes > 1) {
+        nlevel = 0;
+        i = 0;
+        while (i < nnodes) {
+            int start = fts.pos;
+            const char *prev = NULL;
+
+            fts_node_start(&fts, false);
+            for (j = i; j < nnodes; j++) {
+                const char *word = ix.words[lastword[j]].word;
+                if (prev && fts.pos - start + 2 + (int)strlen(word) + 6 >
+                    FTS_NODELEN)
+                    break;
+                fts_node_word(&fts, word, prev);
+                RDADD_32BIT_LSB_FIRST(&fts, nodes[j]);
+                RDADD_16BIT_LSB_FIRST(&fts, 0); /* unknown */
+                prev = word;
+            }
+            fts_node_end(&fts, start, false);
+            nodes[nlevel] = start;
+            lastword[nlevel] = lastword[j-1];
+            nlevel++;
+            i = j;
+        }
+        nnodes = nlevel;
+        depth++;
+    }
+
+    /*
+     * Now the header.
+     */
+    PUT_32BIT_LSB_FIRST(fts.text + 0x00, 0x00280000); /* magic */
+    PUT_32BIT_LSB_FIRST(fts.text + 0x04, ntopics);
+    PUT_32BIT_LSB_FIRST(fts.text + 0x14, nodes[0]); /* root node */
+    PUT_16BIT_LSB_FIRST(fts.text + 0x18, depth);
+    for (i = 0; i < 3; i++) {
+        fts.text[0x1E + 2*i] = 2;      /* scale */
+        fts.text[0x1F + 2*i] = roots[i];
+    }
+    PUT_32BIT_LSB_FIRST(fts.text + 0x2E, FTS_NODELEN);
+    PUT_32BIT_LSB_FIRST(fts.text + 0x3A, maxword);
+    PUT_32BIT_LSB_FIRST(fts.text + 0x3E, ix.npos); /* words in all topics */
+    PUT_32BIT_LSB_FIRST(fts.text + 0x42, ix.nwords); /* distinct words */
+
+    chm_add_file_internal(chm, "/$FIftiMain", fts.text, fts.pos,
+                          &chm->content1, 1);
+
+    for (i = 0; i < ndocs; i++) {
+        sfree(docs[i].words);
+        sfree(docs[i].postings);
+    }
+    sfree(docs);
+    sfree(ix.words);
+    sfree(ix.hits);
+    sfree(ix.pos);
+    sfree(nodes);
+    sfree(lastword);
+    sfree(fts.text);
+}
+
+const rope *chm_build(struct chm *chm)
 {
     rdstringc dir = {0, 0, NULL};
     rdstringc sysfile = {0, 0, NULL};
@@ -1262,6 +1822,12 @@ const char *chm_build(struct chm *chm, int *outlen)
         chm_add_file_internal(chm, "/#URLSTR", urlstr.text, urlstr.pos,
                               &chm->content1, 1);
 
+        /*
+         * Now we know every topic's index, build the full-text
+         * search index to go with them.
+         */
+        chm_fulltext(chm, index);
+
         /*
          * Write #IDXHDR (and its mirror in #SYSTEM), which we
          * couldn't do until we knew how many topic nodes there were.
@@ -1426,9 +1992,6 @@ const char *chm_build(struct chm *chm, int *outlen)
 
     directory(&dir, chm->files);
     itsf(&chm->outfile, &dir, &chm->content0);
-    sfree(dir.text);
 
-    assert(outlen);
-    *outlen = chm->outfile.pos;
-    return chm->outfile.text;
+    return &chm->outfile;
 }
@@ -18,4 +18,4 @@ struct chm_section *chm_add_section(struct chm *chm,
                                     struct chm_section *parent,
                                     const char *title, const char *url);
 
-const char *chm_build(struct chm *chm, int *outlen);
+const rope *chm_build(struct chm *chm);
@@ -10,17 +10,6 @@
 /*
  * Potential future features:
  * 
- *  - perhaps LZ77 compression? This appears to cause a phase order
- *    problem: it's hard to do the compression until the data to be
- *    compressed is finalised, and yet you can't finalise the data
- *    to be compressed until you know how much of it is going into
- *    which TOPICBLOCK in order to work out the offsets in the
- *    topic headers - for which you have to have already done the
- *    compression. Perhaps the thing to do is to implement an LZ77
- *    compressor that can guarantee to leave particular bytes in
- *    the stream as literals, and then go back and fix the offsets
- *    up later. Not pleasant.
- *  
  *  - It would be good to find out what relation (if any) the LCID
  *    record in the |SYSTEM section bears to the codepage used in
  *    the actual help text, so as to be able to vary that if the
@@ -74,6 +63,7 @@
 #include "halibut.h"
 #include "winhelp.h"
 #include "tree234.h"
+#include "lz77.h"
 
 #ifdef WINHELP_TESTMODE
 /*
@@ -117,6 +107,7 @@ char *dupstr(char *s) {
 
 #define MAX_PAGE_SIZE 0x800	       /* max page size in any B-tree */
 #define TOPIC_BLKSIZE 4096	       /* implied by version/flags combo */
+#define TOPIC_DECOMPSIZE 0x4000	       /* expanded size of an LZ77 block */
 
 typedef struct WHLP_TOPIC_tag context;
 
@@ -143,6 +134,8 @@ struct topiclink {
     context *context;
     struct topiclink *nonscroll, *scroll, *nexttopic;
     int block_size;		       /* for the topic header - *boggle* */
+    int patchblock;		       /* where the fields filled in late */
+    short patchpos[8+28];	       /*  went, if |TOPIC is compressed */
 };
 
 struct WHLP_TOPIC_tag {
@@ -184,6 +177,7 @@ struct WHLP_tag {
     int para_attrs[7];
     int ncontexts;
     int picture_index;
+    bool compress;		       /* LZ77-compress the |TOPIC section */
 };
 
 /* Functions to return the index and leaf data for B-tree contents. */
@@ -984,6 +978,348 @@ static void whlp_topicsect_write(WHLP h, struct file *f, void *data, int len,
     }
 }
 
+/*
+ * LZ77 compression of the |TOPIC section. Each TOPICBLOCK still
+ * occupies TOPIC_BLKSIZE bytes of the file, but everything after
+ * its 12-byte header is compressed, independently of every other
+ * block, and expands to at most TOPIC_DECOMPSIZE-12 bytes. TOPICPOS
+ * values then count positions in the expanded data.
+ *
+ * The compressed stream is a sequence of flag bytes, each followed
+ * by the eight items it describes (LSB first): a 0 bit is a literal
+ * byte, and a 1 bit is a little-endian 16-bit word holding a match
+ * length minus 3 in its top four bits and a distance minus 1 in the
+ * rest.
+ *
+ * The phase order problem is that the TOPICLINK headers and the
+ * type-2 topic headers contain TOPICPOS and TOPICOFFSET values we
+ * can't know until the compression has decided where every block
+ * boundary falls. So those fields go through
+ * lz77_compress_patchable(), which guarantees to leave them as
+ * literals that nothing else is copied from; we remember where each
+ * of their bytes landed, and fill in the real values at the end.
+ */
+#define TOPIC_MAXMATCH 18
+
+struct topic_token {
+    int distance, len;		       /* distance 0 means a literal */
+};
+
+struct topic_packer {
+    struct LZ77Context lz;
+    struct topic_token *toks;	       /* output of one lz77_compress */
+    int ntoks, tokssize;
+    unsigned char **blocks;	       /* each TOPIC_BLKSIZE bytes */
+    int nblocks, blockssize;
+    unsigned char *out;		       /* the current block */
+    int outlen;			       /* bytes used, including header */
+    int flagpos, nflags;	       /* current flag byte, bits used */
+    int decomp;			       /* expanded size, including header */
+};
+
+static void topic_lz_token(struct LZ77Context *ctx, int distance, int len)
+{
+    struct topic_packer *pk = (struct topic_packer *)ctx->userdata;
+
+    if (pk->ntoks >= pk->tokssize) {
+	pk->tokssize = pk->ntoks * 3 / 2 + 256;
+	pk->toks = sresize(pk->toks, pk->tokssize, struct topic_token);
+    }
+    pk->toks[pk->ntoks].distance = distance;
+    pk->toks[pk->ntoks].len = len;
+    pk->ntoks++;
+}
+
+static void topic_lz_literal(struct LZ77Context *ctx, unsigned char c)
+{
+    UNUSEDARG(c);
+    topic_lz_token(ctx, 0, 1);
+}
+
+static void topic_lz_match(struct LZ77Context *ctx, int distance, int len)
+{
+    topic_lz_token(ctx, distance, len);
+}
+
+static void topic_pack_newblock(WHLP h, struct topic_packer *pk)
+{
+    if (pk->nblocks > 0) {
+	/*
+	 * Pad out the block we're leaving. Zero bytes decode as
+	 * literals and all-literal flag bytes, so the padding can't
+	 * expand to more than its own size; topic_match_room()
+	 * makes sure there is space in the expanded block for that.
+	 */
+	memset(pk->out + pk->outlen, 0, TOPIC_BLKSIZE - pk->outlen);
+	lz77_cleanup(&pk->lz);
+    }
+
+    if (pk->nblocks >= pk->blockssize) {
+	pk->blockssize = pk->nblocks * 3 / 2 + 16;
+	pk->blocks = sresize(pk->blocks, pk->blockssize, unsigned char *);
+    }
+    pk->out = pk->blocks[pk->nblocks++] = snewn(TOPIC_BLKSIZE, unsigned char);
+    PUT_32BIT_LSB_FIRST(pk->out + 0, h->lasttopiclink);
+    PUT_32BIT_LSB_FIRST(pk->out + 4, 0xFFFFFFFFL);
+    PUT_32BIT_LSB_FIRST(pk->out + 8, h->lasttopicstart);
+    pk->outlen = pk->decomp = 12;
+    pk->nflags = 8;		       /* so the first item starts a group */
+
+    lz77_init(&pk->lz, TOPIC_BLKSIZE);
+    pk->lz.userdata = pk;
+    pk->lz.literal = topic_lz_literal;
+    pk->lz.match = topic_lz_match;
+}
+
+static void topic_pack_flag(struct topic_packer *pk, int bit)
+{
+    if (pk->nflags == 8) {
+	pk->flagpos = pk->outlen++;
+	pk->out[pk->flagpos] = 0;
+	pk->nflags = 0;
+    }
+    if (bit)
+	pk->out[pk->flagpos] |= 1 << pk->nflags;
+    pk->nflags++;
+}
+
+static bool topic_pack_literal(struct topic_packer *pk, unsigned char c)
+{
+    if (pk->outlen + 1 + (pk->nflags == 8) > TOPIC_BLKSIZE) {
+	/*
+	 * The block is full. If one byte remains, a flag byte
+	 * with nothing after it fills it harmlessly.
+	 */
+	if (pk->outlen < TOPIC_BLKSIZE)
+	    pk->out[pk->outlen++] = 0;
+	return false;
+    }
+    topic_pack_flag(pk, 0);
+    pk->out[pk->outlen++] = c;
+    pk->decomp++;
+    return true;
+}
+
+/*
+ * Return the longest match we can output next (which might be less
+ * than 3, meaning none). As well as the compressed space, we keep
+ * the expanded size plus the compressed bytes still free within
+ * TOPIC_DECOMPSIZE, so that whatever fills the rest of the block
+ * - literals or padding - the block can't expand too far.
+ */
+static int topic_match_room(struct topic_packer *pk)
+{
+    int cost = 2 + (pk->nflags == 8);
+    int room;
+
+    if (pk->outlen + cost > TOPIC_BLKSIZE)
+	return 0;
+    room = TOPIC_DECOMPSIZE - pk->decomp - (TOPIC_BLKSIZE - pk->outlen - cost);
+    return room < TOPIC_MAXMATCH ? room : TOPIC_MAXMATCH;
+}
+
+static void topic_pack_match(struct topic_packer *pk, int distance, int len)
+{
+    topic_pack_flag(pk, 1);
+    PUT_16BIT_LSB_FIRST(pk->out + pk->outlen,
+			((len - 3) << 12) | (distance - 1));
+    pk->outlen += 2;
+    pk->decomp += len;
+}
+
+/*
+ * Compress some data into the current block. If `patchpos' is
+ * non-NULL, the data is to be overwritten later, and the offset of
+ * each byte of it within the block is stored there. Returns the
+ * number of bytes consumed, which is less than len only if the
+ * block filled up.
+ */
+static int topic_pack(struct topic_packer *pk, const unsigned char *data,
+		      int len, short *patchpos)
+{
+    int i, done = 0;
+
+    pk->ntoks = 0;
+    if (patchpos)
+	lz77_compress_patchable(&pk->lz, data, len);
+    else
+	lz77_compress(&pk->lz, data, len, true);
+
+    for (i = 0; i < pk->ntoks; i++) {
+	int tlen = pk->toks[i].len;
+
+	/*
+	 * A match may need splitting into pieces short enough for
+	 * our length field, or into a shorter match and some
+	 * literals if the block is nearly full.
+	 */
+	if (pk->toks[i].distance) {
+	    while (tlen >= 3) {
+		int l = topic_match_room(pk);
+		if (l > tlen)
+		    l = tlen;
+		if (tlen - l > 0 && tlen - l < 3 && tlen - 3 >= 3)
+		    l = tlen - 3;      /* leave a tail long enough to match */
+		if (l < 3)
+		    break;
+		topic_pack_match(pk, pk->toks[i].distance, l);
+		tlen -= l;
+		done += l;
+	    }
+	}
+
+	while (tlen-- > 0) {
+	    if (!topic_pack_literal(pk, data[done]))
+		return done;
+	    if (patchpos)
+		patchpos[done] = pk->outlen - 1;
+	    done++;
+	}
+    }
+
+    return done;
+}
+
+/*
+ * Lay out and compress the TOPICLINKs, setting up the TOPICOFFSET
+ * and TOPICPOS of each one, and leaving placeholders for the
+ * fields that depend on them.
+ */
+static void whlp_topic_compress(WHLP h, struct topic_packer *pk)
+{
+    static const unsigned char placeholder[28];
+    int i, nlinks, offset, block, firstblock, done, n;
+    struct topiclink *link;
+
+    h->lasttopiclink = -1L;
+    h->lasttopicstart = 0L;
+    pk->toks = NULL;
+    pk->ntoks = pk->tokssize = 0;
+    pk->blocks = NULL;
+    pk->nblocks = pk->blockssize = 0;
+    topic_pack_newblock(h, pk);
+
+    offset = 0;
+    firstblock = -1;
+    nlinks = count234(h->text);
+    for (i = 0; i < nlinks; i++) {
+	unsigned char header[21];
+
+	link = index234(h->text, i);
+
+	/*
+	 * We can't split within the TOPICLINK header or within
+	 * linkdata1. So if they might not fit in the rest of this
+	 * block even as literals, start a new block _now_.
+	 */
+	n = 21 + link->len1;
+	if (TOPIC_BLKSIZE - pk->outlen < n + n/8 + 2) {
+	    topic_pack_newblock(h, pk);
+	    offset = 0;
+	}
+
+	block = pk->nblocks - 1;
+	link->topicoffset = block * 0x8000 + offset;
+	link->topicpos = block * 0x4000 + pk->decomp;
+	link->patchblock = block;
+	if (firstblock != block) {
+	    PUT_32BIT_LSB_FIRST(pk->out + 4, link->topicpos);
+	    firstblock = block;
+	}
+
+	PUT_32BIT_LSB_FIRST(header + 0, 21 + link->len1 + link->len2);
+	PUT_32BIT_LSB_FIRST(header + 4, link->len2);
+	PUT_32BIT_LSB_FIRST(header + 8, 0xFFFFFFFFL);	/* filled in later */
+	PUT_32BIT_LSB_FIRST(header + 12, 0xFFFFFFFFL);	/* likewise */
+	PUT_32BIT_LSB_FIRST(header + 16, 21 + link->len1);
+	header[20] = link->recordtype;
+
+	done = topic_pack(pk, header, 8, NULL);
+	done += topic_pack(pk, header + 8, 8, link->patchpos);
+	done += topic_pack(pk, header + 16, 5, NULL);
+	if (link->recordtype == 2) {
+	    assert(link->len1 >= 28);
+	    done += topic_pack(pk, placeholder, 28, link->patchpos + 8);
+	    done += topic_pack(pk, link->data1 + 28, link->len1 - 28, NULL);
+	} else {
+	    done += topic_pack(pk, link->data1, link->len1, NULL);
+	}
+	assert(done == n);
+
+	h->lasttopiclink = link->topicpos;
+	if (link->recordtype == 2)
+	    h->lasttopicstart = link->topicpos;
+
+	if (link->recordtype != 2)     /* TOPICOFFSET doesn't count titles */
+	    offset += link->len2;
+	done = 0;
+	while (1) {
+	    done += topic_pack(pk, link->data2 + done, link->len2 - done, NULL);
+	    if (done >= link->len2)
+		break;
+	    topic_pack_newblock(h, pk);
+	    offset = 0;
+	}
+    }
+
+    lz77_cleanup(&pk->lz);
+    sfree(pk->toks);
+
+    /*
+     * Tell WinHelp the |TOPIC section is compressed.
+     */
+    whlp_file_seek(h->systemfile, 10, 0);
+    whlp_file_add_short(h->systemfile, 4);   /* flags=4: LZ77, 4k blocks */
+    whlp_file_seek(h->systemfile, 0, 2);
+}
+
+/*
+ * Fill in the fields left as placeholders by whlp_topic_compress,
+ * and output the compressed blocks.
+ */
+static void whlp_topic_patch(WHLP h, struct topic_packer *pk,
+			     struct file *f)
+{
+    int i, j, nlinks, nfields;
+    struct topiclink *link, *otherlink;
+
+    nlinks = count234(h->text);
+    for (i = 0; i < nlinks; i++) {
+	unsigned char fields[8+28];
+	unsigned char *blk;
+
+	link = index234(h->text, i);
+	if (i == 0) {
+	    PUT_32BIT_LSB_FIRST(fields + 0, 0xFFFFFFFFL);
+	} else {
+	    otherlink = index234(h->text, i-1);
+	    PUT_32BIT_LSB_FIRST(fields + 0, otherlink->topicpos);
+	}
+	if (i+1 >= nlinks) {
+	    PUT_32BIT_LSB_FIRST(fields + 4, 0xFFFFFFFFL);
+	} else {
+	    otherlink = index234(h->text, i+1);
+	    PUT_32BIT_LSB_FIRST(fields + 4, otherlink->topicpos);
+	}
+	nfields = 8;
+	if (link->recordtype == 2) {
+	    memcpy(fields + 8, link->data1, 28);
+	    nfields += 28;
+	}
+
+	blk = pk->blocks[link->patchblock];
+	for (j = 0; j < nfields; j++)
+	    blk[link->patchpos[j]] = fields[j];
+    }
+
+    for (i = 0; i < pk->nblocks; i++) {
+	whlp_file_add(f, pk->blocks[i],
+		      i+1 < pk->nblocks ? TOPIC_BLKSIZE : pk->outlen);
+	sfree(pk->blocks[i]);
+    }
+    sfree(pk->blocks);
+}
+
 static void whlp_topic_layout(WHLP h)
 {
     int block, offset, pos;
@@ -991,6 +1327,7 @@ static void whlp_topic_layout(WHLP h)
     int topicnum;
     struct topiclink *link;
     struct file *f;
+    struct topic_packer pk;
 
     /*
      * Create a final TOPICLINK containing no usable data.
@@ -1017,34 +1354,40 @@ static void whlp_topic_layout(WHLP h)
      * of LinkData1 and LinkData2. So we can now go through and
      * break up the TOPICLINKs into TOPICBLOCKs, and also set up
      * the TOPICOFFSET and TOPICPOS of each one while we do so.
+     * (Or, if we're compressing, do all that block by block as we
+     * compress.)
      */
 
     block = 0;
     offset = 0;
     pos = 12;
     nlinks = count234(h->text);
-    for (i = 0; i < nlinks; i++) {
-	link = index234(h->text, i);
-	size = 21 + link->len1 + link->len2;
-	/*
-	 * We can't split within the topicblock header or within
-	 * linkdata1. So if the split would fall in that area,
-	 * start a new block _now_.
-	 */
-	if (TOPIC_BLKSIZE - pos < 21 + link->len1) {
-	    block++;
-	    offset = 0;
-	    pos = 12;
-	}
-	link->topicoffset = block * 0x8000 + offset;
-	link->topicpos = block * 0x4000 + pos;
-	pos += size;
-	if (link->recordtype != 2)     /* TOPICOFFSET doesn't count titles */
-	    offset += link->len2;
-	while (pos > TOPIC_BLKSIZE) {
-	    block++;
-	    offset = 0;
-	    pos -= TOPIC_BLKSIZE - 12;
+    if (h->compress)
+	whlp_topic_compress(h, &pk);
+    else {
+	for (i = 0; i < nlinks; i++) {
+	    link = index234(h->text, i);
+	    size = 21 + link->len1 + link->len2;
+	    /*
+	     * We can't split within the topicblock header or within
+	     * linkdata1. So if the split would fall in that area,
+	     * start a new block _now_.
+	     */
+	    if (TOPIC_BLKSIZE - pos < 21 + link->len1) {
+		block++;
+		offset = 0;
+		pos = 12;
+	    }
+	    link->topicoffset = block * 0x8000 + offset;
+	    link->topicpos = block * 0x4000 + pos;
+	    pos += size;
+	    if (link->recordtype != 2)     /* TOPICOFFSET doesn't count titles */
+		offset += link->len2;
+	    while (pos > TOPIC_BLKSIZE) {
+		block++;
+		offset = 0;
+		pos -= TOPIC_BLKSIZE - 12;
+	    }
 	}
     }
 
@@ -1093,9 +1436,14 @@ static void whlp_topic_layout(WHLP h)
      * through and create the |TOPIC section in its final form.
      */
 
+    f = whlp_new_file(h, "|TOPIC");
+    if (h->compress) {
+	whlp_topic_patch(h, &pk, f);
+	return;
+    }
+
     h->lasttopiclink = -1L;
     h->lasttopicstart = 0L;
-    f = whlp_new_file(h, "|TOPIC");
     h->topicblock_remaining = -1;
     whlp_topicsect_write(h, f, NULL, 0, 0);   /* start the first block */
     for (i = 0; i < nlinks; i++) {
@@ -1268,6 +1616,11 @@ void whlp_start_macro(WHLP h, char *macro)
     whlp_system_record(h->systemfile, 4, macro, 1+strlen(macro));
 }
 
+void whlp_compress_topics(WHLP h, bool compress)
+{
+    h->compress = compress;
+}
+
 void whlp_primary_topic(WHLP h, WHLP_TOPIC t)
 {
     h->ptopic = t;
@@ -1608,7 +1961,7 @@ static void whlp_free_file(struct file *f)
 static void whlp_file_add(struct file *f, const void *data, int len)
 {
     if (f->pos + len > f->size) {
-	f->size = f->pos + len + 1024;
+	f->size = (f->pos + len) * 3 / 2 + 1024;
 	f->data = sresize(f->data, f->size, unsigned char);
     }
     memcpy(f->data + f->pos, data, len);
@@ -1681,7 +2034,7 @@ static void whlp_file_add_cslong(struct file *f, int data)
 static void whlp_file_fill(struct file *f, int len)
 {
     if (f->pos + len > f->size) {
-	f->size = f->pos + len + 1024;
+	f->size = (f->pos + len) * 3 / 2 + 1024;
 	f->data = sresize(f->data, f->size, unsigned char);
     }
     memset(f->data + f->pos, 0, len);
@@ -1740,6 +2093,7 @@ WHLP whlp_new(void)
     ret->ncontexts = 0;
     ret->link = NULL;
     ret->picture_index = 0;
+    ret->compress = true;
 
     return ret;
 }
@@ -29,6 +29,12 @@ void whlp_title(WHLP h, char *title);
 void whlp_copyright(WHLP h, char *copyright);
 void whlp_start_macro(WHLP h, char *macro);
 
+/*
+ * Choose whether the topic text is LZ77-compressed (the default)
+ * or stored as it is.
+ */
+void whlp_compress_topics(WHLP h, bool compress);
+
 /*
  * Register a help topic. Irritatingly, due to weird phase-order
  * issues with the whole file format, you have to register all your
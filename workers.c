@@ -0,0 +1,185 @@
+/*
+ * workers.c: run independent jobs on a pool of worker threads
+ *
+ * Halibut is single-threaded almost everywhere. The exceptions are a
+ * few places where a large amount of work splits naturally into
+ * independent pieces whose results are then put together in a fixed
+ * order, so the output never depends on how many threads did the
+ * work or in what order they finished. Those call run_jobs().
+ *
+ * On platforms where we don't know how to start threads, or if the
+ * user has asked for only one, run_jobs() simply runs every job in
+ * turn on the calling thread.
+ */
+
+#include <stdlib.h>
+#include "halibut.h"
+
+#if defined _WIN32
+#include <windows.h>
+#define HAVE_THREADS
+#elif defined HAVE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_THREADS
+#endif
+
+#define MAX_WORKERS 64
+
+static int nworkers = 0;	       /* 0 means not yet decided */
+
+void set_worker_threads(int n)
+{
+    if (n < 1)
+	n = 1;
+    if (n > MAX_WORKERS)
+	n = MAX_WORKERS;
+    nworkers = n;
+}
+
+int worker_threads(void)
+{
+    if (!nworkers) {
+	int n = 1;
+#if defined _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	n = si.dwNumberOfProcessors;
+#elif defined HAVE_THREADS && defined _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	set_worker_threads(n);
+    }
+#ifdef HAVE_THREADS
+    return nworkers;
+#else
+    return 1;
+#endif
+}
+
+struct jobset {
+    void (*fn)(void *ctx, int job);
+    void *ctx;
+    int njobs;
+#if defined _WIN32
+    LONG next;
+#elif defined HAVE_THREADS
+    int next;
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef HAVE_THREADS
+
+/*
+ * Hand out job numbers one at a time, so that the threads balance
+ * the load between them however uneven the jobs are.
+ */
+static int next_job(struct jobset *js)
+{
+    int job;
+#if defined _WIN32
+    job = InterlockedIncrement(&js->next) - 1;
+#else
+    pthread_mutex_lock(&js->lock);
+    job = js->next++;
+    pthread_mutex_unlock(&js->lock);
+#endif
+    return job < js->njobs ? job : -1;
+}
+
+static void do_jobs(struct jobset *js)
+{
+    int job;
+
+    while ((job = next_job(js)) >= 0)
+	js->fn(js->ctx, job);
+}
+
+#if defined _WIN32
+static DWORD WINAPI worker_main(LPVOID vjs)
+{
+    do_jobs((struct jobset *)vjs);
+    return 0;
+}
+#else
+static void *worker_main(void *vjs)
+{
+    do_jobs((struct jobset *)vjs);
+    return NULL;
+}
+#endif
+
+#endif /* HAVE_THREADS */
+
+/*
+ * Call fn(ctx, i) for every i from 0 to njobs-1, spread across the
+ * worker threads, and return once they have all finished. The jobs
+ * may run in any order and concurrently with each other, so they
+ * must not touch any shared state without arranging for it
+ * themselves; and they must not print errors directly (see
+ * err_defer()).
+ */
+void run_jobs(int njobs, void (*fn)(void *ctx, int job), void *ctx)
+{
+    int nthreads = worker_threads(), i;
+
+    if (nthreads > njobs)
+	nthreads = njobs;
+
+#ifdef HAVE_THREADS
+    if (nthreads > 1) {
+	struct jobset js;
+#if defined _WIN32
+	HANDLE threads[MAX_WORKERS];
+#else
+	pthread_t threads[MAX_WORKERS];
+#endif
+	int nstarted = 0;
+
+	js.fn = fn;
+	js.ctx = ctx;
+	js.njobs = njobs;
+	js.next = 0;
+#if !defined _WIN32
+	pthread_mutex_init(&js.lock, NULL);
+#endif
+
+	/*
+	 * Start nthreads-1 extra threads, and have this one join
+	 * in. If we fail to start some of them, never mind: the
+	 * ones we did start will pick up the slack.
+	 */
+	for (i = 0; i < nthreads-1; i++) {
+#if defined _WIN32
+	    threads[nstarted] = CreateThread(NULL, 0, worker_main, &js,
+					     0, NULL);
+	    if (threads[nstarted])
+		nstarted++;
+#else
+	    if (pthread_create(&threads[nstarted], NULL,
+			       worker_main, &js) == 0)
+		nstarted++;
+#endif
+	}
+
+	do_jobs(&js);
+
+	for (i = 0; i < nstarted; i++) {
+#if defined _WIN32
+	    WaitForSingleObject(threads[i], INFINITE);
+	    CloseHandle(threads[i]);
+#else
+	    pthread_join(threads[i], NULL);
+#endif
+	}
+#if !defined _WIN32
+	pthread_mutex_destroy(&js.lock);
+#endif
+	return;
+    }
+#endif /* HAVE_THREADS */
+
+    for (i = 0; i < njobs; i++)
+	fn(ctx, i);
+}